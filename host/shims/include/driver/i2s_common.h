@@ -0,0 +1,16 @@
+#pragma once
+
+#include <esp_err.h>
+
+typedef struct HostI2sChannel* i2s_chan_handle_t;
+
+// Host codecs do not own I2S channels, enabling a null channel is a no-op
+static inline esp_err_t i2s_channel_enable(i2s_chan_handle_t handle) {
+    (void)handle;
+    return ESP_OK;
+}
+
+static inline esp_err_t i2s_channel_disable(i2s_chan_handle_t handle) {
+    (void)handle;
+    return ESP_OK;
+}
@@ -0,0 +1,3 @@
+#pragma once
+
+#include <driver/i2s_common.h>
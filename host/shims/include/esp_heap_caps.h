@@ -0,0 +1,38 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define MALLOC_CAP_EXEC (1 << 0)
+#define MALLOC_CAP_32BIT (1 << 1)
+#define MALLOC_CAP_8BIT (1 << 2)
+#define MALLOC_CAP_DMA (1 << 3)
+#define MALLOC_CAP_SPIRAM (1 << 10)
+#define MALLOC_CAP_INTERNAL (1 << 11)
+#define MALLOC_CAP_DEFAULT (1 << 12)
+
+void* heap_caps_malloc(size_t size, uint32_t caps);
+void* heap_caps_calloc(size_t n, size_t size, uint32_t caps);
+void heap_caps_free(void* ptr);
+// Host values are nominal, the system allocator has no fixed pool
+size_t heap_caps_get_free_size(uint32_t caps);
+size_t heap_caps_get_minimum_free_size(uint32_t caps);
+
+// With CONFIG_HEAP_USE_HOOKS the application defines these, the host heap calls them
+// from heap_caps_* and from the global operator new / delete
+void esp_heap_trace_alloc_hook(void* ptr, size_t size, uint32_t caps);
+void esp_heap_trace_free_hook(void* ptr);
+
+#ifdef __cplusplus
+}
+#endif
+
+#ifdef __cplusplus
+// Host only: allocations of a thread whose pause depth is above 0 are not reported to the hooks.
+// The loopback server raises it so that only the device side is counted.
+extern thread_local int host_heap_hooks_pause_depth;
+#endif
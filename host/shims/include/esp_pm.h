@@ -0,0 +1,3 @@
+#pragma once
+
+typedef struct HostPmLock* esp_pm_lock_handle_t;
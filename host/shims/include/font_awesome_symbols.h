@@ -0,0 +1,4 @@
+// Subset of the xiaozhi-fonts symbols used by the sources built on host
+#pragma once
+
+#define FONT_AWESOME_DOWNLOAD "\xef\x80\x99"
@@ -0,0 +1,42 @@
+// FreeRTOS stand-in for the host build, backed by std::thread (see freertos.cc)
+#pragma once
+
+#include <sdkconfig.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <esp_err.h>
+#include <esp_heap_caps.h>
+#include <esp_system.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef int BaseType_t;
+typedef unsigned int UBaseType_t;
+typedef uint32_t TickType_t;
+typedef uint8_t StackType_t;
+
+#define pdFALSE ((BaseType_t)0)
+#define pdTRUE ((BaseType_t)1)
+#define pdPASS pdTRUE
+#define pdFAIL pdFALSE
+
+#define configTICK_RATE_HZ CONFIG_FREERTOS_HZ
+#define configMAX_PRIORITIES 25
+#define portMAX_DELAY ((TickType_t)0xffffffffUL)
+#define portTICK_PERIOD_MS ((TickType_t)1000 / configTICK_RATE_HZ)
+#define pdMS_TO_TICKS(ms) ((TickType_t)(((TickType_t)(ms) * (TickType_t)configTICK_RATE_HZ) / (TickType_t)1000U))
+#define tskNO_AFFINITY ((BaseType_t)0x7FFFFFFF)
+
+// Static allocation buffers are accepted but unused, host objects live on the heap
+typedef struct {
+    void* unused;
+} StaticTask_t;
+typedef StaticTask_t StaticSemaphore_t;
+typedef StaticTask_t StaticQueue_t;
+typedef StaticTask_t StaticEventGroup_t;
+
+#ifdef __cplusplus
+}
+#endif
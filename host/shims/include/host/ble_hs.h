@@ -0,0 +1,10 @@
+// NimBLE is not built on host, these are the declarations referenced by ble_config.h
+#pragma once
+
+#include <stdint.h>
+
+#define BLE_HS_CONN_HANDLE_NONE 0xffff
+
+struct ble_gatt_access_ctxt;
+struct ble_gatt_register_ctxt;
+struct ble_gap_event;
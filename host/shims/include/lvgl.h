@@ -0,0 +1,6 @@
+// Only the opaque types referenced by display.h, the host display does not render anything
+#pragma once
+
+typedef struct _lv_font_t lv_font_t;
+typedef struct _lv_display_t lv_display_t;
+typedef struct _lv_obj_t lv_obj_t;
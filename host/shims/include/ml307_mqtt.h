@@ -0,0 +1,2 @@
+// Not used off-target, the loopback transports live in loopback_server.cc
+#pragma once
@@ -0,0 +1,29 @@
+// Mirrors OpusDecoderWrapper from the esp-opus-encoder component, built against the system libopus
+#pragma once
+
+#include <functional>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <mutex>
+
+struct OpusDecoder;
+
+class OpusDecoderWrapper {
+public:
+    OpusDecoderWrapper(int sample_rate, int channels, int duration_ms = 60);
+    ~OpusDecoderWrapper();
+
+    bool Decode(std::vector<uint8_t>&& opus, std::vector<int16_t>& pcm);
+    void ResetState();
+
+    inline int sample_rate() const { return sample_rate_; }
+    inline int duration_ms() const { return duration_ms_; }
+
+private:
+    std::mutex mutex_;
+    OpusDecoder* audio_dec_ = nullptr;
+    int frame_size_;
+    int sample_rate_;
+    int duration_ms_;
+};
@@ -0,0 +1,25 @@
+// Mirrors OpusResampler from the esp-opus-encoder component.
+// The component wraps the silk resampler, which libopus does not export, so the host uses linear interpolation.
+#pragma once
+
+#include <cstdint>
+
+class OpusResampler {
+public:
+    OpusResampler();
+    ~OpusResampler();
+
+    void Configure(int input_sample_rate, int output_sample_rate);
+    void Process(const int16_t* input, int input_samples, int16_t* output);
+    int GetOutputSamples(int input_samples) const;
+
+    int input_sample_rate() const { return input_sample_rate_; }
+    int output_sample_rate() const { return output_sample_rate_; }
+
+private:
+    int input_sample_rate_ = 0;
+    int output_sample_rate_ = 0;
+    int16_t last_sample_ = 0;
+    // Fractional read position carried between calls, in input samples
+    double phase_ = 0;
+};
@@ -0,0 +1,45 @@
+// Host build configuration, stands in for the sdkconfig.h generated by menuconfig.
+// Boolean options left undefined are "n", as in an IDF build.
+#pragma once
+
+#define CONFIG_FREERTOS_HZ 1000
+#define CONFIG_LANGUAGE_ZH_CN 1
+
+// The AFE (esp-sr) is not available off-target, so CONFIG_USE_AUDIO_PROCESSOR and
+// CONFIG_USE_WAKE_WORD_DETECT stay off and the dummy processor is used instead
+
+#define CONFIG_AUDIO_INPUT_TASK_CORE -1
+#define CONFIG_AUDIO_OUTPUT_TASK_CORE -1
+#define CONFIG_AUDIO_ENCODE_TASK_CORE -1
+#define CONFIG_AUDIO_DECODE_TASK_CORE -1
+#define CONFIG_AUDIO_SEND_TASK_CORE -1
+#define CONFIG_AUDIO_SEND_QUEUE_SIZE 16
+
+// Audio channel standby after a conversation, main.cc overrides the seconds with --standby
+#define CONFIG_AUDIO_CHANNEL_STANDBY_SECONDS 0
+#define CONFIG_AUDIO_CHANNEL_STANDBY_BUDGET 600
+#define CONFIG_WEBSOCKET_LINGER_SECONDS 30
+
+// Control channel pings and the health report at the end of a session, see main/protocols/protocol_health.h.
+// Off by default on the device, the host server answers both.
+#define CONFIG_PROTOCOL_PING_INTERVAL_SECONDS 10
+#define CONFIG_REPORT_SESSION_HEALTH 1
+
+// Bounds of the adaptive encoder settings, see main/encoder_controller.h
+#define CONFIG_OPUS_ENCODER_MIN_COMPLEXITY 0
+#define CONFIG_OPUS_ENCODER_MAX_COMPLEXITY 5
+#define CONFIG_OPUS_ENCODER_DTX 1
+
+// Uplink frames per packet, main.cc overrides it with --frames-per-packet
+#define CONFIG_AUDIO_FRAMES_PER_PACKET 1
+
+// Latency tracing is always on, main.cc writes the buffer with the "trace" script command
+#define CONFIG_USE_AUDIO_TRACE 1
+#define CONFIG_AUDIO_TRACE_BUFFER_SIZE 4096
+
+// Decoded system sounds, see main/pcm_cache.h
+#define CONFIG_SOUND_PCM_CACHE_SIZE 512
+
+// Heap allocations are counted through the heap hooks, see main/alloc_counter.h
+#define CONFIG_HEAP_USE_HOOKS 1
+#define CONFIG_USE_ALLOC_COUNTER 1
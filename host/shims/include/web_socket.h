@@ -0,0 +1,44 @@
+// Mirrors the WebSocket class of the esp-ml307 component.
+// On host the connection is served by the in-process loopback server (loopback_server.cc),
+// or with network by a ws:// server (net_transport.cc).
+#pragma once
+
+#include <string>
+#include <map>
+#include <memory>
+#include <functional>
+
+class NetWebSocket;
+
+class WebSocket {
+public:
+    explicit WebSocket(bool network = false);
+    ~WebSocket();
+
+    void SetHeader(const char* key, const char* value);
+    bool IsConnected() const;
+    bool Connect(const char* uri);
+    bool Send(const std::string& data);
+    bool Send(const void* data, size_t len, bool binary = false, bool fin = true);
+    void Ping();
+    void Close();
+
+    void OnConnected(std::function<void()> callback) { on_connected_ = std::move(callback); }
+    void OnDisconnected(std::function<void()> callback) { on_disconnected_ = std::move(callback); }
+    void OnData(std::function<void(const char*, size_t, bool binary)> callback) { on_data_ = std::move(callback); }
+    void OnError(std::function<void(int)> callback) { on_error_ = std::move(callback); }
+
+    // Called by the loopback server or the network connection to deliver a server frame
+    void Deliver(const char* data, size_t len, bool binary);
+    void Disconnect();
+    const std::map<std::string, std::string>& headers() const { return headers_; }
+
+private:
+    std::map<std::string, std::string> headers_;
+    std::unique_ptr<NetWebSocket> net_;
+    bool connected_ = false;
+    std::function<void()> on_connected_;
+    std::function<void()> on_disconnected_;
+    std::function<void(const char*, size_t, bool binary)> on_data_;
+    std::function<void(int)> on_error_;
+};
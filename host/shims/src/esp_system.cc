@@ -0,0 +1,143 @@
+#include <esp_err.h>
+#include <esp_log.h>
+#include <esp_system.h>
+#include <esp_heap_caps.h>
+#include <esp_timer.h>
+
+#include <cstdarg>
+#include <cstdio>
+#include <cstdlib>
+#include <mutex>
+#include <new>
+#include <unistd.h>
+
+thread_local int host_heap_hooks_pause_depth = 0;
+
+namespace {
+
+esp_log_level_t GetLogLevel() {
+    static esp_log_level_t level = []() {
+        const char* env = getenv("XIAOZHI_LOG_LEVEL");
+        return env != nullptr ? (esp_log_level_t)atoi(env) : ESP_LOG_INFO;
+    }();
+    return level;
+}
+
+esp_log_level_t log_level_override = (esp_log_level_t)-1;
+
+} // namespace
+
+extern "C" {
+
+const char* esp_err_to_name(esp_err_t code) {
+    switch (code) {
+        case ESP_OK: return "ESP_OK";
+        case ESP_FAIL: return "ESP_FAIL";
+        case ESP_ERR_NO_MEM: return "ESP_ERR_NO_MEM";
+        case ESP_ERR_INVALID_ARG: return "ESP_ERR_INVALID_ARG";
+        case ESP_ERR_INVALID_STATE: return "ESP_ERR_INVALID_STATE";
+        case ESP_ERR_TIMEOUT: return "ESP_ERR_TIMEOUT";
+        case ESP_ERR_NVS_NOT_FOUND: return "ESP_ERR_NVS_NOT_FOUND";
+        default: return "UNKNOWN ERROR";
+    }
+}
+
+void esp_log_level_set(const char* tag, esp_log_level_t level) {
+    // Per-tag levels are not supported, "*" sets the global level
+    if (tag != nullptr && tag[0] == '*') {
+        log_level_override = level;
+    }
+}
+
+void esp_log_write(esp_log_level_t level, const char* tag, const char* format, ...) {
+    esp_log_level_t max_level = log_level_override >= 0 ? log_level_override : GetLogLevel();
+    if (level > max_level) {
+        return;
+    }
+    static const char letters[] = "NEWIDV";
+    static std::mutex mutex;
+    std::lock_guard<std::mutex> lock(mutex);
+    fprintf(stderr, "%c (%lld) %s: ", letters[level], (long long)(esp_timer_get_time() / 1000), tag);
+    va_list args;
+    va_start(args, format);
+    vfprintf(stderr, format, args);
+    va_end(args);
+    fputc('\n', stderr);
+}
+
+// Tasks are still running, so static destructors must not run
+void esp_restart(void) {
+    ESP_LOGW("system", "esp_restart() called, exiting");
+    fflush(stdout);
+    _exit(0);
+}
+
+void* heap_caps_malloc(size_t size, uint32_t caps) {
+    void* ptr = malloc(size);
+#if CONFIG_HEAP_USE_HOOKS
+    if (ptr != nullptr && host_heap_hooks_pause_depth == 0) {
+        esp_heap_trace_alloc_hook(ptr, size, caps);
+    }
+#endif
+    return ptr;
+}
+
+void* heap_caps_calloc(size_t n, size_t size, uint32_t caps) {
+    void* ptr = calloc(n, size);
+#if CONFIG_HEAP_USE_HOOKS
+    if (ptr != nullptr && host_heap_hooks_pause_depth == 0) {
+        esp_heap_trace_alloc_hook(ptr, n * size, caps);
+    }
+#endif
+    return ptr;
+}
+
+void heap_caps_free(void* ptr) {
+#if CONFIG_HEAP_USE_HOOKS
+    if (ptr != nullptr && host_heap_hooks_pause_depth == 0) {
+        esp_heap_trace_free_hook(ptr);
+    }
+#endif
+    free(ptr);
+}
+
+size_t heap_caps_get_free_size(uint32_t caps) {
+    return (caps & MALLOC_CAP_SPIRAM) ? 8 * 1024 * 1024 : 256 * 1024;
+}
+
+size_t heap_caps_get_minimum_free_size(uint32_t caps) {
+    return heap_caps_get_free_size(caps);
+}
+
+} // extern "C"
+
+#if CONFIG_HEAP_USE_HOOKS
+// On target operator new ends up in heap_caps_malloc, do the same here so C++ allocations are seen by the hooks
+void* operator new(size_t size) {
+    void* ptr = heap_caps_malloc(size ? size : 1, MALLOC_CAP_DEFAULT);
+    if (ptr == nullptr) {
+        throw std::bad_alloc();
+    }
+    return ptr;
+}
+
+void* operator new[](size_t size) {
+    return operator new(size);
+}
+
+void operator delete(void* ptr) noexcept {
+    heap_caps_free(ptr);
+}
+
+void operator delete[](void* ptr) noexcept {
+    heap_caps_free(ptr);
+}
+
+void operator delete(void* ptr, size_t) noexcept {
+    heap_caps_free(ptr);
+}
+
+void operator delete[](void* ptr, size_t) noexcept {
+    heap_caps_free(ptr);
+}
+#endif
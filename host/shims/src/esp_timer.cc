@@ -0,0 +1,132 @@
+#include <esp_timer.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <set>
+#include <thread>
+
+// All callbacks run on a single dispatcher thread, like ESP_TIMER_TASK dispatch on target
+
+struct HostTimer {
+    esp_timer_cb_t callback;
+    void* arg;
+    int64_t expiry_us = 0;
+    uint64_t period_us = 0;
+    bool active = false;
+};
+
+namespace {
+
+class TimerService {
+public:
+    static TimerService& GetInstance() {
+        static TimerService instance;
+        return instance;
+    }
+
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::set<HostTimer*> timers_;
+
+    void Start(HostTimer* timer, uint64_t timeout_us, uint64_t period_us) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        timer->expiry_us = esp_timer_get_time() + timeout_us;
+        timer->period_us = period_us;
+        timer->active = true;
+        timers_.insert(timer);
+        cv_.notify_all();
+    }
+
+    void Stop(HostTimer* timer) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        timer->active = false;
+        timers_.erase(timer);
+    }
+
+private:
+    TimerService() {
+        std::thread([this]() { Loop(); }).detach();
+    }
+
+    void Loop() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        while (true) {
+            HostTimer* next = nullptr;
+            for (auto timer : timers_) {
+                if (next == nullptr || timer->expiry_us < next->expiry_us) {
+                    next = timer;
+                }
+            }
+            if (next == nullptr) {
+                cv_.wait(lock);
+                continue;
+            }
+            int64_t now = esp_timer_get_time();
+            if (next->expiry_us > now) {
+                cv_.wait_for(lock, std::chrono::microseconds(next->expiry_us - now));
+                continue;
+            }
+            if (next->period_us > 0) {
+                next->expiry_us = now + next->period_us;
+            } else {
+                next->active = false;
+                timers_.erase(next);
+            }
+            auto callback = next->callback;
+            auto arg = next->arg;
+            lock.unlock();
+            callback(arg);
+            lock.lock();
+        }
+    }
+};
+
+} // namespace
+
+extern "C" {
+
+esp_err_t esp_timer_create(const esp_timer_create_args_t* create_args, esp_timer_handle_t* out_handle) {
+    auto timer = new HostTimer();
+    timer->callback = create_args->callback;
+    timer->arg = create_args->arg;
+    *out_handle = timer;
+    return ESP_OK;
+}
+
+esp_err_t esp_timer_start_once(esp_timer_handle_t timer, uint64_t timeout_us) {
+    TimerService::GetInstance().Start(timer, timeout_us, 0);
+    return ESP_OK;
+}
+
+esp_err_t esp_timer_start_periodic(esp_timer_handle_t timer, uint64_t period) {
+    TimerService::GetInstance().Start(timer, period, period);
+    return ESP_OK;
+}
+
+esp_err_t esp_timer_stop(esp_timer_handle_t timer) {
+    if (!timer->active) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    TimerService::GetInstance().Stop(timer);
+    return ESP_OK;
+}
+
+esp_err_t esp_timer_delete(esp_timer_handle_t timer) {
+    TimerService::GetInstance().Stop(timer);
+    delete timer;
+    return ESP_OK;
+}
+
+bool esp_timer_is_active(esp_timer_handle_t timer) {
+    std::lock_guard<std::mutex> lock(TimerService::GetInstance().mutex_);
+    return timer->active;
+}
+
+int64_t esp_timer_get_time(void) {
+    static const auto start = std::chrono::steady_clock::now();
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    return std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count();
+}
+
+} // extern "C"
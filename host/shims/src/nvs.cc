@@ -0,0 +1,162 @@
+#include <nvs.h>
+#include <nvs_flash.h>
+
+#include <cstring>
+#include <map>
+#include <mutex>
+#include <string>
+#include <variant>
+
+// Namespaces live in memory for the lifetime of the process
+
+namespace {
+
+using Value = std::variant<int32_t, std::string>;
+
+struct Storage {
+    std::mutex mutex;
+    std::map<std::string, std::map<std::string, Value>> namespaces;
+    std::map<nvs_handle_t, std::pair<std::string, bool>> handles;  // namespace, writable
+    nvs_handle_t next_handle = 1;
+};
+
+Storage& GetStorage() {
+    static Storage storage;
+    return storage;
+}
+
+std::map<std::string, Value>* Lookup(Storage& storage, nvs_handle_t handle, bool write) {
+    auto it = storage.handles.find(handle);
+    if (it == storage.handles.end() || (write && !it->second.second)) {
+        return nullptr;
+    }
+    return &storage.namespaces[it->second.first];
+}
+
+} // namespace
+
+extern "C" {
+
+esp_err_t nvs_flash_init(void) {
+    return ESP_OK;
+}
+
+esp_err_t nvs_flash_erase(void) {
+    auto& storage = GetStorage();
+    std::lock_guard<std::mutex> lock(storage.mutex);
+    storage.namespaces.clear();
+    return ESP_OK;
+}
+
+esp_err_t nvs_open(const char* name, nvs_open_mode_t open_mode, nvs_handle_t* out_handle) {
+    auto& storage = GetStorage();
+    std::lock_guard<std::mutex> lock(storage.mutex);
+    // Like the real NVS, a read-only open of a namespace that was never written fails
+    if (open_mode == NVS_READONLY && storage.namespaces.find(name) == storage.namespaces.end()) {
+        return ESP_ERR_NVS_NOT_FOUND;
+    }
+    *out_handle = storage.next_handle++;
+    storage.handles[*out_handle] = {name, open_mode == NVS_READWRITE};
+    return ESP_OK;
+}
+
+void nvs_close(nvs_handle_t handle) {
+    auto& storage = GetStorage();
+    std::lock_guard<std::mutex> lock(storage.mutex);
+    storage.handles.erase(handle);
+}
+
+esp_err_t nvs_commit(nvs_handle_t handle) {
+    return ESP_OK;
+}
+
+esp_err_t nvs_get_str(nvs_handle_t handle, const char* key, char* out_value, size_t* length) {
+    auto& storage = GetStorage();
+    std::lock_guard<std::mutex> lock(storage.mutex);
+    auto values = Lookup(storage, handle, false);
+    if (values == nullptr) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    auto it = values->find(key);
+    if (it == values->end()) {
+        return ESP_ERR_NVS_NOT_FOUND;
+    }
+    auto value = std::get_if<std::string>(&it->second);
+    if (value == nullptr) {
+        return ESP_ERR_NVS_TYPE_MISMATCH;
+    }
+    if (out_value == nullptr) {
+        *length = value->size() + 1;
+        return ESP_OK;
+    }
+    if (*length < value->size() + 1) {
+        return ESP_ERR_NVS_INVALID_LENGTH;
+    }
+    memcpy(out_value, value->c_str(), value->size() + 1);
+    *length = value->size() + 1;
+    return ESP_OK;
+}
+
+esp_err_t nvs_set_str(nvs_handle_t handle, const char* key, const char* value) {
+    auto& storage = GetStorage();
+    std::lock_guard<std::mutex> lock(storage.mutex);
+    auto values = Lookup(storage, handle, true);
+    if (values == nullptr) {
+        return ESP_ERR_NVS_READ_ONLY;
+    }
+    (*values)[key] = std::string(value);
+    return ESP_OK;
+}
+
+esp_err_t nvs_get_i32(nvs_handle_t handle, const char* key, int32_t* out_value) {
+    auto& storage = GetStorage();
+    std::lock_guard<std::mutex> lock(storage.mutex);
+    auto values = Lookup(storage, handle, false);
+    if (values == nullptr) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    auto it = values->find(key);
+    if (it == values->end()) {
+        return ESP_ERR_NVS_NOT_FOUND;
+    }
+    auto value = std::get_if<int32_t>(&it->second);
+    if (value == nullptr) {
+        return ESP_ERR_NVS_TYPE_MISMATCH;
+    }
+    *out_value = *value;
+    return ESP_OK;
+}
+
+esp_err_t nvs_set_i32(nvs_handle_t handle, const char* key, int32_t value) {
+    auto& storage = GetStorage();
+    std::lock_guard<std::mutex> lock(storage.mutex);
+    auto values = Lookup(storage, handle, true);
+    if (values == nullptr) {
+        return ESP_ERR_NVS_READ_ONLY;
+    }
+    (*values)[key] = value;
+    return ESP_OK;
+}
+
+esp_err_t nvs_erase_key(nvs_handle_t handle, const char* key) {
+    auto& storage = GetStorage();
+    std::lock_guard<std::mutex> lock(storage.mutex);
+    auto values = Lookup(storage, handle, true);
+    if (values == nullptr) {
+        return ESP_ERR_NVS_READ_ONLY;
+    }
+    return values->erase(key) > 0 ? ESP_OK : ESP_ERR_NVS_NOT_FOUND;
+}
+
+esp_err_t nvs_erase_all(nvs_handle_t handle) {
+    auto& storage = GetStorage();
+    std::lock_guard<std::mutex> lock(storage.mutex);
+    auto values = Lookup(storage, handle, true);
+    if (values == nullptr) {
+        return ESP_ERR_NVS_READ_ONLY;
+    }
+    values->clear();
+    return ESP_OK;
+}
+
+} // extern "C"
@@ -0,0 +1,182 @@
+#include "file_audio_codec.h"
+
+#include <esp_log.h>
+#include <cstring>
+#include <thread>
+#include <vector>
+
+#define TAG "FileAudioCodec"
+
+struct WavHeader {
+    char riff[4];
+    uint32_t riff_size;
+    char wave[4];
+    char fmt[4];
+    uint32_t fmt_size;
+    uint16_t format;
+    uint16_t channels;
+    uint32_t sample_rate;
+    uint32_t byte_rate;
+    uint16_t block_align;
+    uint16_t bits_per_sample;
+    char data[4];
+    uint32_t data_size;
+} __attribute__((packed));
+
+static WavHeader MakeWavHeader(int sample_rate, int channels, uint32_t data_size) {
+    WavHeader header;
+    memcpy(header.riff, "RIFF", 4);
+    header.riff_size = sizeof(WavHeader) - 8 + data_size;
+    memcpy(header.wave, "WAVE", 4);
+    memcpy(header.fmt, "fmt ", 4);
+    header.fmt_size = 16;
+    header.format = 1;
+    header.channels = channels;
+    header.sample_rate = sample_rate;
+    header.byte_rate = sample_rate * channels * sizeof(int16_t);
+    header.block_align = channels * sizeof(int16_t);
+    header.bits_per_sample = 16;
+    memcpy(header.data, "data", 4);
+    header.data_size = data_size;
+    return header;
+}
+
+// Walks the RIFF chunks and leaves the file positioned at the start of the samples
+static bool OpenWavInput(FILE* file, int& sample_rate, int& channels) {
+    char riff[12];
+    if (fread(riff, 1, sizeof(riff), file) != sizeof(riff) || memcmp(riff, "RIFF", 4) != 0 || memcmp(riff + 8, "WAVE", 4) != 0) {
+        ESP_LOGE(TAG, "Not a WAV file");
+        return false;
+    }
+    bool has_format = false;
+    while (true) {
+        char id[4];
+        uint32_t size;
+        if (fread(id, 1, 4, file) != 4 || fread(&size, 1, 4, file) != 4) {
+            ESP_LOGE(TAG, "WAV data chunk not found");
+            return false;
+        }
+        if (memcmp(id, "fmt ", 4) == 0) {
+            std::vector<uint8_t> fmt(size);
+            if (fread(fmt.data(), 1, size, file) != size || size < 16) {
+                return false;
+            }
+            uint16_t format = *(uint16_t*)&fmt[0];
+            channels = *(uint16_t*)&fmt[2];
+            sample_rate = *(uint32_t*)&fmt[4];
+            uint16_t bits_per_sample = *(uint16_t*)&fmt[14];
+            if (format != 1 || bits_per_sample != 16) {
+                ESP_LOGE(TAG, "Only 16-bit PCM WAV is supported");
+                return false;
+            }
+            has_format = true;
+        } else if (memcmp(id, "data", 4) == 0) {
+            return has_format;
+        } else {
+            fseek(file, size + (size & 1), SEEK_CUR);
+        }
+    }
+}
+
+FileAudioCodec::FileAudioCodec(const std::string& input_path, const std::string& output_path,
+                               int input_sample_rate, int output_sample_rate) {
+    duplex_ = true;
+    input_sample_rate_ = input_sample_rate;
+    output_sample_rate_ = output_sample_rate;
+
+    if (!input_path.empty()) {
+        input_file_ = fopen(input_path.c_str(), "rb");
+        int sample_rate = input_sample_rate, channels = 1;
+        if (input_file_ == nullptr) {
+            ESP_LOGE(TAG, "Failed to open %s, using silence", input_path.c_str());
+        } else if (!OpenWavInput(input_file_, sample_rate, channels) || channels != 1) {
+            ESP_LOGE(TAG, "Unsupported input %s (channels=%d), using silence", input_path.c_str(), channels);
+            fclose(input_file_);
+            input_file_ = nullptr;
+        } else {
+            input_sample_rate_ = sample_rate;
+        }
+    }
+
+    if (!output_path.empty()) {
+        output_file_ = fopen(output_path.c_str(), "wb");
+        if (output_file_ == nullptr) {
+            ESP_LOGE(TAG, "Failed to open %s", output_path.c_str());
+        } else {
+            auto header = MakeWavHeader(output_sample_rate_, output_channels_, 0);
+            fwrite(&header, sizeof(header), 1, output_file_);
+        }
+    }
+
+    input_clock_ = std::chrono::steady_clock::now();
+    output_clock_ = input_clock_;
+    ESP_LOGI(TAG, "Input %d Hz, output %d Hz", input_sample_rate_, output_sample_rate_);
+}
+
+FileAudioCodec::~FileAudioCodec() {
+    Flush();
+    if (input_file_ != nullptr) {
+        fclose(input_file_);
+    }
+    if (output_file_ != nullptr) {
+        fclose(output_file_);
+    }
+}
+
+void FileAudioCodec::Flush() {
+    std::lock_guard<std::mutex> lock(output_mutex_);
+    if (output_file_ == nullptr) {
+        return;
+    }
+    auto header = MakeWavHeader(output_sample_rate_, output_channels_, samples_written_ * sizeof(int16_t));
+    long position = ftell(output_file_);
+    fseek(output_file_, 0, SEEK_SET);
+    fwrite(&header, sizeof(header), 1, output_file_);
+    fseek(output_file_, position, SEEK_SET);
+    fflush(output_file_);
+}
+
+int FileAudioCodec::Read(int16_t* dest, int samples) {
+    // Block like an I2S read, a stall longer than one read restarts the clock instead of bursting to catch up
+    auto now = std::chrono::steady_clock::now();
+    auto duration = std::chrono::microseconds((int64_t)samples * 1000000 / input_sample_rate_);
+    if (input_clock_ + duration < now) {
+        input_clock_ = now;
+    }
+    input_clock_ += duration;
+    std::this_thread::sleep_until(input_clock_);
+
+    size_t read = 0;
+    if (input_file_ != nullptr && input_enabled_) {
+        read = fread(dest, sizeof(int16_t), samples, input_file_);
+    }
+    if (read < (size_t)samples) {
+        memset(dest + read, 0, (samples - read) * sizeof(int16_t));
+    }
+    return samples;
+}
+
+int FileAudioCodec::Write(const int16_t* data, int samples) {
+    auto now = std::chrono::steady_clock::now();
+    if (output_clock_ < now) {
+        output_clock_ = now;
+    }
+    output_clock_ += std::chrono::microseconds((int64_t)samples * 1000000 / output_sample_rate_);
+    // Mirrors the DMA buffer of the I2S codecs, a write only blocks once this much audio is pending
+    auto dma_buffer = std::chrono::microseconds((int64_t)AUDIO_CODEC_DMA_DESC_NUM * AUDIO_CODEC_DMA_FRAME_NUM * 1000000 / output_sample_rate_);
+    std::this_thread::sleep_until(output_clock_ - dma_buffer);
+
+    std::lock_guard<std::mutex> lock(output_mutex_);
+    if (output_file_ == nullptr) {
+        return samples;
+    }
+    // Like the I2S codecs, the scaled samples go through a buffer that is reused for every write
+    auto& buffer = write_buffer_;
+    buffer.resize(samples);
+    for (int i = 0; i < samples; i++) {
+        buffer[i] = (int32_t)data[i] * output_volume_ / 100;
+    }
+    fwrite(buffer.data(), sizeof(int16_t), samples, output_file_);
+    samples_written_ += samples;
+    return samples;
+}
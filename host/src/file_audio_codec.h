@@ -0,0 +1,39 @@
+#ifndef _FILE_AUDIO_CODEC_H
+#define _FILE_AUDIO_CODEC_H
+
+#include "audio_codec.h"
+
+#include <cstdio>
+#include <chrono>
+#include <mutex>
+#include <vector>
+#include <string>
+
+// Reads the microphone from a 16-bit PCM WAV file and writes the speaker to another one.
+// Both directions are paced like an I2S channel, so the application sees the same timing as on a board.
+// When the input runs out, silence is returned.
+class FileAudioCodec : public AudioCodec {
+public:
+    FileAudioCodec(const std::string& input_path, const std::string& output_path,
+                   int input_sample_rate, int output_sample_rate);
+    virtual ~FileAudioCodec();
+
+    // Rewrites the WAV header with the final data size
+    void Flush();
+
+    inline size_t samples_written() const { return samples_written_; }
+
+private:
+    FILE* input_file_ = nullptr;
+    FILE* output_file_ = nullptr;
+    std::mutex output_mutex_;
+    std::vector<int16_t> write_buffer_;
+    size_t samples_written_ = 0;
+    std::chrono::steady_clock::time_point input_clock_;
+    std::chrono::steady_clock::time_point output_clock_;
+
+    virtual int Read(int16_t* dest, int samples) override;
+    virtual int Write(const int16_t* data, int samples) override;
+};
+
+#endif // _FILE_AUDIO_CODEC_H
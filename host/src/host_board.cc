@@ -0,0 +1,127 @@
+#include "host_board.h"
+#include "file_audio_codec.h"
+#include "loopback_server.h"
+#include "net_transport.h"
+#include "settings.h"
+#include "display.h"
+
+#include <esp_log.h>
+#include <random>
+
+#define TAG "HostBoard"
+
+static HostBoardConfig host_board_config;
+
+void ConfigureHostBoard(const HostBoardConfig& config) {
+    host_board_config = config;
+}
+
+// Board base class, boards/common/board.cc depends on the OTA and partition APIs of ESP-IDF
+
+Board::Board() {
+    Settings settings("board", true);
+    uuid_ = settings.GetString("uuid");
+    if (uuid_.empty()) {
+        uuid_ = GenerateUuid();
+        settings.SetString("uuid", uuid_);
+    }
+    ESP_LOGI(TAG, "UUID=%s SKU=host", uuid_.c_str());
+}
+
+std::string Board::GenerateUuid() {
+    std::random_device random;
+    uint8_t uuid[16];
+    for (auto& byte : uuid) {
+        byte = random();
+    }
+    uuid[6] = (uuid[6] & 0x0F) | 0x40;    // 版本 4
+    uuid[8] = (uuid[8] & 0x3F) | 0x80;    // 变体 1
+
+    char uuid_str[37];
+    snprintf(uuid_str, sizeof(uuid_str),
+        "%02x%02x%02x%02x-%02x%02x-%02x%02x-%02x%02x-%02x%02x%02x%02x%02x%02x",
+        uuid[0], uuid[1], uuid[2], uuid[3],
+        uuid[4], uuid[5], uuid[6], uuid[7],
+        uuid[8], uuid[9], uuid[10], uuid[11],
+        uuid[12], uuid[13], uuid[14], uuid[15]);
+    return std::string(uuid_str);
+}
+
+bool Board::GetBatteryLevel(int &level, bool& charging, bool& discharging) {
+    return false;
+}
+
+Display* Board::GetDisplay() {
+    static NoDisplay display;
+    return &display;
+}
+
+Led* Board::GetLed() {
+    static NoLed led;
+    return &led;
+}
+
+std::string Board::GetJson() {
+    std::string json = "{";
+    json += "\"version\":2,";
+    json += "\"uuid\":\"" + uuid_ + "\",";
+    json += "\"chip_model_name\":\"host\",";
+    json += "\"board\":" + GetBoardJson();
+    json += "}";
+    return json;
+}
+
+class HostBoard : public Board {
+public:
+    HostBoard() {
+        ESP_LOGI(TAG, "Input %s, output %s", host_board_config.input_path.c_str(), host_board_config.output_path.c_str());
+    }
+
+    virtual std::string GetBoardType() override {
+        return "host";
+    }
+
+    virtual AudioCodec* GetAudioCodec() override {
+        static FileAudioCodec audio_codec(host_board_config.input_path, host_board_config.output_path,
+            host_board_config.input_sample_rate, host_board_config.output_sample_rate);
+        return &audio_codec;
+    }
+
+    virtual Http* CreateHttp() override {
+        return nullptr;
+    }
+
+    virtual WebSocket* CreateWebSocket() override {
+        return new WebSocket(host_board_config.network);
+    }
+
+    virtual Mqtt* CreateMqtt() override {
+        if (host_board_config.network) {
+            return new NetMqtt();
+        }
+        return new LoopbackMqtt();
+    }
+
+    virtual Udp* CreateUdp() override {
+        if (host_board_config.network) {
+            return new NetUdp();
+        }
+        return new LoopbackUdp();
+    }
+
+    virtual void StartNetwork() override {
+    }
+
+    virtual const char* GetNetworkStateIcon() override {
+        return "";
+    }
+
+    virtual void SetPowerSaveMode(bool enabled) override {
+    }
+
+    virtual std::string GetBoardJson() override {
+        return "{\"type\":\"host\",\"name\":\"host\"}";
+    }
+};
+
+DECLARE_BOARD(HostBoard);
@@ -0,0 +1,20 @@
+#ifndef _HOST_BOARD_H
+#define _HOST_BOARD_H
+
+#include "board.h"
+
+#include <string>
+
+struct HostBoardConfig {
+    std::string input_path;
+    std::string output_path;
+    int input_sample_rate = 16000;
+    int output_sample_rate = 24000;
+    // Connect to a real server over TCP and UDP (net_transport.h) instead of the loopback server
+    bool network = false;
+};
+
+// Must be called before the first Board::GetInstance()
+void ConfigureHostBoard(const HostBoardConfig& config);
+
+#endif // _HOST_BOARD_H
@@ -0,0 +1,44 @@
+// Display base class without LVGL, NoDisplay only logs what a screen would show
+#include "display.h"
+
+#include <esp_log.h>
+
+#define TAG "Display"
+
+Display::Display() {
+}
+
+Display::~Display() {
+}
+
+void Display::SetStatus(const char* status) {
+    ESP_LOGD(TAG, "Status: %s", status);
+}
+
+void Display::ShowNotification(const std::string &notification, int duration_ms) {
+    ShowNotification(notification.c_str(), duration_ms);
+}
+
+void Display::ShowNotification(const char* notification, int duration_ms) {
+    ESP_LOGD(TAG, "Notification: %s", notification);
+}
+
+void Display::Update() {
+}
+
+void Display::SetEmotion(const char* emotion) {
+    ESP_LOGD(TAG, "Emotion: %s", emotion);
+}
+
+void Display::SetIcon(const char* icon) {
+}
+
+void Display::SetChatMessage(const char* role, const char* content) {
+    if (content != nullptr && content[0] != '\0') {
+        ESP_LOGI(TAG, "%s: %s", role, content);
+    }
+}
+
+void Display::SetTheme(const std::string& theme_name) {
+    current_theme_name_ = theme_name;
+}
@@ -0,0 +1,43 @@
+// Ota without HTTP: the version check always succeeds with no new firmware,
+// and the protocol is whatever the runner stored in the mqtt or websocket settings.
+#include "ota.h"
+#include "settings.h"
+
+#include <esp_log.h>
+
+#define TAG "Ota"
+
+Ota::Ota() {
+    current_version_ = "host";
+    check_version_url_ = "loopback";
+}
+
+Ota::~Ota() {
+}
+
+void Ota::SetHeader(const std::string& key, const std::string& value) {
+    headers_[key] = value;
+}
+
+bool Ota::CheckVersion() {
+    has_new_version_ = false;
+    has_activation_code_ = false;
+    has_activation_challenge_ = false;
+    has_server_time_ = false;
+    has_mqtt_config_ = !Settings("mqtt", false).GetString("endpoint").empty();
+    has_websocket_config_ = !Settings("websocket", false).GetString("url").empty();
+    firmware_version_ = current_version_;
+    ESP_LOGI(TAG, "Current version: %s", current_version_.c_str());
+    return true;
+}
+
+esp_err_t Ota::Activate() {
+    return ESP_OK;
+}
+
+void Ota::MarkCurrentVersionValid() {
+}
+
+void Ota::StartUpgrade(std::function<void(int progress, size_t speed)> callback) {
+    ESP_LOGW(TAG, "Upgrade is not supported on host");
+}
@@ -0,0 +1,30 @@
+#include "system_info.h"
+
+#include <esp_heap_caps.h>
+#include <cstdlib>
+
+size_t SystemInfo::GetFlashSize() {
+    return 16 * 1024 * 1024;
+}
+
+size_t SystemInfo::GetMinimumFreeHeapSize() {
+    return heap_caps_get_minimum_free_size(MALLOC_CAP_DEFAULT);
+}
+
+size_t SystemInfo::GetFreeHeapSize() {
+    return heap_caps_get_free_size(MALLOC_CAP_DEFAULT);
+}
+
+// XIAOZHI_MAC_ADDRESS lets several host devices share one server with distinct ids
+std::string SystemInfo::GetMacAddress() {
+    const char* mac = getenv("XIAOZHI_MAC_ADDRESS");
+    return mac != nullptr ? mac : "02:00:00:00:00:01";
+}
+
+std::string SystemInfo::GetChipModelName() {
+    return "host";
+}
+
+esp_err_t SystemInfo::PrintRealTimeStats(TickType_t xTicksToWait) {
+    return ESP_OK;
+}
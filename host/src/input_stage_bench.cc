@@ -0,0 +1,137 @@
+// Times InputStage against the path ReadAudio used before it (deinterleave, one OpusResampler per channel,
+// interleave) for stereo capture, one 32ms AFE feed per call, and checks the filter response with test tones.
+// The host OpusResampler is the linear interpolation shim, on target it is the silk resampler and costs more.
+#include "input_stage.h"
+
+#include <opus_resampler.h>
+
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <vector>
+
+static const int kOutputFrames = 512;
+static const int kIterations = 20000;
+
+struct LegacyPath {
+    OpusResampler input_resampler;
+    OpusResampler reference_resampler;
+    std::vector<int16_t> channels[2];
+    std::vector<int16_t> resampled[2];
+
+    void Configure(int input_sample_rate) {
+        input_resampler.Configure(input_sample_rate, 16000);
+        reference_resampler.Configure(input_sample_rate, 16000);
+    }
+
+    // Copy of the stereo branch of Application::ReadAudio before the input stage
+    void Process(std::vector<int16_t>& data) {
+        auto& mic_channel = channels[0];
+        auto& reference_channel = channels[1];
+        auto& resampled_mic = resampled[0];
+        auto& resampled_reference = resampled[1];
+        mic_channel.resize(data.size() / 2);
+        reference_channel.resize(data.size() / 2);
+        for (size_t i = 0, j = 0; i < mic_channel.size(); ++i, j += 2) {
+            mic_channel[i] = data[j];
+            reference_channel[i] = data[j + 1];
+        }
+        resampled_mic.resize(input_resampler.GetOutputSamples(mic_channel.size()));
+        resampled_reference.resize(reference_resampler.GetOutputSamples(reference_channel.size()));
+        input_resampler.Process(mic_channel.data(), mic_channel.size(), resampled_mic.data());
+        reference_resampler.Process(reference_channel.data(), reference_channel.size(), resampled_reference.data());
+        data.resize(resampled_mic.size() + resampled_reference.size());
+        for (size_t i = 0, j = 0; i < resampled_mic.size(); ++i, j += 2) {
+            data[j] = resampled_mic[i];
+            data[j + 1] = resampled_reference[i];
+        }
+    }
+};
+
+static void FillTone(std::vector<int16_t>& data, int sample_rate, double frequency, size_t& phase) {
+    for (size_t i = 0; i < data.size() / 2; i++, phase++) {
+        int16_t value = (int16_t)(16000 * sin(2 * M_PI * frequency * phase / sample_rate));
+        data[i * 2] = value;
+        data[i * 2 + 1] = value / 2;
+    }
+}
+
+// Output level of the microphone channel relative to the input tone, in dB
+static double MeasureGain(int input_sample_rate, double frequency, bool use_stage) {
+    InputStage stage;
+    stage.Configure(input_sample_rate, 16000, 2);
+    LegacyPath legacy;
+    legacy.Configure(input_sample_rate);
+    size_t input_frames = kOutputFrames * input_sample_rate / 16000;
+    std::vector<int16_t> data(input_frames * 2);
+    size_t phase = 0;
+    double energy = 0;
+    size_t count = 0;
+    for (int block = 0; block < 20; block++) {
+        data.resize(input_frames * 2);
+        FillTone(data, input_sample_rate, frequency, phase);
+        size_t frames;
+        if (use_stage) {
+            frames = stage.Process(data.data(), input_frames, data.data());
+        } else {
+            legacy.Process(data);
+            frames = data.size() / 2;
+        }
+        if (block < 2) {
+            continue;
+        }
+        for (size_t i = 0; i < frames; i++) {
+            energy += double(data[i * 2]) * data[i * 2];
+            count++;
+        }
+    }
+    double rms = sqrt(energy / count);
+    return 20 * log10(rms / (16000 / sqrt(2.0)));
+}
+
+static double Measure(const char* name, int input_sample_rate, bool use_stage) {
+    size_t input_frames = kOutputFrames * input_sample_rate / 16000;
+    std::vector<int16_t> data(input_frames * 2);
+    LegacyPath legacy;
+    legacy.Configure(input_sample_rate);
+    InputStage stage;
+    stage.Configure(input_sample_rate, 16000, 2);
+    size_t phase = 0;
+    size_t checksum = 0;
+    double total_ns = 0;
+    for (int i = 0; i < kIterations; i++) {
+        data.resize(input_frames * 2);
+        FillTone(data, input_sample_rate, 440, phase);
+        auto start = std::chrono::steady_clock::now();
+        if (use_stage) {
+            size_t frames = stage.Process(data.data(), input_frames, data.data());
+            data.resize(frames * 2);
+        } else {
+            legacy.Process(data);
+        }
+        total_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+        if (data.size() != kOutputFrames * 2) {
+            printf("%s: %zu output frames instead of %d\n", name, data.size() / 2, kOutputFrames);
+        }
+        checksum += data[i % data.size()];
+    }
+    double ns = total_ns / kIterations;
+    printf("  %-8s %8.1f ns/feed %6.2f ns/output frame  (checksum %zu)\n", name, ns, ns / kOutputFrames, checksum);
+    return ns;
+}
+
+int main() {
+    for (int input_sample_rate : {24000, 48000}) {
+        printf("%d -> 16000, stereo, %d output frames per feed\n", input_sample_rate, kOutputFrames);
+        double legacy = Measure("legacy", input_sample_rate, false);
+        double stage = Measure("stage", input_sample_rate, true);
+        printf("  stage / legacy: %.2f\n", stage / legacy);
+        for (bool use_stage : {false, true}) {
+            // Tones above 8kHz alias into the 16kHz output unless they are filtered out
+            printf("  %-8s gain at 1kHz %6.2f dB, 7kHz %6.2f dB, 9kHz %6.2f dB, 11kHz %6.2f dB\n", use_stage ? "stage" : "legacy",
+                MeasureGain(input_sample_rate, 1000, use_stage), MeasureGain(input_sample_rate, 7000, use_stage),
+                MeasureGain(input_sample_rate, 9000, use_stage), MeasureGain(input_sample_rate, 11000, use_stage));
+        }
+    }
+    return 0;
+}
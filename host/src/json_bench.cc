@@ -0,0 +1,310 @@
+// Control channel JSON: the streaming JsonWriter / JsonReader with the message type hash against the paths they
+// replaced, std::string concatenation for sending, cJSON_Parse with a strcmp chain for receiving, and the
+// cJSON round trip that split the IoT descriptors. Reports time and heap allocations per message, and checks
+// that both paths produce the same JSON and read the same fields.
+#include "control_message.h"
+#include "json_reader.h"
+#include "json_writer.h"
+#include "alloc_counter.h"
+
+#include <cJSON.h>
+#include <esp_heap_caps.h>
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+// cJSON allocates through the same heap as the firmware, both counted by the heap hooks
+static void* HeapMalloc(size_t size) {
+    return heap_caps_malloc(size, MALLOC_CAP_DEFAULT);
+}
+
+static const std::string kSessionId = "d8f0c3a2-5e41-4b8e-9a1c-7f2e6b3d4c5a";
+
+// What the server sends over a turn
+static const char* kIncoming[] = {
+    R"({"type":"stt","text":"今天天气怎么样？","session_id":"d8f0c3a2-5e41-4b8e-9a1c-7f2e6b3d4c5a"})",
+    R"({"type":"llm","text":"😊","emotion":"happy","session_id":"d8f0c3a2-5e41-4b8e-9a1c-7f2e6b3d4c5a"})",
+    R"({"type":"tts","state":"start","sample_rate":24000,"session_id":"d8f0c3a2-5e41-4b8e-9a1c-7f2e6b3d4c5a"})",
+    R"({"type":"tts","state":"sentence_start","text":"今天晴，气温 18 到 25 度，适合出门。","session_id":"d8f0c3a2-5e41-4b8e-9a1c-7f2e6b3d4c5a"})",
+    R"({"type":"tts","state":"sentence_start","text":"记得带上\"防晒\"哦\n","session_id":"d8f0c3a2-5e41-4b8e-9a1c-7f2e6b3d4c5a"})",
+    R"({"type":"iot","commands":[{"name":"Speaker","method":"SetVolume","parameters":{"volume":60}}],"session_id":"d8f0c3a2-5e41-4b8e-9a1c-7f2e6b3d4c5a"})",
+    R"({"type":"tts","state":"stop","session_id":"d8f0c3a2-5e41-4b8e-9a1c-7f2e6b3d4c5a"})",
+};
+
+static const char* kDescriptors =
+    R"([{"name":"Speaker","description":"扬声器","properties":{"volume":{"description":"当前音量值","type":"number"}},)"
+    R"("methods":{"SetVolume":{"description":"设置音量","parameters":{"volume":{"description":"0到100之间的整数","type":"number"}}}}},)"
+    R"({"name":"Battery","description":"电池管理","properties":{"level":{"description":"当前电量百分比","type":"number"},)"
+    R"("charging":{"description":"是否充电中","type":"boolean"}},"methods":{}}])";
+static const char* kStates = R"([{"name":"Speaker","state":{"volume":60}},{"name":"Battery","state":{"level":87,"charging":false}}])";
+
+// What a receive handler takes out of a message, so neither path can skip the work
+struct Fields {
+    int type = 0;
+    size_t text = 0;
+    int volume = 0;
+};
+
+// The old receive path: a heap tree per message and a strcmp chain
+static void ReceiveCjson(const char* message, Fields& fields) {
+    cJSON* root = cJSON_Parse(message);
+    auto type = cJSON_GetObjectItem(root, "type");
+    if (strcmp(type->valuestring, "hello") == 0) {
+        fields.type = kMessageTypeHello;
+    } else if (strcmp(type->valuestring, "tts") == 0) {
+        fields.type = kMessageTypeTts;
+        auto state = cJSON_GetObjectItem(root, "state");
+        if (strcmp(state->valuestring, "sentence_start") == 0) {
+            fields.text += strlen(cJSON_GetObjectItem(root, "text")->valuestring);
+        }
+    } else if (strcmp(type->valuestring, "stt") == 0) {
+        fields.type = kMessageTypeStt;
+        fields.text += strlen(cJSON_GetObjectItem(root, "text")->valuestring);
+    } else if (strcmp(type->valuestring, "llm") == 0) {
+        fields.type = kMessageTypeLlm;
+        fields.text += strlen(cJSON_GetObjectItem(root, "emotion")->valuestring);
+    } else if (strcmp(type->valuestring, "iot") == 0) {
+        fields.type = kMessageTypeIot;
+        auto commands = cJSON_GetObjectItem(root, "commands");
+        for (int i = 0; i < cJSON_GetArraySize(commands); ++i) {
+            auto parameters = cJSON_GetObjectItem(cJSON_GetArrayItem(commands, i), "parameters");
+            fields.volume = cJSON_GetObjectItem(parameters, "volume")->valueint;
+        }
+    }
+    cJSON_Delete(root);
+}
+
+static void ReceiveReader(JsonReader& reader, const char* message, size_t length, Fields& fields) {
+    reader.Parse(message, length);
+    auto& root = reader.root();
+    MessageType type = GetMessageType(root.Get("type"));
+    fields.type = type;
+    switch (type) {
+    case kMessageTypeTts:
+        if (root.Get("state").Is("sentence_start")) {
+            fields.text += root.Get("text").length;
+        }
+        break;
+    case kMessageTypeStt:
+        fields.text += root.Get("text").length;
+        break;
+    case kMessageTypeLlm:
+        fields.text += root.Get("emotion").length;
+        break;
+    case kMessageTypeIot: {
+        JsonArrayReader commands(root.Get("commands"));
+        JsonValue command;
+        while (commands.Next(command)) {
+            JsonObject object, parameters;
+            object.Parse(command);
+            parameters.Parse(object.Get("parameters"));
+            fields.volume = parameters.Get("volume").ToInt();
+        }
+        break;
+    }
+    default:
+        break;
+    }
+}
+
+// The old send path, as Protocol built the messages of a turn
+static void SendConcat(std::vector<std::string>& sent) {
+    std::string message = "{\"session_id\":\"" + kSessionId + "\"";
+    message += ",\"type\":\"listen\",\"state\":\"start\"";
+    message += ",\"mode\":\"auto\"";
+    message += "}";
+    sent.push_back(std::move(message));
+    sent.push_back("{\"session_id\":\"" + kSessionId + "\",\"type\":\"listen\",\"state\":\"stop\"}");
+    message = "{\"session_id\":\"" + kSessionId + "\",\"type\":\"abort\"";
+    message += ",\"reason\":\"wake_word_detected\"";
+    message += "}";
+    sent.push_back(std::move(message));
+    sent.push_back("{\"session_id\":\"" + kSessionId + "\",\"type\":\"iot\",\"update\":true,\"states\":" +
+        std::string(kStates) + "}");
+}
+
+// SendText() takes the buffer by reference, nothing is copied out
+static size_t SendWriter(JsonWriter& writer) {
+    size_t sent = 0;
+    writer.Begin().Add("session_id", kSessionId).Add("type", "listen").Add("state", "start").Add("mode", "auto").End();
+    sent += writer.str().size();
+    writer.Begin().Add("session_id", kSessionId).Add("type", "listen").Add("state", "stop").End();
+    sent += writer.str().size();
+    writer.Begin().Add("session_id", kSessionId).Add("type", "abort").Add("reason", "wake_word_detected").End();
+    sent += writer.str().size();
+    writer.Begin().Add("session_id", kSessionId).Add("type", "iot").Add("update", true)
+        .AddRaw("states", kStates, strlen(kStates)).End();
+    sent += writer.str().size();
+    return sent;
+}
+
+// The old SendIotDescriptors
+static void DescriptorsCjson(std::vector<std::string>& sent) {
+    cJSON* root = cJSON_Parse(kDescriptors);
+    for (int i = 0; i < cJSON_GetArraySize(root); ++i) {
+        cJSON* messageRoot = cJSON_CreateObject();
+        cJSON_AddStringToObject(messageRoot, "session_id", kSessionId.c_str());
+        cJSON_AddStringToObject(messageRoot, "type", "iot");
+        cJSON_AddBoolToObject(messageRoot, "update", true);
+        cJSON* descriptorArray = cJSON_CreateArray();
+        cJSON_AddItemToArray(descriptorArray, cJSON_Duplicate(cJSON_GetArrayItem(root, i), 1));
+        cJSON_AddItemToObject(messageRoot, "descriptors", descriptorArray);
+        char* message = cJSON_PrintUnformatted(messageRoot);
+        sent.push_back(std::string(message));
+        cJSON_free(message);
+        cJSON_Delete(messageRoot);
+    }
+    cJSON_Delete(root);
+}
+
+static void DescriptorsWriter(JsonWriter& writer, std::string& array, std::vector<std::string>& sent) {
+    array.assign(kDescriptors);
+    JsonValue root;
+    ParseJson(&array[0], array.size(), root);
+    JsonArrayReader reader(root);
+    JsonValue descriptor;
+    while (reader.Next(descriptor)) {
+        writer.Begin().Add("session_id", kSessionId).Add("type", "iot").Add("update", true)
+            .BeginArray("descriptors").AddRaw(nullptr, descriptor.text, descriptor.length).End();
+        sent.push_back(writer.str());
+    }
+}
+
+static std::string Canonical(const std::string& json) {
+    cJSON* root = cJSON_Parse(json.c_str());
+    if (root == nullptr) {
+        return "<invalid: " + json + ">";
+    }
+    char* printed = cJSON_PrintUnformatted(root);
+    std::string result = printed;
+    cJSON_free(printed);
+    cJSON_Delete(root);
+    return result;
+}
+
+template <typename F>
+static void Measure(const char* name, int iterations, int messages, F&& run, double& ns, double& allocs) {
+    run();  // warm up, buffers grow to size
+    uint32_t allocations_before = AllocCounter::GetCount();
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < iterations; i++) {
+        run();
+    }
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    ns = double(std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count()) / iterations / messages;
+    allocs = double(AllocCounter::GetCount() - allocations_before) / iterations / messages;
+    printf("  %-34s %8.0f ns/message %6.1f allocations/message\n", name, ns, allocs);
+}
+
+int main(int argc, char** argv) {
+    int iterations = argc > 1 ? atoi(argv[1]) : 20000;
+    cJSON_Hooks hooks = {HeapMalloc, heap_caps_free};
+    cJSON_InitHooks(&hooks);
+    const int incoming = sizeof(kIncoming) / sizeof(kIncoming[0]);
+    std::vector<size_t> lengths;
+    for (auto message : kIncoming) {
+        lengths.push_back(strlen(message));
+    }
+
+    // Both paths read the same fields, and send the same JSON
+    bool ok = true;
+    JsonReader reader;
+    for (int i = 0; i < incoming; i++) {
+        Fields a, b;
+        ReceiveCjson(kIncoming[i], a);
+        ReceiveReader(reader, kIncoming[i], lengths[i], b);
+        if (a.type != b.type || a.text != b.text || a.volume != b.volume) {
+            printf("MISMATCH receiving %s\n", kIncoming[i]);
+            ok = false;
+        }
+    }
+    JsonWriter writer;
+    std::vector<std::string> concat, cjson_descriptors, writer_descriptors;
+    std::string array;
+    SendConcat(concat);
+    {
+        // SendWriter reuses one buffer, build its messages one by one to compare them
+        JsonWriter check;
+        std::vector<std::string> outputs;
+        check.Begin().Add("session_id", kSessionId).Add("type", "listen").Add("state", "start").Add("mode", "auto").End();
+        outputs.push_back(check.str());
+        check.Begin().Add("session_id", kSessionId).Add("type", "listen").Add("state", "stop").End();
+        outputs.push_back(check.str());
+        check.Begin().Add("session_id", kSessionId).Add("type", "abort").Add("reason", "wake_word_detected").End();
+        outputs.push_back(check.str());
+        check.Begin().Add("session_id", kSessionId).Add("type", "iot").Add("update", true)
+            .AddRaw("states", kStates, strlen(kStates)).End();
+        outputs.push_back(check.str());
+        for (size_t i = 0; i < concat.size(); i++) {
+            if (Canonical(concat[i]) != Canonical(outputs[i])) {
+                printf("MISMATCH sending\n  %s\n  %s\n", concat[i].c_str(), outputs[i].c_str());
+                ok = false;
+            }
+        }
+    }
+    DescriptorsCjson(cjson_descriptors);
+    DescriptorsWriter(writer, array, writer_descriptors);
+    if (cjson_descriptors.size() != writer_descriptors.size()) {
+        printf("MISMATCH descriptor count\n");
+        ok = false;
+    }
+    for (size_t i = 0; i < cjson_descriptors.size() && i < writer_descriptors.size(); i++) {
+        if (Canonical(cjson_descriptors[i]) != Canonical(writer_descriptors[i])) {
+            printf("MISMATCH descriptors\n  %s\n  %s\n", cjson_descriptors[i].c_str(), writer_descriptors[i].c_str());
+            ok = false;
+        }
+    }
+
+    double ns[6], allocs[6];
+    Fields sink;
+    printf("Receive, %d messages of a turn\n", incoming);
+    Measure("cJSON_Parse + strcmp chain", iterations, incoming, [&]() {
+        for (auto message : kIncoming) {
+            ReceiveCjson(message, sink);
+        }
+    }, ns[0], allocs[0]);
+    Measure("JsonReader + type hash", iterations, incoming, [&]() {
+        for (int i = 0; i < incoming; i++) {
+            ReceiveReader(reader, kIncoming[i], lengths[i], sink);
+        }
+    }, ns[1], allocs[1]);
+
+    printf("Send, listen start/stop, abort, iot states\n");
+    std::vector<std::string> sent;
+    sent.reserve(8);
+    Measure("std::string concatenation", iterations, 4, [&]() {
+        sent.clear();
+        SendConcat(sent);
+    }, ns[2], allocs[2]);
+    Measure("JsonWriter", iterations, 4, [&]() {
+        sink.text += SendWriter(writer);
+    }, ns[3], allocs[3]);
+
+    // The descriptor messages go out through SendText, the writer version into the reused buffer
+    printf("IoT descriptors, %zu things\n", cjson_descriptors.size());
+    int things = cjson_descriptors.size();
+    Measure("cJSON parse / duplicate / print", iterations / 10, things, [&]() {
+        sent.clear();
+        DescriptorsCjson(sent);
+    }, ns[4], allocs[4]);
+    Measure("JsonArrayReader + JsonWriter", iterations / 10, things, [&]() {
+        array.assign(kDescriptors);
+        JsonValue root;
+        ParseJson(&array[0], array.size(), root);
+        JsonArrayReader descriptors(root);
+        JsonValue descriptor;
+        while (descriptors.Next(descriptor)) {
+            writer.Begin().Add("session_id", kSessionId).Add("type", "iot").Add("update", true)
+                .BeginArray("descriptors").AddRaw(nullptr, descriptor.text, descriptor.length).End();
+            sink.text += writer.str().size();
+        }
+    }, ns[5], allocs[5]);
+
+    printf("Speedup: receive %.1fx, send %.1fx, descriptors %.1fx\n", ns[0] / ns[1], ns[2] / ns[3], ns[4] / ns[5]);
+    printf("%s: both paths agree\n", ok ? "PASS" : "FAIL");
+    return ok ? 0 : 1;
+}
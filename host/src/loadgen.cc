@@ -0,0 +1,826 @@
+// Load generator: simulated devices on the real MqttProtocol / WebsocketProtocol against the loopback server,
+// or with --server against a real one over plain TCP and UDP (net_transport.h), each device with its own MAC and UUID.
+//
+// Every device repeats one turn: open the audio channel, send the wake word pre-roll, detect, listen with a
+// manual stop, send the utterance in real time, stop, wait for the reply (the echoed frames, then tts stop, unless
+// --barge-in aborts it) and close the channel. The frames come from P3 files (a BinaryProtocol3 header before each Opus frame, see
+// scripts/p3_tools), by default the embedded success and welcome sounds.
+//
+// One epoll loop paces all devices: a timerfd fires at the earliest deadline of a heap of device timers, an
+// eventfd wakes it for what the server thread and the workers report. OpenAudioChannel blocks on the handshakes
+// and runs on a pool of workers. Each protocol keeps its own AudioSender task, as on the device.
+#include "application.h"
+#include "mqtt_protocol.h"
+#include "websocket_protocol.h"
+#include "loopback_server.h"
+#include "net_transport.h"
+#include "host_board.h"
+#include "settings.h"
+#include "assets/lang_config.h"
+
+#include <esp_log.h>
+#include <arpa/inet.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+// The pre-roll goes out as fast as the device drains its buffer, not in real time
+#define LOADGEN_PREROLL_INTERVAL_MS 10
+#define LOADGEN_PROGRESS_INTERVAL_MS 5000
+// A timer this late means the loop no longer keeps the audio in real time
+#define LOADGEN_LATE_TIMER_MS 10
+// A user who barges in does so this long into the reply
+#define LOADGEN_BARGE_IN_MS 500
+
+#define TAG "LoadGen"
+
+using Frames = std::vector<std::vector<uint8_t>>;
+
+static void Usage(const char* program) {
+    fprintf(stderr,
+        "Usage: %s [options]\n"
+        "  --devices <n>               simulated devices (default 100)\n"
+        "  --protocol mqtt|websocket   transport to the server (default mqtt)\n"
+        "  --server <endpoint>         a real server instead of the loopback: host:port of a plain MQTT\n"
+        "                              listener, or a ws:// URL; no TLS (mqtts, wss) in the host build\n"
+        "  --token <token>             websocket Authorization token\n"
+        "  --client-id <id>            MQTT client id, {mac} and {uuid} are replaced per device (default loadgen)\n"
+        "  --username <name>           MQTT username\n"
+        "  --password <password>       MQTT password\n"
+        "  --ws-version 1|2|3          websocket binary protocol version (default 1)\n"
+        "  --turns <n>                 conversations per device (default 3)\n"
+        "  --think <ms>                pause between conversations, +-50%% at random (default 3000)\n"
+        "  --ramp <ms>                 devices start evenly spread over this time (default 5000)\n"
+        "  --workers <n>               tasks for the blocking channel opens (default 64)\n"
+        "  --timeout <ms>              a reply not finished this long after the stop fails the turn (default 20000)\n"
+        "  --barge-in <percent>        turns that abort the reply 500 ms into it (default 0)\n"
+        "  --wake <file.p3>            wake word pre-roll (default the success sound)\n"
+        "  --utterance <file.p3>       what the user says (default the welcome sound)\n"
+        "  --rtt <ms>                  round trip time of the connect and hello handshakes (loopback only)\n"
+        "  --loss <percent>            drop downlink UDP packets (loopback mqtt only)\n"
+        "  --jitter <ms>               delay downlink UDP packets by up to ms (loopback mqtt only)\n"
+        "  --frames-per-packet <n>     ask the server to pack n Opus frames per packet\n"
+        "  --csv <file>                latencies of each device\n",
+        program);
+}
+
+static int64_t NowUs() {
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000LL + now.tv_nsec / 1000;
+}
+
+// Opus frames of a P3 stream, each behind a 4-byte header: type, reserved, big endian payload size
+static bool ParseP3(std::string_view data, Frames& frames) {
+    size_t offset = 0;
+    while (offset + sizeof(BinaryProtocol3) <= data.size()) {
+        auto p3 = (const BinaryProtocol3*)(data.data() + offset);
+        size_t size = ntohs(p3->payload_size);
+        offset += sizeof(BinaryProtocol3);
+        if (offset + size > data.size()) {
+            return false;
+        }
+        frames.emplace_back(p3->payload, p3->payload + size);
+        offset += size;
+    }
+    return !frames.empty();
+}
+
+static bool LoadFrames(const std::string& path, std::string_view fallback, Frames& frames) {
+    if (path.empty()) {
+        return ParseP3(fallback, frames);
+    }
+    std::ifstream file(path, std::ios::binary);
+    if (!file) {
+        return false;
+    }
+    std::stringstream buffer;
+    buffer << file.rdbuf();
+    return ParseP3(buffer.str(), frames);
+}
+
+// Latencies in ms, the percentiles are taken when the run is over
+class Samples {
+public:
+    void Add(uint32_t ms) {
+        values_.push_back(ms);
+        sorted_ = false;
+    }
+    void Append(const Samples& other) {
+        values_.insert(values_.end(), other.values_.begin(), other.values_.end());
+        sorted_ = false;
+    }
+    size_t count() const {
+        return values_.size();
+    }
+    // Nearest rank, 0 without samples
+    uint32_t Percentile(int percent) {
+        if (values_.empty()) {
+            return 0;
+        }
+        if (!sorted_) {
+            std::sort(values_.begin(), values_.end());
+            sorted_ = true;
+        }
+        size_t rank = (values_.size() * percent + 99) / 100;
+        return values_[std::clamp<size_t>(rank, 1, values_.size()) - 1];
+    }
+
+private:
+    std::vector<uint32_t> values_;
+    bool sorted_ = true;
+};
+
+// Runs the calls that block on a handshake
+class WorkerPool {
+public:
+    explicit WorkerPool(int count) {
+        for (int i = 0; i < count; i++) {
+            std::thread([this]() { Run(); }).detach();
+        }
+    }
+
+    void Submit(std::function<void()> job) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        jobs_.push_back(std::move(job));
+        cv_.notify_one();
+    }
+
+private:
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::deque<std::function<void()>> jobs_;
+
+    void Run() {
+        while (true) {
+            std::function<void()> job;
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                cv_.wait(lock, [this]() { return !jobs_.empty(); });
+                job = std::move(jobs_.front());
+                jobs_.pop_front();
+            }
+            job();
+        }
+    }
+};
+
+struct LoadConfig {
+    std::string protocol = "mqtt";
+    std::string server;     // Empty for the loopback server
+    int devices = 100;
+    int turns = 3;
+    int think_ms = 3000;
+    int ramp_ms = 5000;
+    int workers = 64;
+    int timeout_ms = 20000;
+    int barge_in_percent = 0;
+    std::string csv_path;
+};
+
+enum DeviceStep {
+    kStepBooting,       // Until Start() returned on a worker
+    kStepThinking,      // Between turns
+    kStepOpening,       // OpenAudioChannel() on a worker
+    kStepPreroll,
+    kStepSpeaking,
+    kStepWaitingReply,
+    kStepDone,
+};
+
+struct Device {
+    int index;
+    std::unique_ptr<Protocol> protocol;
+    DeviceStep step = kStepBooting;
+    uint32_t timer_generation = 0;  // Only the latest timer of a device fires
+    size_t next_frame = 0;
+    int64_t frame_due_us = 0;       // Frames are paced from the first one, lateness does not add up
+    int64_t open_start_us = 0;
+    int64_t stop_us = 0;
+    bool got_audio = false;
+    bool barge_in = false;          // This turn aborts the reply
+    int64_t abort_us = 0;
+    std::atomic<bool> awaiting_audio = false;   // Set on the loop, taken by the first reply packet
+    int turns = 0;
+    int failures = 0;
+    Samples hello_ms;
+    Samples open_ms;
+    Samples first_tts_ms;
+    Samples end_of_turn_ms;
+    Samples abort_ms;               // Abort to tts stop
+};
+
+enum LoadEventType {
+    kEventStarted,
+    kEventOpened,
+    kEventFirstAudio,
+    kEventTtsStop,
+    kEventClosed,
+};
+
+struct LoadEvent {
+    int device;
+    LoadEventType type;
+    bool ok;
+    int64_t time_us;
+};
+
+struct LoadTimer {
+    int64_t due_us;
+    int device;
+    uint32_t generation;
+
+    bool operator>(const LoadTimer& other) const {
+        return due_us > other.due_us;
+    }
+};
+
+class LoadGenerator {
+public:
+    LoadGenerator(const LoadConfig& config, Frames&& wake, Frames&& utterance)
+        : config_(config), wake_(std::move(wake)), utterance_(std::move(utterance)), workers_(config.workers) {
+    }
+
+    int Run();
+
+private:
+    LoadConfig config_;
+    Frames wake_;
+    Frames utterance_;
+    WorkerPool workers_;
+    std::vector<std::unique_ptr<Device>> devices_;
+    std::priority_queue<LoadTimer, std::vector<LoadTimer>, std::greater<LoadTimer>> timers_;
+    std::mt19937 random_{1};
+    int epoll_fd_ = -1;
+    int timer_fd_ = -1;
+    int event_fd_ = -1;
+    int64_t start_us_ = 0;
+    int finished_ = 0;
+
+    // Events from the server thread and the workers
+    std::mutex events_mutex_;
+    std::vector<LoadEvent> events_;
+    std::atomic<uint32_t> downlink_frames_ = 0;
+
+    // Loop timing
+    uint32_t timers_fired_ = 0;
+    int64_t timer_late_total_us_ = 0;
+    int64_t timer_late_max_us_ = 0;
+    uint32_t timers_late_ = 0;
+
+    void Post(int device, LoadEventType type, bool ok = true);
+    void Arm(Device& device, int64_t due_us);
+    void ArmTimerFd(int64_t due_us);
+    int64_t ThinkTimeUs();
+    void OnTimer(Device& device, int64_t now);
+    void OnEvent(const LoadEvent& event);
+    void SendFrame(Device& device, const std::vector<uint8_t>& opus, uint32_t timestamp);
+    void EndTurn(Device& device, bool ok, int64_t now);
+    void NextTurn(Device& device, int64_t now);
+    void PrintProgress(int64_t now);
+    void PrintReport(int64_t now);
+    void WriteCsv();
+};
+
+void LoadGenerator::Post(int device, LoadEventType type, bool ok) {
+    bool wake;
+    {
+        std::lock_guard<std::mutex> lock(events_mutex_);
+        wake = events_.empty();
+        events_.push_back({device, type, ok, NowUs()});
+    }
+    // The loop drains them all at once, one wakeup is enough
+    if (wake) {
+        uint64_t one = 1;
+        write(event_fd_, &one, sizeof(one));
+    }
+}
+
+void LoadGenerator::Arm(Device& device, int64_t due_us) {
+    timers_.push({due_us, device.index, ++device.timer_generation});
+}
+
+void LoadGenerator::ArmTimerFd(int64_t due_us) {
+    itimerspec spec = {};
+    // A zero it_value disarms the timer, one that is already due fires right away
+    due_us = std::max<int64_t>(due_us, 1);
+    spec.it_value.tv_sec = due_us / 1000000;
+    spec.it_value.tv_nsec = (due_us % 1000000) * 1000;
+    timerfd_settime(timer_fd_, TFD_TIMER_ABSTIME, &spec, nullptr);
+}
+
+int64_t LoadGenerator::ThinkTimeUs() {
+    std::uniform_int_distribution<int> think(config_.think_ms / 2, config_.think_ms * 3 / 2);
+    return think(random_) * 1000LL;
+}
+
+// A locally administered MAC and a UUID from the device index
+static NetIdentity DeviceIdentity(int index) {
+    char mac[18];
+    snprintf(mac, sizeof(mac), "02:00:%02x:%02x:%02x:%02x", (index >> 24) & 0xFF, (index >> 16) & 0xFF,
+        (index >> 8) & 0xFF, index & 0xFF);
+    char uuid[37];
+    snprintf(uuid, sizeof(uuid), "00000000-0000-4000-8000-%012x", index);
+    return NetIdentity{mac, uuid};
+}
+
+void LoadGenerator::SendFrame(Device& device, const std::vector<uint8_t>& opus, uint32_t timestamp) {
+    AudioStreamPacket packet;
+    packet.timestamp = timestamp;
+    packet.payload = AudioBuffer<uint8_t>(AudioBufferPool::GetOpusPool(), opus.data(), opus.size());
+    device.protocol->SendAudio(std::move(packet));
+}
+
+void LoadGenerator::OnTimer(Device& device, int64_t now) {
+    switch (device.step) {
+    case kStepBooting:
+        workers_.Submit([this, &device]() {
+            SetNetIdentity(DeviceIdentity(device.index));
+            bool ok = device.protocol->Start();
+            Post(device.index, kEventStarted, ok);
+        });
+        break;
+    case kStepThinking:
+        device.step = kStepOpening;
+        device.open_start_us = now;
+        workers_.Submit([this, &device]() {
+            SetNetIdentity(DeviceIdentity(device.index));
+            bool ok = device.protocol->OpenAudioChannel();
+            Post(device.index, kEventOpened, ok);
+        });
+        break;
+    case kStepPreroll:
+        if (device.next_frame < wake_.size()) {
+            SendFrame(device, wake_[device.next_frame], device.next_frame * OPUS_FRAME_DURATION_MS);
+            device.next_frame++;
+            Arm(device, now + LOADGEN_PREROLL_INTERVAL_MS * 1000);
+            break;
+        }
+        device.protocol->SendWakeWordDetected("你好小智");
+        device.protocol->SendStartListening(kListeningModeManualStop);
+        device.step = kStepSpeaking;
+        device.next_frame = 0;
+        device.frame_due_us = now;
+        Arm(device, now);
+        break;
+    case kStepSpeaking:
+        if (device.next_frame < utterance_.size()) {
+            SendFrame(device, utterance_[device.next_frame], device.next_frame * OPUS_FRAME_DURATION_MS);
+            device.next_frame++;
+            device.frame_due_us += OPUS_FRAME_DURATION_MS * 1000;
+            Arm(device, device.frame_due_us);
+            break;
+        }
+        // The button is let go one frame after the last one was captured. Armed before the stop goes out,
+        // the reply may start on the server thread right away.
+        device.stop_us = now;
+        device.got_audio = false;
+        device.barge_in = (int)(random_() % 100) < config_.barge_in_percent;
+        device.abort_us = 0;
+        device.awaiting_audio = true;
+        device.step = kStepWaitingReply;
+        device.protocol->SendStopListening();
+        Arm(device, now + config_.timeout_ms * 1000LL);
+        break;
+    case kStepWaitingReply:
+        if (device.barge_in && device.abort_us == 0) {
+            device.abort_us = now;
+            device.protocol->SendAbortSpeaking(kAbortReasonNone);
+            Arm(device, now + config_.timeout_ms * 1000LL);
+            break;
+        }
+        ESP_LOGW(TAG, "Device %d: no reply %d ms after the stop", device.index, config_.timeout_ms);
+        EndTurn(device, false, now);
+        break;
+    default:
+        break;
+    }
+}
+
+void LoadGenerator::OnEvent(const LoadEvent& event) {
+    auto& device = *devices_[event.device];
+    switch (event.type) {
+    case kEventStarted:
+        // A device that could not connect at boot tries again when it opens the channel
+        if (device.step == kStepBooting) {
+            device.step = kStepThinking;
+            Arm(device, event.time_us + ThinkTimeUs());
+        }
+        break;
+    case kEventOpened:
+        if (device.step != kStepOpening) {
+            break;
+        }
+        if (!event.ok) {
+            ESP_LOGW(TAG, "Device %d: failed to open the audio channel", device.index);
+            device.failures++;
+            NextTurn(device, event.time_us);
+            break;
+        }
+        device.open_ms.Add((event.time_us - device.open_start_us) / 1000);
+        device.hello_ms.Add(device.protocol->GetHealthStats().hello_ms);
+        device.step = kStepPreroll;
+        device.next_frame = 0;
+        Arm(device, event.time_us);
+        break;
+    case kEventFirstAudio:
+        if (device.step == kStepWaitingReply && !device.got_audio) {
+            device.got_audio = true;
+            device.first_tts_ms.Add((event.time_us - device.stop_us) / 1000);
+            if (device.barge_in) {
+                Arm(device, event.time_us + LOADGEN_BARGE_IN_MS * 1000);
+            }
+        }
+        break;
+    case kEventTtsStop:
+        if (device.step == kStepWaitingReply) {
+            if (device.abort_us != 0) {
+                device.abort_ms.Add((event.time_us - device.abort_us) / 1000);
+            } else {
+                device.end_of_turn_ms.Add((event.time_us - device.stop_us) / 1000);
+            }
+            EndTurn(device, device.got_audio, event.time_us);
+        }
+        break;
+    case kEventClosed:
+        // Our own closes come in after the turn has ended, only a close by the server is seen mid turn
+        if (device.step == kStepPreroll || device.step == kStepSpeaking || device.step == kStepWaitingReply) {
+            ESP_LOGW(TAG, "Device %d: audio channel closed by the server", device.index);
+            EndTurn(device, false, event.time_us);
+        }
+        break;
+    }
+}
+
+void LoadGenerator::EndTurn(Device& device, bool ok, int64_t now) {
+    device.awaiting_audio = false;
+    device.protocol->CloseAudioChannel();
+    if (!ok) {
+        device.failures++;
+    }
+    NextTurn(device, now);
+}
+
+void LoadGenerator::NextTurn(Device& device, int64_t now) {
+    device.turns++;
+    if (device.turns >= config_.turns) {
+        device.step = kStepDone;
+        device.timer_generation++;
+        finished_++;
+        return;
+    }
+    device.step = kStepThinking;
+    Arm(device, now + ThinkTimeUs());
+}
+
+int LoadGenerator::Run() {
+    epoll_fd_ = epoll_create1(0);
+    timer_fd_ = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+    event_fd_ = eventfd(0, EFD_NONBLOCK);
+    if (epoll_fd_ < 0 || timer_fd_ < 0 || event_fd_ < 0) {
+        perror("epoll");
+        return 1;
+    }
+    for (int fd : {timer_fd_, event_fd_}) {
+        epoll_event event = {};
+        event.events = EPOLLIN;
+        event.data.fd = fd;
+        epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &event);
+    }
+
+    start_us_ = NowUs();
+    for (int i = 0; i < config_.devices; i++) {
+        auto device = std::make_unique<Device>();
+        device->index = i;
+        if (config_.protocol == "mqtt") {
+            device->protocol = std::make_unique<MqttProtocol>();
+        } else {
+            device->protocol = std::make_unique<WebsocketProtocol>();
+        }
+        auto raw = device.get();
+        device->protocol->OnIncomingAudio([this, raw](AudioStreamPacket&& packet) {
+            downlink_frames_++;
+            if (raw->awaiting_audio.exchange(false)) {
+                Post(raw->index, kEventFirstAudio);
+            }
+        });
+        device->protocol->OnIncomingJson([this, raw](MessageType type, const JsonObject& root) {
+            if (type == kMessageTypeTts && root.Get("state").Is("stop")) {
+                Post(raw->index, kEventTtsStop);
+            }
+        });
+        device->protocol->OnAudioChannelClosed([this, raw]() {
+            Post(raw->index, kEventClosed);
+        });
+        Arm(*device, start_us_ + (int64_t)config_.ramp_ms * 1000 * i / config_.devices);
+        devices_.push_back(std::move(device));
+    }
+
+    int64_t next_progress_us = start_us_ + LOADGEN_PROGRESS_INTERVAL_MS * 1000;
+    std::vector<LoadEvent> events;
+    while (finished_ < config_.devices) {
+        int64_t due_us = next_progress_us;
+        if (!timers_.empty()) {
+            due_us = std::min(due_us, timers_.top().due_us);
+        }
+        ArmTimerFd(due_us);
+        epoll_event ready[2];
+        int count = epoll_wait(epoll_fd_, ready, 2, -1);
+        for (int i = 0; i < count; i++) {
+            uint64_t value;
+            read(ready[i].data.fd, &value, sizeof(value));
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(events_mutex_);
+            events.swap(events_);
+        }
+        for (auto& event : events) {
+            OnEvent(event);
+        }
+        events.clear();
+
+        int64_t now = NowUs();
+        while (!timers_.empty() && timers_.top().due_us <= now) {
+            auto timer = timers_.top();
+            timers_.pop();
+            auto& device = *devices_[timer.device];
+            if (timer.generation != device.timer_generation) {
+                continue;
+            }
+            int64_t late_us = now - timer.due_us;
+            timers_fired_++;
+            timer_late_total_us_ += late_us;
+            timer_late_max_us_ = std::max(timer_late_max_us_, late_us);
+            if (late_us >= LOADGEN_LATE_TIMER_MS * 1000) {
+                timers_late_++;
+            }
+            OnTimer(device, now);
+        }
+        if (now >= next_progress_us) {
+            PrintProgress(now);
+            next_progress_us += LOADGEN_PROGRESS_INTERVAL_MS * 1000;
+        }
+    }
+
+    PrintReport(NowUs());
+    if (!config_.csv_path.empty()) {
+        WriteCsv();
+    }
+    int failures = 0;
+    for (auto& device : devices_) {
+        failures += device->failures;
+    }
+    return failures == 0 ? 0 : 1;
+}
+
+void LoadGenerator::PrintProgress(int64_t now) {
+    int steps[kStepDone + 1] = {};
+    int turns = 0;
+    int failures = 0;
+    for (auto& device : devices_) {
+        steps[device->step]++;
+        turns += device->turns;
+        failures += device->failures;
+    }
+    printf("%6.1f s: %d booting, %d thinking, %d opening, %d speaking, %d waiting, %d done; %d turns, %d failed\n",
+        (now - start_us_) / 1000000.0, steps[kStepBooting], steps[kStepThinking], steps[kStepOpening],
+        steps[kStepPreroll] + steps[kStepSpeaking], steps[kStepWaitingReply], steps[kStepDone], turns, failures);
+    fflush(stdout);
+}
+
+static void PrintSamples(const char* name, Samples& samples) {
+    printf("  %-13s %8zu %7u %7u %7u %7u\n", name, samples.count(), samples.Percentile(50), samples.Percentile(90),
+        samples.Percentile(99), samples.Percentile(100));
+}
+
+void LoadGenerator::PrintReport(int64_t now) {
+    double seconds = (now - start_us_) / 1000000.0;
+    int turns = 0;
+    int failures = 0;
+    Samples hello, open, first_tts, end_of_turn, abort;
+    // How the devices differ: the distribution of each device's own p99
+    Samples device_first_tts_p99, device_end_of_turn_p99;
+    for (auto& device : devices_) {
+        turns += device->turns;
+        failures += device->failures;
+        hello.Append(device->hello_ms);
+        open.Append(device->open_ms);
+        first_tts.Append(device->first_tts_ms);
+        end_of_turn.Append(device->end_of_turn_ms);
+        abort.Append(device->abort_ms);
+        if (device->first_tts_ms.count() > 0) {
+            device_first_tts_p99.Add(device->first_tts_ms.Percentile(99));
+        }
+        if (device->end_of_turn_ms.count() > 0) {
+            device_end_of_turn_p99.Add(device->end_of_turn_ms.Percentile(99));
+        }
+    }
+
+    printf("\n%s: %d devices, %d turns, %d failed in %.1f s, utterance %zu frames, pre-roll %zu frames\n",
+        failures == 0 ? "PASS" : "FAIL", config_.devices, turns, failures, seconds, utterance_.size(), wake_.size());
+    printf("Latency (ms)         count     p50     p90     p99     max\n");
+    PrintSamples("hello", hello);
+    PrintSamples("open", open);
+    PrintSamples("first TTS", first_tts);
+    PrintSamples("end of turn", end_of_turn);
+    if (abort.count() > 0) {
+        PrintSamples("abort", abort);
+    }
+    printf("Per device p99 (ms)  count     p50     p90     p99     max\n");
+    PrintSamples("first TTS", device_first_tts_p99);
+    PrintSamples("end of turn", device_end_of_turn_p99);
+
+    if (config_.server.empty()) {
+        auto uplink = LoopbackServer::GetInstance().GetUplinkStats();
+        printf("Uplink: %u packets, %u frames, %.1f packets/s; downlink %u frames, %.1f frames/s\n", uplink.packets,
+            uplink.frames, uplink.packets / seconds, downlink_frames_.load(), downlink_frames_ / seconds);
+        auto connects = LoopbackServer::GetInstance().GetConnectStats();
+        printf("Handshakes: %u MQTT and %u WebSocket connects, %u hellos, %u UDP sockets, %u keys\n",
+            connects.mqtt_connects, connects.websocket_connects, connects.hellos, connects.udp_connects, connects.keys);
+    } else {
+        // Only the client side is seen, frames packed by the server count as one
+        auto net = GetNetTransportStats();
+        printf("Uplink: %u packets, %.1f packets/s; downlink %u packets, %u frames, %.1f frames/s\n",
+            net.audio_packets_sent, net.audio_packets_sent / seconds, net.audio_packets_received,
+            downlink_frames_.load(), downlink_frames_ / seconds);
+        printf("Network %s: %u TCP connects, %u failed, %u UDP sockets, %u closed by the server, "
+            "%.1f MB sent, %.1f MB received\n", config_.server.c_str(), net.tcp_connects, net.connect_failures,
+            net.udp_sockets, net.remote_closes, net.bytes_sent / 1e6, net.bytes_received / 1e6);
+    }
+    printf("Loop: %u timers, late avg %.2f ms max %.1f ms, %u over %d ms\n", timers_fired_,
+        timers_fired_ > 0 ? timer_late_total_us_ / 1000.0 / timers_fired_ : 0, timer_late_max_us_ / 1000.0,
+        timers_late_, LOADGEN_LATE_TIMER_MS);
+    fflush(stdout);
+}
+
+void LoadGenerator::WriteCsv() {
+    FILE* file = fopen(config_.csv_path.c_str(), "w");
+    if (file == nullptr) {
+        perror(config_.csv_path.c_str());
+        return;
+    }
+    fprintf(file, "device,turns,failures");
+    for (auto name : {"hello", "open", "first_tts", "end_of_turn", "abort"}) {
+        fprintf(file, ",%s_p50,%s_p90,%s_p99,%s_max", name, name, name, name);
+    }
+    fprintf(file, "\n");
+    for (auto& device : devices_) {
+        fprintf(file, "%d,%d,%d", device->index, device->turns, device->failures);
+        for (auto samples : {&device->hello_ms, &device->open_ms, &device->first_tts_ms, &device->end_of_turn_ms,
+                             &device->abort_ms}) {
+            fprintf(file, ",%u,%u,%u,%u", samples->Percentile(50), samples->Percentile(90), samples->Percentile(99),
+                samples->Percentile(100));
+        }
+        fprintf(file, "\n");
+    }
+    fclose(file);
+}
+
+int main(int argc, char* argv[]) {
+    LoadConfig config;
+    int ws_version = 1;
+    int rtt_ms = 0;
+    int loss_percent = 0;
+    int jitter_ms = 0;
+    int frames_per_packet = CONFIG_AUDIO_FRAMES_PER_PACKET;
+    std::string wake_path;
+    std::string utterance_path;
+    std::string token;
+    std::string client_id = "loadgen";
+    std::string username;
+    std::string password;
+
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (i + 1 >= argc) {
+            Usage(argv[0]);
+            return 2;
+        }
+        std::string value = argv[++i];
+        if (arg == "--devices") {
+            config.devices = std::stoi(value);
+        } else if (arg == "--protocol") {
+            config.protocol = value;
+        } else if (arg == "--server") {
+            config.server = value;
+        } else if (arg == "--token") {
+            token = value;
+        } else if (arg == "--client-id") {
+            client_id = value;
+        } else if (arg == "--username") {
+            username = value;
+        } else if (arg == "--password") {
+            password = value;
+        } else if (arg == "--ws-version") {
+            ws_version = std::stoi(value);
+        } else if (arg == "--turns") {
+            config.turns = std::stoi(value);
+        } else if (arg == "--think") {
+            config.think_ms = std::stoi(value);
+        } else if (arg == "--ramp") {
+            config.ramp_ms = std::stoi(value);
+        } else if (arg == "--workers") {
+            config.workers = std::stoi(value);
+        } else if (arg == "--timeout") {
+            config.timeout_ms = std::stoi(value);
+        } else if (arg == "--barge-in") {
+            config.barge_in_percent = std::stoi(value);
+        } else if (arg == "--wake") {
+            wake_path = value;
+        } else if (arg == "--utterance") {
+            utterance_path = value;
+        } else if (arg == "--rtt") {
+            rtt_ms = std::stoi(value);
+        } else if (arg == "--loss") {
+            loss_percent = std::stoi(value);
+        } else if (arg == "--jitter") {
+            jitter_ms = std::stoi(value);
+        } else if (arg == "--frames-per-packet") {
+            frames_per_packet = std::stoi(value);
+        } else if (arg == "--csv") {
+            config.csv_path = value;
+        } else {
+            Usage(argv[0]);
+            return 2;
+        }
+    }
+    if (config.devices <= 0 || config.turns <= 0 || config.workers <= 0 ||
+        (config.protocol != "mqtt" && config.protocol != "websocket")) {
+        Usage(argv[0]);
+        return 2;
+    }
+    // MqttProtocol takes a missing port for 8883, which is TLS
+    if (!config.server.empty() && (rtt_ms != 0 || loss_percent != 0 || jitter_ms != 0 ||
+        (config.protocol == "mqtt" && (config.server.find("://") != std::string::npos ||
+                                       config.server.find(':') == std::string::npos)) ||
+        (config.protocol == "websocket" && config.server.rfind("ws://", 0) != 0))) {
+        fprintf(stderr, "--server takes host:port for mqtt and a ws:// URL for websocket, "
+            "--rtt, --loss and --jitter only impair the loopback server\n");
+        return 2;
+    }
+
+    Frames wake, utterance;
+    if (!LoadFrames(wake_path, Lang::Sounds::P3_SUCCESS, wake) ||
+        !LoadFrames(utterance_path, Lang::Sounds::P3_WELCOME, utterance)) {
+        fprintf(stderr, "Failed to load the wake word or utterance P3 file\n");
+        return 2;
+    }
+
+    // Thousands of sessions log too much at info, XIAOZHI_LOG_LEVEL still wins
+    if (getenv("XIAOZHI_LOG_LEVEL") == nullptr) {
+        esp_log_level_set("*", ESP_LOG_WARN);
+    }
+    if (config.server.empty()) {
+        LoopbackServer::GetInstance().SetDownlinkImpairment(loss_percent, jitter_ms);
+        LoopbackServer::GetInstance().SetHandshakeRtt(rtt_ms);
+    } else {
+        HostBoardConfig board_config;
+        board_config.network = true;
+        ConfigureHostBoard(board_config);
+    }
+
+    // What the OTA check would have stored, the same for every device but the identity (see DeviceIdentity())
+    if (config.protocol == "mqtt") {
+        Settings settings("mqtt", true);
+        settings.SetString("endpoint", config.server.empty() ? "loopback:1883" : config.server);
+        settings.SetString("client_id", client_id);
+        settings.SetString("username", username);
+        settings.SetString("password", password);
+        settings.SetString("publish_topic", "device-server");
+        settings.SetInt("frames_per_packet", frames_per_packet);
+    } else {
+        Settings settings("websocket", true);
+        settings.SetString("url", config.server.empty() ? "ws://loopback/xiaozhi/v1/" : config.server);
+        settings.SetString("token", token);
+        settings.SetInt("version", ws_version);
+        settings.SetInt("frames_per_packet", frames_per_packet);
+    }
+
+    LoadGenerator generator(config, std::move(wake), std::move(utterance));
+    int result = generator.Run();
+
+    // Protocol and worker tasks never return, leave without running static destructors under them
+    fflush(stdout);
+    fflush(stderr);
+    _exit(result);
+}
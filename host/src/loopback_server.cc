@@ -0,0 +1,790 @@
+#include "loopback_server.h"
+#include "protocol.h"
+#include "net_transport.h"
+
+#include <esp_log.h>
+#include <esp_heap_caps.h>
+#include <esp_timer.h>
+#include <cJSON.h>
+#include <mbedtls/aes.h>
+#include <arpa/inet.h>
+
+#include <algorithm>
+#include <cstring>
+#include <random>
+
+#define TAG "LoopbackServer"
+
+struct LoopbackSession {
+    int id;
+    std::string session_id;
+
+    // MQTT control channel with UDP audio, or a single WebSocket
+    Mqtt* mqtt = nullptr;
+    Udp* udp = nullptr;
+    WebSocket* websocket = nullptr;
+    std::function<void(const std::string&)> mqtt_deliver;
+    std::function<void(const std::string&)> udp_deliver;
+    int version = 1;
+
+    mbedtls_aes_context aes;
+    std::string aes_key;
+    std::string aes_nonce;
+    uint32_t remote_sequence = 0;
+    uint32_t local_sequence = 0;
+
+    int frame_duration = 60;
+    // Frames per audio packet in both directions, agreed in the hello
+    int frames_per_packet = 1;
+    bool listening = false;
+    bool manual_stop = false;
+    std::vector<std::vector<uint8_t>> frames;
+    // Bumped on abort, pending TTS events of an older reply are discarded
+    uint32_t reply_generation = 0;
+
+    LoopbackSession() { mbedtls_aes_init(&aes); }
+    ~LoopbackSession() { mbedtls_aes_free(&aes); }
+};
+
+// Server work is not part of the device, keep it out of the heap hook counts (see AllocCounter)
+class ServerHeapScope {
+public:
+    ServerHeapScope() { host_heap_hooks_pause_depth++; }
+    ~ServerHeapScope() { host_heap_hooks_pause_depth--; }
+};
+
+// Delivering to an endpoint runs device code, count it again
+class DeviceHeapScope {
+public:
+    DeviceHeapScope() : depth_(host_heap_hooks_pause_depth) { host_heap_hooks_pause_depth = 0; }
+    ~DeviceHeapScope() { host_heap_hooks_pause_depth = depth_; }
+
+private:
+    int depth_;
+};
+
+static std::string EncodeHexString(const std::string& data) {
+    static const char hex_chars[] = "0123456789ABCDEF";
+    std::string encoded;
+    for (uint8_t c : data) {
+        encoded.push_back(hex_chars[c >> 4]);
+        encoded.push_back(hex_chars[c & 0x0F]);
+    }
+    return encoded;
+}
+
+LoopbackServer::LoopbackServer() {
+    std::thread([this]() { EventLoop(); }).detach();
+}
+
+LoopbackServer::~LoopbackServer() {
+}
+
+void LoopbackServer::SetDownlinkImpairment(int loss_percent, int jitter_ms) {
+    ServerHeapScope heap_scope;
+    std::lock_guard<std::recursive_mutex> lock(mutex_);
+    loss_percent_ = loss_percent;
+    jitter_ms_ = jitter_ms;
+}
+
+void LoopbackServer::SetHandshakeRtt(int rtt_ms) {
+    rtt_ms_ = rtt_ms;
+}
+
+void LoopbackServer::SetUdpKeyPerHello(bool new_key_per_hello) {
+    ServerHeapScope heap_scope;
+    std::lock_guard<std::recursive_mutex> lock(mutex_);
+    new_key_per_hello_ = new_key_per_hello;
+}
+
+void LoopbackServer::DropConnections() {
+    Post(0, [this]() {
+        std::vector<Mqtt*> mqtts;
+        std::vector<WebSocket*> websockets;
+        for (auto& [id, session] : sessions_) {
+            if (session->mqtt != nullptr) {
+                mqtts.push_back(session->mqtt);
+            } else if (session->websocket != nullptr) {
+                websockets.push_back(session->websocket);
+            }
+        }
+        ESP_LOGI(TAG, "Dropping %zu connections", mqtts.size() + websockets.size());
+        DeviceHeapScope heap_scope;
+        for (auto mqtt : mqtts) {
+            mqtt->Disconnect();
+        }
+        for (auto websocket : websockets) {
+            websocket->Disconnect();
+        }
+    });
+}
+
+LoopbackConnectStats LoopbackServer::GetConnectStats() {
+    ServerHeapScope heap_scope;
+    std::lock_guard<std::recursive_mutex> lock(mutex_);
+    return connects_;
+}
+
+// On the client's task, which is held for the handshake as it would be by a blocking connect
+void LoopbackServer::ConnectHandshake(bool websocket) {
+    int delay_ms = rtt_ms_ * 4;
+    {
+        ServerHeapScope heap_scope;
+        std::lock_guard<std::recursive_mutex> lock(mutex_);
+        if (websocket) {
+            connects_.websocket_connects++;
+        } else {
+            connects_.mqtt_connects++;
+        }
+        connects_.handshake_ms += delay_ms;
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(delay_ms));
+}
+
+void LoopbackServer::ExpectUplink() {
+    ServerHeapScope heap_scope;
+    std::lock_guard<std::recursive_mutex> lock(mutex_);
+    expect_uplink_us_ = esp_timer_get_time();
+}
+
+LoopbackUplinkStats LoopbackServer::GetUplinkStats() {
+    ServerHeapScope heap_scope;
+    std::lock_guard<std::recursive_mutex> lock(mutex_);
+    return uplink_;
+}
+
+void LoopbackServer::Post(int delay_ms, std::function<void()> callback) {
+    ServerHeapScope heap_scope;
+    std::lock_guard<std::recursive_mutex> lock(mutex_);
+    events_.emplace(std::chrono::steady_clock::now() + std::chrono::milliseconds(delay_ms), std::move(callback));
+    cv_.notify_all();
+}
+
+// Events run with mutex_ held, so an endpoint cannot be destroyed while a message is delivered to it
+void LoopbackServer::EventLoop() {
+    ServerHeapScope heap_scope;
+    std::unique_lock<std::recursive_mutex> lock(mutex_);
+    while (true) {
+        if (events_.empty()) {
+            cv_.wait(lock);
+            continue;
+        }
+        auto it = events_.begin();
+        if (it->first > std::chrono::steady_clock::now()) {
+            cv_.wait_until(lock, it->first);
+            continue;
+        }
+        auto callback = std::move(it->second);
+        events_.erase(it);
+        callback();
+    }
+}
+
+LoopbackSession* LoopbackServer::NewSession() {
+    auto session = std::make_unique<LoopbackSession>();
+    session->id = next_session_id_++;
+    session->session_id = "loopback-" + std::to_string(session->id);
+    auto& slot = sessions_[session->id];
+    slot = std::move(session);
+    return slot.get();
+}
+
+LoopbackSession* LoopbackServer::FindSession(int id) {
+    auto it = sessions_.find(id);
+    return it != sessions_.end() ? it->second.get() : nullptr;
+}
+
+LoopbackSession* LoopbackServer::FindEndpoint(const void* endpoint) {
+    auto it = endpoints_.find(endpoint);
+    return it != endpoints_.end() ? it->second : nullptr;
+}
+
+void LoopbackServer::BindEndpoint(LoopbackSession* session, const void* endpoint) {
+    endpoints_[endpoint] = session;
+}
+
+// Only while it is still bound to this session, a reused Udp may have moved on to a newer one
+void LoopbackServer::UnbindEndpoint(LoopbackSession* session, const void* endpoint) {
+    auto it = endpoints_.find(endpoint);
+    if (it != endpoints_.end() && it->second == session) {
+        endpoints_.erase(it);
+    }
+}
+
+void LoopbackServer::RemoveSession(LoopbackSession* session) {
+    UnbindEndpoint(session, session->mqtt);
+    UnbindEndpoint(session, session->udp);
+    UnbindEndpoint(session, session->websocket);
+    int id = session->id;
+    sessions_.erase(id);
+}
+
+void LoopbackServer::OnMqttConnected(Mqtt* mqtt, std::function<void(const std::string&)> deliver) {
+    ServerHeapScope heap_scope;
+    std::lock_guard<std::recursive_mutex> lock(mutex_);
+    auto session = NewSession();
+    session->mqtt = mqtt;
+    session->mqtt_deliver = std::move(deliver);
+    BindEndpoint(session, mqtt);
+}
+
+void LoopbackServer::OnMqttDisconnected(Mqtt* mqtt) {
+    ServerHeapScope heap_scope;
+    std::lock_guard<std::recursive_mutex> lock(mutex_);
+    auto session = FindEndpoint(mqtt);
+    if (session != nullptr) {
+        RemoveSession(session);
+    }
+}
+
+void LoopbackServer::OnMqttPublish(Mqtt* mqtt, const std::string& payload) {
+    ServerHeapScope heap_scope;
+    std::lock_guard<std::recursive_mutex> lock(mutex_);
+    auto session = FindEndpoint(mqtt);
+    if (session != nullptr) {
+        HandleJson(session, payload);
+    }
+}
+
+// The UDP "port" handed out in the hello reply is the session id
+bool LoopbackServer::OnUdpConnected(Udp* udp, int port, std::function<void(const std::string&)> deliver) {
+    ServerHeapScope heap_scope;
+    std::lock_guard<std::recursive_mutex> lock(mutex_);
+    auto session = FindSession(port);
+    if (session == nullptr) {
+        ESP_LOGE(TAG, "No session for UDP port %d", port);
+        return false;
+    }
+    UnbindEndpoint(session, session->udp);
+    session->udp = udp;
+    session->udp_deliver = std::move(deliver);
+    BindEndpoint(session, udp);
+    connects_.udp_connects++;
+    return true;
+}
+
+void LoopbackServer::OnUdpDisconnected(Udp* udp) {
+    ServerHeapScope heap_scope;
+    std::lock_guard<std::recursive_mutex> lock(mutex_);
+    auto session = FindEndpoint(udp);
+    if (session != nullptr) {
+        UnbindEndpoint(session, udp);
+        session->udp = nullptr;
+        session->udp_deliver = nullptr;
+    }
+}
+
+void LoopbackServer::OnUdpPacket(Udp* udp, const std::string& data) {
+    ServerHeapScope heap_scope;
+    std::lock_guard<std::recursive_mutex> lock(mutex_);
+    auto session = FindEndpoint(udp);
+    if (session == nullptr || data.size() < session->aes_nonce.size()) {
+        return;
+    }
+
+    uint32_t sequence = ntohl(*(uint32_t*)&data[12]);
+    if (sequence != session->remote_sequence + 1) {
+        ESP_LOGW(TAG, "Uplink sequence %u, expected %u", sequence, session->remote_sequence + 1);
+    }
+    session->remote_sequence = sequence;
+
+    uint8_t nonce[16];
+    memcpy(nonce, data.data(), sizeof(nonce));
+    size_t nc_off = 0;
+    uint8_t stream_block[16] = {0};
+    std::vector<uint8_t> payload(data.size() - sizeof(nonce));
+    mbedtls_aes_crypt_ctr(&session->aes, payload.size(), &nc_off, nonce, stream_block,
+        (const uint8_t*)data.data() + sizeof(nonce), payload.data());
+    CountUplinkPacket(data.size());
+    if (data[1] & AUDIO_PACKET_FLAG_PACKED) {
+        // The header has the sequence number of the first frame
+        session->remote_sequence += HandlePackedAudio(session, payload.data(), payload.size()) - 1;
+        return;
+    }
+    uplink_.frames++;
+    HandleAudio(session, std::move(payload));
+}
+
+// Returns the number of frames
+int LoopbackServer::HandlePackedAudio(LoopbackSession* session, const uint8_t* data, size_t size) {
+    AudioUnpacker unpacker;
+    if (!unpacker.Parse(data, size)) {
+        return 1;
+    }
+    const uint8_t* opus;
+    size_t opus_size;
+    uint32_t timestamp;
+    while (unpacker.Next(opus, opus_size, timestamp)) {
+        HandleAudio(session, std::vector<uint8_t>(opus, opus + opus_size));
+    }
+    uplink_.frames += unpacker.count();
+    return unpacker.count();
+}
+
+void LoopbackServer::OnWebSocketConnected(WebSocket* websocket) {
+    ServerHeapScope heap_scope;
+    std::lock_guard<std::recursive_mutex> lock(mutex_);
+    auto session = NewSession();
+    session->websocket = websocket;
+    BindEndpoint(session, websocket);
+    auto it = websocket->headers().find("Protocol-Version");
+    if (it != websocket->headers().end()) {
+        session->version = std::stoi(it->second);
+    }
+}
+
+void LoopbackServer::OnWebSocketDisconnected(WebSocket* websocket) {
+    ServerHeapScope heap_scope;
+    std::lock_guard<std::recursive_mutex> lock(mutex_);
+    auto session = FindEndpoint(websocket);
+    if (session != nullptr) {
+        RemoveSession(session);
+    }
+}
+
+void LoopbackServer::OnWebSocketData(WebSocket* websocket, const char* data, size_t len, bool binary) {
+    ServerHeapScope heap_scope;
+    std::lock_guard<std::recursive_mutex> lock(mutex_);
+    auto session = FindEndpoint(websocket);
+    if (session == nullptr) {
+        return;
+    }
+    if (!binary) {
+        HandleJson(session, std::string(data, len));
+        return;
+    }
+
+    CountUplinkPacket(len);
+    if (session->version == 2) {
+        auto bp2 = (const BinaryProtocol2*)data;
+        auto payload_size = ntohl(bp2->payload_size);
+        if (ntohs(bp2->type) == AUDIO_PACKET_TYPE_PACKED) {
+            HandlePackedAudio(session, bp2->payload, payload_size);
+            return;
+        }
+        HandleAudio(session, std::vector<uint8_t>(bp2->payload, bp2->payload + payload_size));
+    } else if (session->version == 3) {
+        auto bp3 = (const BinaryProtocol3*)data;
+        auto payload_size = ntohs(bp3->payload_size);
+        if (bp3->type == AUDIO_PACKET_TYPE_PACKED) {
+            HandlePackedAudio(session, bp3->payload, payload_size);
+            return;
+        }
+        HandleAudio(session, std::vector<uint8_t>(bp3->payload, bp3->payload + payload_size));
+    } else {
+        HandleAudio(session, std::vector<uint8_t>((const uint8_t*)data, (const uint8_t*)data + len));
+    }
+    uplink_.frames++;
+}
+
+void LoopbackServer::CountUplinkPacket(size_t bytes) {
+    uplink_.packets++;
+    uplink_.bytes += bytes;
+    if (expect_uplink_us_ != 0) {
+        uint32_t latency_us = esp_timer_get_time() - expect_uplink_us_;
+        expect_uplink_us_ = 0;
+        uplink_.first_packets++;
+        uplink_.first_packet_total_us += latency_us;
+        uplink_.first_packet_max_us = std::max(uplink_.first_packet_max_us, latency_us);
+        ESP_LOGI(TAG, "First uplink packet after %.1f ms", latency_us / 1000.0);
+    }
+}
+
+void LoopbackServer::HandleJson(LoopbackSession* session, const std::string& text) {
+    cJSON* root = cJSON_Parse(text.c_str());
+    if (root == nullptr) {
+        ESP_LOGE(TAG, "Invalid json: %s", text.c_str());
+        return;
+    }
+    auto type = cJSON_GetObjectItem(root, "type");
+    auto state = cJSON_GetObjectItem(root, "state");
+    if (!cJSON_IsString(type)) {
+        ESP_LOGE(TAG, "Missing message type: %s", text.c_str());
+    } else if (strcmp(type->valuestring, "hello") == 0) {
+        auto audio_params = cJSON_GetObjectItem(root, "audio_params");
+        auto frame_duration = cJSON_GetObjectItem(audio_params, "frame_duration");
+        if (cJSON_IsNumber(frame_duration)) {
+            session->frame_duration = frame_duration->valueint;
+        }
+        auto version = cJSON_GetObjectItem(root, "version");
+        if (cJSON_IsNumber(version) && session->websocket != nullptr) {
+            session->version = version->valueint;
+        }
+        // Packing is accepted as asked, over UDP and WebSocket versions 2 and 3
+        auto frames_per_packet = cJSON_GetObjectItem(audio_params, "frames_per_packet");
+        session->frames_per_packet = 1;
+        if (cJSON_IsNumber(frames_per_packet) && (session->mqtt != nullptr || session->version >= 2)) {
+            session->frames_per_packet = std::clamp(frames_per_packet->valueint, 1, AUDIO_PACKER_MAX_FRAMES);
+        }
+
+        // Echoed frames come straight from the 16kHz uplink encoder
+        std::string message = "{\"type\":\"hello\",\"session_id\":\"" + session->session_id + "\",";
+        message += "\"audio_params\":{\"format\":\"opus\",\"sample_rate\":16000,\"channels\":1,";
+        message += "\"frame_duration\":" + std::to_string(session->frame_duration);
+        if (session->frames_per_packet > 1) {
+            message += ",\"frames_per_packet\":" + std::to_string(session->frames_per_packet);
+        }
+        message += "},";
+        if (session->mqtt != nullptr) {
+            // A kept key keeps the sequence numbers going, so no counter block is used twice
+            if (session->aes_key.empty() || new_key_per_hello_) {
+                std::random_device random;
+                std::string key(16, 0);
+                for (auto& c : key) {
+                    c = random();
+                }
+                // |type 1u|flags 1u|payload_len 2u|ssrc 4u|timestamp 4u|sequence 4u|
+                session->aes_nonce = std::string(16, 0);
+                session->aes_nonce[0] = 0x01;
+                *(uint32_t*)&session->aes_nonce[4] = htonl(session->id);
+                session->aes_key = key;
+                mbedtls_aes_setkey_enc(&session->aes, (const uint8_t*)key.data(), 128);
+                session->local_sequence = 0;
+                session->remote_sequence = 0;
+                connects_.keys++;
+            }
+            std::string& key = session->aes_key;
+            message += "\"transport\":\"udp\",\"udp\":{\"server\":\"127.0.0.1\",\"port\":" + std::to_string(session->id) + ",";
+            message += "\"encryption\":\"aes-128-ctr\",\"key\":\"" + EncodeHexString(key) + "\",";
+            message += "\"nonce\":\"" + EncodeHexString(session->aes_nonce) + "\"}}";
+        } else {
+            message += "\"transport\":\"websocket\"}";
+        }
+        connects_.hellos++;
+        connects_.handshake_ms += rtt_ms_;
+        SendJson(session, message, rtt_ms_);
+    } else if (strcmp(type->valuestring, "listen") == 0 && cJSON_IsString(state)) {
+        if (strcmp(state->valuestring, "start") == 0) {
+            auto mode = cJSON_GetObjectItem(root, "mode");
+            session->listening = true;
+            session->manual_stop = cJSON_IsString(mode) && strcmp(mode->valuestring, "manual") == 0;
+            session->frames.clear();
+        } else if (strcmp(state->valuestring, "stop") == 0) {
+            if (session->listening) {
+                session->listening = false;
+                StartReply(session);
+            }
+        } else if (strcmp(state->valuestring, "detect") == 0) {
+            auto text = cJSON_GetObjectItem(root, "text");
+            ESP_LOGI(TAG, "Wake word: %s", cJSON_IsString(text) ? text->valuestring : "");
+        }
+    } else if (strcmp(type->valuestring, "ping") == 0) {
+        // Answered one round trip later, like the hello
+        auto id = cJSON_GetObjectItem(root, "id");
+        SendJson(session, "{\"type\":\"pong\",\"id\":" + std::to_string(cJSON_IsNumber(id) ? id->valueint : 0) + "}",
+            rtt_ms_);
+    } else if (strcmp(type->valuestring, "health") == 0) {
+        ESP_LOGI(TAG, "Health report: %s", text.c_str());
+    } else if (strcmp(type->valuestring, "abort") == 0) {
+        StopReply(session);
+    } else if (strcmp(type->valuestring, "goodbye") == 0) {
+        session->listening = false;
+        session->reply_generation++;
+    }
+    cJSON_Delete(root);
+}
+
+void LoopbackServer::HandleAudio(LoopbackSession* session, std::vector<uint8_t>&& opus) {
+    if (!session->listening) {
+        return;
+    }
+    session->frames.push_back(std::move(opus));
+    if (!session->manual_stop && session->frames.size() >= LOOPBACK_AUTO_STOP_FRAMES) {
+        session->listening = false;
+        StartReply(session);
+    }
+}
+
+void LoopbackServer::SendJson(LoopbackSession* session, const std::string& json, int delay_ms) {
+    // Always deliver from the server thread
+    Post(delay_ms, [this, id = session->id, json]() {
+        auto session = FindSession(id);
+        if (session == nullptr) {
+            return;
+        }
+        if (session->mqtt_deliver) {
+            session->mqtt_deliver(json);
+        } else if (session->websocket != nullptr) {
+            session->websocket->Deliver(json.c_str(), json.size(), false);
+        }
+    });
+}
+
+// One frame, or frames packed by AudioPacker
+void LoopbackServer::SendAudio(LoopbackSession* session, const uint8_t* payload, size_t size, uint32_t timestamp,
+                               int frames, bool packed) {
+    if (session->mqtt != nullptr) {
+        if (!session->udp_deliver) {
+            return;
+        }
+        std::string nonce = session->aes_nonce;
+        nonce[1] = packed ? AUDIO_PACKET_FLAG_PACKED : 0;
+        *(uint16_t*)&nonce[2] = htons(size);
+        *(uint32_t*)&nonce[8] = htonl(timestamp);
+        *(uint32_t*)&nonce[12] = htonl(session->local_sequence + 1);
+        session->local_sequence += frames;
+
+        std::string packet(nonce.size() + size, 0);
+        memcpy(packet.data(), nonce.data(), nonce.size());
+        size_t nc_off = 0;
+        uint8_t stream_block[16] = {0};
+        mbedtls_aes_crypt_ctr(&session->aes, size, &nc_off, (uint8_t*)nonce.data(), stream_block,
+            payload, (uint8_t*)&packet[nonce.size()]);
+        if (loss_percent_ > 0 && (int)(random_() % 100) < loss_percent_) {
+            return;
+        }
+        if (jitter_ms_ > 0) {
+            Post(random_() % (jitter_ms_ + 1), [this, id = session->id, packet = std::move(packet)]() {
+                auto session = FindSession(id);
+                if (session != nullptr && session->udp_deliver) {
+                    session->udp_deliver(packet);
+                }
+            });
+            return;
+        }
+        session->udp_deliver(packet);
+        return;
+    }
+
+    std::string packet;
+    if (session->version == 2) {
+        packet.resize(sizeof(BinaryProtocol2) + size);
+        auto bp2 = (BinaryProtocol2*)packet.data();
+        bp2->version = htons(2);
+        bp2->type = htons(packed ? AUDIO_PACKET_TYPE_PACKED : 0);
+        bp2->reserved = 0;
+        bp2->timestamp = htonl(timestamp);
+        bp2->payload_size = htonl(size);
+        memcpy(bp2->payload, payload, size);
+    } else if (session->version == 3) {
+        packet.resize(sizeof(BinaryProtocol3) + size);
+        auto bp3 = (BinaryProtocol3*)packet.data();
+        bp3->type = packed ? AUDIO_PACKET_TYPE_PACKED : 0;
+        bp3->reserved = 0;
+        bp3->payload_size = htons(size);
+        memcpy(bp3->payload, payload, size);
+    } else {
+        packet.assign((const char*)payload, size);
+    }
+    session->websocket->Deliver(packet.data(), packet.size(), true);
+}
+
+// Replies with the frames collected during the turn: stt, tts start, the frames paced in real time, tts stop
+void LoopbackServer::StartReply(LoopbackSession* session) {
+    auto frames = std::make_shared<std::vector<std::vector<uint8_t>>>(std::move(session->frames));
+    session->frames.clear();
+    uint32_t generation = ++session->reply_generation;
+    int id = session->id;
+    int frame_duration = session->frame_duration;
+    int frames_per_packet = session->frames_per_packet;
+    ESP_LOGI(TAG, "Session %d: replying with %u frames", id, (unsigned)frames->size());
+
+    std::string count = std::to_string(frames->size());
+    SendJson(session, "{\"type\":\"stt\",\"text\":\"" + count + " frames\"}");
+    SendJson(session, "{\"type\":\"llm\",\"emotion\":\"happy\"}");
+    SendJson(session, "{\"type\":\"tts\",\"state\":\"start\"}");
+    SendJson(session, "{\"type\":\"tts\",\"state\":\"sentence_start\",\"text\":\"echo " + count + " frames\"}");
+
+    // A still-current reply of this session, or nullptr
+    auto current = [this, id, generation]() {
+        auto s = FindSession(id);
+        return s != nullptr && s->reply_generation == generation ? s : nullptr;
+    };
+    // Packed replies go out when their last frame would have, like from a server that packs as it synthesizes
+    for (size_t i = 0; i < frames->size(); i += frames_per_packet) {
+        size_t count = std::min<size_t>(frames_per_packet, frames->size() - i);
+        Post((i + count - 1) * frame_duration, [this, current, frames, i, count, frame_duration, frames_per_packet]() {
+            auto s = current();
+            if (s == nullptr) {
+                return;
+            }
+            if (frames_per_packet == 1) {
+                auto& opus = (*frames)[i];
+                SendAudio(s, opus.data(), opus.size(), i * frame_duration, 1, false);
+                return;
+            }
+            AudioPacker packer;
+            packer.Configure(frames_per_packet);
+            for (size_t j = i; j < i + count; j++) {
+                packer.Add((*frames)[j].data(), (*frames)[j].size(), j * frame_duration);
+            }
+            auto& packet = packer.Finish();
+            SendAudio(s, packet.data(), packet.size(), i * frame_duration, count, true);
+        });
+    }
+    Post(frames->size() * frame_duration, [this, current]() {
+        if (auto s = current()) {
+            SendJson(s, "{\"type\":\"tts\",\"state\":\"stop\"}");
+        }
+    });
+}
+
+void LoopbackServer::StopReply(LoopbackSession* session) {
+    session->reply_generation++;
+    SendJson(session, "{\"type\":\"tts\",\"state\":\"stop\"}");
+}
+
+LoopbackMqtt::~LoopbackMqtt() {
+    Disconnect();
+}
+
+bool LoopbackMqtt::Connect(const std::string broker_address, int broker_port, const std::string client_id,
+                           const std::string username, const std::string password) {
+    Disconnect();
+    LoopbackServer::GetInstance().ConnectHandshake(false);
+    LoopbackServer::GetInstance().OnMqttConnected(this, [this](const std::string& payload) {
+        DeviceHeapScope heap_scope;
+        if (on_message_callback_ != nullptr) {
+            on_message_callback_("", payload);
+        }
+    });
+    connected_ = true;
+    if (on_connected_callback_ != nullptr) {
+        on_connected_callback_();
+    }
+    return true;
+}
+
+void LoopbackMqtt::Disconnect() {
+    if (!connected_) {
+        return;
+    }
+    connected_ = false;
+    LoopbackServer::GetInstance().OnMqttDisconnected(this);
+    if (on_disconnected_callback_ != nullptr) {
+        on_disconnected_callback_();
+    }
+}
+
+bool LoopbackMqtt::Publish(const std::string topic, const std::string payload, int qos) {
+    if (!connected_) {
+        return false;
+    }
+    LoopbackServer::GetInstance().OnMqttPublish(this, payload);
+    return true;
+}
+
+bool LoopbackMqtt::Subscribe(const std::string topic, int qos) {
+    return connected_;
+}
+
+bool LoopbackMqtt::Unsubscribe(const std::string topic) {
+    return connected_;
+}
+
+bool LoopbackMqtt::IsConnected() {
+    return connected_;
+}
+
+LoopbackUdp::~LoopbackUdp() {
+    Disconnect();
+}
+
+bool LoopbackUdp::Connect(const std::string& host, int port) {
+    connected_ = LoopbackServer::GetInstance().OnUdpConnected(this, port, [this](const std::string& data) {
+        DeviceHeapScope heap_scope;
+        if (message_callback_ != nullptr) {
+            message_callback_(data);
+        }
+    });
+    return connected_;
+}
+
+void LoopbackUdp::Disconnect() {
+    if (connected_) {
+        connected_ = false;
+        LoopbackServer::GetInstance().OnUdpDisconnected(this);
+    }
+}
+
+int LoopbackUdp::Send(const std::string& data) {
+    if (!connected_) {
+        return -1;
+    }
+    LoopbackServer::GetInstance().OnUdpPacket(this, data);
+    return data.size();
+}
+
+WebSocket::WebSocket(bool network) {
+    if (network) {
+        net_ = std::make_unique<NetWebSocket>(this);
+    }
+}
+
+// Like the esp-ml307 client, deleting a connected socket reports the disconnection
+WebSocket::~WebSocket() {
+    Disconnect();
+}
+
+void WebSocket::SetHeader(const char* key, const char* value) {
+    headers_[key] = value;
+}
+
+bool WebSocket::IsConnected() const {
+    return connected_;
+}
+
+bool WebSocket::Connect(const char* uri) {
+    if (net_ != nullptr) {
+        connected_ = net_->Connect(uri, headers_);
+        if (connected_ && on_connected_ != nullptr) {
+            on_connected_();
+        }
+        return connected_;
+    }
+    auto& server = LoopbackServer::GetInstance();
+    server.ConnectHandshake(true);
+    server.OnWebSocketConnected(this);
+    connected_ = true;
+    if (on_connected_ != nullptr) {
+        on_connected_();
+    }
+    return true;
+}
+
+bool WebSocket::Send(const std::string& data) {
+    return Send(data.data(), data.size(), false);
+}
+
+bool WebSocket::Send(const void* data, size_t len, bool binary, bool fin) {
+    if (!connected_) {
+        return false;
+    }
+    if (net_ != nullptr) {
+        return net_->Send(data, len, binary, fin);
+    }
+    LoopbackServer::GetInstance().OnWebSocketData(this, (const char*)data, len, binary);
+    return true;
+}
+
+void WebSocket::Ping() {
+    if (connected_ && net_ != nullptr) {
+        net_->Ping();
+    }
+}
+
+void WebSocket::Close() {
+    Disconnect();
+}
+
+void WebSocket::Deliver(const char* data, size_t len, bool binary) {
+    DeviceHeapScope heap_scope;
+    if (on_data_ != nullptr) {
+        on_data_(data, len, binary);
+    }
+}
+
+void WebSocket::Disconnect() {
+    if (!connected_) {
+        return;
+    }
+    connected_ = false;
+    if (net_ != nullptr) {
+        net_->Close();
+    } else {
+        LoopbackServer::GetInstance().OnWebSocketDisconnected(this);
+    }
+    if (on_disconnected_ != nullptr) {
+        on_disconnected_();
+    }
+}
@@ -0,0 +1,151 @@
+#ifndef _LOOPBACK_SERVER_H
+#define _LOOPBACK_SERVER_H
+
+#include <mqtt.h>
+#include <udp.h>
+#include <web_socket.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <map>
+#include <random>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+// Number of uplink frames after which an auto-stop listen turn ends, 1.8s at 60ms frames
+#define LOOPBACK_AUTO_STOP_FRAMES 30
+
+struct LoopbackSession;
+
+// Audio the device sent, over all sessions
+struct LoopbackUplinkStats {
+    uint32_t packets;       // UDP datagrams or WebSocket binary messages
+    uint32_t frames;        // Opus frames in them
+    uint64_t bytes;         // Datagram or message sizes, before the IP/UDP or TCP/WebSocket headers
+    uint32_t first_packets;         // Uplinks timed from ExpectUplink() to their first packet
+    uint64_t first_packet_total_us;
+    uint32_t first_packet_max_us;
+};
+
+// Connections and handshakes the device made, over all sessions
+struct LoopbackConnectStats {
+    uint32_t mqtt_connects;         // TCP, TLS and MQTT CONNECT
+    uint32_t websocket_connects;    // TCP, TLS and HTTP upgrade
+    uint32_t hellos;
+    uint32_t udp_connects;
+    uint32_t keys;                  // AES keys handed out in hellos
+    uint32_t handshake_ms;          // Emulated round trips the device waited for, see SetHandshakeRtt()
+};
+
+// An in-process stand-in for the xiaozhi server.
+// It answers hello/listen/abort/goodbye and echoes the uplinked Opus frames back as TTS,
+// paced at the negotiated frame duration. Replies are delivered from the server thread,
+// like a network task on target, never from inside the client's send call.
+class LoopbackServer {
+public:
+    static LoopbackServer& GetInstance() {
+        static LoopbackServer instance;
+        return instance;
+    }
+
+    LoopbackServer(const LoopbackServer&) = delete;
+    LoopbackServer& operator=(const LoopbackServer&) = delete;
+
+    // Drops loss_percent of the downlink UDP packets and delays the others by 0 - jitter_ms,
+    // so they can arrive out of order. WebSocket is a reliable stream and is not impaired.
+    void SetDownlinkImpairment(int loss_percent, int jitter_ms);
+    // Round trip time of the handshakes: the server hello comes one round trip after the client hello, and an MQTT
+    // or WebSocket connect takes four (TCP, TLS 1.2, MQTT CONNECT or HTTP upgrade). Other messages are not delayed.
+    void SetHandshakeRtt(int rtt_ms);
+    // With new_key_per_hello every hello gets a new UDP key, otherwise one key lasts the MQTT session
+    void SetUdpKeyPerHello(bool new_key_per_hello);
+    // Closes every MQTT and WebSocket connection from the server side, as a broker restart would
+    void DropConnections();
+    LoopbackConnectStats GetConnectStats();
+    // Times the next uplink packet from now, such as the first one after a wake word
+    void ExpectUplink();
+    LoopbackUplinkStats GetUplinkStats();
+
+    // Called by the client endpoints
+    void ConnectHandshake(bool websocket);
+    void OnMqttConnected(Mqtt* mqtt, std::function<void(const std::string&)> deliver);
+    void OnMqttDisconnected(Mqtt* mqtt);
+    void OnMqttPublish(Mqtt* mqtt, const std::string& payload);
+    bool OnUdpConnected(Udp* udp, int port, std::function<void(const std::string&)> deliver);
+    void OnUdpDisconnected(Udp* udp);
+    void OnUdpPacket(Udp* udp, const std::string& data);
+    void OnWebSocketConnected(WebSocket* websocket);
+    void OnWebSocketDisconnected(WebSocket* websocket);
+    void OnWebSocketData(WebSocket* websocket, const char* data, size_t len, bool binary);
+
+private:
+    LoopbackServer();
+    ~LoopbackServer();
+
+    std::recursive_mutex mutex_;
+    std::condition_variable_any cv_;
+    std::multimap<std::chrono::steady_clock::time_point, std::function<void()>> events_;
+    std::unordered_map<int, std::unique_ptr<LoopbackSession>> sessions_;
+    // Sessions by their Mqtt, Udp or WebSocket, looked up for every packet of thousands of devices (see loadgen.cc)
+    std::unordered_map<const void*, LoopbackSession*> endpoints_;
+    int next_session_id_ = 1;
+    int loss_percent_ = 0;
+    int jitter_ms_ = 0;
+    std::atomic<int> rtt_ms_{0};
+    bool new_key_per_hello_ = false;
+    int64_t expect_uplink_us_ = 0;
+    LoopbackConnectStats connects_ = {};
+    std::mt19937 random_;
+    LoopbackUplinkStats uplink_ = {};
+
+    void Post(int delay_ms, std::function<void()> callback);
+    void EventLoop();
+    LoopbackSession* NewSession();
+    LoopbackSession* FindSession(int id);
+    LoopbackSession* FindEndpoint(const void* endpoint);
+    void BindEndpoint(LoopbackSession* session, const void* endpoint);
+    void UnbindEndpoint(LoopbackSession* session, const void* endpoint);
+    void RemoveSession(LoopbackSession* session);
+    void HandleJson(LoopbackSession* session, const std::string& text);
+    void HandleAudio(LoopbackSession* session, std::vector<uint8_t>&& opus);
+    int HandlePackedAudio(LoopbackSession* session, const uint8_t* data, size_t size);
+    void SendJson(LoopbackSession* session, const std::string& json, int delay_ms = 0);
+    void CountUplinkPacket(size_t bytes);
+    void SendAudio(LoopbackSession* session, const uint8_t* payload, size_t size, uint32_t timestamp, int frames, bool packed);
+    void StartReply(LoopbackSession* session);
+    void StopReply(LoopbackSession* session);
+};
+
+// esp-ml307 style transports served by the loopback server
+class LoopbackMqtt : public Mqtt {
+public:
+    ~LoopbackMqtt();
+
+    bool Connect(const std::string broker_address, int broker_port, const std::string client_id,
+                 const std::string username, const std::string password) override;
+    void Disconnect() override;
+    bool Publish(const std::string topic, const std::string payload, int qos = 0) override;
+    bool Subscribe(const std::string topic, int qos = 0) override;
+    bool Unsubscribe(const std::string topic) override;
+    bool IsConnected() override;
+
+private:
+    bool connected_ = false;
+};
+
+class LoopbackUdp : public Udp {
+public:
+    ~LoopbackUdp();
+
+    bool Connect(const std::string& host, int port) override;
+    void Disconnect() override;
+    int Send(const std::string& data) override;
+};
+
+#endif // _LOOPBACK_SERVER_H
@@ -0,0 +1,360 @@
+// Host runner: starts the Application against the stand-in board and drives it with a script.
+//
+// Script commands, one per line, '#' starts a comment:
+//   wake <word>               WakeWordInvoke(word)
+//   toggle                    ToggleChatState()
+//   listen / stop             StartListening() / StopListening()
+//   abort                     AbortSpeaking() from the main loop
+//   block <ms>                keep the main loop busy, as a slow OpenAudioChannel would
+//   wait <ms>                 sleep
+//   expect <state> [ms]       wait for a device state, fail after the timeout (default 10000)
+//   trace <file>              write the audio trace records to a file, "-" logs them like trace_dump
+//   quit                      stop here
+#include "application.h"
+#include "file_audio_codec.h"
+#include "host_board.h"
+#include "loopback_server.h"
+#include "alloc_counter.h"
+#include "settings.h"
+#include "audio_trace.h"
+
+#include <esp_log.h>
+#include <esp_timer.h>
+
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <unistd.h>
+
+#define TAG "Host"
+
+static const char* const STATE_STRINGS[] = {
+    "unknown",
+    "starting",
+    "configuring",
+    "idle",
+    "connecting",
+    "listening",
+    "speaking",
+    "upgrading",
+    "activating",
+    "fatal_error",
+};
+
+static const char* const DEFAULT_SCRIPT =
+    "expect idle\n"
+    "wake 你好小智\n"
+    "expect listening\n"
+    "expect speaking\n"
+    "wait 1000\n"
+    "abort\n"
+    "expect listening\n"
+    "toggle\n"
+    "expect idle\n";
+
+static void Usage(const char* program) {
+    fprintf(stderr,
+        "Usage: %s [options]\n"
+        "  --protocol mqtt|websocket   transport to the loopback server (default mqtt)\n"
+        "  --ws-version 1|2|3          websocket binary protocol version (default 1)\n"
+        "  --input <file.wav>          16-bit mono microphone input (default silence)\n"
+        "  --output <file.wav>         speaker output\n"
+        "  --input-rate <hz>           microphone rate when no input file is given (default 16000)\n"
+        "  --output-rate <hz>          speaker rate (default 24000)\n"
+        "  --script <file|->           session script (default wake, listen, speak, abort, close)\n"
+        "  --loss <percent>            drop downlink UDP packets (mqtt only)\n"
+        "  --jitter <ms>               delay downlink UDP packets by up to ms, reordering them (mqtt only)\n"
+        "  --frames-per-packet <n>     ask the server to pack n Opus frames per packet (websocket version 2/3)\n"
+        "  --rtt <ms>                  round trip time of the connect and hello handshakes (default 0)\n"
+        "  --standby <seconds>         keep the audio channel open after a conversation (default off)\n"
+        "  --udp-key <session|hello>   server hands out a UDP key per MQTT session or per hello (default session)\n",
+        program);
+}
+
+static bool WaitForState(const std::string& name, int timeout_ms) {
+    auto& app = Application::GetInstance();
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
+    while (std::chrono::steady_clock::now() < deadline) {
+        if (name == STATE_STRINGS[app.GetDeviceState()]) {
+            return true;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    }
+    ESP_LOGE(TAG, "Timeout waiting for state %s, current %s", name.c_str(), STATE_STRINGS[app.GetDeviceState()]);
+    return false;
+}
+
+// Heap allocations are counted from the first command that starts a conversation
+static int64_t session_start_us = 0;
+static uint32_t session_start_allocs = 0;
+
+static bool RunCommand(const std::string& line) {
+    std::istringstream stream(line);
+    std::string command;
+    stream >> command;
+    if (command.empty() || command[0] == '#') {
+        return true;
+    }
+
+    auto& app = Application::GetInstance();
+    ESP_LOGI(TAG, "> %s", line.c_str());
+    bool starts_conversation = command == "wake" || command == "toggle" || command == "listen";
+    if (session_start_us == 0 && starts_conversation) {
+        session_start_us = esp_timer_get_time();
+        session_start_allocs = AllocCounter::GetCount();
+    }
+    if (starts_conversation && app.GetDeviceState() == kDeviceStateIdle) {
+        LoopbackServer::GetInstance().ExpectUplink();
+    }
+    if (command == "wake") {
+        std::string word;
+        std::getline(stream >> std::ws, word);
+        app.WakeWordInvoke(word.empty() ? "你好小智" : word);
+    } else if (command == "toggle") {
+        app.ToggleChatState();
+    } else if (command == "listen") {
+        app.StartListening();
+    } else if (command == "stop") {
+        app.StopListening();
+    } else if (command == "abort") {
+        app.Schedule([&app]() {
+            app.AbortSpeaking(kAbortReasonNone);
+        });
+    } else if (command == "block") {
+        int ms = 0;
+        stream >> ms;
+        app.Schedule([ms]() {
+            std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+        });
+    } else if (command == "drop") {
+        LoopbackServer::GetInstance().DropConnections();
+    } else if (command == "wait") {
+        int ms = 0;
+        stream >> ms;
+        std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+    } else if (command == "expect") {
+        std::string state;
+        int timeout_ms = 10000;
+        stream >> state >> timeout_ms;
+        return WaitForState(state, timeout_ms);
+    } else if (command == "trace") {
+        std::string path;
+        stream >> path;
+        if (path.empty() || path == "-") {
+            AudioTrace::GetInstance().Dump();
+            return true;
+        }
+        auto records = AudioTrace::GetInstance().Snapshot();
+        std::ofstream file(path, std::ios::binary);
+        file.write((const char*)records.data(), records.size() * sizeof(AudioTraceRecord));
+        if (!file) {
+            ESP_LOGE(TAG, "Failed to write %s", path.c_str());
+            return false;
+        }
+        ESP_LOGI(TAG, "Wrote %zu trace records to %s", records.size(), path.c_str());
+    } else {
+        ESP_LOGE(TAG, "Unknown command: %s", command.c_str());
+        return false;
+    }
+    return true;
+}
+
+// What the uplink would cost on an ML307 board: every datagram or message is an AT+MIPSEND command
+// carrying the data hex encoded, plus the modem's OK and send report, over the 921600 baud UART
+#define ML307_UART_BAUD 921600
+#define ML307_AT_OVERHEAD_BYTES 48
+// IPv4 + UDP, or IPv4 + TCP + a masked WebSocket frame header
+#define UDP_HEADER_BYTES 28
+#define WEBSOCKET_HEADER_BYTES 48
+
+static void PrintUplinkStats(const std::string& protocol) {
+    auto uplink = LoopbackServer::GetInstance().GetUplinkStats();
+    if (uplink.packets == 0) {
+        return;
+    }
+    double audio_seconds = uplink.frames * OPUS_FRAME_DURATION_MS / 1000.0;
+    uint64_t wire_bytes = uplink.bytes + uint64_t(uplink.packets) * (protocol == "mqtt" ? UDP_HEADER_BYTES : WEBSOCKET_HEADER_BYTES);
+    uint64_t uart_bytes = uplink.bytes * 2 + uint64_t(uplink.packets) * ML307_AT_OVERHEAD_BYTES;
+    // 10 bits per byte on the UART with start and stop bits
+    double uart_percent = audio_seconds > 0 ? uart_bytes * 10 * 100.0 / (ML307_UART_BAUD * audio_seconds) : 0;
+    ESP_LOGI(TAG, "Uplink: %u frames in %u packets, %.2f frames/packet, %.1f packets/s, %.0f bytes/s on the wire, "
+        "ML307 UART %.1f%% (%.0f bytes/s)", uplink.frames, uplink.packets, (double)uplink.frames / uplink.packets,
+        audio_seconds > 0 ? uplink.packets / audio_seconds : 0, audio_seconds > 0 ? wire_bytes / audio_seconds : 0,
+        uart_percent, audio_seconds > 0 ? uart_bytes / audio_seconds : 0);
+    if (uplink.first_packets > 0) {
+        ESP_LOGI(TAG, "Start to first uplink packet: %u conversations, avg %.1f ms max %.1f ms", uplink.first_packets,
+            uplink.first_packet_total_us / 1000.0 / uplink.first_packets, uplink.first_packet_max_us / 1000.0);
+    }
+}
+
+static void PrintConnectStats() {
+    auto connects = LoopbackServer::GetInstance().GetConnectStats();
+    int tls_connects = connects.mqtt_connects + connects.websocket_connects;
+    ESP_LOGI(TAG, "Handshakes: %d TLS connects (%u MQTT, %u WebSocket), %u hellos, %u UDP sockets, %u keys, "
+        "%u ms waiting on round trips", tls_connects, connects.mqtt_connects, connects.websocket_connects,
+        connects.hellos, connects.udp_connects, connects.keys, connects.handshake_ms);
+    auto channel = Application::GetInstance().GetChannelManagerStats();
+    int conversations = channel.opens + channel.reused;
+    if (conversations > 0) {
+        // A chatty user, one conversation a minute
+        ESP_LOGI(TAG, "Per hour at 60 conversations: %.0f TLS connects, %.0f ms connecting",
+            tls_connects * 60.0 / conversations, connects.handshake_ms * 60.0 / conversations);
+    }
+}
+
+int main(int argc, char* argv[]) {
+    HostBoardConfig board_config;
+    std::string protocol = "mqtt";
+    int ws_version = 1;
+    std::string script_path;
+    int loss_percent = 0;
+    int jitter_ms = 0;
+    int frames_per_packet = CONFIG_AUDIO_FRAMES_PER_PACKET;
+    int rtt_ms = 0;
+    int standby_seconds = CONFIG_AUDIO_CHANNEL_STANDBY_SECONDS;
+    std::string udp_key = "session";
+
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (i + 1 >= argc) {
+            Usage(argv[0]);
+            return 2;
+        }
+        std::string value = argv[++i];
+        if (arg == "--protocol") {
+            protocol = value;
+        } else if (arg == "--ws-version") {
+            ws_version = std::stoi(value);
+        } else if (arg == "--input") {
+            board_config.input_path = value;
+        } else if (arg == "--output") {
+            board_config.output_path = value;
+        } else if (arg == "--input-rate") {
+            board_config.input_sample_rate = std::stoi(value);
+        } else if (arg == "--output-rate") {
+            board_config.output_sample_rate = std::stoi(value);
+        } else if (arg == "--script") {
+            script_path = value;
+        } else if (arg == "--loss") {
+            loss_percent = std::stoi(value);
+        } else if (arg == "--jitter") {
+            jitter_ms = std::stoi(value);
+        } else if (arg == "--frames-per-packet") {
+            frames_per_packet = std::stoi(value);
+        } else if (arg == "--rtt") {
+            rtt_ms = std::stoi(value);
+        } else if (arg == "--standby") {
+            standby_seconds = std::stoi(value);
+        } else if (arg == "--udp-key") {
+            udp_key = value;
+        } else {
+            Usage(argv[0]);
+            return 2;
+        }
+    }
+    ConfigureHostBoard(board_config);
+    LoopbackServer::GetInstance().SetDownlinkImpairment(loss_percent, jitter_ms);
+    LoopbackServer::GetInstance().SetHandshakeRtt(rtt_ms);
+    LoopbackServer::GetInstance().SetUdpKeyPerHello(udp_key == "hello");
+    {
+        Settings settings("audio", true);
+        settings.SetInt("standby_seconds", standby_seconds);
+    }
+
+    // What the OTA check would have stored on a device
+    if (protocol == "mqtt") {
+        Settings settings("mqtt", true);
+        settings.SetString("endpoint", "loopback:1883");
+        settings.SetString("client_id", "host");
+        settings.SetString("publish_topic", "device-server");
+        settings.SetInt("frames_per_packet", frames_per_packet);
+    } else if (protocol == "websocket") {
+        Settings settings("websocket", true);
+        settings.SetString("url", "ws://loopback/xiaozhi/v1/");
+        settings.SetInt("version", ws_version);
+        settings.SetInt("frames_per_packet", frames_per_packet);
+    } else {
+        Usage(argv[0]);
+        return 2;
+    }
+
+    std::thread([]() {
+        Application::GetInstance().Start();
+    }).detach();
+
+    std::string script;
+    if (script_path.empty()) {
+        script = DEFAULT_SCRIPT;
+    } else if (script_path == "-") {
+        std::stringstream buffer;
+        buffer << std::cin.rdbuf();
+        script = buffer.str();
+    } else {
+        std::ifstream file(script_path);
+        if (!file) {
+            ESP_LOGE(TAG, "Failed to open script %s", script_path.c_str());
+            return 2;
+        }
+        std::stringstream buffer;
+        buffer << file.rdbuf();
+        script = buffer.str();
+    }
+
+    int result = 0;
+    std::istringstream lines(script);
+    std::string line;
+    while (std::getline(lines, line)) {
+        if (line == "quit") {
+            break;
+        }
+        if (!RunCommand(line)) {
+            result = 1;
+            break;
+        }
+    }
+
+    auto& app = Application::GetInstance();
+    auto stats = app.GetMainTaskStats();
+    auto codec = static_cast<FileAudioCodec*>(Board::GetInstance().GetAudioCodec());
+    codec->Flush();
+    ESP_LOGI(TAG, "%s: state %s, %zu samples played, main tasks high water %zu/%zu overflow %u",
+        result == 0 ? "PASS" : "FAIL", STATE_STRINGS[app.GetDeviceState()], codec->samples_written(),
+        stats.high_water, stats.capacity, stats.overflow_count);
+    if (session_start_us != 0) {
+        uint32_t allocs = AllocCounter::GetCount() - session_start_allocs;
+        double seconds = (esp_timer_get_time() - session_start_us) / 1000000.0;
+        ESP_LOGI(TAG, "Heap allocations: %u in %.1f s, %.1f/s", allocs, seconds, allocs / seconds);
+    }
+    PrintConnectStats();
+    auto jitter = app.GetJitterBufferStats();
+    ESP_LOGI(TAG, "Jitter buffer: received %u late %u lost %u concealed %u underruns %u backpressure %u, jitter %u ms",
+        jitter.received, jitter.late, jitter.lost, jitter.concealed, jitter.underruns, jitter.backpressure, jitter.jitter_ms);
+
+    PrintUplinkStats(protocol);
+    auto sender = app.GetAudioSenderStats();
+    ESP_LOGI(TAG, "Audio sender: sent %u dropped %u high water %zu/%zu, latency avg %u max %u us, send avg %u us",
+        sender.sent, sender.dropped, sender.high_water, sender.capacity, sender.avg_latency_us, sender.max_latency_us,
+        sender.avg_send_us);
+    auto channel = app.GetChannelManagerStats();
+    ESP_LOGI(TAG, "Audio channel: opened %u failed %u reused %u, open avg %u ms last %u ms, standby %u/%u s",
+        channel.opens, channel.failures, channel.reused, channel.avg_open_ms, channel.last_open_ms,
+        channel.standby_seconds, channel.standby_budget);
+    auto health = app.GetProtocolHealthStats();
+    ESP_LOGI(TAG, "Protocol health: %u sessions, last %u ms sent %u/%u received %u/%u packets/bytes, lost %u/%u "
+        "reordered %u jitter %u ms, hello %u ms first audio %u ms, rtt %u/%u/%u ms (%u/%u pongs)", health.sessions,
+        health.duration_ms, health.packets_sent, health.bytes_sent, health.packets_received, health.bytes_received,
+        health.frames_lost, health.frames_expected, health.frames_reordered, health.jitter_ms, health.hello_ms,
+        health.first_audio_ms, health.min_rtt_ms, health.avg_rtt_ms, health.max_rtt_ms, health.pongs, health.pings);
+    auto aec = app.GetAecTimelineStats();
+    ESP_LOGI(TAG, "AEC timeline: played %u starts %u, uplink paired %u silent %u missed %u, skew %d ppm",
+        aec.played, aec.starts, aec.paired, aec.silent, aec.missed, aec.skew_ppm);
+
+    // Application tasks never return, leave without running static destructors under them
+    fflush(stdout);
+    fflush(stderr);
+    _exit(result);
+}
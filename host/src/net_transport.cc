@@ -0,0 +1,789 @@
+#include "net_transport.h"
+
+#include <web_socket.h>
+#include <esp_log.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <random>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#define TAG "NetTransport"
+
+#define NET_TICK_MS 1000
+// Reads of one socket per wakeup, so that a busy one does not starve the others
+#define NET_READS_PER_EVENT 64
+
+static struct {
+    std::atomic<uint32_t> tcp_connects;
+    std::atomic<uint32_t> connect_failures;
+    std::atomic<uint32_t> udp_sockets;
+    std::atomic<uint32_t> remote_closes;
+    std::atomic<uint32_t> audio_packets_sent;
+    std::atomic<uint32_t> audio_packets_received;
+    std::atomic<uint64_t> bytes_sent;
+    std::atomic<uint64_t> bytes_received;
+} net_stats;
+
+static thread_local NetIdentity net_identity;
+
+NetTransportStats GetNetTransportStats() {
+    return NetTransportStats{
+        .tcp_connects = net_stats.tcp_connects,
+        .connect_failures = net_stats.connect_failures,
+        .udp_sockets = net_stats.udp_sockets,
+        .remote_closes = net_stats.remote_closes,
+        .audio_packets_sent = net_stats.audio_packets_sent,
+        .audio_packets_received = net_stats.audio_packets_received,
+        .bytes_sent = net_stats.bytes_sent,
+        .bytes_received = net_stats.bytes_received,
+    };
+}
+
+void SetNetIdentity(const NetIdentity& identity) {
+    net_identity = identity;
+}
+
+static int64_t NowMs() {
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000LL + now.tv_nsec / 1000000;
+}
+
+// One thread reads all sockets, as the network task does on target.
+// Sockets are looked up by id, an event that was already fetched for a removed one is dropped.
+class NetLoop {
+public:
+    static NetLoop& GetInstance() {
+        static NetLoop instance;
+        return instance;
+    }
+
+    void Add(NetSocket* socket, int fd) {
+        std::lock_guard<std::recursive_mutex> lock(mutex_);
+        socket->id_ = next_id_++;
+        sockets_[socket->id_] = socket;
+        epoll_event event = {};
+        event.events = EPOLLIN;
+        event.data.u64 = socket->id_;
+        epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &event);
+    }
+
+    // Waits for a callback of the socket running on the loop thread, unless called from it
+    void Remove(NetSocket* socket, int fd) {
+        std::lock_guard<std::recursive_mutex> lock(mutex_);
+        epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, fd, nullptr);
+        sockets_.erase(socket->id_);
+    }
+
+private:
+    std::recursive_mutex mutex_;
+    int epoll_fd_;
+    uint64_t next_id_ = 1;
+    std::unordered_map<uint64_t, NetSocket*> sockets_;
+
+    NetLoop() {
+        epoll_fd_ = epoll_create1(EPOLL_CLOEXEC);
+        std::thread([this]() { Run(); }).detach();
+    }
+
+    void Run() {
+        epoll_event events[64];
+        std::vector<uint64_t> ids;
+        int64_t next_tick_ms = NowMs() + NET_TICK_MS;
+        while (true) {
+            int timeout_ms = std::max<int64_t>(next_tick_ms - NowMs(), 0);
+            int count = epoll_wait(epoll_fd_, events, 64, timeout_ms);
+            for (int i = 0; i < count; i++) {
+                std::lock_guard<std::recursive_mutex> lock(mutex_);
+                auto it = sockets_.find(events[i].data.u64);
+                if (it != sockets_.end()) {
+                    it->second->OnReadable();
+                }
+            }
+
+            int64_t now_ms = NowMs();
+            if (now_ms < next_tick_ms) {
+                continue;
+            }
+            next_tick_ms = now_ms + NET_TICK_MS;
+            {
+                std::lock_guard<std::recursive_mutex> lock(mutex_);
+                ids.clear();
+                for (auto& [id, socket] : sockets_) {
+                    ids.push_back(id);
+                }
+            }
+            for (auto id : ids) {
+                std::lock_guard<std::recursive_mutex> lock(mutex_);
+                auto it = sockets_.find(id);
+                if (it != sockets_.end()) {
+                    it->second->OnTick(now_ms);
+                }
+            }
+        }
+    }
+};
+
+NetSocket::NetSocket() : identity_(net_identity) {
+}
+
+NetSocket::~NetSocket() {
+    Close();
+}
+
+bool NetSocket::Open(const std::string& host, int port, int type) {
+    Close();
+    stream_ = type == SOCK_STREAM;
+
+    addrinfo hints = {};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = type;
+    addrinfo* addresses = nullptr;
+    int error = getaddrinfo(host.c_str(), std::to_string(port).c_str(), &hints, &addresses);
+    if (error != 0) {
+        ESP_LOGE(TAG, "Failed to resolve %s: %s", host.c_str(), gai_strerror(error));
+        net_stats.connect_failures++;
+        return false;
+    }
+
+    int fd = -1;
+    for (auto address = addresses; address != nullptr && fd < 0; address = address->ai_next) {
+        fd = socket(address->ai_family, address->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, address->ai_protocol);
+        if (fd < 0) {
+            continue;
+        }
+        if (connect(fd, address->ai_addr, address->ai_addrlen) != 0) {
+            pollfd poll_fd = {fd, POLLOUT, 0};
+            int so_error = errno;
+            if (so_error == EINPROGRESS && poll(&poll_fd, 1, NET_CONNECT_TIMEOUT_S * 1000) == 1) {
+                socklen_t length = sizeof(so_error);
+                getsockopt(fd, SOL_SOCKET, SO_ERROR, &so_error, &length);
+            } else if (so_error == EINPROGRESS) {
+                so_error = ETIMEDOUT;
+            }
+            if (so_error != 0) {
+                error = so_error;
+                close(fd);
+                fd = -1;
+            }
+        }
+    }
+    freeaddrinfo(addresses);
+    if (fd < 0) {
+        ESP_LOGE(TAG, "Failed to connect to %s:%d: %s", host.c_str(), port, strerror(error));
+        net_stats.connect_failures++;
+        return false;
+    }
+
+    // Sends block, reads are polled
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+    timeval timeout = {NET_SEND_TIMEOUT_S, 0};
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    if (stream_) {
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        net_stats.tcp_connects++;
+    } else {
+        net_stats.udp_sockets++;
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    fd_ = fd;
+    return true;
+}
+
+bool NetSocket::Receive(std::string& buffer, int timeout_ms) {
+    int fd;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        fd = fd_;
+    }
+    pollfd poll_fd = {fd, POLLIN, 0};
+    if (fd < 0 || poll(&poll_fd, 1, timeout_ms) != 1) {
+        return false;
+    }
+    char data[1024];
+    ssize_t length = recv(fd, data, sizeof(data), MSG_DONTWAIT);
+    if (length <= 0) {
+        return false;
+    }
+    net_stats.bytes_received += length;
+    buffer.append(data, length);
+    return true;
+}
+
+// A blocked send holds only send_mutex_, the loop thread keeps reading
+bool NetSocket::SendAll(const void* data, size_t len) {
+    std::lock_guard<std::mutex> send_lock(send_mutex_);
+    int fd;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        fd = fd_;
+    }
+    if (fd < 0) {
+        return false;
+    }
+    auto bytes = (const char*)data;
+    size_t sent = 0;
+    while (sent < len) {
+        ssize_t length = send(fd, bytes + sent, len - sent, MSG_NOSIGNAL);
+        if (length < 0 && errno == EINTR) {
+            continue;
+        }
+        if (length <= 0) {
+            ESP_LOGW(TAG, "Send failed: %s", strerror(errno));
+            return false;
+        }
+        sent += length;
+    }
+    net_stats.bytes_sent += len;
+    return true;
+}
+
+void NetSocket::Attach() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (fd_ >= 0) {
+        NetLoop::GetInstance().Add(this, fd_);
+    }
+}
+
+bool NetSocket::Close() {
+    int fd;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        fd = fd_;
+        fd_ = -1;
+    }
+    if (fd < 0) {
+        return false;
+    }
+    // Not under a lock, a callback on the loop thread may be sending
+    NetLoop::GetInstance().Remove(this, fd);
+    std::lock_guard<std::mutex> send_lock(send_mutex_);
+    close(fd);
+    return true;
+}
+
+bool NetSocket::IsOpen() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return fd_ >= 0;
+}
+
+// On the loop thread. Close() removes the socket before it closes the fd, which stays valid until this returns.
+void NetSocket::OnReadable() {
+    static char data[65536];
+    int fd;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        fd = fd_;
+    }
+    for (int i = 0; i < NET_READS_PER_EVENT && fd >= 0; i++) {
+        ssize_t length = recv(fd, data, sizeof(data), MSG_DONTWAIT);
+        if (length > 0) {
+            net_stats.bytes_received += length;
+            OnData(data, length);
+            if (!IsOpen()) {
+                return;
+            }
+            continue;
+        }
+        if (length < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+            return;
+        }
+        // ICMP errors such as a refused port do not close a UDP socket
+        if (!stream_) {
+            if (length < 0) {
+                return;
+            }
+            continue;
+        }
+        if (Close()) {
+            net_stats.remote_closes++;
+            OnRemoteClosed();
+        }
+        return;
+    }
+}
+
+static void PutString(std::string& packet, const std::string& value) {
+    packet.push_back(value.size() >> 8);
+    packet.push_back(value.size() & 0xFF);
+    packet += value;
+}
+
+static void ReplaceAll(std::string& text, const std::string& from, const std::string& to) {
+    for (size_t pos = text.find(from); pos != std::string::npos; pos = text.find(from, pos + to.size())) {
+        text.replace(pos, from.size(), to);
+    }
+}
+
+NetMqtt::~NetMqtt() {
+    Disconnect();
+}
+
+bool NetMqtt::Connect(const std::string broker_address, int broker_port, const std::string client_id,
+                      const std::string username, const std::string password) {
+    Disconnect();
+    if (!Open(broker_address, broker_port, SOCK_STREAM)) {
+        return false;
+    }
+
+    std::string id = client_id;
+    if (!identity_.mac.empty()) {
+        std::string mac = identity_.mac;
+        std::replace(mac.begin(), mac.end(), ':', '_');
+        ReplaceAll(id, "{mac}", mac);
+        ReplaceAll(id, "{uuid}", identity_.uuid);
+    }
+
+    // CONNECT with a clean session
+    std::string body;
+    PutString(body, "MQTT");
+    body.push_back(4);
+    body.push_back(0x02 | (username.empty() ? 0 : 0x80) | (password.empty() ? 0 : 0x40));
+    body.push_back(keep_alive_seconds_ >> 8);
+    body.push_back(keep_alive_seconds_ & 0xFF);
+    PutString(body, id);
+    if (!username.empty()) {
+        PutString(body, username);
+    }
+    if (!password.empty()) {
+        PutString(body, password);
+    }
+    SendPacket(0x10, body);
+
+    std::string reply;
+    int64_t deadline_ms = NowMs() + NET_CONNECT_TIMEOUT_S * 1000;
+    while (reply.size() < 4 && Receive(reply, std::max<int64_t>(deadline_ms - NowMs(), 0))) {
+    }
+    if (reply.size() < 4 || reply[0] != 0x20 || reply[3] != 0) {
+        ESP_LOGE(TAG, "MQTT connect to %s:%d refused, return code %d", broker_address.c_str(), broker_port,
+            reply.size() < 4 ? -1 : reply[3]);
+        net_stats.connect_failures++;
+        Close();
+        return false;
+    }
+
+    // The server may have sent more than the CONNACK
+    buffer_.clear();
+    if (reply.size() > 4) {
+        OnData(reply.data() + 4, reply.size() - 4);
+    }
+    Attach();
+    if (on_connected_callback_ != nullptr) {
+        on_connected_callback_();
+    }
+    return true;
+}
+
+void NetMqtt::Disconnect() {
+    if (!IsOpen()) {
+        return;
+    }
+    SendPacket(0xE0, "");
+    if (Close() && on_disconnected_callback_ != nullptr) {
+        on_disconnected_callback_();
+    }
+}
+
+bool NetMqtt::Publish(const std::string topic, const std::string payload, int qos) {
+    qos = std::min(qos, 1);
+    std::string body;
+    body.reserve(topic.size() + payload.size() + 4);
+    PutString(body, topic);
+    if (qos > 0) {
+        uint16_t id = ++packet_id_;
+        body.push_back(id >> 8);
+        body.push_back(id & 0xFF);
+    }
+    body += payload;
+    return SendPacket(0x30 | (qos << 1), body);
+}
+
+bool NetMqtt::Subscribe(const std::string topic, int qos) {
+    uint16_t id = ++packet_id_;
+    std::string body;
+    body.push_back(id >> 8);
+    body.push_back(id & 0xFF);
+    PutString(body, topic);
+    body.push_back(std::min(qos, 1));
+    return SendPacket(0x82, body);
+}
+
+bool NetMqtt::Unsubscribe(const std::string topic) {
+    uint16_t id = ++packet_id_;
+    std::string body;
+    body.push_back(id >> 8);
+    body.push_back(id & 0xFF);
+    PutString(body, topic);
+    return SendPacket(0xA2, body);
+}
+
+bool NetMqtt::IsConnected() {
+    return IsOpen();
+}
+
+bool NetMqtt::SendPacket(uint8_t header, const std::string& body) {
+    std::string packet(1, header);
+    size_t length = body.size();
+    do {
+        uint8_t byte = length & 0x7F;
+        length >>= 7;
+        packet.push_back(length > 0 ? byte | 0x80 : byte);
+    } while (length > 0);
+    packet += body;
+    last_send_ms_ = NowMs();
+    return SendAll(packet.data(), packet.size());
+}
+
+void NetMqtt::OnData(const char* data, size_t len) {
+    buffer_.append(data, len);
+    size_t offset = 0;
+    // A callback may have closed the connection
+    while (buffer_.size() - offset >= 2 && IsOpen()) {
+        // Fixed header, then up to four bytes of remaining length
+        uint8_t header = buffer_[offset];
+        size_t length = 0;
+        size_t pos = offset + 1;
+        int shift = 0;
+        bool complete = false;
+        while (pos < buffer_.size() && shift < 28) {
+            uint8_t byte = buffer_[pos++];
+            length |= (size_t)(byte & 0x7F) << shift;
+            shift += 7;
+            if ((byte & 0x80) == 0) {
+                complete = true;
+                break;
+            }
+        }
+        if (!complete && shift >= 28) {
+            ESP_LOGE(TAG, "Malformed MQTT packet");
+            if (Close()) {
+                OnRemoteClosed();
+            }
+            return;
+        }
+        if (!complete || buffer_.size() - pos < length) {
+            break;
+        }
+        offset = pos + length;
+
+        // Only PUBLISH needs handling, acks and PINGRESP are dropped
+        if ((header >> 4) != 3 || length < 2) {
+            continue;
+        }
+        int qos = (header >> 1) & 0x03;
+        const char* body = buffer_.data() + pos;
+        size_t topic_size = ((uint8_t)body[0] << 8) | (uint8_t)body[1];
+        size_t payload_pos = 2 + topic_size + (qos > 0 ? 2 : 0);
+        if (payload_pos > length) {
+            continue;
+        }
+        if (qos == 1) {
+            SendPacket(0x40, std::string(body + 2 + topic_size, 2));
+        }
+        if (on_message_callback_ != nullptr) {
+            on_message_callback_(std::string(body + 2, topic_size), std::string(body + payload_pos, length - payload_pos));
+        }
+    }
+    buffer_.erase(0, offset);
+}
+
+void NetMqtt::OnRemoteClosed() {
+    ESP_LOGW(TAG, "MQTT connection closed by the server");
+    if (on_disconnected_callback_ != nullptr) {
+        on_disconnected_callback_();
+    }
+}
+
+void NetMqtt::OnTick(int64_t now_ms) {
+    if (keep_alive_seconds_ > 0 && now_ms - last_send_ms_ >= keep_alive_seconds_ * 1000 / 2) {
+        SendPacket(0xC0, "");
+    }
+}
+
+NetUdp::~NetUdp() {
+    Disconnect();
+}
+
+bool NetUdp::Connect(const std::string& host, int port) {
+    Disconnect();
+    if (!Open(host, port, SOCK_DGRAM)) {
+        return false;
+    }
+    Attach();
+    connected_ = true;
+    return true;
+}
+
+void NetUdp::Disconnect() {
+    connected_ = false;
+    Close();
+}
+
+int NetUdp::Send(const std::string& data) {
+    if (!connected_ || !SendAll(data.data(), data.size())) {
+        return -1;
+    }
+    net_stats.audio_packets_sent++;
+    return data.size();
+}
+
+void NetUdp::OnData(const char* data, size_t len) {
+    net_stats.audio_packets_received++;
+    if (message_callback_ != nullptr) {
+        message_callback_(std::string(data, len));
+    }
+}
+
+static std::string EncodeBase64(const uint8_t* data, size_t size) {
+    static const char table[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    std::string encoded;
+    for (size_t i = 0; i < size; i += 3) {
+        uint32_t value = data[i] << 16;
+        if (i + 1 < size) {
+            value |= data[i + 1] << 8;
+        }
+        if (i + 2 < size) {
+            value |= data[i + 2];
+        }
+        encoded.push_back(table[(value >> 18) & 0x3F]);
+        encoded.push_back(table[(value >> 12) & 0x3F]);
+        encoded.push_back(i + 1 < size ? table[(value >> 6) & 0x3F] : '=');
+        encoded.push_back(i + 2 < size ? table[value & 0x3F] : '=');
+    }
+    return encoded;
+}
+
+// Frame masks only need to differ, not to be secret
+static uint32_t RandomMask() {
+    static thread_local std::minstd_rand random(std::random_device{}());
+    return random();
+}
+
+NetWebSocket::NetWebSocket(WebSocket* websocket) : websocket_(websocket) {
+}
+
+NetWebSocket::~NetWebSocket() {
+    NetSocket::Close();
+}
+
+bool NetWebSocket::Connect(const char* uri, const std::map<std::string, std::string>& headers) {
+    std::string url = uri;
+    if (url.rfind("ws://", 0) != 0) {
+        ESP_LOGE(TAG, "Only ws:// URLs are supported, the host build has no TLS: %s", uri);
+        net_stats.connect_failures++;
+        return false;
+    }
+    size_t path_pos = url.find('/', 5);
+    std::string authority = url.substr(5, path_pos == std::string::npos ? std::string::npos : path_pos - 5);
+    std::string path = path_pos == std::string::npos ? "/" : url.substr(path_pos);
+    std::string host = authority;
+    int port = 80;
+    size_t colon = authority.rfind(':');
+    if (colon != std::string::npos) {
+        host = authority.substr(0, colon);
+        port = std::stoi(authority.substr(colon + 1));
+    }
+    if (!Open(host, port, SOCK_STREAM)) {
+        return false;
+    }
+
+    uint8_t key[16];
+    for (auto& byte : key) {
+        byte = RandomMask();
+    }
+    std::string request = "GET " + path + " HTTP/1.1\r\nHost: " + authority + "\r\n"
+        "Upgrade: websocket\r\nConnection: Upgrade\r\nSec-WebSocket-Version: 13\r\n"
+        "Sec-WebSocket-Key: " + EncodeBase64(key, sizeof(key)) + "\r\n";
+    for (auto& [name, value] : headers) {
+        std::string header_value = value;
+        if (name == "Device-Id" && !identity_.mac.empty()) {
+            header_value = identity_.mac;
+        } else if (name == "Client-Id" && !identity_.uuid.empty()) {
+            header_value = identity_.uuid;
+        }
+        request += name + ": " + header_value + "\r\n";
+    }
+    request += "\r\n";
+    SendAll(request.data(), request.size());
+
+    // The accept key is not checked, the host build has no SHA-1
+    std::string response;
+    size_t header_end = std::string::npos;
+    int64_t deadline_ms = NowMs() + NET_CONNECT_TIMEOUT_S * 1000;
+    while (header_end == std::string::npos && Receive(response, std::max<int64_t>(deadline_ms - NowMs(), 0))) {
+        header_end = response.find("\r\n\r\n");
+    }
+    std::string status = response.substr(0, response.find("\r\n"));
+    if (header_end == std::string::npos || status.find(" 101") == std::string::npos) {
+        ESP_LOGE(TAG, "WebSocket upgrade of %s failed: %s", uri, status.empty() ? "no response" : status.c_str());
+        net_stats.connect_failures++;
+        NetSocket::Close();
+        return false;
+    }
+
+    buffer_.clear();
+    message_.clear();
+    continuation_ = false;
+    if (response.size() > header_end + 4) {
+        OnData(response.data() + header_end + 4, response.size() - header_end - 4);
+    }
+    Attach();
+    return true;
+}
+
+bool NetWebSocket::Send(const void* data, size_t len, bool binary, bool fin) {
+    uint8_t opcode = continuation_ ? 0x0 : (binary ? 0x2 : 0x1);
+    continuation_ = !fin;
+    if (!SendFrame(opcode, fin, data, len)) {
+        return false;
+    }
+    if (binary && fin) {
+        net_stats.audio_packets_sent++;
+    }
+    return true;
+}
+
+void NetWebSocket::Ping() {
+    SendFrame(0x9, true, nullptr, 0);
+}
+
+void NetWebSocket::Close() {
+    if (IsOpen()) {
+        uint8_t normal_closure[2] = {0x03, 0xE8};
+        SendFrame(0x8, true, normal_closure, sizeof(normal_closure));
+    }
+    NetSocket::Close();
+}
+
+// Client frames are masked (RFC 6455 5.3)
+bool NetWebSocket::SendFrame(uint8_t opcode, bool fin, const void* data, size_t len) {
+    std::string frame;
+    frame.reserve(len + 14);
+    frame.push_back((fin ? 0x80 : 0x00) | opcode);
+    if (len < 126) {
+        frame.push_back(0x80 | len);
+    } else if (len < 65536) {
+        frame.push_back(0x80 | 126);
+        frame.push_back(len >> 8);
+        frame.push_back(len & 0xFF);
+    } else {
+        frame.push_back(0x80 | 127);
+        for (int shift = 56; shift >= 0; shift -= 8) {
+            frame.push_back(((uint64_t)len >> shift) & 0xFF);
+        }
+    }
+    uint32_t mask_value = RandomMask();
+    uint8_t mask[4];
+    memcpy(mask, &mask_value, sizeof(mask));
+    frame.append((const char*)mask, sizeof(mask));
+    auto bytes = (const uint8_t*)data;
+    for (size_t i = 0; i < len; i++) {
+        frame.push_back(bytes[i] ^ mask[i & 3]);
+    }
+    return SendAll(frame.data(), frame.size());
+}
+
+void NetWebSocket::OnData(const char* data, size_t len) {
+    buffer_.append(data, len);
+    size_t offset = 0;
+    // A callback may have closed the connection
+    while (buffer_.size() - offset >= 2 && IsOpen()) {
+        auto header = (uint8_t*)buffer_.data() + offset;
+        bool fin = header[0] & 0x80;
+        uint8_t opcode = header[0] & 0x0F;
+        bool masked = header[1] & 0x80;
+        uint64_t length = header[1] & 0x7F;
+        size_t header_size = 2;
+        if (length == 126) {
+            header_size = 4;
+        } else if (length == 127) {
+            header_size = 10;
+        }
+        if (masked) {
+            header_size += 4;
+        }
+        if (buffer_.size() - offset < header_size) {
+            break;
+        }
+        if (length == 126) {
+            length = (header[2] << 8) | header[3];
+        } else if (length == 127) {
+            length = 0;
+            for (int i = 2; i < 10; i++) {
+                length = (length << 8) | header[i];
+            }
+        }
+        if (buffer_.size() - offset - header_size < length) {
+            break;
+        }
+        // Servers do not mask, unmask in place if one does
+        char* payload = (char*)header + header_size;
+        if (masked) {
+            auto mask = header + header_size - 4;
+            for (uint64_t i = 0; i < length; i++) {
+                payload[i] ^= mask[i & 3];
+            }
+        }
+        offset += header_size + length;
+
+        switch (opcode) {
+        case 0x0:
+        case 0x1:
+        case 0x2:
+            if (opcode != 0x0) {
+                message_binary_ = opcode == 0x2;
+                message_.clear();
+                // Most messages are a single frame, delivered without a copy
+                if (fin) {
+                    if (message_binary_) {
+                        net_stats.audio_packets_received++;
+                    }
+                    websocket_->Deliver(payload, length, message_binary_);
+                    break;
+                }
+            }
+            message_.append(payload, length);
+            if (fin) {
+                if (message_binary_) {
+                    net_stats.audio_packets_received++;
+                }
+                websocket_->Deliver(message_.data(), message_.size(), message_binary_);
+                message_.clear();
+            }
+            break;
+        case 0x8:
+            SendFrame(0x8, true, payload, std::min<uint64_t>(length, 2));
+            if (NetSocket::Close()) {
+                net_stats.remote_closes++;
+                OnRemoteClosed();
+            }
+            return;
+        case 0x9:
+            SendFrame(0xA, true, payload, length);
+            break;
+        default:
+            break;
+        }
+    }
+    buffer_.erase(0, offset);
+}
+
+void NetWebSocket::OnRemoteClosed() {
+    ESP_LOGW(TAG, "WebSocket closed by the server");
+    websocket_->Disconnect();
+}
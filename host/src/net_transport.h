@@ -0,0 +1,142 @@
+#ifndef _NET_TRANSPORT_H
+#define _NET_TRANSPORT_H
+
+#include <mqtt.h>
+#include <udp.h>
+
+#include <atomic>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <string>
+
+// Seconds to wait for a TCP connect, the MQTT CONNACK or the HTTP upgrade
+#define NET_CONNECT_TIMEOUT_S 10
+// A send blocked this long by a server that stops reading fails
+#define NET_SEND_TIMEOUT_S 5
+
+// What the network transports did, over all connections
+struct NetTransportStats {
+    uint32_t tcp_connects;
+    uint32_t connect_failures;      // TCP, MQTT CONNACK or HTTP upgrade
+    uint32_t udp_sockets;
+    uint32_t remote_closes;         // Closed by the server or the network
+    uint32_t audio_packets_sent;    // UDP datagrams and WebSocket binary messages
+    uint32_t audio_packets_received;
+    uint64_t bytes_sent;
+    uint64_t bytes_received;
+};
+
+NetTransportStats GetNetTransportStats();
+
+// Who the transports created on this thread connect as, so that simulated devices do not share one identity.
+// The WebSocket Device-Id and Client-Id headers become mac and uuid, {mac} and {uuid} in an MQTT client id are
+// replaced by them, the MAC with underscores as the OTA server writes it. Empty keeps what the protocol sends.
+struct NetIdentity {
+    std::string mac;
+    std::string uuid;
+};
+
+void SetNetIdentity(const NetIdentity& identity);
+
+// A socket whose reads are dispatched on the shared net loop thread.
+// Close() may come from any thread, also from a callback; it returns once no callback of the socket runs.
+class NetSocket {
+public:
+    virtual ~NetSocket();
+
+protected:
+    NetIdentity identity_;
+
+    NetSocket();
+    // Blocking connect, type is SOCK_STREAM or SOCK_DGRAM
+    bool Open(const std::string& host, int port, int type);
+    // Reads before Attach(), for the handshakes
+    bool Receive(std::string& buffer, int timeout_ms);
+    bool SendAll(const void* data, size_t len);
+    // Further reads go to OnData() on the loop thread
+    void Attach();
+    // False if it was not open
+    bool Close();
+    bool IsOpen();
+
+    virtual void OnData(const char* data, size_t len) = 0;
+    // Closed by the server or the network, on the loop thread after Close()
+    virtual void OnRemoteClosed() = 0;
+    virtual void OnTick(int64_t now_ms) {}
+
+private:
+    friend class NetLoop;
+
+    std::mutex mutex_;          // fd_
+    std::mutex send_mutex_;     // Whole frames and packets, the fd is not closed under a send
+    int fd_ = -1;
+    bool stream_ = true;
+    uint64_t id_ = 0;
+
+    void OnReadable();
+};
+
+// MQTT 3.1.1 over plain TCP, QoS 0 and 1 without retransmission
+class NetMqtt : public Mqtt, private NetSocket {
+public:
+    ~NetMqtt();
+
+    bool Connect(const std::string broker_address, int broker_port, const std::string client_id,
+                 const std::string username, const std::string password) override;
+    void Disconnect() override;
+    bool Publish(const std::string topic, const std::string payload, int qos = 0) override;
+    bool Subscribe(const std::string topic, int qos = 0) override;
+    bool Unsubscribe(const std::string topic) override;
+    bool IsConnected() override;
+
+private:
+    std::string buffer_;
+    std::atomic<uint16_t> packet_id_ = 0;
+    std::atomic<int64_t> last_send_ms_ = 0;
+
+    bool SendPacket(uint8_t header, const std::string& body);
+    void OnData(const char* data, size_t len) override;
+    void OnRemoteClosed() override;
+    void OnTick(int64_t now_ms) override;
+};
+
+class NetUdp : public Udp, private NetSocket {
+public:
+    ~NetUdp();
+
+    bool Connect(const std::string& host, int port) override;
+    void Disconnect() override;
+    int Send(const std::string& data) override;
+
+private:
+    void OnData(const char* data, size_t len) override;
+    void OnRemoteClosed() override {}
+};
+
+class WebSocket;
+
+// The ws:// connection behind a WebSocket off the loopback server (see web_socket.h)
+class NetWebSocket : private NetSocket {
+public:
+    explicit NetWebSocket(WebSocket* websocket);
+    ~NetWebSocket();
+
+    bool Connect(const char* uri, const std::map<std::string, std::string>& headers);
+    bool Send(const void* data, size_t len, bool binary, bool fin);
+    void Ping();
+    void Close();
+
+private:
+    WebSocket* websocket_;
+    std::string buffer_;
+    std::string message_;
+    bool message_binary_ = false;
+    bool continuation_ = false;     // The last frame sent had no fin
+
+    bool SendFrame(uint8_t opcode, bool fin, const void* data, size_t len);
+    void OnData(const char* data, size_t len) override;
+    void OnRemoteClosed() override;
+};
+
+#endif // _NET_TRANSPORT_H
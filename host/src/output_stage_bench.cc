@@ -0,0 +1,88 @@
+// Times the software volume stage of the codec-less boards (NoAudioCodec, K10AudioCodec)
+// against the per-sample pow / int64 / saturate loop it replaced, for one 60ms frame at 24kHz.
+#include "output_stage.h"
+
+#include <chrono>
+#include <climits>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAS_CYCLE_COUNTER 1
+static inline uint64_t ReadCycles() { return __rdtsc(); }
+#else
+static inline uint64_t ReadCycles() { return 0; }
+#endif
+
+static const int kFrameSamples = 24000 * 60 / 1000;
+static const int kIterations = 200000;
+
+// The loop in NoAudioCodec::Write before the output stage
+__attribute__((noinline))
+static void LegacyWrite(const int16_t* data, int32_t* buffer, int samples, int output_volume) {
+    int32_t volume_factor = pow(double(output_volume) / 100.0, 2) * 65536;
+    for (int i = 0; i < samples; i++) {
+        int64_t temp = int64_t(data[i]) * volume_factor;
+        if (temp > INT32_MAX) {
+            buffer[i] = INT32_MAX;
+        } else if (temp < INT32_MIN) {
+            buffer[i] = INT32_MIN;
+        } else {
+            buffer[i] = static_cast<int32_t>(temp);
+        }
+    }
+}
+
+__attribute__((noinline))
+static void StageWrite(const int16_t* data, int32_t* buffer, int samples, int output_volume) {
+    ScaleToI2sSlots(data, buffer, samples, OutputVolumeFactor(output_volume));
+}
+
+template <typename F>
+static void Measure(const char* name, F&& write, const std::vector<int16_t>& input, std::vector<int32_t>& output) {
+    uint64_t checksum = 0;
+    auto start = std::chrono::steady_clock::now();
+    uint64_t cycles_start = ReadCycles();
+    for (int i = 0; i < kIterations; i++) {
+        write(input.data(), output.data(), kFrameSamples, 70 + (i & 15));
+        checksum += output[i % kFrameSamples];
+    }
+    uint64_t cycles = ReadCycles() - cycles_start;
+    auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+    printf("%-8s %8.1f ns/frame", name, double(ns) / kIterations);
+#if HAS_CYCLE_COUNTER
+    printf(" %8.1f cycles/frame %5.2f cycles/sample", double(cycles) / kIterations, double(cycles) / kIterations / kFrameSamples);
+#endif
+    printf("  (checksum %llu)\n", (unsigned long long)checksum);
+}
+
+int main() {
+    std::vector<int16_t> input(kFrameSamples);
+    std::vector<int32_t> expected(kFrameSamples);
+    std::vector<int32_t> output(kFrameSamples);
+    srand(1);
+    for (auto& sample : input) {
+        sample = int16_t(rand() & 0xFFFF);
+    }
+    input[0] = INT16_MIN;
+    input[1] = INT16_MAX;
+
+    // Same samples at every volume before timing anything
+    for (int volume = 0; volume <= 100; volume++) {
+        LegacyWrite(input.data(), expected.data(), kFrameSamples, volume);
+        StageWrite(input.data(), output.data(), kFrameSamples, volume);
+        if (expected != output) {
+            printf("Mismatch at volume %d\n", volume);
+            return 1;
+        }
+    }
+    printf("Output identical to the legacy loop at volumes 0-100\n");
+
+    printf("%d samples per frame, %d frames\n", kFrameSamples, kIterations);
+    Measure("legacy", LegacyWrite, input, output);
+    Measure("stage", StageWrite, input, output);
+    return 0;
+}
@@ -0,0 +1,241 @@
+// Runs the wake word silence gate (PreVad) over a corpus the way Application::OnGatedAudioInput does, and reports
+// how much of the audio still reaches the AFE, whether the wake words keep their onset, what the gate costs,
+// and the idle CPU and power that follow. Without arguments the corpus is synthesized: a quiet room, a fan
+// that comes on for half a minute, a door knock, and six wake word like phrases that start with a fricative.
+// Given 16kHz 16-bit WAV files (mono, or stereo with the microphone first) it reports on them instead.
+//
+// The AFE load and the power figures are a model, not a measurement: pass the AFE load measured on the board
+// (idle, wake word only) with --afe-load, the defaults are rough ESP32-S3 figures.
+#include "pre_vad.h"
+
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <string>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+static inline uint64_t ReadCycles() { return __rdtsc(); }
+#else
+static inline uint64_t ReadCycles() { return 0; }
+#endif
+
+static const int kSampleRate = 16000;
+static const size_t kChunkFrames = 512;    // AFE feed chunk, 32ms
+
+// Model defaults, ESP32-S3 at 240MHz
+static double afe_load = 40;        // % of one core, AEC + NS + wakenet on every chunk
+static double core_mw = 110;        // A busy core over an idle one
+static double baseline_mw = 160;    // Capture, codec and an idle system, the part the gate does not change
+
+struct Corpus {
+    std::string name;
+    int channels = 1;
+    std::vector<int16_t> samples;
+    std::vector<double> onsets;     // Seconds, synthesized corpus only
+};
+
+static bool ReadWav(const char* path, Corpus& corpus) {
+    FILE* file = fopen(path, "rb");
+    if (file == nullptr) {
+        fprintf(stderr, "Cannot open %s\n", path);
+        return false;
+    }
+    char riff[12];
+    if (fread(riff, 1, 12, file) != 12 || memcmp(riff, "RIFF", 4) != 0 || memcmp(riff + 8, "WAVE", 4) != 0) {
+        fprintf(stderr, "%s is not a WAV file\n", path);
+        fclose(file);
+        return false;
+    }
+    bool ok = false;
+    char id[4];
+    uint32_t size;
+    while (fread(id, 1, 4, file) == 4 && fread(&size, 4, 1, file) == 1) {
+        if (memcmp(id, "fmt ", 4) == 0) {
+            uint8_t format[16];
+            if (size < 16 || fread(format, 1, 16, file) != 16) {
+                break;
+            }
+            uint16_t channels, bits;
+            uint32_t sample_rate;
+            memcpy(&channels, format + 2, 2);
+            memcpy(&sample_rate, format + 4, 4);
+            memcpy(&bits, format + 14, 2);
+            if (sample_rate != kSampleRate || bits != 16 || channels < 1 || channels > 2) {
+                fprintf(stderr, "%s: %u Hz %u bit %u channels, expected 16000 Hz 16 bit mono or stereo\n",
+                    path, sample_rate, bits, channels);
+                break;
+            }
+            corpus.channels = channels;
+            fseek(file, size - 16, SEEK_CUR);
+        } else if (memcmp(id, "data", 4) == 0) {
+            corpus.samples.resize(size / 2);
+            corpus.samples.resize(fread(corpus.samples.data(), 2, corpus.samples.size(), file));
+            ok = true;
+            break;
+        } else {
+            fseek(file, size + (size & 1), SEEK_CUR);
+        }
+    }
+    fclose(file);
+    corpus.name = path;
+    return ok;
+}
+
+static Corpus Synthesize() {
+    Corpus corpus;
+    corpus.name = "synthesized (90s: quiet room, fan 40-70s, knock 33s, 6 phrases)";
+    const double seconds = 90;
+    corpus.samples.resize(size_t(seconds * kSampleRate));
+    std::mt19937 random(1);
+    std::normal_distribution<double> noise(0, 1);
+    std::vector<double> audio(corpus.samples.size());
+
+    // Room: low passed noise around -62dBFS, and a fan around -48dBFS from 40 to 70s
+    double room = 0, fan = 0;
+    for (size_t i = 0; i < audio.size(); i++) {
+        double t = double(i) / kSampleRate;
+        room += 0.2 * (noise(random) * 60 - room);
+        audio[i] = room + 8;    // and a small DC offset
+        if (t >= 40 && t < 70) {
+            fan += 0.05 * (noise(random) * 900 - fan);
+            audio[i] += fan;
+        }
+    }
+    // A knock: a decaying low thump
+    for (size_t i = 0; i < kSampleRate / 10; i++) {
+        audio[33 * kSampleRate + i] += 6000 * exp(-double(i) / 300) * sin(2 * M_PI * 120 * i / kSampleRate);
+    }
+    // Phrases: an 80ms fricative at -40dBFS, then three voiced syllables around -26dBFS
+    corpus.onsets = {5, 15, 28, 50, 62, 80};
+    for (double onset : corpus.onsets) {
+        size_t start = size_t(onset * kSampleRate);
+        double previous = 0;
+        for (size_t i = 0; i < kSampleRate * 8 / 100; i++) {
+            double white = noise(random) * 500;
+            audio[start + i] += white - previous;   // high passed
+            previous = white;
+        }
+        start += kSampleRate * 8 / 100;
+        for (int syllable = 0; syllable < 3; syllable++) {
+            size_t length = kSampleRate * 22 / 100;
+            double f0 = 170 + 30 * syllable;
+            for (size_t i = 0; i < length; i++) {
+                double envelope = sin(M_PI * i / length);
+                double value = 0;
+                for (int harmonic = 1; harmonic <= 12; harmonic++) {
+                    value += sin(2 * M_PI * f0 * harmonic * i / kSampleRate) / harmonic;
+                }
+                audio[start + i] += 2000 * envelope * value;
+            }
+            start += length + kSampleRate * 5 / 100;
+        }
+    }
+    for (size_t i = 0; i < audio.size(); i++) {
+        corpus.samples[i] = int16_t(std::max(-32768.0, std::min(32767.0, audio[i])));
+    }
+    return corpus;
+}
+
+// Feeds the corpus through the gate like the audio input task, with all of it already captured
+static void Run(const Corpus& corpus) {
+    size_t frames = corpus.samples.size() / corpus.channels;
+    size_t chunks = frames / kChunkFrames;
+    PreVad gate;
+    gate.Configure(kSampleRate, corpus.channels, kChunkFrames);
+    // Configure() leaves the gate open for the hang time, as after listening
+    std::vector<bool> fed(chunks, false);
+    size_t gate_position = 0, input_position = 0;
+    double gate_ns = 0;
+    uint64_t gate_cycles = 0;
+
+    while (gate_position + kChunkFrames <= chunks * kChunkFrames) {
+        auto start = std::chrono::steady_clock::now();
+        uint64_t cycles_start = ReadCycles();
+        bool open = gate.Process(corpus.samples.data() + gate_position * corpus.channels);
+        gate_cycles += ReadCycles() - cycles_start;
+        gate_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+        gate_position += kChunkFrames;
+        if (!open) {
+            if (gate_position - input_position > gate.preroll_frames()) {
+                input_position = gate_position - gate.preroll_frames();
+            }
+            continue;
+        }
+        while (gate_position - input_position >= kChunkFrames) {
+            fed[input_position / kChunkFrames] = true;
+            input_position += kChunkFrames;
+        }
+    }
+
+    auto stats = gate.GetStats();
+    size_t fed_chunks = 0;
+    for (bool chunk : fed) {
+        fed_chunks += chunk;
+    }
+    double fed_percent = 100.0 * fed_chunks / chunks;
+    double chunk_ns = gate_ns / chunks;
+    double gate_load = 100.0 * chunk_ns / (kChunkFrames * 1e9 / kSampleRate);
+    printf("%s\n", corpus.name.c_str());
+    printf("  %zu chunks of %zums, %.1f%% fed to the AFE, gate opened %u times, final noise floor %u\n",
+        chunks, kChunkFrames * 1000 / kSampleRate, fed_percent, stats.opens, stats.noise_floor);
+    printf("  gate: %.0f ns/chunk %.0f cycles/chunk on this host, %.4f%% of a core\n",
+        chunk_ns, double(gate_cycles) / chunks, gate_load);
+
+    for (double onset : corpus.onsets) {
+        size_t chunk = size_t(onset * kSampleRate) / kChunkFrames;
+        // Audio fed before the onset, back to the start of the run the onset is in
+        size_t first = chunk;
+        while (first > 0 && fed[first - 1]) {
+            first--;
+        }
+        if (!fed[chunk]) {
+            printf("  phrase at %5.1fs: onset NOT fed\n", onset);
+        } else {
+            double lead_ms = onset * 1000 - double(first * kChunkFrames) * 1000 / kSampleRate;
+            size_t last = chunk;
+            while (last + 1 < chunks && fed[last + 1]) {
+                last++;
+            }
+            printf("  phrase at %5.1fs: fed from %.0fms before the onset, for %.1fs\n",
+                onset, lead_ms, double((last + 1 - first) * kChunkFrames) / kSampleRate);
+        }
+    }
+
+    double before_load = afe_load;
+    double after_load = afe_load * fed_percent / 100 + gate_load;
+    printf("  idle CPU (model, AFE %.0f%% of a core): before %.1f%%, after %.1f%%\n", afe_load, before_load, after_load);
+    printf("  idle power (model, %.0fmW + %.0fmW per busy core): before %.0fmW, after %.0fmW, %.0f%% less\n",
+        baseline_mw, core_mw, baseline_mw + core_mw * before_load / 100, baseline_mw + core_mw * after_load / 100,
+        100 * (core_mw * (before_load - after_load) / 100) / (baseline_mw + core_mw * before_load / 100));
+}
+
+int main(int argc, char** argv) {
+    std::vector<Corpus> corpora;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--afe-load") == 0 && i + 1 < argc) {
+            afe_load = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--core-mw") == 0 && i + 1 < argc) {
+            core_mw = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--baseline-mw") == 0 && i + 1 < argc) {
+            baseline_mw = atof(argv[++i]);
+        } else {
+            Corpus corpus;
+            if (!ReadWav(argv[i], corpus)) {
+                return 1;
+            }
+            corpora.push_back(std::move(corpus));
+        }
+    }
+    if (corpora.empty()) {
+        corpora.push_back(Synthesize());
+    }
+    for (auto& corpus : corpora) {
+        Run(corpus);
+    }
+    return 0;
+}
@@ -0,0 +1,120 @@
+#include "aec_timeline.h"
+
+#include <esp_log.h>
+#include <algorithm>
+
+#define TAG "AecTimeline"
+
+void AecTimeline::Configure(int sample_rate, size_t dma_frames) {
+    sample_rate_ = sample_rate;
+    dma_us_ = int64_t(dma_frames) * 1000000 / sample_rate;
+    ESP_LOGI(TAG, "Output %dHz, %lld us in the DMA queue", sample_rate_, dma_us_);
+}
+
+void AecTimeline::OnPlayback(uint32_t timestamp, size_t frames, int64_t write_start_us, int64_t write_end_us) {
+    int64_t duration_us = int64_t(frames) * 1000000 / sample_rate_;
+    bool underrun = write_start_us >= last_end_us_;
+    if (underrun) {
+        // The DMA queue was empty before this write, the frame starts as it is written
+        starts_.fetch_add(1, std::memory_order_relaxed);
+        run_start_us_ = 0;
+    }
+    int64_t end_us = std::max(last_end_us_, write_start_us) + duration_us;
+    // The write returned once the end of the frame fitted in the DMA queue: the DMA clock places it from there.
+    // A write that returns within a millisecond of that has waited for the queue too.
+    bool blocked = end_us >= write_end_us + dma_us_ - 1000;
+    end_us = std::clamp(end_us, write_end_us, write_end_us + dma_us_);
+
+    if (blocked) {
+        if (run_start_us_ == 0) {
+            run_start_us_ = end_us;
+            run_nominal_us_ = 0;
+        } else {
+            run_nominal_us_ += duration_us;
+            if (run_nominal_us_ >= AEC_TIMELINE_SKEW_MIN_MS * 1000) {
+                int64_t skew_us = (end_us - run_start_us_) - run_nominal_us_;
+                skew_ppm_.store(int32_t(skew_us * 1000000 / run_nominal_us_), std::memory_order_relaxed);
+            }
+        }
+    }
+
+    frames_.Push(Frame{timestamp, end_us - duration_us, end_us});
+    last_end_us_ = end_us;
+    played_.fetch_add(1, std::memory_order_relaxed);
+}
+
+void AecTimeline::OnFeed(uint32_t sample, int64_t capture_time_us) {
+    feeds_.Push(Feed{sample, capture_time_us});
+}
+
+bool AecTimeline::GetCaptureTime(uint32_t sample, int64_t& capture_time_us) const {
+    uint32_t head = feeds_.head();
+    uint32_t newer_sample = UINT32_MAX;
+    for (uint32_t i = 1; i <= AEC_TIMELINE_FEEDS && i <= head; i++) {
+        Feed feed;
+        if (!feeds_.Read(head - i, feed)) {
+            return false;
+        }
+        // Samples count from the start of listening, a larger one further back is from an earlier session
+        if (feed.sample > newer_sample) {
+            return false;
+        }
+        if (feed.sample <= sample) {
+            capture_time_us = feed.capture_time_us + int64_t(sample - feed.sample) * 1000000 / 16000;
+            return true;
+        }
+        newer_sample = feed.sample;
+    }
+    return false;
+}
+
+uint32_t AecTimeline::GetTimestamp(uint32_t sample, int64_t now_us) {
+    int64_t capture_time_us;
+    if (!GetCaptureTime(sample, capture_time_us)) {
+        missed_.fetch_add(1, std::memory_order_relaxed);
+        return 0;
+    }
+
+    uint32_t head = frames_.head();
+    for (uint32_t i = 1; i <= AEC_TIMELINE_FRAMES && i <= head; i++) {
+        Frame frame;
+        if (!frames_.Read(head - i, frame)) {
+            break;
+        }
+        if (capture_time_us >= frame.end_us) {
+            // After this frame, and before the next one if there is one: an underrun or the end of playback
+            silent_.fetch_add(1, std::memory_order_relaxed);
+            return 0;
+        }
+        if (capture_time_us >= frame.start_us) {
+            if (frame.timestamp == 0) {
+                // A local sound, the server has no reference for it
+                silent_.fetch_add(1, std::memory_order_relaxed);
+                return 0;
+            }
+            paired_.fetch_add(1, std::memory_order_relaxed);
+            capture_lag_ms_.store(uint32_t((now_us - capture_time_us) / 1000), std::memory_order_relaxed);
+            // Server timestamps are in ms of the stream, so the position inside the frame carries over
+            return frame.timestamp + uint32_t((capture_time_us - frame.start_us) / 1000);
+        }
+    }
+    if (head < AEC_TIMELINE_FRAMES) {
+        // Captured before anything was played
+        silent_.fetch_add(1, std::memory_order_relaxed);
+    } else {
+        missed_.fetch_add(1, std::memory_order_relaxed);
+    }
+    return 0;
+}
+
+AecTimelineStats AecTimeline::GetStats() const {
+    return AecTimelineStats{
+        .played = played_.load(std::memory_order_relaxed),
+        .starts = starts_.load(std::memory_order_relaxed),
+        .paired = paired_.load(std::memory_order_relaxed),
+        .silent = silent_.load(std::memory_order_relaxed),
+        .missed = missed_.load(std::memory_order_relaxed),
+        .skew_ppm = skew_ppm_.load(std::memory_order_relaxed),
+        .capture_lag_ms = capture_lag_ms_.load(std::memory_order_relaxed),
+    };
+}
@@ -0,0 +1,81 @@
+#ifndef AEC_TIMELINE_H
+#define AEC_TIMELINE_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+#include "seqlock_ring.h"
+
+// Played frames kept for the uplink to look up, a second of 60ms frames with room for the uplink delay
+#define AEC_TIMELINE_FRAMES 32
+// Capture times of the fed chunks, covers the AFE and encoder delay between feed and encode
+#define AEC_TIMELINE_FEEDS 64
+// Continuous playback needed before a skew is reported
+#define AEC_TIMELINE_SKEW_MIN_MS 2000
+
+struct AecTimelineStats {
+    uint32_t played;            // Frames written to the codec
+    uint32_t starts;            // Times playback started from an empty DMA queue, a new reply or an underrun
+    uint32_t paired;            // Uplink frames stamped with the frame audible when they were captured
+    uint32_t silent;            // Uplink frames captured while nothing played, stamped 0
+    uint32_t missed;            // Uplink frames whose capture time or playback frame had left the rings
+    int32_t skew_ppm;           // Output (I2S) clock against esp_timer over the current run, 0 until known
+    uint32_t capture_lag_ms;    // Capture to encode of the last paired frame
+};
+
+// Pairs each uplink frame with the server timestamp of the downlink frame that was coming out of the speaker
+// when its first sample was captured, for server side AEC. Both sides run on clocks: the playback side places
+// each frame on the esp_timer clock from when its write to the codec returned (with the DMA queue full, the
+// frame ends one DMA queue later), the capture side takes the capture times the capture ring recorded.
+// Three tasks, no locks: the decode lane writes the played frames, the audio input task the feed times,
+// the encode lane reads both.
+class AecTimeline {
+public:
+    // dma_frames at sample_rate is how much audio the codec queues
+    void Configure(int sample_rate, size_t dma_frames);
+
+    // Decode lane, after each write to the codec
+    void OnPlayback(uint32_t timestamp, size_t frames, int64_t write_start_us, int64_t write_end_us);
+    // Audio input task, for each chunk fed to the audio processor. sample counts 16kHz frames since listening started.
+    void OnFeed(uint32_t sample, int64_t capture_time_us);
+    // Encode lane, the timestamp for the uplink frame that starts at sample, 0 if nothing was playing.
+    // now_us is the encode time, for the capture lag.
+    uint32_t GetTimestamp(uint32_t sample, int64_t now_us);
+
+    AecTimelineStats GetStats() const;
+
+private:
+    struct Frame {
+        uint32_t timestamp;
+        int64_t start_us;
+        int64_t end_us;
+    };
+    struct Feed {
+        uint32_t sample;
+        int64_t capture_time_us;
+    };
+
+    int sample_rate_ = 24000;
+    int64_t dma_us_ = 0;
+    SeqlockRing<Frame, AEC_TIMELINE_FRAMES> frames_;
+    SeqlockRing<Feed, AEC_TIMELINE_FEEDS> feeds_;
+
+    // Decode lane
+    int64_t last_end_us_ = 0;
+    int64_t run_start_us_ = 0;      // End of the first frame of the current run of blocking writes
+    int64_t run_nominal_us_ = 0;    // Audio written in the run since that frame
+
+    std::atomic<uint32_t> played_ = 0;
+    std::atomic<uint32_t> starts_ = 0;
+    std::atomic<int32_t> skew_ppm_ = 0;
+    // Encode lane
+    std::atomic<uint32_t> paired_ = 0;
+    std::atomic<uint32_t> silent_ = 0;
+    std::atomic<uint32_t> missed_ = 0;
+    std::atomic<uint32_t> capture_lag_ms_ = 0;
+
+    bool GetCaptureTime(uint32_t sample, int64_t& capture_time_us) const;
+};
+
+#endif // AEC_TIMELINE_H
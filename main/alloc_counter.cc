@@ -0,0 +1,28 @@
+#include "alloc_counter.h"
+
+#include <esp_attr.h>
+#include <esp_heap_caps.h>
+#include <atomic>
+
+// 32 bits: the hook runs from ISRs and with the cache disabled, where a 64-bit atomic would call into libatomic in flash
+static std::atomic<uint32_t> alloc_count = 0;
+static std::atomic<uint32_t> alloc_bytes = 0;
+
+uint32_t AllocCounter::GetCount() {
+    return alloc_count.load(std::memory_order_relaxed);
+}
+
+uint32_t AllocCounter::GetBytes() {
+    return alloc_bytes.load(std::memory_order_relaxed);
+}
+
+#if CONFIG_USE_ALLOC_COUNTER
+// Called by the heap for every allocation, also from ISRs and with the cache disabled
+extern "C" IRAM_ATTR void esp_heap_trace_alloc_hook(void* ptr, size_t size, uint32_t caps) {
+    alloc_count.fetch_add(1, std::memory_order_relaxed);
+    alloc_bytes.fetch_add(size, std::memory_order_relaxed);
+}
+
+extern "C" IRAM_ATTR void esp_heap_trace_free_hook(void* ptr) {
+}
+#endif
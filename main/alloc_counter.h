@@ -0,0 +1,14 @@
+#ifndef ALLOC_COUNTER_H
+#define ALLOC_COUNTER_H
+
+#include <cstdint>
+
+// Counts successful heap allocations through the ESP-IDF heap hooks (CONFIG_HEAP_USE_HOOKS).
+// Both counters stay 0 unless CONFIG_USE_ALLOC_COUNTER is set. They wrap around, take differences.
+class AllocCounter {
+public:
+    static uint32_t GetCount();
+    static uint32_t GetBytes();
+};
+
+#endif // ALLOC_COUNTER_H
@@ -9,6 +9,8 @@
 #include "font_awesome_symbols.h"
 #include "iot/thing_manager.h"
 #include "assets/lang_config.h"
+#include "audio_trace.h"
+#include "alloc_counter.h"
 
 #if CONFIG_USE_AUDIO_PROCESSOR
 #include "afe_audio_processor.h"
@@ -18,12 +20,14 @@
 
 #include <cstring>
 #include <esp_log.h>
-#include <cJSON.h>
 #include <driver/gpio.h>
 #include <arpa/inet.h>
 
 #define TAG "Application"
 
+// Kconfig uses -1 for "not pinned"
+#define TASK_CORE_ID(core) ((core) < 0 ? tskNO_AFFINITY : (core))
+
 
 static const char* const STATE_STRINGS[] = {
     "unknown",
@@ -41,10 +45,12 @@ static const char* const STATE_STRINGS[] = {
 
 Application::Application() {
     event_group_ = xEventGroupCreate();
-    background_task_ = new BackgroundTask(4096 * 8);
+    // Decode feeds the speaker, so it gets its own lane above encode and never queues behind a burst of encodes
+    encode_task_ = new BackgroundTask("opus_encode", 4096 * 8, 2, TASK_CORE_ID(CONFIG_AUDIO_ENCODE_TASK_CORE));
+    decode_task_ = new BackgroundTask("opus_decode", 4096 * 6, 3, TASK_CORE_ID(CONFIG_AUDIO_DECODE_TASK_CORE));
 
 #if CONFIG_USE_AUDIO_PROCESSOR
-    audio_processor_ = std::make_unique<AfeAudioProcessor>();
+    audio_processor_ = std::make_unique<AfeAudioProcessor>(audio_front_end_);
 #else
     audio_processor_ = std::make_unique<DummyAudioProcessor>();
 #endif
@@ -68,8 +74,11 @@ Application::~Application() {
         esp_timer_stop(clock_timer_handle_);
         esp_timer_delete(clock_timer_handle_);
     }
-    if (background_task_ != nullptr) {
-        delete background_task_;
+    if (encode_task_ != nullptr) {
+        delete encode_task_;
+    }
+    if (decode_task_ != nullptr) {
+        delete decode_task_;
     }
     vEventGroupDelete(event_group_);
 }
@@ -130,11 +139,14 @@ void Application::CheckNewVersion() {
             codec->EnableOutput(false);
             {
                 std::lock_guard<std::mutex> lock(mutex_);
-                audio_decode_queue_.clear();
+                audio_jitter_buffer_.Reset();
             }
-            background_task_->WaitForCompletion();
-            delete background_task_;
-            background_task_ = nullptr;
+            encode_task_->WaitForCompletion();
+            decode_task_->WaitForCompletion();
+            delete encode_task_;
+            encode_task_ = nullptr;
+            delete decode_task_;
+            decode_task_ = nullptr;
             vTaskDelay(pdMS_TO_TICKS(1000));
 
             ota_.StartUpgrade([display](int progress, size_t speed) {
@@ -205,7 +217,7 @@ void Application::ShowActivationCode() {
         digit_sound{'9', Lang::Sounds::P3_9}
     }};
 
-    // This sentence uses 9KB of SRAM, so we need to wait for it to finish
+    // The digits queue up behind the sentence, nothing is copied or waited for
     Alert(Lang::Strings::ACTIVATION, message.c_str(), "happy", Lang::Sounds::P3_ACTIVATION);
 
     for (const auto& digit : code) {
@@ -225,7 +237,7 @@ void Application::Alert(const char* status, const char* message, const char* emo
     display->SetChatMessage("system", message);
     if (!sound.empty()) {
         ResetDecoder();
-        PlaySound(sound);
+        PlaySound(sound, kSoundPriorityHigh);
     }
 }
 
@@ -238,33 +250,19 @@ void Application::DismissAlert() {
     }
 }
 
-void Application::PlaySound(const std::string_view& sound) {
-    // Wait for the previous sound to finish
+// Returns at once, the audio output task plays queued sounds ahead of the server stream
+void Application::PlaySound(const std::string_view& sound, SoundPriority priority) {
     {
-        std::unique_lock<std::mutex> lock(mutex_);
-        audio_decode_cv_.wait(lock, [this]() {
-            return audio_decode_queue_.empty();
-        });
-    }
-    background_task_->WaitForCompletion();
-
-    // The assets are encoded at 16000Hz, 60ms frame duration
-    SetDecodeSampleRate(16000, 60);
-    const char* data = sound.data();
-    size_t size = sound.size();
-    for (const char* p = data; p < data + size; ) {
-        auto p3 = (BinaryProtocol3*)p;
-        p += sizeof(BinaryProtocol3);
-
-        auto payload_size = ntohs(p3->payload_size);
-        AudioStreamPacket packet;
-        packet.payload.resize(payload_size);
-        memcpy(packet.payload.data(), p3->payload, payload_size);
-        p += payload_size;
-
         std::lock_guard<std::mutex> lock(mutex_);
-        audio_decode_queue_.emplace_back(std::move(packet));
+        if (!sound_queue_.Push(sound, priority)) {
+            return;
+        }
     }
+    auto codec = Board::GetInstance().GetAudioCodec();
+    if (!codec->output_enabled()) {
+        codec->EnableOutput(true);
+    }
+    NotifyAudioOutput();
 }
 
 void Application::ToggleChatState() {
@@ -281,11 +279,9 @@ void Application::ToggleChatState() {
     if (device_state_ == kDeviceStateIdle) {
         Schedule([this]() {
             SetDeviceState(kDeviceStateConnecting);
-            if (!protocol_->OpenAudioChannel()) {
-                return;
-            }
-
-            SetListeningMode(realtime_chat_enabled_ ? kListeningModeRealtime : kListeningModeAutoStop);
+            OpenAudioChannel([this]() {
+                SetListeningMode(realtime_chat_enabled_ ? kListeningModeRealtime : kListeningModeAutoStop);
+            });
         });
     } else if (device_state_ == kDeviceStateSpeaking) {
         Schedule([this]() {
@@ -293,7 +289,7 @@ void Application::ToggleChatState() {
         });
     } else if (device_state_ == kDeviceStateListening) {
         Schedule([this]() {
-            protocol_->CloseAudioChannel();
+            ReleaseAudioChannel();
         });
     }
 }
@@ -311,14 +307,10 @@ void Application::StartListening() {
     
     if (device_state_ == kDeviceStateIdle) {
         Schedule([this]() {
-            if (!protocol_->IsAudioChannelOpened()) {
-                SetDeviceState(kDeviceStateConnecting);
-                if (!protocol_->OpenAudioChannel()) {
-                    return;
-                }
-            }
-
-            SetListeningMode(kListeningModeManualStop);
+            SetDeviceState(kDeviceStateConnecting);
+            OpenAudioChannel([this]() {
+                SetListeningMode(kListeningModeManualStop);
+            });
         });
     } else if (device_state_ == kDeviceStateSpeaking) {
         Schedule([this]() {
@@ -347,6 +339,35 @@ void Application::StopListening() {
     });
 }
 
+// The channel opens on the channel manager task, or is still open from the last conversation, and the main loop
+// goes on meanwhile. on_opened runs on the main loop, if the device is still waiting for it.
+void Application::OpenAudioChannel(std::function<void()> on_opened) {
+    channel_manager_.Open([this, on_opened = std::move(on_opened)](bool opened) {
+        // A failed open has reported the error and set the device idle
+        if (!opened) {
+            return;
+        }
+        Schedule([this, on_opened]() {
+            if (device_state_ != kDeviceStateConnecting) {
+                return;
+            }
+            // A standby channel was opened with power save on
+            Board::GetInstance().SetPowerSaveMode(false);
+            on_opened();
+        });
+    });
+}
+
+// The conversation is over, the device goes idle either way.
+// A channel kept in standby stays open, a closed one reports it through OnAudioChannelClosed.
+void Application::ReleaseAudioChannel() {
+    if (channel_manager_.Release()) {
+        Board::GetInstance().SetPowerSaveMode(true);
+        Board::GetInstance().GetDisplay()->SetChatMessage("system", "");
+        SetDeviceState(kDeviceStateIdle);
+    }
+}
+
 void Application::Start() {
     auto& board = Board::GetInstance();
     SetDeviceState(kDeviceStateStarting);
@@ -358,36 +379,55 @@ void Application::Start() {
     auto codec = board.GetAudioCodec();
     opus_decoder_ = std::make_unique<OpusDecoderWrapper>(codec->output_sample_rate(), 1, OPUS_FRAME_DURATION_MS);
     opus_encoder_ = std::make_unique<OpusEncoderWrapper>(16000, 1, OPUS_FRAME_DURATION_MS);
+#if CONFIG_OPUS_ENCODER_DTX
+    bool opus_dtx = true;
+#else
+    bool opus_dtx = false;
+#endif
+    // The controller moves complexity within the bounds from here on
     if (realtime_chat_enabled_) {
         ESP_LOGI(TAG, "Realtime chat enabled, setting opus encoder complexity to 0");
-        opus_encoder_->SetComplexity(0);
+        encoder_controller_.Configure(0, 0, 0, opus_dtx, OPUS_FRAME_DURATION_MS);
     } else if (board.GetBoardType() == "ml307") {
-        ESP_LOGI(TAG, "ML307 board detected, setting opus encoder complexity to 5");
-        opus_encoder_->SetComplexity(5);
+        ESP_LOGI(TAG, "ML307 board detected, starting opus encoder complexity at 5");
+        encoder_controller_.Configure(ENCODER_MIN_COMPLEXITY, ENCODER_MAX_COMPLEXITY, 5, opus_dtx, OPUS_FRAME_DURATION_MS);
     } else {
-        ESP_LOGI(TAG, "WiFi board detected, setting opus encoder complexity to 3");
-        opus_encoder_->SetComplexity(3);
+        ESP_LOGI(TAG, "WiFi board detected, starting opus encoder complexity at 3");
+        encoder_controller_.Configure(ENCODER_MIN_COMPLEXITY, ENCODER_MAX_COMPLEXITY, 3, opus_dtx, OPUS_FRAME_DURATION_MS);
     }
+    opus_encoder_->SetComplexity(encoder_controller_.settings().complexity);
+    opus_encoder_->SetDtx(encoder_controller_.settings().dtx);
 
-    if (codec->input_sample_rate() != 16000) {
+    if (codec->input_sample_rate() != 16000 &&
+        !input_stage_.Configure(codec->input_sample_rate(), 16000, codec->input_channels())) {
         input_resampler_.Configure(codec->input_sample_rate(), 16000);
         reference_resampler_.Configure(codec->input_sample_rate(), 16000);
     }
+    capture_ring_.Configure(16000, codec->input_channels());
+    aec_timeline_.Configure(codec->output_sample_rate(), AUDIO_CODEC_DMA_DESC_NUM * AUDIO_CODEC_DMA_FRAME_NUM);
     codec->Start();
 
-#if CONFIG_USE_AUDIO_PROCESSOR
+    // Capture blocks in the I2S read, input and output on their event bits, so none of them waits for another
     xTaskCreatePinnedToCore([](void* arg) {
         Application* app = (Application*)arg;
-        app->AudioLoop();
+        app->AudioCaptureTask();
         vTaskDelete(NULL);
-    }, "audio_loop", 4096 * 2, this, 8, &audio_loop_task_handle_, 1);
-#else
-    xTaskCreate([](void* arg) {
+    }, "audio_capture", 4096 * 2, this, 9, &audio_capture_task_handle_, TASK_CORE_ID(CONFIG_AUDIO_INPUT_TASK_CORE));
+    xTaskCreatePinnedToCore([](void* arg) {
         Application* app = (Application*)arg;
-        app->AudioLoop();
+        app->AudioInputTask();
         vTaskDelete(NULL);
-    }, "audio_loop", 4096 * 2, this, 8, &audio_loop_task_handle_);
-#endif
+    }, "audio_input", 4096 * 2, this, 8, &audio_input_task_handle_, TASK_CORE_ID(CONFIG_AUDIO_INPUT_TASK_CORE));
+    xTaskCreatePinnedToCore([](void* arg) {
+        Application* app = (Application*)arg;
+        app->AudioOutputTask();
+        vTaskDelete(NULL);
+    }, "audio_output", 4096, this, 8, &audio_output_task_handle_, TASK_CORE_ID(CONFIG_AUDIO_OUTPUT_TASK_CORE));
+
+    // Alerts then play without decoding, even while the AFE keeps the CPU busy
+    for (auto sound : {Lang::Sounds::P3_SUCCESS, Lang::Sounds::P3_EXCLAMATION, Lang::Sounds::P3_VIBRATION}) {
+        PrewarmSound(sound);
+    }
 
     /* Wait for the network to be ready */
     board.StartNetwork();
@@ -407,16 +447,27 @@ void Application::Start() {
         protocol_ = std::make_unique<MqttProtocol>();
     }
 
+    // Errors come from the channel manager task as well as the main loop
     protocol_->OnNetworkError([this](const std::string& message) {
-        SetDeviceState(kDeviceStateIdle);
-        Alert(Lang::Strings::ERROR, message.c_str(), "sad", Lang::Sounds::P3_EXCLAMATION);
+        Schedule([this, message]() {
+            SetDeviceState(kDeviceStateIdle);
+            Alert(Lang::Strings::ERROR, message.c_str(), "sad", Lang::Sounds::P3_EXCLAMATION);
+        });
     });
     protocol_->OnIncomingAudio([this](AudioStreamPacket&& packet) {
-        const int max_packets_in_queue = 600 / OPUS_FRAME_DURATION_MS;
-        std::lock_guard<std::mutex> lock(mutex_);
-        if (audio_decode_queue_.size() < max_packets_in_queue) {
-            audio_decode_queue_.emplace_back(std::move(packet));
+        AUDIO_TRACE(kAudioTraceIncomingAudio, packet.timestamp);
+        std::unique_lock<std::mutex> lock(mutex_);
+        if (audio_jitter_buffer_.full()) {
+            // Hold the network task instead of dropping: TCP then pushes back on the server, UDP queues in the socket.
+            // The wait is bounded so a stalled output can not block the protocol forever.
+            audio_jitter_buffer_.CountBackpressure();
+            audio_decode_cv_.wait_for(lock, std::chrono::milliseconds(AUDIO_BACKPRESSURE_TIMEOUT_MS), [this]() {
+                return !audio_jitter_buffer_.full();
+            });
         }
+        audio_jitter_buffer_.Push(std::move(packet));
+        lock.unlock();
+        NotifyAudioOutput();
     });
     protocol_->OnAudioChannelOpened([this, codec, &board]() {
         board.SetPowerSaveMode(false);
@@ -425,6 +476,13 @@ void Application::Start() {
                 protocol_->server_sample_rate(), codec->output_sample_rate());
         }
         SetDecodeSampleRate(protocol_->server_sample_rate(), protocol_->server_frame_duration());
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            audio_jitter_buffer_.Configure(protocol_->server_frame_duration(), AUDIO_JITTER_BUFFER_MAX_MS,
+                protocol_->frames_per_packet());
+            stream_sample_rate_ = protocol_->server_sample_rate();
+            stream_frame_duration_ = protocol_->server_frame_duration();
+        }
         auto& thing_manager = iot::ThingManager::GetInstance();
         protocol_->SendIotDescriptors(thing_manager.GetDescriptorsJson());
         std::string states;
@@ -440,119 +498,157 @@ void Application::Start() {
             SetDeviceState(kDeviceStateIdle);
         });
     });
-    protocol_->OnIncomingJson([this, display](const cJSON* root) {
-        // Parse JSON data
-        auto type = cJSON_GetObjectItem(root, "type");
-        if (strcmp(type->valuestring, "tts") == 0) {
-            auto state = cJSON_GetObjectItem(root, "state");
-            if (strcmp(state->valuestring, "start") == 0) {
+    protocol_->OnIncomingJson([this, display](MessageType type, const JsonObject& root) {
+        switch (type) {
+        case kMessageTypeTts: {
+            auto& state = root.Get("state");
+            if (state.Is("start")) {
                 Schedule([this]() {
                     aborted_ = false;
                     if (device_state_ == kDeviceStateIdle || device_state_ == kDeviceStateListening) {
                         SetDeviceState(kDeviceStateSpeaking);
                     }
                 });
-            } else if (strcmp(state->valuestring, "stop") == 0) {
-                Schedule([this]() {
-                    background_task_->WaitForCompletion();
-                    if (device_state_ == kDeviceStateSpeaking) {
-                        if (listening_mode_ == kListeningModeManualStop) {
-                            SetDeviceState(kDeviceStateIdle);
-                        } else {
-                            SetDeviceState(kDeviceStateListening);
-                        }
-                    }
-                });
-            } else if (strcmp(state->valuestring, "sentence_start") == 0) {
-                auto text = cJSON_GetObjectItem(root, "text");
-                if (text != NULL) {
-                    ESP_LOGI(TAG, "<< %s", text->valuestring);
-                    Schedule([this, display, message = std::string(text->valuestring)]() {
+            } else if (state.Is("stop")) {
+                // The output task switches state once the jitter buffer is drained
+                std::lock_guard<std::mutex> lock(mutex_);
+                audio_jitter_buffer_.SetEndOfStream();
+                NotifyAudioOutput();
+            } else if (state.Is("sentence_start")) {
+                auto& text = root.Get("text");
+                if (text.IsString()) {
+                    ESP_LOGI(TAG, "<< %s", text.c_str());
+                    Schedule([this, display, message = std::string(text.c_str(), text.length)]() {
                         display->SetChatMessage("assistant", message.c_str());
                     });
                 }
             }
-        } else if (strcmp(type->valuestring, "stt") == 0) {
-            auto text = cJSON_GetObjectItem(root, "text");
-            if (text != NULL) {
-                ESP_LOGI(TAG, ">> %s", text->valuestring);
-                Schedule([this, display, message = std::string(text->valuestring)]() {
+            break;
+        }
+        case kMessageTypeStt: {
+            auto& text = root.Get("text");
+            if (text.IsString()) {
+                ESP_LOGI(TAG, ">> %s", text.c_str());
+                Schedule([this, display, message = std::string(text.c_str(), text.length)]() {
                     display->SetChatMessage("user", message.c_str());
                 });
             }
-        } else if (strcmp(type->valuestring, "llm") == 0) {
-            auto emotion = cJSON_GetObjectItem(root, "emotion");
-            if (emotion != NULL) {
-                Schedule([this, display, emotion_str = std::string(emotion->valuestring)]() {
+            break;
+        }
+        case kMessageTypeLlm: {
+            auto& emotion = root.Get("emotion");
+            if (emotion.IsString()) {
+                Schedule([this, display, emotion_str = std::string(emotion.c_str(), emotion.length)]() {
                     display->SetEmotion(emotion_str.c_str());
                 });
             }
-        } else if (strcmp(type->valuestring, "iot") == 0) {
-            auto commands = cJSON_GetObjectItem(root, "commands");
-            if (commands != NULL) {
-                auto& thing_manager = iot::ThingManager::GetInstance();
-                for (int i = 0; i < cJSON_GetArraySize(commands); ++i) {
-                    auto command = cJSON_GetArrayItem(commands, i);
-                    thing_manager.Invoke(command);
-                }
+            break;
+        }
+        case kMessageTypeIot: {
+            auto& thing_manager = iot::ThingManager::GetInstance();
+            JsonArrayReader commands(root.Get("commands"));
+            JsonValue command;
+            while (commands.Next(command)) {
+                thing_manager.Invoke(command);
             }
-        } else if (strcmp(type->valuestring, "system") == 0) {
-            auto command = cJSON_GetObjectItem(root, "command");
-            if (command != NULL) {
-                ESP_LOGI(TAG, "System command: %s", command->valuestring);
-                if (strcmp(command->valuestring, "reboot") == 0) {
+            break;
+        }
+        case kMessageTypeSystem: {
+            auto& command = root.Get("command");
+            if (command.IsString()) {
+                ESP_LOGI(TAG, "System command: %s", command.c_str());
+                if (command.Is("reboot")) {
                     // Do a reboot if user requests a OTA update
                     Schedule([this]() {
                         Reboot();
                     });
+                } else if (command.Is("trace_dump")) {
+                    AudioTrace::GetInstance().Dump();
                 } else {
-                    ESP_LOGW(TAG, "Unknown system command: %s", command->valuestring);
+                    ESP_LOGW(TAG, "Unknown system command: %s", command.c_str());
                 }
             }
-        } else if (strcmp(type->valuestring, "alert") == 0) {
-            auto status = cJSON_GetObjectItem(root, "status");
-            auto message = cJSON_GetObjectItem(root, "message");
-            auto emotion = cJSON_GetObjectItem(root, "emotion");
-            if (status != NULL && message != NULL && emotion != NULL) {
-                Alert(status->valuestring, message->valuestring, emotion->valuestring, Lang::Sounds::P3_VIBRATION);
+            break;
+        }
+        case kMessageTypeAlert: {
+            auto& status = root.Get("status");
+            auto& message = root.Get("message");
+            auto& emotion = root.Get("emotion");
+            if (status.IsString() && message.IsString() && emotion.IsString()) {
+                Alert(status.c_str(), message.c_str(), emotion.c_str(), Lang::Sounds::P3_VIBRATION);
             } else {
                 ESP_LOGW(TAG, "Alert command requires status, message and emotion");
             }
+            break;
+        }
+        default:
+            break;
         }
     });
     bool protocol_started = protocol_->Start();
+    channel_manager_.Initialize(protocol_.get());
 
+#if CONFIG_USE_WAKE_WORD_DETECT
+    audio_front_end_.Initialize(codec, true);
+#if CONFIG_USE_WAKE_WORD_PRE_VAD
+    pre_vad_.Configure(16000, capture_ring_.channels(), audio_front_end_.GetFeedSize() / capture_ring_.channels());
+#endif
+#elif CONFIG_USE_AUDIO_PROCESSOR
+    audio_front_end_.Initialize(codec, false);
+#endif
     audio_processor_->Initialize(codec);
-    audio_processor_->OnOutput([this](std::vector<int16_t>&& data) {
-        background_task_->Schedule([this, data = std::move(data)]() mutable {
-            if (protocol_->IsAudioChannelBusy()) {
+    audio_processor_->OnOutput([this](AudioBuffer<int16_t>&& data) {
+        uint32_t samples = data.size();
+        uint32_t skipped = encode_skipped_samples_.exchange(0);
+        bool scheduled = encode_task_->Schedule([this, skipped, data = std::move(data)]() mutable {
+            encoded_samples_ += skipped + data.size();
+            if (!encoder_controller_.Admit(protocol_->IsAudioChannelBusy())) {
                 return;
             }
-            opus_encoder_->Encode(std::move(data), [this](std::vector<uint8_t>&& opus) {
+            AUDIO_TRACE(kAudioTraceEncodeStart, encoded_samples_ / 16);
+            // The encoder takes the vector over when its input buffer is empty, otherwise the capacity is reused.
+            // Room for another frame lets the taken vector absorb the next chunk without growing.
+            encode_pcm_.reserve(data.size() + opus_encoder_->sample_rate() / 1000 * opus_encoder_->duration_ms());
+            encode_pcm_.assign(data.begin(), data.end());
+            if (opus_encoder_->IsBufferEmpty()) {
+                frame_start_sample_ = encoded_samples_ - encode_pcm_.size();
+                encoder_pending_samples_ = 0;
+            }
+            encoder_pending_samples_ += encode_pcm_.size();
+            data.reset();
+            uint32_t frames_before = encoded_frames_;
+            int64_t encode_start = esp_timer_get_time();
+            opus_encoder_->Encode(std::move(encode_pcm_), [this](std::vector<uint8_t>&& opus) {
+                ++encoded_frames_;
                 AudioStreamPacket packet;
-                packet.payload = std::move(opus);
-                uint32_t last_output_timestamp_value = last_output_timestamp_.load();
-                {
-                    std::lock_guard<std::mutex> lock(timestamp_mutex_);
-                    if (!timestamp_queue_.empty()) {
-                        packet.timestamp = timestamp_queue_.front();
-                        timestamp_queue_.pop_front();
-                    } else {
-                        packet.timestamp = 0;
-                    }
-
-                    if (timestamp_queue_.size() > 3) { // 限制队列长度3
-                        timestamp_queue_.pop_front(); // 该包发送前先出队保持队列长度
-                        return;
-                    }
-                }
-                Schedule([this, last_output_timestamp_value, packet = std::move(packet)]() {
-                    protocol_->SendAudio(packet);
-                    // ESP_LOGI(TAG, "Send %zu bytes, timestamp %lu, last_ts %lu, qsize %zu",
-                    //     packet.payload.size(), packet.timestamp, last_output_timestamp_value, timestamp_queue_.size());
-                });
+                packet.payload = AudioBuffer<uint8_t>(AudioBufferPool::GetOpusPool(), opus.data(), opus.size());
+                // For server side AEC, what was playing when the first sample of this frame was captured
+                packet.timestamp = aec_timeline_.GetTimestamp(frame_start_sample_, esp_timer_get_time());
+                // The rest of the chunk is contiguous, even when this frame began before a dropped one
+                encoder_pending_samples_ -= opus_encoder_->sample_rate() / 1000 * opus_encoder_->duration_ms();
+                frame_start_sample_ = encoded_samples_ - encoder_pending_samples_;
+                // Where the frame ends, so dropped chunks do not put it behind the other uplink ids
+                packet.trace_id = frame_start_sample_ / 16;
+                AUDIO_TRACE(kAudioTraceEncodeEnd, packet.trace_id);
+                // Straight to the protocol's sender task, the main loop is not in the way
+                protocol_->SendAudio(std::move(packet));
             });
+            encoder_controller_.OnEncode(esp_timer_get_time() - encode_start, encoded_frames_ - frames_before);
+            EncoderSettings settings;
+            if (encoder_controller_.Update(settings)) {
+                opus_encoder_->SetComplexity(settings.complexity);
+                opus_encoder_->SetDtx(settings.dtx);
+            }
         });
+        // Captured speech is lost from the uplink, say so once per stall
+        if (!scheduled) {
+            if (skipped == 0) {
+                ESP_LOGW(TAG, "Encode lane full, skipping captured audio");
+            }
+            encode_skipped_samples_ += skipped + samples;
+        } else if (skipped > 0) {
+            ESP_LOGW(TAG, "Encode lane skipped %lu ms of captured audio", skipped / 16);
+        }
     });
     audio_processor_->OnVadStateChange([this](bool speaking) {
         if (device_state_ == kDeviceStateListening) {
@@ -569,27 +665,44 @@ void Application::Start() {
     });
 
 #if CONFIG_USE_WAKE_WORD_DETECT
-    wake_word_detect_.Initialize(codec);
+    wake_word_detect_.Initialize(&audio_front_end_);
     wake_word_detect_.OnWakeWordDetected([this](const std::string& wake_word) {
         Schedule([this, &wake_word]() {
             if (device_state_ == kDeviceStateIdle) {
                 SetDeviceState(kDeviceStateConnecting);
                 wake_word_detect_.EncodeWakeWordData();
 
-                if (!protocol_ || !protocol_->OpenAudioChannel()) {
-                    wake_word_detect_.StartDetection();
-                    return;
-                }
-                
-                AudioStreamPacket packet;
-                // Encode and send the wake word data to the server
-                while (wake_word_detect_.GetWakeWordOpus(packet.payload)) {
-                    protocol_->SendAudio(packet);
-                }
-                // Set the chat state to wake word detected
-                protocol_->SendWakeWordDetected(wake_word);
-                ESP_LOGI(TAG, "Wake word detected: %s", wake_word.c_str());
-                SetListeningMode(realtime_chat_enabled_ ? kListeningModeRealtime : kListeningModeAutoStop);
+                // The handshake runs on the channel task while the pre-roll is encoded, and the pre-roll goes out as
+                // soon as the server hello is in, from the encode lane ahead of the frames encoded after it.
+                // The detection message and listening follow once it is queued.
+                channel_manager_.Open([this, &wake_word](bool opened) {
+                    if (!opened) {
+                        Schedule([this]() {
+                            wake_word_detect_.StartDetection();
+                            NotifyAudioInput();
+                        });
+                        return;
+                    }
+                    encode_task_->Fence([this, &wake_word]() {
+                        std::vector<uint8_t> opus;
+                        while (wake_word_detect_.GetWakeWordOpus(opus)) {
+                            AudioStreamPacket packet;
+                            packet.payload = AudioBuffer<uint8_t>(AudioBufferPool::GetOpusPool(), opus.data(), opus.size());
+                            // The whole pre-roll is wanted, it is longer than the queue
+                            protocol_->SendAudio(std::move(packet), true);
+                        }
+                        Schedule([this, &wake_word]() {
+                            if (device_state_ != kDeviceStateConnecting) {
+                                return;
+                            }
+                            Board::GetInstance().SetPowerSaveMode(false);
+                            // Set the chat state to wake word detected
+                            protocol_->SendWakeWordDetected(wake_word);
+                            ESP_LOGI(TAG, "Wake word detected: %s", wake_word.c_str());
+                            SetListeningMode(realtime_chat_enabled_ ? kListeningModeRealtime : kListeningModeAutoStop);
+                        });
+                    });
+                });
             } else if (device_state_ == kDeviceStateSpeaking) {
                 AbortSpeaking(kAbortReasonWakeWordDetected);
             } else if (device_state_ == kDeviceStateActivating) {
@@ -598,6 +711,7 @@ void Application::Start() {
         });
     });
     wake_word_detect_.StartDetection();
+    NotifyAudioInput();
 #endif
 
     // Wait for the new version check to finish
@@ -610,7 +724,7 @@ void Application::Start() {
         display->SetChatMessage("system", "");
         // Play the success sound to indicate the device is ready
         ResetDecoder();
-        PlaySound(Lang::Sounds::P3_SUCCESS);
+        PlaySound(Lang::Sounds::P3_SUCCESS, kSoundPriorityLow);
     }
     
     // Enter the main event loop
@@ -620,6 +734,15 @@ void Application::Start() {
 void Application::OnClockTimer() {
     clock_ticks_++;
 
+    if (PROTOCOL_PING_INTERVAL_SECONDS > 0 && ++ping_ticks_ >= PROTOCOL_PING_INTERVAL_SECONDS && protocol_) {
+        ping_ticks_ = 0;
+        Schedule([this]() {
+            if (protocol_->IsAudioChannelOpened()) {
+                protocol_->SendPing();
+            }
+        });
+    }
+
     // Print the debug info every 10 seconds
     if (clock_ticks_ % 10 == 0) {
         // SystemInfo::PrintRealTimeStats(pdMS_TO_TICKS(1000));
@@ -628,6 +751,66 @@ void Application::OnClockTimer() {
         int min_free_sram = heap_caps_get_minimum_free_size(MALLOC_CAP_INTERNAL);
         ESP_LOGI(TAG, "Free internal: %u minimal internal: %u", free_sram, min_free_sram);
 
+        auto stats = GetMainTaskStats();
+        ESP_LOGI(TAG, "Main tasks: depth %u high water %u/%u overflow %lu",
+            stats.depth, stats.high_water, stats.capacity, stats.overflow_count);
+        for (auto task : {encode_task_, decode_task_}) {
+            if (task == nullptr) {
+                continue;
+            }
+            auto lane = task->GetStats();
+            ESP_LOGI(TAG, "%s: depth %u high water %u done %lu dropped %lu latency avg %lu max %lu us run avg %lu us",
+                task == encode_task_ ? "Encode" : "Decode", lane.depth, lane.high_water, lane.completed,
+                lane.dropped, lane.avg_latency_us, lane.max_latency_us, lane.avg_run_us);
+        }
+        auto jitter = GetJitterBufferStats();
+        ESP_LOGI(TAG, "Jitter buffer: depth %u/%u jitter %lu ms received %lu late %lu lost %lu concealed %lu underruns %lu backpressure %lu",
+            jitter.depth, jitter.target_depth, jitter.jitter_ms, jitter.received, jitter.late, jitter.lost,
+            jitter.concealed, jitter.underruns, jitter.backpressure);
+        for (auto pool : {&AudioBufferPool::GetOpusPool(), &AudioBufferPool::GetPcmPool()}) {
+            auto buffers = pool->GetStats();
+            ESP_LOGI(TAG, "Buffer pool %s: in use %u high water %u/%u fallbacks %lu",
+                pool->name(), buffers.in_use, buffers.high_water, buffers.blocks, buffers.fallbacks);
+        }
+        if (protocol_) {
+            auto sender = GetAudioSenderStats();
+            ESP_LOGI(TAG, "Audio sender: depth %u high water %u/%u sent %lu dropped %lu latency avg %lu max %lu us send avg %lu us",
+                sender.depth, sender.high_water, sender.capacity, sender.sent, sender.dropped, sender.avg_latency_us,
+                sender.max_latency_us, sender.avg_send_us);
+            auto channel = GetChannelManagerStats();
+            ESP_LOGI(TAG, "Audio channel: opened %lu failed %lu reused %lu, open avg %lu ms last %lu ms, standby %lu/%lu s",
+                channel.opens, channel.failures, channel.reused, channel.avg_open_ms, channel.last_open_ms,
+                channel.standby_seconds, channel.standby_budget);
+            auto health = GetProtocolHealthStats();
+            ESP_LOGI(TAG, "Protocol health: session %lu sent %lu received %lu lost %lu/%lu reordered %lu jitter %lu ms "
+                "rtt %lu ms avg %lu ms", health.sessions, health.packets_sent, health.packets_received,
+                health.frames_lost, health.frames_expected, health.frames_reordered, health.jitter_ms,
+                health.rtt_ms, health.avg_rtt_ms);
+        }
+        auto encoder = encoder_controller_.GetStats();
+        ESP_LOGI(TAG, "Encoder: complexity %d DTX %d load %lu%% idle %d%% busy %lu dropped %lu lowered %lu raised %lu",
+            encoder.complexity, encoder.dtx, encoder.load_percent, encoder.idle_percent, encoder.busy, encoder.dropped,
+            encoder.lowered, encoder.raised);
+        auto capture = capture_ring_.GetStats();
+        ESP_LOGI(TAG, "Capture ring: %lu frames written, overruns %lu", capture.written, capture.overruns);
+        auto aec = aec_timeline_.GetStats();
+        ESP_LOGI(TAG, "AEC timeline: played %lu starts %lu, uplink paired %lu silent %lu missed %lu, skew %ld ppm, "
+            "capture lag %lu ms", aec.played, aec.starts, aec.paired, aec.silent, aec.missed, aec.skew_ppm,
+            aec.capture_lag_ms);
+#if CONFIG_USE_WAKE_WORD_PRE_VAD
+        auto gate = pre_vad_.GetStats();
+        ESP_LOGI(TAG, "Pre-VAD: %lu/%lu chunks to the AFE, opened %lu times, noise floor %lu",
+            gate.open_chunks, gate.chunks, gate.opens, gate.noise_floor);
+#endif
+        auto cache = pcm_cache_.GetStats();
+        ESP_LOGI(TAG, "PCM cache: %u sounds %u/%u bytes hits %lu misses %lu evictions %lu",
+            cache.entries, cache.bytes, cache.budget, cache.hits, cache.misses, cache.evictions);
+#if CONFIG_USE_ALLOC_COUNTER
+        uint32_t alloc_count = AllocCounter::GetCount();
+        ESP_LOGI(TAG, "Heap allocations: %lu/s", (alloc_count - last_alloc_count_) / 10);
+        last_alloc_count_ = alloc_count;
+#endif
+
         // If we have synchronized server time, set the status to clock "HH:MM" if the device is idle
         if (ota_.HasServerTime()) {
             if (device_state_ == kDeviceStateIdle) {
@@ -643,127 +826,474 @@ void Application::OnClockTimer() {
     }
 }
 
-// Add a async task to MainLoop
-void Application::Schedule(std::function<void()> callback) {
+// The ring is full, keep the task in the overflow list so it is never dropped.
+// Once set, overflow_pending_ routes new tasks here too to keep them in order.
+void Application::ScheduleOverflow(MainTask&& task) {
     {
         std::lock_guard<std::mutex> lock(mutex_);
-        main_tasks_.push_back(std::move(callback));
+        overflow_tasks_.push_back(std::move(task));
+        overflow_pending_.store(true, std::memory_order_release);
     }
     xEventGroupSetBits(event_group_, SCHEDULE_EVENT);
 }
 
+MainTaskStats Application::GetMainTaskStats() const {
+    return MainTaskStats{
+        .depth = main_tasks_.size(),
+        .high_water = main_tasks_.high_water(),
+        .capacity = main_tasks_.capacity(),
+        .overflow_count = main_tasks_.overflow_count(),
+    };
+}
+
+JitterBufferStats Application::GetJitterBufferStats() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return audio_jitter_buffer_.GetStats();
+}
+
+AecTimelineStats Application::GetAecTimelineStats() {
+    return aec_timeline_.GetStats();
+}
+
+AudioSenderStats Application::GetAudioSenderStats() {
+    return protocol_ ? protocol_->GetAudioSenderStats() : AudioSenderStats{};
+}
+
+ChannelManagerStats Application::GetChannelManagerStats() {
+    return channel_manager_.GetStats();
+}
+
+// The current session, or the last one once its channel closed
+ProtocolHealthStats Application::GetProtocolHealthStats() {
+    return protocol_ ? protocol_->GetHealthStats() : ProtocolHealthStats{};
+}
+
 // The Main Event Loop controls the chat state and websocket connection
 // If other tasks need to access the websocket or chat state,
 // they should use Schedule to call this function
 void Application::MainEventLoop() {
+    MainTask task;
     while (true) {
         auto bits = xEventGroupWaitBits(event_group_, SCHEDULE_EVENT, pdTRUE, pdFALSE, portMAX_DELAY);
 
         if (bits & SCHEDULE_EVENT) {
-            std::unique_lock<std::mutex> lock(mutex_);
-            std::list<std::function<void()>> tasks = std::move(main_tasks_);
-            lock.unlock();
-            for (auto& task : tasks) {
+            while (main_tasks_.TryPop(task)) {
                 task();
+                task.Reset();
+            }
+
+            if (overflow_pending_.load(std::memory_order_acquire)) {
+                std::unique_lock<std::mutex> lock(mutex_);
+                std::list<MainTask> tasks = std::move(overflow_tasks_);
+                overflow_tasks_.clear();
+                overflow_pending_.store(false, std::memory_order_release);
+                lock.unlock();
+                for (auto& overflow_task : tasks) {
+                    overflow_task();
+                }
             }
         }
     }
 }
 
-// The Audio Loop is used to input and output audio data
-void Application::AudioLoop() {
+// Reads the microphone in fixed chunks into the capture ring while the wake word detector or the audio processor
+// runs, otherwise sleeps until NotifyAudioInput(). Their feed sizes do not decide how I2S is read,
+// and a switch from one to the other neither drops nor repeats samples.
+void Application::AudioCaptureTask() {
     auto codec = Board::GetInstance().GetAudioCodec();
+    int channels = codec->input_channels();
+    int chunk_frames = 16000 * CAPTURE_CHUNK_MS / 1000;
     while (true) {
-        OnAudioInput();
-        if (codec->output_enabled()) {
-            OnAudioOutput();
+        if (!IsCaptureNeeded()) {
+            xEventGroupWaitBits(event_group_, AUDIO_CAPTURE_START_EVENT, pdTRUE, pdFALSE, portMAX_DELAY);
+            continue;
         }
+        ReadAudio(capture_buffer_, 16000, chunk_frames * channels);
+        // The read returns when the last frame is in
+        size_t frames = capture_buffer_.size() / channels;
+        int64_t capture_time_us = esp_timer_get_time() - int64_t(frames) * 1000000 / 16000;
+        capture_ring_.Write(capture_buffer_.data(), frames, capture_time_us);
+        xEventGroupSetBits(event_group_, AUDIO_INPUT_READY_EVENT);
     }
 }
 
-void Application::OnAudioOutput() {
-    if (busy_decoding_audio_) {
-        return;
+bool Application::IsCaptureNeeded() {
+#if CONFIG_USE_WAKE_WORD_DETECT
+    if (wake_word_detect_.IsDetectionRunning()) {
+        return true;
     }
+#endif
+    return audio_processor_->IsRunning();
+}
 
+// Feeds the audio front end shared by the wake word detector and the audio processor from the capture ring,
+// sleeps until the capture task has written more or NotifyAudioInput()
+void Application::AudioInputTask() {
+    while (true) {
+        if (!OnAudioInput()) {
+            xEventGroupWaitBits(event_group_, AUDIO_INPUT_READY_EVENT, pdTRUE, pdFALSE, portMAX_DELAY);
+        }
+    }
+}
+
+// Hands packets to the decode lane as soon as they arrive or a decode finishes.
+// Without events it only wakes up when the jitter buffer is due to start playout, or for the idle output power-down.
+void Application::AudioOutputTask() {
+    auto codec = Board::GetInstance().GetAudioCodec();
+    int wait_ms = 1000;
+    while (true) {
+        xEventGroupWaitBits(event_group_, AUDIO_OUTPUT_READY_EVENT, pdTRUE, pdFALSE, pdMS_TO_TICKS(wait_ms));
+        wait_ms = 1000;
+        if (codec->output_enabled()) {
+            wait_ms = OnAudioOutput();
+        }
+    }
+}
+
+void Application::NotifyAudioInput() {
+    xEventGroupSetBits(event_group_, AUDIO_INPUT_READY_EVENT | AUDIO_CAPTURE_START_EVENT);
+}
+
+void Application::NotifyAudioOutput() {
+    xEventGroupSetBits(event_group_, AUDIO_OUTPUT_READY_EVENT);
+}
+
+// Returns how long the output task may sleep if no event arrives
+int Application::OnAudioOutput() {
     auto now = std::chrono::steady_clock::now();
     auto codec = Board::GetInstance().GetAudioCodec();
     const int max_silence_seconds = 10;
 
     std::unique_lock<std::mutex> lock(mutex_);
-    if (audio_decode_queue_.empty()) {
+    // Sounds are played straight from the assets, the server stream waits in the jitter buffer meanwhile
+    while (decoding_packets_ < AUDIO_DECODE_PIPELINE_DEPTH) {
+        AudioStreamPacket packet;
+        auto result = sound_queue_.PopFrame(packet);
+        // The fences below wait when the decode lane is full, mutex_ is not held meanwhile
+        if (result != kSoundFrameNext && playing_sound_) {
+            // The previous sound is over or was cut
+            lock.unlock();
+            FinishSound();
+            lock.lock();
+        }
+        if (result == kSoundFrameNone) {
+            if (playing_sound_) {
+                playing_sound_ = false;
+                // Back to the format of the server stream after the last frame
+                if (stream_sample_rate_ != 0) {
+                    int sample_rate = stream_sample_rate_;
+                    int frame_duration = stream_frame_duration_;
+                    lock.unlock();
+                    SetDecodeSampleRate(sample_rate, frame_duration);
+                    lock.lock();
+                }
+            }
+            break;
+        }
+        if (result == kSoundFrameStart) {
+            playing_sound_ = true;
+            std::string_view sound = sound_queue_.current_sound();
+            lock.unlock();
+            StartSound(codec, sound);
+            lock.lock();
+        }
+        if (cached_sound_ != nullptr) {
+            // One frame worth of the cached PCM instead of decoding the frame
+            size_t count = std::min(cached_sound_->frame_samples, cached_sound_->size - cached_offset_);
+            auto samples = cached_sound_->samples + cached_offset_;
+            cached_offset_ += count;
+            lock.unlock();
+            OutputCachedPcm(codec, samples, count);
+        } else {
+            lock.unlock();
+            DecodePacket(codec, std::move(packet));
+        }
+        lock.lock();
+    }
+    if (playing_sound_) {
+        return 1000;
+    }
+
+    if (audio_jitter_buffer_.empty()) {
         // Disable the output if there is no audio data for a long time
-        if (device_state_ == kDeviceStateIdle) {
+        if (device_state_ == kDeviceStateIdle && decoding_packets_ == 0) {
             auto duration = std::chrono::duration_cast<std::chrono::seconds>(now - last_output_time_).count();
             if (duration > max_silence_seconds) {
                 codec->EnableOutput(false);
             }
         }
-        return;
+    } else if (device_state_ == kDeviceStateListening) {
+        audio_jitter_buffer_.Reset();
+        audio_decode_cv_.notify_all();
+        return 1000;
     }
 
-    if (device_state_ == kDeviceStateListening) {
-        audio_decode_queue_.clear();
+    while (decoding_packets_ < AUDIO_DECODE_PIPELINE_DEPTH) {
+        AudioStreamPacket packet;
+        auto result = audio_jitter_buffer_.Pop(packet);
+        if (result == kJitterBufferEmpty) {
+            break;
+        }
+        lock.unlock();
         audio_decode_cv_.notify_all();
+        DecodePacket(codec, std::move(packet));
+        lock.lock();
+    }
+
+    if (audio_jitter_buffer_.drained()) {
+        // tts stop has been received and every packet handed to the decoder,
+        // switch state once they are played, without blocking the main loop
+        audio_jitter_buffer_.Reset();
+        lock.unlock();
+        decode_task_->Fence([this]() {
+            Schedule([this]() {
+                if (device_state_ == kDeviceStateSpeaking) {
+                    if (listening_mode_ == kListeningModeManualStop) {
+                        SetDeviceState(kDeviceStateIdle);
+                    } else {
+                        SetDeviceState(kDeviceStateListening);
+                    }
+                }
+            });
+        });
+        lock.lock();
+    }
+
+    int wait_ms = audio_jitter_buffer_.GetPlayoutWaitMs();
+    return wait_ms > 0 ? wait_ms : 1000;
+}
+
+// Called by the output task when the first frame of a sound is popped, without mutex_
+void Application::StartSound(AudioCodec* codec, const std::string_view& sound) {
+    cached_sound_ = pcm_cache_.Acquire(sound.data());
+    cached_offset_ = 0;
+    if (cached_sound_ != nullptr) {
         return;
     }
 
-    auto packet = std::move(audio_decode_queue_.front());
-    audio_decode_queue_.pop_front();
-    lock.unlock();
-    audio_decode_cv_.notify_all();
+    // The assets are encoded at 16000Hz, 60ms frame duration, each one is a new Opus stream
+    SetDecodeSampleRate(16000, 60);
+    filling_cache_ = true;
+    decode_task_->Fence([this, codec, sound]() {
+        opus_decoder_->ResetState();
+        size_t frame_samples = opus_decoder_->sample_rate() * opus_decoder_->duration_ms() / 1000;
+        if (opus_decoder_->sample_rate() != codec->output_sample_rate()) {
+            frame_samples = output_resampler_.GetOutputSamples(frame_samples);
+        }
+        // Decoded frames are copied in as they play, see DecodePacket()
+        cache_fill_ = pcm_cache_.Reserve(sound.data(), SoundQueue::GetFrameCount(sound), frame_samples);
+    });
+}
+
+// Called by the output task when the sound that was playing is over or was cut, without mutex_
+void Application::FinishSound() {
+    if (cached_sound_ != nullptr) {
+        auto entry = cached_sound_;
+        cached_sound_ = nullptr;
+        // Unpinned after the last frame has been written
+        decode_task_->Fence([this, entry]() {
+            pcm_cache_.Release(entry);
+        });
+    }
+    if (filling_cache_) {
+        filling_cache_ = false;
+        // Kept if every frame made it in
+        decode_task_->Fence([this]() {
+            if (cache_fill_ != nullptr) {
+                pcm_cache_.Finish(cache_fill_);
+                cache_fill_ = nullptr;
+            }
+        });
+    }
+}
+
+void Application::PrewarmSound(const std::string_view& sound) {
+    decode_task_->Fence([this, sound]() {
+        DecodeSoundToCache(sound);
+    });
+}
 
-    busy_decoding_audio_ = true;
-    background_task_->Schedule([this, codec, packet = std::move(packet)]() mutable {
-        busy_decoding_audio_ = false;
+// Runs on the decode lane with a decoder of its own, the stream decoder and its state are not touched
+void Application::DecodeSoundToCache(const std::string_view& sound) {
+    auto codec = Board::GetInstance().GetAudioCodec();
+    OpusDecoderWrapper decoder(16000, 1, 60);
+    OpusResampler resampler;
+    size_t frame_samples = 16000 * 60 / 1000;
+    bool resample = codec->output_sample_rate() != 16000;
+    if (resample) {
+        resampler.Configure(16000, codec->output_sample_rate());
+        frame_samples = resampler.GetOutputSamples(frame_samples);
+    }
+    auto entry = pcm_cache_.Reserve(sound.data(), SoundQueue::GetFrameCount(sound), frame_samples);
+    if (entry == nullptr) {
+        return;
+    }
+
+    SoundQueue frames;
+    frames.Push(sound, kSoundPriorityNormal);
+    AudioStreamPacket packet;
+    std::vector<uint8_t> opus;
+    std::vector<int16_t> pcm;
+    std::vector<int16_t> resampled;
+    while (frames.PopFrame(packet) != kSoundFrameNone) {
+        opus.assign(packet.payload.begin(), packet.payload.end());
+        if (!decoder.Decode(std::move(opus), pcm)) {
+            break;
+        }
+        if (resample) {
+            resampled.resize(resampler.GetOutputSamples(pcm.size()));
+            resampler.Process(pcm.data(), pcm.size(), resampled.data());
+            std::swap(pcm, resampled);
+        }
+        if (!pcm_cache_.Append(entry, pcm.data(), pcm.size())) {
+            return;
+        }
+    }
+    pcm_cache_.Finish(entry);
+}
+
+void Application::OutputCachedPcm(AudioCodec* codec, const int16_t* samples, size_t count) {
+    decoding_packets_++;
+    bool scheduled = decode_task_->Schedule([this, codec, samples, count]() {
+        decoding_packets_--;
+        NotifyAudioOutput();
         if (aborted_) {
             return;
         }
+        decode_pcm_.assign(samples, samples + count);
+        WriteDecodedPcm(codec, 0);
+    });
+    if (!scheduled) {
+        decoding_packets_--;
+    }
+}
 
-        std::vector<int16_t> pcm;
-        if (!opus_decoder_->Decode(std::move(packet.payload), pcm)) {
+// Writes decode_pcm_ to the codec and records when the frame plays for server side AEC
+void Application::WriteDecodedPcm(AudioCodec* codec, uint32_t timestamp) {
+    int64_t write_start = esp_timer_get_time();
+    codec->OutputData(decode_pcm_);
+    aec_timeline_.OnPlayback(timestamp, decode_pcm_.size(), write_start, esp_timer_get_time());
+    AUDIO_TRACE(kAudioTraceOutputData, timestamp);
+    last_output_time_ = std::chrono::steady_clock::now();
+}
+
+void Application::DecodePacket(AudioCodec* codec, AudioStreamPacket&& packet) {
+    decoding_packets_++;
+    bool scheduled = decode_task_->Schedule([this, codec, packet = std::move(packet)]() mutable {
+        // Queue the next packet while this one is decoded and written to I2S
+        decoding_packets_--;
+        NotifyAudioOutput();
+        if (aborted_) {
             return;
         }
+
+        AUDIO_TRACE(kAudioTraceDecodeStart, packet.timestamp);
+        // The decoder does not keep the input, the scratch vectors are reused for every frame
+        decode_opus_.assign(packet.payload.begin(), packet.payload.end());
+        packet.payload.reset();
+        if (!opus_decoder_->Decode(std::move(decode_opus_), decode_pcm_)) {
+            return;
+        }
+        AUDIO_TRACE(kAudioTraceDecodeEnd, packet.timestamp);
         // Resample if the sample rate is different
         if (opus_decoder_->sample_rate() != codec->output_sample_rate()) {
-            int target_size = output_resampler_.GetOutputSamples(pcm.size());
-            std::vector<int16_t> resampled(target_size);
-            output_resampler_.Process(pcm.data(), pcm.size(), resampled.data());
-            pcm = std::move(resampled);
+            int target_size = output_resampler_.GetOutputSamples(decode_pcm_.size());
+            decode_resampled_.resize(target_size);
+            output_resampler_.Process(decode_pcm_.data(), decode_pcm_.size(), decode_resampled_.data());
+            std::swap(decode_pcm_, decode_resampled_);
         }
-        codec->OutputData(pcm);
-        {
-            std::lock_guard<std::mutex> lock(timestamp_mutex_);
-            timestamp_queue_.push_back(packet.timestamp);
-            last_output_timestamp_ = packet.timestamp;
+        // Only set while a sound that is not cached yet plays
+        if (cache_fill_ != nullptr && !pcm_cache_.Append(cache_fill_, decode_pcm_.data(), decode_pcm_.size())) {
+            cache_fill_ = nullptr;
         }
-        last_output_time_ = std::chrono::steady_clock::now();
+        WriteDecodedPcm(codec, packet.timestamp);
     });
+    if (!scheduled) {
+        decoding_packets_--;
+    }
 }
 
-void Application::OnAudioInput() {
-#if CONFIG_USE_WAKE_WORD_DETECT
-    if (wake_word_detect_.IsDetectionRunning()) {
-        std::vector<int16_t> data;
-        int samples = wake_word_detect_.GetFeedSize();
+// Returns false if nothing consumes microphone data
+bool Application::OnAudioInput() {
+#if CONFIG_USE_AUDIO_PROCESSOR || CONFIG_USE_WAKE_WORD_DETECT
+    // The wake word detector and the audio processor share one feed
+    if (audio_front_end_.IsRunning()) {
+        auto& data = input_buffer_;
+        int samples = audio_front_end_.GetFeedSize();
         if (samples > 0) {
-            ReadAudio(data, 16000, samples);
-            wake_word_detect_.Feed(data);
-            return;
+#if CONFIG_USE_WAKE_WORD_PRE_VAD
+            if (!audio_processor_->IsRunning()) {
+                return OnGatedAudioInput(samples);
+            }
+            // The gate takes over where the audio processor stops, open
+            gate_reader_ = input_reader_;
+            pre_vad_.Hold();
+#endif
+            int64_t capture_time_us;
+            if (!ReadCapture(data, samples, &capture_time_us)) {
+                return false;
+            }
+            aec_timeline_.OnFeed(input_samples_ / capture_ring_.channels(), capture_time_us);
+            input_samples_ += samples;
+            AUDIO_TRACE(kAudioTraceReadAudio, input_samples_ / capture_ring_.channels() / 16);
+            audio_front_end_.Feed(data);
+            return true;
         }
     }
 #endif
     if (audio_processor_->IsRunning()) {
-        std::vector<int16_t> data;
+        auto& data = input_buffer_;
         int samples = audio_processor_->GetFeedSize();
         if (samples > 0) {
-            ReadAudio(data, 16000, samples);
+            int64_t capture_time_us;
+            if (!ReadCapture(data, samples, &capture_time_us)) {
+                return false;
+            }
+            aec_timeline_.OnFeed(input_samples_ / capture_ring_.channels(), capture_time_us);
+            input_samples_ += samples;
+            AUDIO_TRACE(kAudioTraceReadAudio, input_samples_ / capture_ring_.channels() / 16);
             audio_processor_->Feed(data);
-            return;
+            return true;
         }
     }
+    return false;
+}
 
-    vTaskDelay(pdMS_TO_TICKS(30));
+#if CONFIG_USE_WAKE_WORD_PRE_VAD
+// Only the wake word listens. The gate reads each chunk before the feed does, and while the room is quiet
+// the feed is held the pre-roll behind it without reading, so the AFE and wakenet do not run on silence.
+// Returns false if there is nothing to do until more audio is captured.
+bool Application::OnGatedAudioInput(int samples) {
+    size_t frames = samples / capture_ring_.channels();
+    bool progressed = false;
+    gate_buffer_.resize(samples);
+    if (capture_ring_.Read(gate_reader_, gate_buffer_.data(), frames)) {
+        progressed = true;
+        if (!pre_vad_.Process(gate_buffer_.data())) {
+            if (gate_reader_.position - input_reader_.position > pre_vad_.preroll_frames()) {
+                input_reader_.position = gate_reader_.position - pre_vad_.preroll_frames();
+            }
+            return true;
+        }
+    }
+    // Open: the feed catches up with the gate through the pre-roll, never past it
+    if (pre_vad_.IsOpen() && gate_reader_.position - input_reader_.position >= frames) {
+        auto& data = input_buffer_;
+        if (ReadCapture(data, samples)) {
+            input_samples_ += samples;
+            AUDIO_TRACE(kAudioTraceReadAudio, input_samples_ / capture_ring_.channels() / 16);
+            audio_front_end_.Feed(data);
+            progressed = true;
+        }
+    }
+    return progressed;
+}
+#endif
+
+// samples counts every channel, false until the capture task has read that much
+bool Application::ReadCapture(std::vector<int16_t>& data, int samples, int64_t* capture_time_us) {
+    data.resize(samples);
+    return capture_ring_.Read(input_reader_, data.data(), samples / capture_ring_.channels(), capture_time_us);
 }
 
 void Application::ReadAudio(std::vector<int16_t>& data, int sample_rate, int samples) {
@@ -773,15 +1303,28 @@ void Application::ReadAudio(std::vector<int16_t>& data, int sample_rate, int sam
         if (!codec->InputData(data)) {
             return;
         }
+        if (input_stage_.configured()) {
+            // Deinterleaved, filtered and written back interleaved in place
+            int channels = codec->input_channels();
+            size_t frames = input_stage_.Process(data.data(), data.size() / channels, data.data());
+            data.resize(frames * channels);
+            return;
+        }
+        // Fallback for ratios the input stage does not handle.
+        // The scratch vectors keep their capacity, so reading does not allocate after the first call
+        auto& mic_channel = input_channels_[0];
+        auto& reference_channel = input_channels_[1];
+        auto& resampled_mic = input_resampled_[0];
+        auto& resampled_reference = input_resampled_[1];
         if (codec->input_channels() == 2) {
-            auto mic_channel = std::vector<int16_t>(data.size() / 2);
-            auto reference_channel = std::vector<int16_t>(data.size() / 2);
+            mic_channel.resize(data.size() / 2);
+            reference_channel.resize(data.size() / 2);
             for (size_t i = 0, j = 0; i < mic_channel.size(); ++i, j += 2) {
                 mic_channel[i] = data[j];
                 reference_channel[i] = data[j + 1];
             }
-            auto resampled_mic = std::vector<int16_t>(input_resampler_.GetOutputSamples(mic_channel.size()));
-            auto resampled_reference = std::vector<int16_t>(reference_resampler_.GetOutputSamples(reference_channel.size()));
+            resampled_mic.resize(input_resampler_.GetOutputSamples(mic_channel.size()));
+            resampled_reference.resize(reference_resampler_.GetOutputSamples(reference_channel.size()));
             input_resampler_.Process(mic_channel.data(), mic_channel.size(), resampled_mic.data());
             reference_resampler_.Process(reference_channel.data(), reference_channel.size(), resampled_reference.data());
             data.resize(resampled_mic.size() + resampled_reference.size());
@@ -790,9 +1333,9 @@ void Application::ReadAudio(std::vector<int16_t>& data, int sample_rate, int sam
                 data[j + 1] = resampled_reference[i];
             }
         } else {
-            auto resampled = std::vector<int16_t>(input_resampler_.GetOutputSamples(data.size()));
-            input_resampler_.Process(data.data(), data.size(), resampled.data());
-            data = std::move(resampled);
+            resampled_mic.resize(input_resampler_.GetOutputSamples(data.size()));
+            input_resampler_.Process(data.data(), data.size(), resampled_mic.data());
+            std::swap(data, resampled_mic);
         }
     } else {
         data.resize(samples);
@@ -814,6 +1357,16 @@ void Application::SetListeningMode(ListeningMode mode) {
 }
 
 // 设置设备状态并更新用户界面
+// The last frames of a turn may wait in the protocol for a packed packet to fill up.
+// They go out after the frames still in the encode lane, which queues its frames for the sender first.
+void Application::FlushAudioUplink() {
+    encode_task_->Fence([this]() {
+        if (protocol_) {
+            protocol_->FlushAudio();
+        }
+    });
+}
+
 void Application::SetDeviceState(DeviceState state) {
     if (device_state_ == state) {
         return;
@@ -823,8 +1376,7 @@ void Application::SetDeviceState(DeviceState state) {
     auto previous_state = device_state_;
     device_state_ = state;
     ESP_LOGI(TAG, "STATE: %s", STATE_STRINGS[device_state_]);
-    // The state is changed, wait for all background tasks to finish
-    background_task_->WaitForCompletion();
+    // Codec state is only touched from its own lane, so the main loop never waits for queued encodes or decodes
 
     auto& board = Board::GetInstance();
     auto display = board.GetDisplay();
@@ -835,18 +1387,17 @@ void Application::SetDeviceState(DeviceState state) {
         case kDeviceStateIdle:
             display->SetStatus(Lang::Strings::STANDBY);
             display->SetEmotion("neutral");
-            audio_processor_->Stop();
-            
+            // Detection starts before the audio processor stops, so the shared front end keeps its buffers
 #if CONFIG_USE_WAKE_WORD_DETECT
             wake_word_detect_.StartDetection();
 #endif
+            audio_processor_->Stop();
+            FlushAudioUplink();
             break;
         case kDeviceStateConnecting:
             display->SetStatus(Lang::Strings::CONNECTING);
             display->SetEmotion("neutral");
             display->SetChatMessage("system", "");
-            timestamp_queue_.clear();
-            last_output_timestamp_ = 0;
             break;
         case kDeviceStateListening:
             display->SetStatus(Lang::Strings::LISTENING);
@@ -862,21 +1413,30 @@ void Application::SetDeviceState(DeviceState state) {
                     // FIXME: Wait for the speaker to empty the buffer
                     vTaskDelay(pdMS_TO_TICKS(120));
                 }
-                opus_encoder_->ResetState();
+                encode_task_->Fence([this]() {
+                    opus_encoder_->ResetState();
+                    encoded_samples_ = 0;
+                    encoded_frames_ = 0;
+                    frame_start_sample_ = 0;
+                    encoder_pending_samples_ = 0;
+                });
+                input_samples_ = 0;
+                encode_skipped_samples_ = 0;
+                audio_processor_->Start();
 #if CONFIG_USE_WAKE_WORD_DETECT
                 wake_word_detect_.StopDetection();
 #endif
-                audio_processor_->Start();
             }
             break;
         case kDeviceStateSpeaking:
             display->SetStatus(Lang::Strings::SPEAKING);
 
             if (listening_mode_ != kListeningModeRealtime) {
-                audio_processor_->Stop();
 #if CONFIG_USE_WAKE_WORD_DETECT
                 wake_word_detect_.StartDetection();
 #endif
+                audio_processor_->Stop();
+                FlushAudioUplink();
             }
             ResetDecoder();
             break;
@@ -884,316 +1444,92 @@ void Application::SetDeviceState(DeviceState state) {
             // Do nothing
             break;
     }
+    // The wake word detector or the audio processor may have been started
+    NotifyAudioInput();
 }
 
 void Application::ResetDecoder() {
-    std::lock_guard<std::mutex> lock(mutex_);
-    opus_decoder_->ResetState();
-    audio_decode_queue_.clear();
-    audio_decode_cv_.notify_all();
-    last_output_time_ = std::chrono::steady_clock::now();
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        audio_jitter_buffer_.Reset();
+        sound_queue_.Clear();
+        audio_decode_cv_.notify_all();
+        last_output_time_ = std::chrono::steady_clock::now();
+    }
+    // Waits when the decode lane is full, so not under mutex_
+    decode_task_->Fence([this]() {
+        opus_decoder_->ResetState();
+    });
     auto codec = Board::GetInstance().GetAudioCodec();
     codec->EnableOutput(true);
+    NotifyAudioOutput();
 }
 
+// The decoder is replaced on the decode lane, after the frames already queued with the old parameters
 void Application::SetDecodeSampleRate(int sample_rate, int frame_duration) {
-    if (opus_decoder_->sample_rate() == sample_rate && opus_decoder_->duration_ms() == frame_duration) {
-        return;
-    }
-
-    opus_decoder_.reset();
-    opus_decoder_ = std::make_unique<OpusDecoderWrapper>(sample_rate, 1, frame_duration);
-
-    auto codec = Board::GetInstance().GetAudioCodec();
-    if (codec->input_sample_rate() != sample_rate) {
-        data.resize(samples * codec->input_sample_rate() / sample_rate);
-        if (!codec->InputData(data)) {
-            return;
-        }
-        if (codec->input_channels() == 2) {
-            auto mic_channel = std::vector<int16_t>(data.size() / 2);
-            auto reference_channel = std::vector<int16_t>(data.size() / 2);
-            for (size_t i = 0, j = 0; i < mic_channel.size(); ++i, j += 2) {
-                mic_channel[i] = data[j];
-                reference_channel[i] = data[j + 1];
-            }
-            auto resampled_mic = std::vector<int16_t>(input_resampler_.GetOutputSamples(mic_channel.size()));
-            auto resampled_reference = std::vector<int16_t>(reference_resampler_.GetOutputSamples(reference_channel.size()));
-            input_resampler_.Process(mic_channel.data(), mic_channel.size(), resampled_mic.data());
-            reference_resampler_.Process(reference_channel.data(), reference_channel.size(), resampled_reference.data());
-            data.resize(resampled_mic.size() + resampled_reference.size());
-            for (size_t i = 0, j = 0; i < resampled_mic.size(); ++i, j += 2) {
-                data[j] = resampled_mic[i];
-                data[j + 1] = resampled_reference[i];
-            }
-        } else {
-            auto resampled = std::vector<int16_t>(input_resampler_.GetOutputSamples(data.size()));
-            input_resampler_.Process(data.data(), data.size(), resampled.data());
-            data = std::move(resampled);
-        }
-    } else {
-        data.resize(samples);
-        if (!codec->InputData(data)) {
+    decode_task_->Fence([this, sample_rate, frame_duration]() {
+        if (opus_decoder_->sample_rate() == sample_rate && opus_decoder_->duration_ms() == frame_duration) {
             return;
         }
-    }
-}
 
-void Application::AbortSpeaking(AbortReason reason) {
-    ESP_LOGI(TAG, "Abort speaking");
-    aborted_ = true;
-    protocol_->SendAbortSpeaking(reason);
-}
-
-void Application::SetListeningMode(ListeningMode mode) {
-    listening_mode_ = mode;
-    SetDeviceState(kDeviceStateListening);
-}
-
-// 设置设备状态并更新用户界面
-void Application::SetDeviceState(DeviceState state) {
-    device_state_ = state;
-    // 移除显示状态更新
-}
+        opus_decoder_.reset();
+        opus_decoder_ = std::make_unique<OpusDecoderWrapper>(sample_rate, 1, frame_duration);
 
-void Application::CheckNewVersion() {
-    // 移除版本检查中的显示操作
-}
-
-void Application::OnClockTimer() {
-    // 移除时间显示更新
-}
-
-void Application::Alert() {
-    // 移除警报显示逻辑
-}
-
-// 移除所有display->方法调用
-
-void Application::Alert(const char* status, const char* message, const char* emotion, const std::string_view& sound) {
-    ESP_LOGW(TAG, "Alert %s: %s [%s]", status, message, emotion);
-    auto display = Board::GetInstance().GetDisplay();
-    display->SetStatus(status);
-    display->SetEmotion(emotion);
-    display->SetChatMessage("system", message);
-    if (!sound.empty()) {
-        ResetDecoder();
-        PlaySound(sound);
-    }
+        auto codec = Board::GetInstance().GetAudioCodec();
+        if (opus_decoder_->sample_rate() != codec->output_sample_rate()) {
+            ESP_LOGI(TAG, "Resampling audio from %d to %d", opus_decoder_->sample_rate(), codec->output_sample_rate());
+            output_resampler_.Configure(opus_decoder_->sample_rate(), codec->output_sample_rate());
+        }
+    });
 }
 
-void Application::DismissAlert() {
-    if (device_state_ == kDeviceStateIdle) {
-        auto display = Board::GetInstance().GetDisplay();
-        display->SetStatus(Lang::Strings::STANDBY);
-        display->SetEmotion("neutral");
-        display->SetChatMessage("system", "");
+void Application::UpdateIotStates() {
+    auto& thing_manager = iot::ThingManager::GetInstance();
+    std::string states;
+    if (thing_manager.GetStatesJson(states, true)) {
+        protocol_->SendIotStates(states);
     }
 }
 
-void Application::PlaySound(const std::string_view& sound) {
-    // Wait for the previous sound to finish
-    {
-        std::unique_lock<std::mutex> lock(mutex_);
-        audio_decode_cv_.wait(lock, [this]() {
-            return audio_decode_queue_.empty();
-        });
-    }
-    background_task_->WaitForCompletion();
-
-    // The assets are encoded at 16000Hz, 60ms frame duration
-    SetDecodeSampleRate(16000, 60);
-    const char* data = sound.data();
-    size_t size = sound.size();
-    for (const char* p = data; p < data + size; ) {
-        auto p3 = (BinaryProtocol3*)p;
-        p += sizeof(BinaryProtocol3);
-
-        auto payload_size = ntohs(p3->payload_size);
-        std::vector<uint8_t> opus;
-        opus.resize(payload_size);
-        memcpy(opus.data(), p3->payload, payload_size);
-        p += payload_size;
-
-        std::lock_guard<std::mutex> lock(mutex_);
-        audio_decode_queue_.emplace_back(std::move(opus));
-    }
+void Application::Reboot() {
+    ESP_LOGI(TAG, "Rebooting...");
+    esp_restart();
 }
 
-void Application::ToggleChatState() {
-    if (device_state_ == kDeviceStateActivating) {
-        SetDeviceState(kDeviceStateIdle);
-        return;
-    }
-
+void Application::WakeWordInvoke(const std::string& wake_word) {
     if (!protocol_) {
         ESP_LOGE(TAG, "Protocol not initialized");
         return;
     }
 
     if (device_state_ == kDeviceStateIdle) {
-        Schedule([this]() {
+        Schedule([this, wake_word]() {
             SetDeviceState(kDeviceStateConnecting);
-            if (!protocol_->OpenAudioChannel()) {
-                return;
-            }
-
-            SetListeningMode(realtime_chat_enabled_ ? kListeningModeRealtime : kListeningModeAutoStop);
+            OpenAudioChannel([this, wake_word]() {
+                protocol_->SendWakeWordDetected(wake_word);
+                SetListeningMode(realtime_chat_enabled_ ? kListeningModeRealtime : kListeningModeAutoStop);
+            });
         });
     } else if (device_state_ == kDeviceStateSpeaking) {
         Schedule([this]() {
             AbortSpeaking(kAbortReasonNone);
         });
-    } else if (device_state_ == kDeviceStateListening) {
+    } else if (device_state_ == kDeviceStateListening) {   
         Schedule([this]() {
-            protocol_->CloseAudioChannel();
+            ReleaseAudioChannel();
         });
     }
 }
 
-void Application::StartListening() {
-    if (device_state_ == kDeviceStateActivating) {
-        SetDeviceState(kDeviceStateIdle);
-        return;
+bool Application::CanEnterSleepMode() {
+    if (device_state_ != kDeviceStateIdle) {
+        return false;
     }
 
-    if (!protocol_) {
-        ESP_LOGE(TAG, "Protocol not initialized");
-        return;
+    if (protocol_ && protocol_->IsAudioChannelOpened()) {
+        return false;
     }
-    
-    if (device_state_ == kDeviceStateIdle) {
-        Schedule([this]() {
-            if (!protocol_->IsAudioChannelOpened()) {
-                SetDeviceState(kDeviceStateConnecting);
-                if (!protocol_->OpenAudioChannel()) {
-                    return;
-                }
-            }
 
-            SetListeningMode(kListeningModeManualStop);
-        });
-    } else if (device_state_ == kDeviceStateSpeaking) {
-        Schedule([this]() {
-            AbortSpeaking(kAbortReasonNone);
-            SetListeningMode(kListeningModeManualStop);
-        });
-    }
+    // Now it is safe to enter sleep mode
+    return true;
 }
-
-void Application::StopListening() {
-    const std::array<int, 3> valid_states = {
-        kDeviceStateListening,
-        kDeviceStateSpeaking,
-        kDeviceStateIdle,
-    };
-    // If not valid, do nothing
-    if (std::find(valid_states.begin(), valid_states.end(), device_state_) == valid_states.end()) {
-        return;
-    }
-
-    Schedule([this]() {
-        if (device_state_ == kDeviceStateListening) {
-            protocol_->SendStopListening();
-            SetDeviceState(kDeviceStateIdle);
-        }
-    });
-}
-
-void Application::Start() {
-    auto& board = Board::GetInstance();
-    SetDeviceState(kDeviceStateStarting);
-
-    /* Setup the display */
-    auto display = board.GetDisplay();
-
-    /* Setup the audio codec */
-    auto codec = board.GetAudioCodec();
-    opus_decoder_ = std::make_unique<OpusDecoderWrapper>(codec->output_sample_rate(), 1, OPUS_FRAME_DURATION_MS);
-    opus_encoder_ = std::make_unique<OpusEncoderWrapper>(16000, 1, OPUS_FRAME_DURATION_MS);
-    if (realtime_chat_enabled_) {
-        ESP_LOGI(TAG, "Realtime chat enabled, setting opus encoder complexity to 0");
-        opus_encoder_->SetComplexity(0);
-    } else if (board.GetBoardType() == "ml307") {
-        ESP_LOGI(TAG, "ML307 board detected, setting opus encoder complexity to 5");
-        opus_encoder_->SetComplexity(5);
-    } else {
-        ESP_LOGI(TAG, "WiFi board detected, setting opus encoder complexity to 3");
-        opus_encoder_->SetComplexity(3);
-    }
-
-    if (codec->input_sample_rate() != 16000) {
-        input_resampler_.Configure(codec->input_sample_rate(), 16000);
-        reference_resampler_.Configure(codec->input_sample_rate(), 16000);
-    }
-    codec->Start();
-
-    xTaskCreatePinnedToCore([](void* arg) {
-        Application* app = (Application*)arg;
-        app->AudioLoop();
-        vTaskDelete(NULL);
-    }, "audio_loop", 4096 * 2, this, 8, &audio_loop_task_handle_, realtime_chat_enabled_ ? 1 : 0);
-
-    /* Wait for the network to be ready */
-    board.StartNetwork();
-
-    // Check for new firmware version or get the MQTT broker address
-    CheckNewVersion();
-
-    // Initialize the protocol
-    display->SetStatus(Lang::Strings::LOADING_PROTOCOL);
-#ifdef CONFIG_CONNECTION_TYPE_WEBSOCKET
-    protocol_ = std::make_unique<WebsocketProtocol>();
-#else
-    protocol_ = std::make_unique<MqttProtocol>();
-#endif
-    protocol_->OnNetworkError([this](const std::string& message) {
-        SetDeviceState(kDeviceStateIdle);
-        Alert(Lang::Strings::ERROR, message.c_str(), "sad", Lang::Sounds::P3_EXCLAMATION);
-    });
-    protocol_->OnIncomingAudio([this](std::vector<uint8_t>&& data) {
-        const int max_packets_in_queue = 300 / OPUS_FRAME_DURATION_MS;
-        std::lock_guard<std::mutex> lock(mutex_);
-        if (audio_decode_queue_.size() < max_packets_in_queue) {
-            audio_decode_queue_.emplace_back(std::move(data));
-        }
-    });
-    protocol_->OnAudioChannelOpened([this, codec, &board]() {
-        board.SetPowerSaveMode(false);
-        if (protocol_->server_sample_rate() != codec->output_sample_rate()) {
-            ESP_LOGW(TAG, "Server sample rate %d does not match device output sample rate %d, resampling may cause distortion",
-                protocol_->server_sample_rate(), codec->output_sample_rate());
-        }
-        SetDecodeSampleRate(protocol_->server_sample_rate(), protocol_->server_frame_duration());
-        auto& thing_manager = iot::ThingManager::GetInstance();
-        protocol_->SendIotDescriptors(thing_manager.GetDescriptorsJson());
-        std::string states;
-        if (thing_manager.GetStatesJson(states, false)) {
-            protocol_->SendIotStates(states);
-        }
-    });
-    protocol_->OnAudioChannelClosed([this, &board]() {
-        board.SetPowerSaveMode(true);
-        Schedule([this]() {
-            auto display = Board::GetInstance().GetDisplay();
-            display->SetChatMessage("system", "");
-            SetDeviceState(kDeviceStateIdle);
-        });
-    });
-    protocol_->OnIncomingJson([this, display](const cJSON* root) {
-        // Parse JSON data
-        auto type = cJSON_GetObjectItem(root, "type");
-        if (strcmp(type->valuestring, "tts") == 0) {
-            auto state = cJSON_GetObjectItem(root, "state");
-            if (strcmp(state->valuestring, "start") == 0) {
-                Schedule([this]() {
-                    aborted_ = false;
-                    if (device_state_ == kDeviceStateIdle || device_state_ == kDeviceStateListening) {
-                        SetDeviceState(kDeviceStateSpeaking);
-                    }
-                });
-            } else if (strcmp(state->valuestring, "stop") == 0) {
-                Schedule([this]() {
-                    background_task_->WaitForCompletion();
-                    if (device_state_ == kDeviceStateSpeaking) {
-                        if (list
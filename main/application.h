@@ -9,6 +9,7 @@
 #include <string>
 #include <mutex>
 #include <list>
+#include <deque>
 #include <vector>
 #include <condition_variable>
 #include <memory>
@@ -18,20 +19,36 @@
 #include <opus_resampler.h>
 
 #include "protocol.h"
+#include "channel_manager.h"
 #include "ota.h"
 #include "background_task.h"
+#include "jitter_buffer.h"
+#include "sound_queue.h"
+#include "pcm_cache.h"
+#include "input_stage.h"
+#include "capture_ring.h"
+#include "aec_timeline.h"
+#include "encoder_controller.h"
 #include "audio_processor.h"
+#include "task_queue.h"
 
 #include "ble_config/ble_config.h"  // [新增] 添加BLE配置头文件
 
+#if CONFIG_USE_AUDIO_PROCESSOR || CONFIG_USE_WAKE_WORD_DETECT
+#include "audio_front_end.h"
+#endif
 #if CONFIG_USE_WAKE_WORD_DETECT
 #include "wake_word_detect.h"
 #endif
+#if CONFIG_USE_WAKE_WORD_PRE_VAD
+#include "pre_vad.h"
+#endif
 
 #define SCHEDULE_EVENT (1 << 0)
 #define AUDIO_INPUT_READY_EVENT (1 << 1)
 #define AUDIO_OUTPUT_READY_EVENT (1 << 2)
 #define CHECK_NEW_VERSION_DONE_EVENT (1 << 3)
+#define AUDIO_CAPTURE_START_EVENT (1 << 4)
 
 enum DeviceState {
     kDeviceStateUnknown,            // [新增] 设备状态：未知
@@ -47,6 +64,22 @@ enum DeviceState {
 };
 
 #define OPUS_FRAME_DURATION_MS 60
+#define MAIN_TASK_QUEUE_SIZE 32
+// Packets waiting on the decode lane behind the one being decoded and written to I2S
+#define AUDIO_DECODE_PIPELINE_DEPTH 1
+// Incoming audio beyond this holds back the network task
+#define AUDIO_JITTER_BUFFER_MAX_MS 1200
+#define AUDIO_BACKPRESSURE_TIMEOUT_MS 1000
+
+// Large enough for the biggest capture we schedule: an AudioStreamPacket or a std::string plus a few pointers
+using MainTask = InlineTask<sizeof(AudioStreamPacket) + sizeof(std::string)>;
+
+struct MainTaskStats {
+    size_t depth;
+    size_t high_water;
+    size_t capacity;
+    uint32_t overflow_count;
+};
 
 class Application {
 public:
@@ -62,7 +95,23 @@ public:
     void Start();
     DeviceState GetDeviceState() const { return device_state_; }
     bool IsVoiceDetected() const { return voice_detected_; }
-    void Schedule(std::function<void()> callback);
+    MainTaskStats GetMainTaskStats() const;
+    JitterBufferStats GetJitterBufferStats();
+    AecTimelineStats GetAecTimelineStats();
+    AudioSenderStats GetAudioSenderStats();
+    ChannelManagerStats GetChannelManagerStats();
+    ProtocolHealthStats GetProtocolHealthStats();
+
+    // Add a async task to MainLoop, the callback is stored inline without heap allocation
+    template <typename F>
+    void Schedule(F&& callback) {
+        MainTask task(std::forward<F>(callback));
+        if (overflow_pending_.load(std::memory_order_acquire) || !main_tasks_.TryPush(task)) {
+            ScheduleOverflow(std::move(task));
+            return;
+        }
+        xEventGroupSetBits(event_group_, SCHEDULE_EVENT);
+    }
     // 添加设置设备状态的函数
     void SetDeviceState(DeviceState state);  
     void Alert(const char* status, const char* message, const char* emotion = "", const std::string_view& sound = "");
@@ -74,21 +123,31 @@ public:
     void UpdateIotStates();
     void Reboot();
     void WakeWordInvoke(const std::string& wake_word);
-    void PlaySound(const std::string_view& sound);
+    void PlaySound(const std::string_view& sound, SoundPriority priority = kSoundPriorityNormal);
+    // Decodes a sound into the PCM cache in the background, so that playing it costs no decoding
+    void PrewarmSound(const std::string_view& sound);
     bool CanEnterSleepMode();
 
 private:
     Application();
     ~Application();
 
+#if CONFIG_USE_AUDIO_PROCESSOR || CONFIG_USE_WAKE_WORD_DETECT
+    // One AFE pipeline for the wake word detector and the audio processor
+    AudioFrontEnd audio_front_end_;
+#endif
 #if CONFIG_USE_WAKE_WORD_DETECT
     WakeWordDetect wake_word_detect_;
 #endif
     std::unique_ptr<AudioProcessor> audio_processor_;
     Ota ota_;
     std::mutex mutex_;
-    std::list<std::function<void()>> main_tasks_;
+    TaskQueue<MainTask, MAIN_TASK_QUEUE_SIZE> main_tasks_;
+    // Only used when main_tasks_ is full, so that no task is ever dropped
+    std::list<MainTask> overflow_tasks_;
+    std::atomic<bool> overflow_pending_ = false;
     std::unique_ptr<Protocol> protocol_;
+    ChannelManager channel_manager_;
     EventGroupHandle_t event_group_ = nullptr;
     esp_timer_handle_t clock_timer_handle_ = nullptr;
     volatile DeviceState device_state_ = kDeviceStateUnknown;
@@ -100,40 +159,104 @@ private:
 #endif
     bool aborted_ = false;
     bool voice_detected_ = false;
-    bool busy_decoding_audio_ = false;
+    // Packets handed to the decode lane that it has not started yet
+    std::atomic<int> decoding_packets_ = 0;
     int clock_ticks_ = 0;
+    int ping_ticks_ = 0;    // Unlike clock_ticks_, not restarted by state changes
+    uint32_t last_alloc_count_ = 0;
     TaskHandle_t check_new_version_task_handle_ = nullptr;
 
     // Audio encode / decode
-    TaskHandle_t audio_loop_task_handle_ = nullptr;
-    BackgroundTask* background_task_ = nullptr;
+    TaskHandle_t audio_capture_task_handle_ = nullptr;
+    TaskHandle_t audio_input_task_handle_ = nullptr;
+    TaskHandle_t audio_output_task_handle_ = nullptr;
+    BackgroundTask* encode_task_ = nullptr;
+    BackgroundTask* decode_task_ = nullptr;
     std::chrono::steady_clock::time_point last_output_time_;
-    std::list<AudioStreamPacket> audio_decode_queue_;
+    JitterBuffer audio_jitter_buffer_;
+    SoundQueue sound_queue_;
+    bool playing_sound_ = false;
+    // Decoder format of the server stream, restored after a sound
+    int stream_sample_rate_ = 0;
+    int stream_frame_duration_ = 0;
+    PcmCache pcm_cache_;
+    PcmCache::Entry* cached_sound_ = nullptr;   // output task, the playing sound if it was cached
+    size_t cached_offset_ = 0;                  // output task
+    bool filling_cache_ = false;                // output task, the playing sound is being decoded into the cache
+    PcmCache::Entry* cache_fill_ = nullptr;     // decode lane
     std::condition_variable audio_decode_cv_;
 
-    // 新增：用于维护音频包的timestamp队列
-    std::list<uint32_t> timestamp_queue_;
-    std::mutex timestamp_mutex_;
-    std::atomic<uint32_t> last_output_timestamp_ = 0;
+    // Playback frames and capture times, pairs each uplink frame with the downlink timestamp for server side AEC
+    AecTimeline aec_timeline_;
+
+    // Uplink trace ids (ms of 16kHz capture since listening started), see audio_trace.h
+    std::atomic<uint32_t> input_samples_ = 0;   // Interleaved, all capture channels
+    uint32_t encoded_samples_ = 0;  // encode lane only
+    uint32_t encoded_frames_ = 0;   // encode lane only
+    // Where the encoder's next frame starts in encoded_samples_, and what it holds towards that frame.
+    // Chunks the encoder controller drops leave a gap, so this does not follow from encoded_frames_.
+    uint32_t frame_start_sample_ = 0;       // encode lane only
+    uint32_t encoder_pending_samples_ = 0;  // encode lane only
+    // Processor output the encode lane had no room for, carried by the next chunk that gets in so encoded_samples_
+    // stays in step with the capture
+    std::atomic<uint32_t> encode_skipped_samples_ = 0;
+
+    // Scratch buffers that keep their capacity between frames, each owned by one task
+    CaptureRing capture_ring_;
+    CaptureRing::Reader input_reader_;              // audio input task
+#if CONFIG_USE_WAKE_WORD_PRE_VAD
+    PreVad pre_vad_;                                // audio input task
+    CaptureRing::Reader gate_reader_;               // audio input task, up to the pre-roll ahead of input_reader_
+    std::vector<int16_t> gate_buffer_;              // audio input task
+#endif
+    std::vector<int16_t> capture_buffer_;           // audio capture task
+    std::vector<int16_t> input_buffer_;             // audio input task
+    std::vector<int16_t> input_channels_[2];        // audio input task
+    std::vector<int16_t> input_resampled_[2];       // audio input task
+    std::vector<int16_t> encode_pcm_;               // encode lane
+    std::vector<uint8_t> decode_opus_;              // decode lane
+    std::vector<int16_t> decode_pcm_;               // decode lane
+    std::vector<int16_t> decode_resampled_;         // decode lane
 
     std::unique_ptr<OpusEncoderWrapper> opus_encoder_;
+    EncoderController encoder_controller_;          // encode task
     std::unique_ptr<OpusDecoderWrapper> opus_decoder_;
 
+    InputStage input_stage_;                        // audio input task
     OpusResampler input_resampler_;
     OpusResampler reference_resampler_;
     OpusResampler output_resampler_;
 
     void MainEventLoop();
-    void OnAudioInput();
-    void OnAudioOutput();
+    void ScheduleOverflow(MainTask&& task);
+    bool OnAudioInput();
+    int OnAudioOutput();
+    void DecodePacket(AudioCodec* codec, AudioStreamPacket&& packet);
+    void OutputCachedPcm(AudioCodec* codec, const int16_t* samples, size_t count);
+    void WriteDecodedPcm(AudioCodec* codec, uint32_t timestamp);
+    void StartSound(AudioCodec* codec, const std::string_view& sound);
+    void FinishSound();
+    void DecodeSoundToCache(const std::string_view& sound);
+    void NotifyAudioInput();
+    void NotifyAudioOutput();
     void ReadAudio(std::vector<int16_t>& data, int sample_rate, int samples);
+    void FlushAudioUplink();
+    bool IsCaptureNeeded();
+    bool ReadCapture(std::vector<int16_t>& data, int samples, int64_t* capture_time_us = nullptr);
+#if CONFIG_USE_WAKE_WORD_PRE_VAD
+    bool OnGatedAudioInput(int samples);
+#endif
     void ResetDecoder();
     void SetDecodeSampleRate(int sample_rate, int frame_duration);
     void CheckNewVersion();
     void ShowActivationCode();
     void OnClockTimer();
     void SetListeningMode(ListeningMode mode);
-    void AudioLoop();
+    void OpenAudioChannel(std::function<void()> on_opened);
+    void ReleaseAudioChannel();
+    void AudioCaptureTask();
+    void AudioInputTask();
+    void AudioOutputTask();
 };
 
 #endif // _APPLICATION_H_
@@ -0,0 +1,80 @@
+#include "audio_buffer.h"
+
+#include <esp_log.h>
+#include <esp_heap_caps.h>
+
+#define TAG "AudioBufferPool"
+
+#if CONFIG_AUDIO_BUFFER_POOL_IN_PSRAM
+#define AUDIO_BUFFER_POOL_CAPS (MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT)
+#else
+#define AUDIO_BUFFER_POOL_CAPS (MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT)
+#endif
+
+AudioBufferPool& AudioBufferPool::GetOpusPool() {
+    static AudioBufferPool pool("opus", AUDIO_OPUS_BLOCK_SIZE, AUDIO_OPUS_BUFFER_COUNT);
+    return pool;
+}
+
+AudioBufferPool& AudioBufferPool::GetPcmPool() {
+    static AudioBufferPool pool("pcm", AUDIO_PCM_BLOCK_SIZE, AUDIO_PCM_BUFFER_COUNT);
+    return pool;
+}
+
+AudioBufferPool::AudioBufferPool(const char* name, size_t block_size, size_t blocks)
+    : name_(name), block_size_(block_size), blocks_(blocks) {
+    memory_ = (uint8_t*)heap_caps_malloc(block_size_ * blocks_, AUDIO_BUFFER_POOL_CAPS);
+    if (memory_ == nullptr) {
+        ESP_LOGE(TAG, "Failed to allocate %u x %u bytes for %s, every buffer comes from the heap", blocks_, block_size_, name_);
+        blocks_ = 0;
+        return;
+    }
+    free_blocks_.reserve(blocks_);
+    // Hand out the lowest blocks first
+    for (size_t i = blocks_; i > 0; i--) {
+        free_blocks_.push_back(i - 1);
+    }
+}
+
+AudioBufferPool::~AudioBufferPool() {
+    if (memory_ != nullptr) {
+        heap_caps_free(memory_);
+    }
+}
+
+void* AudioBufferPool::Allocate(size_t size) {
+    if (size <= block_size_) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!free_blocks_.empty()) {
+            auto index = free_blocks_.back();
+            free_blocks_.pop_back();
+            high_water_ = std::max(high_water_, blocks_ - free_blocks_.size());
+            return memory_ + index * block_size_;
+        }
+        fallbacks_++;
+    } else {
+        std::lock_guard<std::mutex> lock(mutex_);
+        fallbacks_++;
+    }
+    return heap_caps_malloc(size, AUDIO_BUFFER_POOL_CAPS);
+}
+
+void AudioBufferPool::Free(void* block) {
+    if (!Owns(block)) {
+        heap_caps_free(block);
+        return;
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    free_blocks_.push_back(((uint8_t*)block - memory_) / block_size_);
+}
+
+AudioBufferPoolStats AudioBufferPool::GetStats() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return AudioBufferPoolStats{
+        .block_size = block_size_,
+        .blocks = blocks_,
+        .in_use = blocks_ - free_blocks_.size(),
+        .high_water = high_water_,
+        .fallbacks = fallbacks_,
+    };
+}
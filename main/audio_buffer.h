@@ -0,0 +1,168 @@
+#ifndef AUDIO_BUFFER_H
+#define AUDIO_BUFFER_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+// Opus frames are a few hundred bytes, bigger ones fall back to the heap
+#define AUDIO_OPUS_BLOCK_SIZE 512
+// One processor output: 30ms of 16kHz audio with the reference channel, or a 32ms AFE chunk
+#define AUDIO_PCM_BLOCK_SIZE (960 * sizeof(int16_t))
+
+#ifdef CONFIG_AUDIO_OPUS_BUFFER_COUNT
+#define AUDIO_OPUS_BUFFER_COUNT CONFIG_AUDIO_OPUS_BUFFER_COUNT
+#else
+#define AUDIO_OPUS_BUFFER_COUNT 32
+#endif
+#ifdef CONFIG_AUDIO_PCM_BUFFER_COUNT
+#define AUDIO_PCM_BUFFER_COUNT CONFIG_AUDIO_PCM_BUFFER_COUNT
+#else
+#define AUDIO_PCM_BUFFER_COUNT 16
+#endif
+
+struct AudioBufferPoolStats {
+    size_t block_size;
+    size_t blocks;
+    size_t in_use;
+    size_t high_water;
+    uint32_t fallbacks;     // Requests served by the heap because the pool was empty or the block too small
+};
+
+// Fixed-size blocks carved out of a single allocation, so per-frame audio buffers never touch the heap.
+// Thread safe. Requests the pool cannot serve fall back to the heap and are counted.
+class AudioBufferPool {
+public:
+    AudioBufferPool(const char* name, size_t block_size, size_t blocks);
+    ~AudioBufferPool();
+
+    // Uplink and downlink Opus packets
+    static AudioBufferPool& GetOpusPool();
+    // Audio processor output waiting for the encoder
+    static AudioBufferPool& GetPcmPool();
+
+    // Never returns nullptr unless the heap is exhausted too
+    void* Allocate(size_t size);
+    void Free(void* block);
+    AudioBufferPoolStats GetStats();
+
+    inline const char* name() const { return name_; }
+    inline size_t block_size() const { return block_size_; }
+    inline bool Owns(const void* block) const {
+        return block >= memory_ && block < memory_ + block_size_ * blocks_;
+    }
+
+private:
+    const char* name_;
+    size_t block_size_;
+    size_t blocks_;
+    uint8_t* memory_ = nullptr;
+    std::mutex mutex_;
+    // Indexes of the free blocks, reserved up front so it never grows
+    std::vector<uint16_t> free_blocks_;
+    size_t high_water_ = 0;
+    uint32_t fallbacks_ = 0;
+};
+
+// A move-only array of T that lives in an AudioBufferPool block.
+// It is sized once, shrinking and growing within the block is free, growing past it reallocates.
+// A buffer made with Wrap() only refers to memory owned elsewhere, resizing it copies into a block first.
+template <typename T>
+class AudioBuffer {
+public:
+    AudioBuffer() = default;
+    AudioBuffer(AudioBufferPool& pool, size_t size) : pool_(&pool) {
+        resize(size);
+    }
+    AudioBuffer(AudioBufferPool& pool, const T* data, size_t size) : pool_(&pool) {
+        resize(size);
+        memcpy(data_, data, size * sizeof(T));
+    }
+    ~AudioBuffer() {
+        reset();
+    }
+
+    // Refers to read-only memory that outlives the buffer, such as an embedded asset in flash, without copying.
+    // The contents must not be written.
+    static AudioBuffer Wrap(const T* data, size_t size) {
+        AudioBuffer buffer;
+        buffer.data_ = const_cast<T*>(data);
+        buffer.size_ = size;
+        return buffer;
+    }
+
+    AudioBuffer(const AudioBuffer&) = delete;
+    AudioBuffer& operator=(const AudioBuffer&) = delete;
+    AudioBuffer(AudioBuffer&& other) noexcept {
+        *this = std::move(other);
+    }
+    AudioBuffer& operator=(AudioBuffer&& other) noexcept {
+        if (this != &other) {
+            reset();
+            data_ = other.data_;
+            size_ = other.size_;
+            capacity_ = other.capacity_;
+            pool_ = other.pool_;
+            other.data_ = nullptr;
+            other.size_ = 0;
+            other.capacity_ = 0;
+        }
+        return *this;
+    }
+
+    inline T* data() { return data_; }
+    inline const T* data() const { return data_; }
+    inline size_t size() const { return size_; }
+    inline size_t capacity() const { return capacity_; }
+    inline bool empty() const { return size_ == 0; }
+    inline T* begin() { return data_; }
+    inline T* end() { return data_ + size_; }
+    inline const T* begin() const { return data_; }
+    inline const T* end() const { return data_ + size_; }
+    inline T& operator[](size_t index) { return data_[index]; }
+    inline const T& operator[](size_t index) const { return data_[index]; }
+
+    // Keeps the contents up to the new size, a default constructed buffer takes blocks from the Opus pool
+    void resize(size_t size) {
+        if (size > capacity_) {
+            if (pool_ == nullptr) {
+                pool_ = &AudioBufferPool::GetOpusPool();
+            }
+            T* data = (T*)pool_->Allocate(size * sizeof(T));
+            if (data_ != nullptr) {
+                memcpy(data, data_, std::min(size_, size) * sizeof(T));
+                if (owned()) {
+                    pool_->Free(data_);
+                }
+            }
+            data_ = data;
+            capacity_ = std::max(size, pool_->Owns(data) ? pool_->block_size() / sizeof(T) : size);
+        }
+        size_ = size;
+    }
+    // Keeps the block for reuse
+    inline void clear() { size_ = 0; }
+    // Returns the block to its pool
+    void reset() {
+        if (owned()) {
+            pool_->Free(data_);
+        }
+        data_ = nullptr;
+        size_ = 0;
+        capacity_ = 0;
+    }
+
+    // False for wrapped memory
+    inline bool owned() const { return capacity_ > 0; }
+
+private:
+    T* data_ = nullptr;
+    size_t size_ = 0;
+    size_t capacity_ = 0;     // 0 for wrapped memory
+    AudioBufferPool* pool_ = nullptr;
+};
+
+#endif // AUDIO_BUFFER_H
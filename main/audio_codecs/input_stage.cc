@@ -0,0 +1,122 @@
+#include "input_stage.h"
+
+#include <esp_log.h>
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <numeric>
+
+#define TAG "InputStage"
+
+// Kaiser window shape, about 70dB of stopband attenuation
+#define INPUT_STAGE_KAISER_BETA 7.0
+// Cutoff as a fraction of the lower sample rate, the AFE only looks at speech below 7.6kHz
+#define INPUT_STAGE_CUTOFF 0.475
+
+static double BesselI0(double x) {
+    double sum = 1.0;
+    double term = 1.0;
+    for (int k = 1; k < 32; k++) {
+        term *= (x / (2.0 * k)) * (x / (2.0 * k));
+        sum += term;
+        if (term < sum * 1e-12) {
+            break;
+        }
+    }
+    return sum;
+}
+
+// A plain multiply-accumulate loop is the shape GCC turns into SIMD (pmaddwd on the host) when vectorizing,
+// which -O2 alone does not do for reductions
+__attribute__((optimize("tree-vectorize")))
+static int32_t DotProduct(const int16_t* __restrict window, const int16_t* __restrict coefficients, int taps) {
+    int32_t sum = 0;
+    for (int tap = 0; tap < taps; tap++) {
+        sum += int32_t(window[tap]) * coefficients[tap];
+    }
+    return sum;
+}
+
+bool InputStage::Configure(int input_sample_rate, int output_sample_rate, int channels) {
+    int divisor = std::gcd(input_sample_rate, output_sample_rate);
+    int up = output_sample_rate / divisor;
+    int down = input_sample_rate / divisor;
+    if (up > INPUT_STAGE_MAX_PHASES || channels < 1 || channels > INPUT_STAGE_MAX_CHANNELS) {
+        ESP_LOGE(TAG, "Unsupported conversion %d -> %d with %d channels", input_sample_rate, output_sample_rate, channels);
+        up_ = 0;
+        return false;
+    }
+    up_ = up;
+    down_ = down;
+    channels_ = channels;
+    taps_ = (INPUT_STAGE_BASE_TAPS * std::max(up, down) / up + 3) & ~3;
+    position_ = 0;
+
+    // Windowed sinc prototype at the upsampled rate, with a gain of L to make up for the zero stuffing
+    int length = up_ * taps_;
+    double cutoff = INPUT_STAGE_CUTOFF * std::min(input_sample_rate, output_sample_rate) / (double(input_sample_rate) * up_);
+    double center = (length - 1) / 2.0;
+    double window_scale = BesselI0(INPUT_STAGE_KAISER_BETA);
+    std::vector<double> prototype(length);
+    for (int n = 0; n < length; n++) {
+        double x = n - center;
+        double sinc = x == 0 ? 2.0 * cutoff : sin(2.0 * M_PI * cutoff * x) / (M_PI * x);
+        double ratio = 2.0 * n / (length - 1) - 1.0;
+        double window = BesselI0(INPUT_STAGE_KAISER_BETA * sqrt(1.0 - ratio * ratio)) / window_scale;
+        prototype[n] = sinc * window * up_;
+    }
+
+    // Phase p uses prototype taps p, p + L, p + 2L ... against the newest, second newest ... input sample
+    coefficients_.assign(up_ * taps_, 0);
+    for (int phase = 0; phase < up_; phase++) {
+        for (int tap = 0; tap < taps_; tap++) {
+            double value = prototype[phase + (taps_ - 1 - tap) * up_] * 32768.0;
+            coefficients_[phase * taps_ + tap] = (int16_t)std::clamp(lround(value), -32768L, 32767L);
+        }
+    }
+
+    for (int channel = 0; channel < channels_; channel++) {
+        history_[channel].assign(taps_ - 1, 0);
+    }
+    ESP_LOGI(TAG, "Configured %d -> %d, %d channels, %d phases of %d taps", input_sample_rate, output_sample_rate,
+        channels_, up_, taps_);
+    return true;
+}
+
+size_t InputStage::GetOutputFrames(size_t input_frames) const {
+    return (input_frames * up_ + down_ - 1) / down_;
+}
+
+size_t InputStage::Process(const int16_t* input, size_t frames, int16_t* output) {
+    size_t keep = taps_ - 1;
+    for (int channel = 0; channel < channels_; channel++) {
+        auto& history = history_[channel];
+        history.resize(keep + frames);
+        int16_t* dest = history.data() + keep;
+        const int16_t* src = input + channel;
+        for (size_t i = 0; i < frames; i++) {
+            dest[i] = src[i * channels_];
+        }
+    }
+
+    size_t end = frames * up_;
+    size_t produced = 0;
+    for (int channel = 0; channel < channels_; channel++) {
+        const int16_t* history = history_[channel].data();
+        int16_t* dest = output + channel;
+        produced = 0;
+        for (size_t position = position_; position < end; position += down_, produced++) {
+            // The window ends at the input sample the output falls on
+            int32_t sum = DotProduct(history + position / up_, coefficients_.data() + (position % up_) * taps_, taps_);
+            sum = (sum + (1 << 14)) >> 15;
+            dest[produced * channels_] = (int16_t)std::clamp(sum, int32_t(INT16_MIN), int32_t(INT16_MAX));
+        }
+    }
+    position_ += produced * down_ - end;
+
+    for (int channel = 0; channel < channels_; channel++) {
+        auto& history = history_[channel];
+        memmove(history.data(), history.data() + frames, keep * sizeof(int16_t));
+    }
+    return produced;
+}
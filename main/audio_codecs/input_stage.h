@@ -0,0 +1,41 @@
+#ifndef _INPUT_STAGE_H
+#define _INPUT_STAGE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Largest interpolation factor L of the L/M rate ratio, 24000 -> 16000 needs 2, 48000 -> 16000 needs 1
+#define INPUT_STAGE_MAX_PHASES 8
+// Filter taps per output sample at 1:1, scaled with the decimation factor so the transition band stays the same
+#define INPUT_STAGE_BASE_TAPS 24
+#define INPUT_STAGE_MAX_CHANNELS 2
+
+// Resamples interleaved capture (microphone, plus the AEC reference when there is one) for the AFE in one pass.
+// Each channel is deinterleaved into its filter history, run through a polyphase low-pass FIR and written
+// back interleaved. The output may be the input buffer. Buffers grow on the first call only.
+class InputStage {
+public:
+    // Returns false if the ratio needs more than INPUT_STAGE_MAX_PHASES phases
+    bool Configure(int input_sample_rate, int output_sample_rate, int channels);
+    // Returns the number of frames (samples per channel) written, at most GetOutputFrames(frames).
+    // Exactly frames * output / input when that is a whole number, as it is for the AFE feed sizes.
+    size_t Process(const int16_t* input, size_t frames, int16_t* output);
+    size_t GetOutputFrames(size_t input_frames) const;
+
+    inline bool configured() const { return up_ > 0; }
+
+private:
+    int channels_ = 1;
+    int up_ = 0;        // L
+    int down_ = 1;      // M
+    int taps_ = 0;      // Per phase
+    // taps_ coefficients per phase in Q15, in input order so that each output is a dot product over the history
+    std::vector<int16_t> coefficients_;
+    // Per channel, the last taps_ - 1 input samples followed by the current block
+    std::vector<int16_t> history_[INPUT_STAGE_MAX_CHANNELS];
+    // Upsampled position of the next output relative to the first sample of the next block
+    size_t position_ = 0;
+};
+
+#endif // _INPUT_STAGE_H
@@ -8,6 +8,10 @@
 
 class NoAudioCodec : public AudioCodec {
 private:
+    // 32 位 I2S 样本的缓冲区，分别只在输出和输入线程使用，复用容量避免每帧分配
+    std::vector<int32_t> write_buffer_;
+    std::vector<int32_t> read_buffer_;
+
     virtual int Write(const int16_t* data, int samples) override;
     virtual int Read(int16_t* dest, int samples) override;
 
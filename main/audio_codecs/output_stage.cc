@@ -0,0 +1,57 @@
+#include "output_stage.h"
+
+#include <array>
+
+namespace {
+
+constexpr int kMaxVolume = 100;
+
+// Same curve as the pow(volume / 100.0, 2) * 65536 it replaces, integer division truncates like the cast did
+constexpr std::array<int32_t, kMaxVolume + 1> MakeVolumeTable() {
+    std::array<int32_t, kMaxVolume + 1> table{};
+    for (int volume = 0; volume <= kMaxVolume; volume++) {
+        table[volume] = int32_t(int64_t(volume) * volume * 65536 / (kMaxVolume * kMaxVolume));
+    }
+    return table;
+}
+
+constexpr auto kVolumeTable = MakeVolumeTable();
+
+static_assert(kVolumeTable[kMaxVolume] == 65536, "full volume must be unity gain");
+static_assert(int64_t(INT16_MIN) * kVolumeTable[kMaxVolume] >= INT32_MIN, "products must fit in int32_t");
+static_assert(int64_t(INT16_MAX) * kVolumeTable[kMaxVolume] <= INT32_MAX, "products must fit in int32_t");
+
+} // namespace
+
+int32_t OutputVolumeFactor(int volume) {
+    if (volume < 0) {
+        volume = 0;
+    } else if (volume > kMaxVolume) {
+        volume = kMaxVolume;
+    }
+    return kVolumeTable[volume];
+}
+
+void ScaleToI2sSlots(const int16_t* __restrict input, int32_t* __restrict output, size_t samples, int32_t factor, int slots_per_sample) {
+    if (slots_per_sample == 2) {
+        for (size_t i = 0; i < samples; i++) {
+            int32_t value = int32_t(input[i]) * factor;
+            output[i * 2] = value;
+            output[i * 2 + 1] = value;
+        }
+        return;
+    }
+
+    // Branch free, four samples per iteration so the Xtensa core keeps its multiplier busy,
+    // the host compiler turns the loop into SIMD on its own
+    size_t i = 0;
+    for (; i + 4 <= samples; i += 4) {
+        output[i] = int32_t(input[i]) * factor;
+        output[i + 1] = int32_t(input[i + 1]) * factor;
+        output[i + 2] = int32_t(input[i + 2]) * factor;
+        output[i + 3] = int32_t(input[i + 3]) * factor;
+    }
+    for (; i < samples; i++) {
+        output[i] = int32_t(input[i]) * factor;
+    }
+}
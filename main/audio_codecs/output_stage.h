@@ -0,0 +1,15 @@
+#ifndef _OUTPUT_STAGE_H
+#define _OUTPUT_STAGE_H
+
+#include <cstddef>
+#include <cstdint>
+
+// (volume / 100)^2 in Q16, from a table built at compile time. volume is clamped to 0-100.
+int32_t OutputVolumeFactor(int volume);
+
+// Widens 16-bit PCM to 32-bit I2S slots with the volume applied, in a single pass.
+// Each sample fills slots_per_sample consecutive slots, 2 plays mono on both channels of a stereo frame.
+// A factor of at most 1.0 in Q16 keeps every product within int32_t, so no sample needs saturating.
+void ScaleToI2sSlots(const int16_t* input, int32_t* output, size_t samples, int32_t factor, int slots_per_sample = 1);
+
+#endif // _OUTPUT_STAGE_H
@@ -2,9 +2,6 @@
 #define AFE_AUDIO_PROCESSOR_H
 
 #include <esp_afe_sr_models.h>
-#include <freertos/FreeRTOS.h>
-#include <freertos/task.h>
-#include <freertos/event_groups.h>
 
 #include <string>
 #include <vector>
@@ -12,10 +9,12 @@
 
 #include "audio_processor.h"
 #include "audio_codec.h"
+#include "audio_front_end.h"
 
+// NS and VAD for the uplink, a consumer of the shared AFE front end
 class AfeAudioProcessor : public AudioProcessor {
 public:
-    AfeAudioProcessor();
+    AfeAudioProcessor(AudioFrontEnd& front_end);
     ~AfeAudioProcessor();
 
     void Initialize(AudioCodec* codec) override;
@@ -23,20 +22,21 @@ public:
     void Start() override;
     void Stop() override;
     bool IsRunning() override;
-    void OnOutput(std::function<void(std::vector<int16_t>&& data)> callback) override;
+    void OnOutput(std::function<void(AudioBuffer<int16_t>&& data)> callback) override;
     void OnVadStateChange(std::function<void(bool speaking)> callback) override;
     size_t GetFeedSize() override;
 
 private:
-    EventGroupHandle_t event_group_ = nullptr;
-    esp_afe_sr_iface_t* afe_iface_ = nullptr;
-    esp_afe_sr_data_t* afe_data_ = nullptr;
-    std::function<void(std::vector<int16_t>&& data)> output_callback_;
+    AudioFrontEnd& front_end_;
+    int consumer_ = -1;
+    std::function<void(AudioBuffer<int16_t>&& data)> output_callback_;
     std::function<void(bool speaking)> vad_state_change_callback_;
     AudioCodec* codec_ = nullptr;
     bool is_speaking_ = false;
+    // 16kHz samples fetched since Start(), trace id of the fetched chunk
+    uint32_t output_samples_ = 0;
 
-    void AudioProcessorTask();
+    void OnFetch(afe_fetch_result_t* res);
 };
 
 #endif 
\ No newline at end of file
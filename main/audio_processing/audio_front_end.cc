@@ -0,0 +1,199 @@
+#include "audio_front_end.h"
+
+#include <esp_log.h>
+#include <model_path.h>
+#include <cassert>
+#include <cstring>
+
+#define FRONT_END_RUNNING_EVENT 0x01
+
+static const char* TAG = "AudioFrontEnd";
+
+AudioFrontEnd::AudioFrontEnd() {
+    event_group_ = xEventGroupCreate();
+}
+
+AudioFrontEnd::~AudioFrontEnd() {
+    if (afe_data_ != nullptr) {
+        afe_iface_->destroy(afe_data_);
+    }
+    vEventGroupDelete(event_group_);
+}
+
+int AudioFrontEnd::AddConsumer(const char* name, uint32_t features, std::function<void(afe_fetch_result_t* result)> callback) {
+    assert(consumer_count_ < AUDIO_FRONT_END_MAX_CONSUMERS);
+    consumers_[consumer_count_] = Consumer{name, features, callback};
+    return consumer_count_++;
+}
+
+void AudioFrontEnd::Initialize(AudioCodec* codec, bool wakenet) {
+    codec_ = codec;
+    int ref_num = codec_->input_reference() ? 1 : 0;
+
+    models_ = esp_srmodel_init("model");
+    if (wakenet) {
+        for (int i = 0; i < models_->num; i++) {
+            ESP_LOGI(TAG, "Model %d: %s", i, models_->model_name[i]);
+            if (strstr(models_->model_name[i], ESP_WN_PREFIX) != NULL) {
+                wakenet_model_ = models_->model_name[i];
+            }
+        }
+    }
+    char* ns_model_name = esp_srmodel_filter(models_, ESP_NSNET_PREFIX, NULL);
+
+    std::string input_format;
+    for (int i = 0; i < codec_->input_channels() - ref_num; i++) {
+        input_format.push_back('M');
+    }
+    for (int i = 0; i < ref_num; i++) {
+        input_format.push_back('R');
+    }
+
+    // A speech recognition pipeline runs the wake word and still gives NS and VAD to the audio processor
+    afe_type_t afe_type = wakenet_model_ != nullptr ? AFE_TYPE_SR : AFE_TYPE_VC;
+    afe_config_t* afe_config = afe_config_init(input_format.c_str(), wakenet_model_ != nullptr ? models_ : NULL,
+        afe_type, AFE_MODE_HIGH_PERF);
+#ifdef CONFIG_USE_DEVICE_AEC
+    afe_config->aec_init = true;
+    afe_config->aec_mode = AEC_MODE_VOIP_HIGH_PERF;
+#else
+    // Only the wake word uses AEC, it is turned off while the audio processor runs alone
+    afe_config->aec_init = wakenet_model_ != nullptr && codec_->input_reference();
+    afe_config->aec_mode = AEC_MODE_SR_HIGH_PERF;
+#endif
+    afe_config->ns_init = true;
+    afe_config->ns_model_name = ns_model_name;
+    afe_config->afe_ns_mode = AFE_NS_MODE_NET;
+#ifdef CONFIG_USE_DEVICE_AEC
+    afe_config->vad_init = false;
+#else
+    afe_config->vad_init = true;
+    afe_config->vad_mode = VAD_MODE_0;
+    afe_config->vad_min_noise_ms = 100;
+#endif
+    afe_config->afe_perferred_core = 1;
+    afe_config->afe_perferred_priority = 1;
+    afe_config->agc_init = false;
+    afe_config->memory_alloc_mode = AFE_MEMORY_ALLOC_MORE_PSRAM;
+
+    afe_iface_ = esp_afe_handle_from_config(afe_config);
+    afe_data_ = afe_iface_->create_from_config(afe_config);
+    available_ = (wakenet_model_ != nullptr ? AUDIO_FRONT_END_WAKENET : 0) | (afe_config->aec_init ? AUDIO_FRONT_END_AEC : 0) |
+        (afe_config->ns_init ? AUDIO_FRONT_END_NS : 0) | (afe_config->vad_init ? AUDIO_FRONT_END_VAD : 0);
+    // Everything built starts enabled, the first Start() turns off what its consumer does not need
+    features_ = available_;
+
+    xTaskCreate([](void* arg) {
+        auto this_ = (AudioFrontEnd*)arg;
+        this_->FetchTask();
+        vTaskDelete(NULL);
+    }, "audio_front_end", 4096, this, 3, NULL);
+}
+
+// Turns the optional stages on or off for the consumers that are running
+void AudioFrontEnd::UpdateFeatures(uint32_t running) {
+    if (afe_data_ == nullptr || running == 0) {
+        return;
+    }
+    uint32_t needed = 0;
+    for (int i = 0; i < consumer_count_; i++) {
+        if (running & (1 << i)) {
+            needed |= consumers_[i].features;
+        }
+    }
+    needed &= available_;
+    auto toggle = [this, needed](uint32_t feature, auto enable, auto disable) {
+        if ((needed & feature) == (features_ & feature)) {
+            return;
+        }
+        if (needed & feature) {
+            enable(afe_data_);
+        } else {
+            disable(afe_data_);
+        }
+    };
+    toggle(AUDIO_FRONT_END_WAKENET, afe_iface_->enable_wakenet, afe_iface_->disable_wakenet);
+    toggle(AUDIO_FRONT_END_AEC, afe_iface_->enable_aec, afe_iface_->disable_aec);
+    toggle(AUDIO_FRONT_END_NS, afe_iface_->enable_ns, afe_iface_->disable_ns);
+    toggle(AUDIO_FRONT_END_VAD, afe_iface_->enable_vad, afe_iface_->disable_vad);
+    if (needed != features_) {
+        ESP_LOGI(TAG, "Wakenet %s, AEC %s, NS %s, VAD %s", (needed & AUDIO_FRONT_END_WAKENET) ? "on" : "off",
+            (needed & AUDIO_FRONT_END_AEC) ? "on" : "off", (needed & AUDIO_FRONT_END_NS) ? "on" : "off",
+            (needed & AUDIO_FRONT_END_VAD) ? "on" : "off");
+    }
+    features_ = needed;
+}
+
+void AudioFrontEnd::Start(int consumer) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    uint32_t running = running_.load() | (1 << consumer);
+    UpdateFeatures(running);
+    running_.store(running);
+    xEventGroupSetBits(event_group_, FRONT_END_RUNNING_EVENT);
+}
+
+void AudioFrontEnd::Stop(int consumer) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    uint32_t running = running_.load() & ~(1 << consumer);
+    running_.store(running);
+    if (running != 0) {
+        // Another consumer carries on with the same audio, nothing to flush
+        UpdateFeatures(running);
+        return;
+    }
+    xEventGroupClearBits(event_group_, FRONT_END_RUNNING_EVENT);
+    if (afe_data_ != nullptr) {
+        afe_iface_->reset_buffer(afe_data_);
+    }
+}
+
+bool AudioFrontEnd::IsRunning(int consumer) const {
+    return running_.load() & (1 << consumer);
+}
+
+bool AudioFrontEnd::IsRunning() const {
+    return running_.load() != 0;
+}
+
+void AudioFrontEnd::Feed(const std::vector<int16_t>& data) {
+    if (afe_data_ == nullptr) {
+        return;
+    }
+    afe_iface_->feed(afe_data_, data.data());
+}
+
+size_t AudioFrontEnd::GetFeedSize() {
+    if (afe_data_ == nullptr) {
+        return 0;
+    }
+    return afe_iface_->get_feed_chunksize(afe_data_) * codec_->input_channels();
+}
+
+void AudioFrontEnd::FetchTask() {
+    auto fetch_size = afe_iface_->get_fetch_chunksize(afe_data_);
+    auto feed_size = afe_iface_->get_feed_chunksize(afe_data_);
+    ESP_LOGI(TAG, "Audio front end task started, feed size: %d fetch size: %d",
+        feed_size, fetch_size);
+
+    while (true) {
+        xEventGroupWaitBits(event_group_, FRONT_END_RUNNING_EVENT, pdFALSE, pdTRUE, portMAX_DELAY);
+
+        auto res = afe_iface_->fetch_with_delay(afe_data_, portMAX_DELAY);
+        uint32_t running = running_.load();
+        if (running == 0) {
+            continue;
+        }
+        if (res == nullptr || res->ret_value == ESP_FAIL) {
+            if (res != nullptr) {
+                ESP_LOGI(TAG, "Error code: %d", res->ret_value);
+            }
+            continue;
+        }
+
+        for (int i = 0; i < consumer_count_; i++) {
+            if (running & (1 << i)) {
+                consumers_[i].callback(res);
+            }
+        }
+    }
+}
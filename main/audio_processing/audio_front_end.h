@@ -0,0 +1,72 @@
+#ifndef AUDIO_FRONT_END_H
+#define AUDIO_FRONT_END_H
+
+#include <esp_afe_sr_models.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <freertos/event_groups.h>
+
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <functional>
+
+#include "audio_codec.h"
+
+#define AUDIO_FRONT_END_MAX_CONSUMERS 4
+
+// What a consumer needs from the pipeline, the optional stages nobody running needs are turned off
+#define AUDIO_FRONT_END_WAKENET 0x01
+#define AUDIO_FRONT_END_AEC 0x02
+#define AUDIO_FRONT_END_NS 0x04
+#define AUDIO_FRONT_END_VAD 0x08
+
+// The one AFE pipeline on the device. The microphone is fed once, AEC and NS run once, and every fetched
+// chunk goes to the consumers that are running (the wake word detector, the audio processor), on the fetch task.
+// Switching from one consumer to another keeps the pipeline and its buffers, it is only reset when the last one stops.
+class AudioFrontEnd {
+public:
+    AudioFrontEnd();
+    ~AudioFrontEnd();
+
+    // wakenet loads the wake word model, otherwise the pipeline is built for voice communication
+    void Initialize(AudioCodec* codec, bool wakenet);
+    // Before the consumer is started. Returns the consumer id.
+    int AddConsumer(const char* name, uint32_t features, std::function<void(afe_fetch_result_t* result)> callback);
+    void Start(int consumer);
+    void Stop(int consumer);
+    bool IsRunning(int consumer) const;
+    bool IsRunning() const;
+
+    void Feed(const std::vector<int16_t>& data);
+    size_t GetFeedSize();
+
+    srmodel_list_t* models() const { return models_; }
+    char* wakenet_model() const { return wakenet_model_; }
+
+private:
+    struct Consumer {
+        const char* name;
+        uint32_t features;
+        std::function<void(afe_fetch_result_t* result)> callback;
+    };
+
+    EventGroupHandle_t event_group_ = nullptr;
+    esp_afe_sr_iface_t* afe_iface_ = nullptr;
+    esp_afe_sr_data_t* afe_data_ = nullptr;
+    srmodel_list_t* models_ = nullptr;
+    char* wakenet_model_ = nullptr;
+    AudioCodec* codec_ = nullptr;
+    uint32_t available_ = 0;                // The optional stages the pipeline was built with
+    Consumer consumers_[AUDIO_FRONT_END_MAX_CONSUMERS];
+    int consumer_count_ = 0;
+    std::atomic<uint32_t> running_ = 0;     // Bit per consumer
+    std::mutex mutex_;                      // Start() and Stop()
+    uint32_t features_ = 0;                 // mutex_, the optional stages turned on
+
+    void UpdateFeatures(uint32_t running);
+    void FetchTask();
+};
+
+#endif // AUDIO_FRONT_END_H
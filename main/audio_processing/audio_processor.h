@@ -6,6 +6,7 @@
 #include <functional>
 
 #include "audio_codec.h"
+#include "audio_buffer.h"
 
 class AudioProcessor {
 public:
@@ -16,7 +17,8 @@ public:
     virtual void Start() = 0;
     virtual void Stop() = 0;
     virtual bool IsRunning() = 0;
-    virtual void OnOutput(std::function<void(std::vector<int16_t>&& data)> callback) = 0;
+    // The output is a block from the PCM pool
+    virtual void OnOutput(std::function<void(AudioBuffer<int16_t>&& data)> callback) = 0;
     virtual void OnVadStateChange(std::function<void(bool speaking)> callback) = 0;
     virtual size_t GetFeedSize() = 0;
 };
@@ -1,4 +1,6 @@
 #include "dummy_audio_processor.h"
+#include "audio_trace.h"
+
 #include <esp_log.h>
 
 #define TAG "DummyAudioProcessor"
@@ -11,11 +13,15 @@ void DummyAudioProcessor::Feed(const std::vector<int16_t>& data) {
     if (!is_running_ || !output_callback_) {
         return;
     }
+    // Feed() gets 16kHz data, interleaved with the reference channel on two-channel codecs
+    output_samples_ += data.size() / codec_->input_channels();
+    AUDIO_TRACE(kAudioTraceAfeFetch, output_samples_ / 16);
     // 直接将输入数据传递给输出回调
-    output_callback_(std::vector<int16_t>(data));
+    output_callback_(AudioBuffer<int16_t>(AudioBufferPool::GetPcmPool(), data.data(), data.size()));
 }
 
 void DummyAudioProcessor::Start() {
+    output_samples_ = 0;
     is_running_ = true;
 }
 
@@ -27,7 +33,7 @@ bool DummyAudioProcessor::IsRunning() {
     return is_running_;
 }
 
-void DummyAudioProcessor::OnOutput(std::function<void(std::vector<int16_t>&& data)> callback) {
+void DummyAudioProcessor::OnOutput(std::function<void(AudioBuffer<int16_t>&& data)> callback) {
     output_callback_ = callback;
 }
 
@@ -0,0 +1,92 @@
+#include "opus_preroll.h"
+
+#include <esp_log.h>
+#include <esp_heap_caps.h>
+#include <cstring>
+
+#define TAG "OpusPreroll"
+
+#if CONFIG_SPIRAM
+#define OPUS_PREROLL_CAPS (MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT)
+#else
+#define OPUS_PREROLL_CAPS (MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT)
+#endif
+
+OpusPreroll::OpusPreroll(size_t bytes, size_t max_frames) {
+    buffer_ = (uint8_t*)heap_caps_malloc(bytes, OPUS_PREROLL_CAPS);
+    if (buffer_ == nullptr) {
+        ESP_LOGE(TAG, "Failed to allocate %u bytes", bytes);
+    } else {
+        capacity_ = bytes;
+    }
+    frames_.resize(max_frames);
+}
+
+OpusPreroll::~OpusPreroll() {
+    if (buffer_ != nullptr) {
+        heap_caps_free(buffer_);
+    }
+}
+
+void OpusPreroll::Clear() {
+    head_ = 0;
+    count_ = 0;
+    write_offset_ = 0;
+}
+
+void OpusPreroll::DropOldest() {
+    head_ = (head_ + 1) % frames_.size();
+    count_--;
+    if (count_ == 0) {
+        write_offset_ = 0;
+    }
+}
+
+void OpusPreroll::Push(const uint8_t* opus, size_t size) {
+    if (size == 0 || size > capacity_ || frames_.empty()) {
+        return;
+    }
+    if (count_ == frames_.size()) {
+        DropOldest();
+    }
+
+    // Free space runs from write_offset_ to the oldest frame, around the end of the buffer
+    size_t offset;
+    while (true) {
+        if (count_ == 0) {
+            offset = 0;
+            break;
+        }
+        size_t oldest = frames_[head_].offset;
+        if (write_offset_ > oldest) {
+            if (capacity_ - write_offset_ >= size) {
+                offset = write_offset_;
+                break;
+            }
+            // Frames are stored in one piece, the tail is left unused
+            if (oldest >= size) {
+                offset = 0;
+                break;
+            }
+        } else if (oldest - write_offset_ >= size) {
+            offset = write_offset_;
+            break;
+        }
+        DropOldest();
+    }
+
+    memcpy(buffer_ + offset, opus, size);
+    frames_[(head_ + count_) % frames_.size()] = Frame{offset, size};
+    count_++;
+    write_offset_ = offset + size;
+}
+
+bool OpusPreroll::Pop(std::vector<uint8_t>& opus) {
+    if (count_ == 0) {
+        return false;
+    }
+    auto& frame = frames_[head_];
+    opus.assign(buffer_ + frame.offset, buffer_ + frame.offset + frame.size);
+    DropOldest();
+    return true;
+}
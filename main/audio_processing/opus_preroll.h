@@ -0,0 +1,44 @@
+#ifndef OPUS_PREROLL_H
+#define OPUS_PREROLL_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Audio kept from before the wake word
+#define OPUS_PREROLL_MS 2000
+// 2 seconds of 16kHz complexity 0 Opus with room to spare, instead of 64KB of PCM
+#define OPUS_PREROLL_BYTES (8 * 1024)
+
+// The newest Opus frames in a fixed byte ring, each frame stored in one piece.
+// A new frame evicts the oldest ones until it fits, so pushing never allocates. Not thread safe.
+class OpusPreroll {
+public:
+    OpusPreroll(size_t bytes, size_t max_frames);
+    ~OpusPreroll();
+
+    // Frames larger than the ring are dropped
+    void Push(const uint8_t* opus, size_t size);
+    // Copies the oldest frame out and removes it, false if there is none
+    bool Pop(std::vector<uint8_t>& opus);
+    void Clear();
+
+    inline size_t frames() const { return count_; }
+
+private:
+    struct Frame {
+        size_t offset;
+        size_t size;
+    };
+
+    uint8_t* buffer_ = nullptr;
+    size_t capacity_ = 0;
+    std::vector<Frame> frames_;     // Ring of the stored frames, oldest at head_
+    size_t head_ = 0;
+    size_t count_ = 0;
+    size_t write_offset_ = 0;       // Where the next frame goes if it fits before the end
+
+    void DropOldest();
+};
+
+#endif // OPUS_PREROLL_H
@@ -0,0 +1,85 @@
+#include "pre_vad.h"
+
+#include <algorithm>
+
+void PreVad::Configure(int sample_rate, int channels, size_t frames) {
+    channels_ = channels;
+    frames_ = frames;
+    preroll_frames_ = size_t(sample_rate) * PRE_VAD_PREROLL_MS / 1000;
+    hang_chunks_ = std::max<int>(1, int64_t(PRE_VAD_HANG_MS) * sample_rate / 1000 / frames);
+    noise_floor_ = 0;
+    dc_ = 0;
+    chunks_ = 0;
+    open_chunks_ = 0;
+    opens_ = 0;
+    Hold();
+}
+
+void PreVad::Hold() {
+    open_ = true;
+    quiet_chunks_ = 0;
+}
+
+bool PreVad::Process(const int16_t* data) {
+    // Mean and mean square of the microphone channel, the DC offset of the microphone is not energy.
+    // Crossings are counted around the mean of the previous chunk, the offset drifts slowly.
+    int32_t sum = 0;
+    uint64_t sum_squares = 0;
+    uint32_t crossings = 0;
+    bool negative = data[0] < dc_;
+    for (size_t i = 0; i < frames_; i++) {
+        int32_t sample = data[i * channels_];
+        sum += sample;
+        sum_squares += uint32_t(sample * sample);
+        bool sample_negative = sample < dc_;
+        crossings += sample_negative != negative;
+        negative = sample_negative;
+    }
+    int32_t mean = sum / int32_t(frames_);
+    uint64_t mean_square = sum_squares / frames_;
+    uint32_t energy = uint32_t(mean_square - std::min<uint64_t>(mean_square, uint64_t(int64_t(mean) * mean)));
+    uint32_t zcr = crossings * 1000 / frames_;
+    dc_ = mean;
+
+    if (noise_floor_ == 0) {
+        noise_floor_ = std::max<uint32_t>(energy, PRE_VAD_MIN_FLOOR);
+    }
+    uint64_t floor = noise_floor_;
+    bool loud = energy >= PRE_VAD_MIN_ENERGY &&
+        (energy > floor * PRE_VAD_OPEN_RATIO || (zcr > PRE_VAD_FRICATIVE_ZCR && energy > floor * PRE_VAD_CLOSE_RATIO));
+    bool quiet = energy < floor * PRE_VAD_CLOSE_RATIO || energy < PRE_VAD_MIN_ENERGY;
+
+    if (loud) {
+        if (!open_) {
+            opens_.fetch_add(1, std::memory_order_relaxed);
+        }
+        open_ = true;
+        quiet_chunks_ = 0;
+    } else if (open_ && quiet && ++quiet_chunks_ >= hang_chunks_) {
+        open_ = false;
+    }
+
+    // Down in a few chunks, up over a couple of seconds, and over some fifteen seconds while the gate is open
+    if (energy < noise_floor_) {
+        noise_floor_ -= (noise_floor_ - energy) >> 2;
+    } else {
+        noise_floor_ += (energy - noise_floor_) >> (open_ ? 9 : 6);
+    }
+    noise_floor_ = std::max<uint32_t>(noise_floor_, PRE_VAD_MIN_FLOOR);
+
+    chunks_.fetch_add(1, std::memory_order_relaxed);
+    if (open_) {
+        open_chunks_.fetch_add(1, std::memory_order_relaxed);
+    }
+    noise_floor_stat_.store(noise_floor_, std::memory_order_relaxed);
+    return open_;
+}
+
+PreVadStats PreVad::GetStats() const {
+    return PreVadStats{
+        .chunks = chunks_.load(std::memory_order_relaxed),
+        .open_chunks = open_chunks_.load(std::memory_order_relaxed),
+        .opens = opens_.load(std::memory_order_relaxed),
+        .noise_floor = noise_floor_stat_.load(std::memory_order_relaxed),
+    };
+}
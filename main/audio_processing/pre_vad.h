@@ -0,0 +1,61 @@
+#ifndef PRE_VAD_H
+#define PRE_VAD_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+// Audio fed to the AFE from before the gate opened, so the start of the wake word is not clipped
+#define PRE_VAD_PREROLL_MS 128
+// Quiet audio still fed after the last loud chunk, covers the gaps inside a phrase and the wakenet decision
+#define PRE_VAD_HANG_MS 1500
+// Mean square over the noise floor that opens the gate (x8 = +9dB), and that keeps it open (x2 = +3dB)
+#define PRE_VAD_OPEN_RATIO 8
+#define PRE_VAD_CLOSE_RATIO 2
+// Zero crossings per 1000 samples above which a quieter chunk is taken as a fricative (the x in xiao)
+#define PRE_VAD_FRICATIVE_ZCR 250
+// Mean square below which nothing opens the gate, an RMS of 10 or about -70dBFS
+#define PRE_VAD_MIN_ENERGY 100
+// Lowest noise floor, keeps the ratios meaningful on a near silent input
+#define PRE_VAD_MIN_FLOOR 4
+
+struct PreVadStats {
+    uint32_t chunks;
+    uint32_t open_chunks;       // Chunks passed to the AFE
+    uint32_t opens;
+    uint32_t noise_floor;       // Mean square
+};
+
+// Energy and zero crossing gate in front of the wake word AFE. Integer only, one pass over the chunk.
+// The noise floor follows the quiet chunks quickly downwards and slowly upwards, and keeps adapting very slowly
+// while the gate is open, so a fan that starts does not hold it open for ever.
+// One task calls everything but GetStats(), which any task may call.
+class PreVad {
+public:
+    // frames of each chunk, the first of channels interleaved channels is the microphone
+    void Configure(int sample_rate, int channels, size_t frames);
+    // Returns true if the chunk should reach the AFE
+    bool Process(const int16_t* data);
+    // Opens the gate for the hang time, when something else has just been listening
+    void Hold();
+
+    inline bool IsOpen() const { return open_; }
+    inline size_t preroll_frames() const { return preroll_frames_; }
+    PreVadStats GetStats() const;
+
+private:
+    int channels_ = 1;
+    size_t frames_ = 512;
+    size_t preroll_frames_ = 0;
+    int hang_chunks_ = 0;
+    bool open_ = true;
+    int quiet_chunks_ = 0;
+    uint32_t noise_floor_ = 0;     // 0 until the first chunk
+    int32_t dc_ = 0;
+    std::atomic<uint32_t> chunks_ = 0;
+    std::atomic<uint32_t> open_chunks_ = 0;
+    std::atomic<uint32_t> opens_ = 0;
+    std::atomic<uint32_t> noise_floor_stat_ = 0;
+};
+
+#endif // PRE_VAD_H
@@ -6,71 +6,53 @@
 #include <arpa/inet.h>
 #include <sstream>
 
-#define DETECTION_RUNNING_EVENT 1
-
 static const char* TAG = "WakeWordDetect";
 
 WakeWordDetect::WakeWordDetect()
-    : afe_data_(nullptr),
-      wake_word_pcm_(),
-      wake_word_opus_() {
-
-    event_group_ = xEventGroupCreate();
+    : preroll_(OPUS_PREROLL_BYTES, OPUS_PREROLL_MS / OPUS_FRAME_DURATION_MS + 1) {
 }
 
 WakeWordDetect::~WakeWordDetect() {
-    if (afe_data_ != nullptr) {
-        afe_iface_->destroy(afe_data_);
-    }
-
     if (wake_word_encode_task_stack_ != nullptr) {
         heap_caps_free(wake_word_encode_task_stack_);
     }
-
-    vEventGroupDelete(event_group_);
 }
 
-void WakeWordDetect::Initialize(AudioCodec* codec) {
-    codec_ = codec;
-    int ref_num = codec_->input_reference() ? 1 : 0;
-
-    srmodel_list_t *models = esp_srmodel_init("model");
-    for (int i = 0; i < models->num; i++) {
-        ESP_LOGI(TAG, "Model %d: %s", i, models->model_name[i]);
-        if (strstr(models->model_name[i], ESP_WN_PREFIX) != NULL) {
-            wakenet_model_ = models->model_name[i];
-            auto words = esp_srmodel_get_wake_words(models, wakenet_model_);
-            // split by ";" to get all wake words
-            std::stringstream ss(words);
-            std::string word;
-            while (std::getline(ss, word, ';')) {
-                wake_words_.push_back(word);
-            }
-        }
+void WakeWordDetect::Initialize(AudioFrontEnd* front_end) {
+    front_end_ = front_end;
+    if (front_end_->wakenet_model() == nullptr) {
+        ESP_LOGE(TAG, "No wakenet model");
+        return;
+    }
+    auto words = esp_srmodel_get_wake_words(front_end_->models(), front_end_->wakenet_model());
+    // split by ";" to get all wake words
+    std::stringstream ss(words);
+    std::string word;
+    while (std::getline(ss, word, ';')) {
+        wake_words_.push_back(word);
     }
 
-    std::string input_format;
-    for (int i = 0; i < codec_->input_channels() - ref_num; i++) {
-        input_format.push_back('M');
+    // Below the front end task, the Opus encoder needs a large stack, kept in PSRAM when there is any
+    wake_word_encode_task_stack_ = (StackType_t*)heap_caps_malloc(4096 * 8, MALLOC_CAP_SPIRAM);
+    if (wake_word_encode_task_stack_ == nullptr) {
+        wake_word_encode_task_stack_ = (StackType_t*)heap_caps_malloc(4096 * 8, MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
     }
-    for (int i = 0; i < ref_num; i++) {
-        input_format.push_back('R');
+    if (wake_word_encode_task_stack_ == nullptr) {
+        ESP_LOGE(TAG, "Failed to allocate the encode task stack, wake word detection disabled");
+        return;
     }
-    afe_config_t* afe_config = afe_config_init(input_format.c_str(), models, AFE_TYPE_SR, AFE_MODE_HIGH_PERF);
-    afe_config->aec_init = codec_->input_reference();
-    afe_config->aec_mode = AEC_MODE_SR_HIGH_PERF;
-    afe_config->afe_perferred_core = 1;
-    afe_config->afe_perferred_priority = 1;
-    afe_config->memory_alloc_mode = AFE_MEMORY_ALLOC_MORE_PSRAM;
-    
-    afe_iface_ = esp_afe_handle_from_config(afe_config);
-    afe_data_ = afe_iface_->create_from_config(afe_config);
-
-    xTaskCreate([](void* arg) {
+
+    preroll_pcm_.Configure(16000, 1);
+    wake_word_encode_task_ = xTaskCreateStatic([](void* arg) {
         auto this_ = (WakeWordDetect*)arg;
-        this_->AudioDetectionTask();
+        this_->PrerollEncodeTask();
         vTaskDelete(NULL);
-    }, "audio_detection", 4096, this, 3, nullptr);
+    }, "encode_detect_packets", 4096 * 8, this, 1, wake_word_encode_task_stack_, &wake_word_encode_task_buffer_);
+
+    consumer_ = front_end_->AddConsumer("wake_word", AUDIO_FRONT_END_WAKENET | AUDIO_FRONT_END_AEC,
+        [this](afe_fetch_result_t* res) {
+            OnFetch(res);
+        });
 }
 
 void WakeWordDetect::OnWakeWordDetected(std::function<void(const std::string& wake_word)> callback) {
@@ -78,110 +60,103 @@ void WakeWordDetect::OnWakeWordDetected(std::function<void(const std::string& wa
 }
 
 void WakeWordDetect::StartDetection() {
-    xEventGroupSetBits(event_group_, DETECTION_RUNNING_EVENT);
+    if (consumer_ < 0) {
+        return;
+    }
+    // Audio from before detection stopped does not belong to the next wake word
+    preroll_reset_ = true;
+    front_end_->Start(consumer_);
 }
 
 void WakeWordDetect::StopDetection() {
-    xEventGroupClearBits(event_group_, DETECTION_RUNNING_EVENT);
-    if (afe_data_ != nullptr) {
-        afe_iface_->reset_buffer(afe_data_);
+    if (consumer_ < 0) {
+        return;
     }
+    front_end_->Stop(consumer_);
 }
 
 bool WakeWordDetect::IsDetectionRunning() {
-    return xEventGroupGetBits(event_group_) & DETECTION_RUNNING_EVENT;
+    return consumer_ >= 0 && front_end_->IsRunning(consumer_);
 }
 
-void WakeWordDetect::Feed(const std::vector<int16_t>& data) {
-    if (afe_data_ == nullptr) {
-        return;
+// On the front end fetch task
+void WakeWordDetect::OnFetch(afe_fetch_result_t* res) {
+    // Store the wake word data for voice recognition, like who is speaking
+    StoreWakeWordData((uint16_t*)res->data, res->data_size / sizeof(uint16_t));
+
+    if (res->wakeup_state == WAKENET_DETECTED) {
+        StopDetection();
+        last_detected_wake_word_ = wake_words_[res->wake_word_index - 1];
+
+        if (wake_word_detected_callback_) {
+            wake_word_detected_callback_(last_detected_wake_word_);
+        }
     }
-    afe_iface_->feed(afe_data_, data.data());
 }
 
-size_t WakeWordDetect::GetFeedSize() {
-    if (afe_data_ == nullptr) {
-        return 0;
-    }
-    return afe_iface_->get_feed_chunksize(afe_data_) * codec_->input_channels();
+// Hands the AFE output to the pre-roll encoder, detect duration is 32ms (sample_rate == 16000, chunksize == 512)
+void WakeWordDetect::StoreWakeWordData(uint16_t* data, size_t samples) {
+    preroll_pcm_.Write((const int16_t*)data, samples, 0);
+    xTaskNotifyGive(wake_word_encode_task_);
 }
 
-void WakeWordDetect::AudioDetectionTask() {
-    auto fetch_size = afe_iface_->get_fetch_chunksize(afe_data_);
-    auto feed_size = afe_iface_->get_feed_chunksize(afe_data_);
-    ESP_LOGI(TAG, "Audio detection task started, feed size: %d fetch size: %d",
-        feed_size, fetch_size);
+// Keeps the last OPUS_PREROLL_MS encoded at complexity 0, so the wake word audio is ready when the channel opens
+void WakeWordDetect::PrerollEncodeTask() {
+    preroll_encoder_ = std::make_unique<OpusEncoderWrapper>(16000, 1, OPUS_FRAME_DURATION_MS);
+    preroll_encoder_->SetComplexity(0); // 0 is the fastest
+    size_t frame_samples = 16000 / 1000 * OPUS_FRAME_DURATION_MS;
 
     while (true) {
-        xEventGroupWaitBits(event_group_, DETECTION_RUNNING_EVENT, pdFALSE, pdTRUE, portMAX_DELAY);
-
-        auto res = afe_iface_->fetch_with_delay(afe_data_, portMAX_DELAY);
-        if (res == nullptr || res->ret_value == ESP_FAIL) {
-            continue;;
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        if (preroll_reset_.exchange(false)) {
+            preroll_encoder_->ResetState();
+            preroll_pcm_.Seek(preroll_reader_);
+            std::lock_guard<std::mutex> lock(wake_word_mutex_);
+            preroll_.Clear();
         }
 
-        // Store the wake word data for voice recognition, like who is speaking
-        StoreWakeWordData((uint16_t*)res->data, res->data_size / sizeof(uint16_t));
-
-        if (res->wakeup_state == WAKENET_DETECTED) {
-            StopDetection();
-            last_detected_wake_word_ = wake_words_[res->wake_word_index - 1];
-
-            if (wake_word_detected_callback_) {
-                wake_word_detected_callback_(last_detected_wake_word_);
+        while (preroll_pcm_.Available(preroll_reader_) >= frame_samples) {
+            // The encoder takes the vector over whenever its own buffer is empty and frees the one it held.
+            // Kept a sample short of a whole frame, its buffer never empties and preroll_frame_ keeps its storage.
+            size_t samples = preroll_encoder_->IsBufferEmpty() ? frame_samples - 1 : frame_samples;
+            preroll_frame_.resize(samples);
+            // Fails only if this task fell a whole ring behind, the reader then skips ahead
+            if (!preroll_pcm_.Read(preroll_reader_, preroll_frame_.data(), samples)) {
+                continue;
             }
+            preroll_encoder_->Encode(std::move(preroll_frame_), [this](std::vector<uint8_t>&& opus) {
+                std::lock_guard<std::mutex> lock(wake_word_mutex_);
+                preroll_.Push(opus.data(), opus.size());
+            });
         }
-    }
-}
 
-void WakeWordDetect::StoreWakeWordData(uint16_t* data, size_t samples) {
-    // store audio data to wake_word_pcm_
-    wake_word_pcm_.emplace_back(std::vector<int16_t>(data, data + samples));
-    // keep about 2 seconds of data, detect duration is 32ms (sample_rate == 16000, chunksize == 512)
-    while (wake_word_pcm_.size() > 2000 / 32) {
-        wake_word_pcm_.pop_front();
+        std::lock_guard<std::mutex> lock(wake_word_mutex_);
+        if (preroll_sealed_) {
+            preroll_sealed_ = false;
+            preroll_ready_ = true;
+            wake_word_cv_.notify_all();
+        }
     }
 }
 
+// Detection has stopped, nothing is written to the PCM ring any more
 void WakeWordDetect::EncodeWakeWordData() {
-    wake_word_opus_.clear();
-    if (wake_word_encode_task_stack_ == nullptr) {
-        wake_word_encode_task_stack_ = (StackType_t*)heap_caps_malloc(4096 * 8, MALLOC_CAP_SPIRAM);
+    {
+        std::lock_guard<std::mutex> lock(wake_word_mutex_);
+        preroll_sealed_ = true;
+        preroll_ready_ = false;
     }
-    wake_word_encode_task_ = xTaskCreateStatic([](void* arg) {
-        auto this_ = (WakeWordDetect*)arg;
-        {
-            auto start_time = esp_timer_get_time();
-            auto encoder = std::make_unique<OpusEncoderWrapper>(16000, 1, OPUS_FRAME_DURATION_MS);
-            encoder->SetComplexity(0); // 0 is the fastest
-
-            for (auto& pcm: this_->wake_word_pcm_) {
-                encoder->Encode(std::move(pcm), [this_](std::vector<uint8_t>&& opus) {
-                    std::lock_guard<std::mutex> lock(this_->wake_word_mutex_);
-                    this_->wake_word_opus_.emplace_back(std::move(opus));
-                    this_->wake_word_cv_.notify_all();
-                });
-            }
-            this_->wake_word_pcm_.clear();
-
-            auto end_time = esp_timer_get_time();
-            ESP_LOGI(TAG, "Encode wake word opus %zu packets in %lld ms",
-                this_->wake_word_opus_.size(), (end_time - start_time) / 1000);
-
-            std::lock_guard<std::mutex> lock(this_->wake_word_mutex_);
-            this_->wake_word_opus_.push_back(std::vector<uint8_t>());
-            this_->wake_word_cv_.notify_all();
-        }
-        vTaskDelete(NULL);
-    }, "encode_detect_packets", 4096 * 8, this, 2, wake_word_encode_task_stack_, &wake_word_encode_task_buffer_);
+    xTaskNotifyGive(wake_word_encode_task_);
 }
 
 bool WakeWordDetect::GetWakeWordOpus(std::vector<uint8_t>& opus) {
     std::unique_lock<std::mutex> lock(wake_word_mutex_);
     wake_word_cv_.wait(lock, [this]() {
-        return !wake_word_opus_.empty();
+        return preroll_ready_;
     });
-    opus.swap(wake_word_opus_.front());
-    wake_word_opus_.pop_front();
-    return !opus.empty();
+    if (!preroll_.Pop(opus)) {
+        preroll_ready_ = false;
+        return false;
+    }
+    return true;
 }
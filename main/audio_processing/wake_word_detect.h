@@ -3,56 +3,65 @@
 
 #include <freertos/FreeRTOS.h>
 #include <freertos/task.h>
-#include <freertos/event_groups.h>
 
 #include <esp_afe_sr_models.h>
-#include <esp_nsn_models.h>
 
-#include <list>
+#include <atomic>
+#include <memory>
 #include <string>
 #include <vector>
 #include <functional>
 #include <mutex>
 #include <condition_variable>
 
-#include "audio_codec.h"
+#include "audio_front_end.h"
+#include "capture_ring.h"
+#include "opus_preroll.h"
 
+class OpusEncoderWrapper;
+
+// Wakenet on the shared AFE front end, which the application feeds
 class WakeWordDetect {
 public:
     WakeWordDetect();
     ~WakeWordDetect();
 
-    void Initialize(AudioCodec* codec);
-    void Feed(const std::vector<int16_t>& data);
+    void Initialize(AudioFrontEnd* front_end);
     void OnWakeWordDetected(std::function<void(const std::string& wake_word)> callback);
     void StartDetection();
     void StopDetection();
     bool IsDetectionRunning();
-    size_t GetFeedSize();
+    // Marks the end of the wake word audio, the pre-roll encoder catches up with the last few frames
     void EncodeWakeWordData();
+    // Returns the pre-roll frames oldest first, false when they are all out
     bool GetWakeWordOpus(std::vector<uint8_t>& opus);
     const std::string& GetLastDetectedWakeWord() const { return last_detected_wake_word_; }
 
 private:
-    esp_afe_sr_iface_t* afe_iface_ = nullptr;
-    esp_afe_sr_data_t* afe_data_ = nullptr;
-    char* wakenet_model_ = NULL;
+    AudioFrontEnd* front_end_ = nullptr;
+    int consumer_ = -1;
     std::vector<std::string> wake_words_;
-    EventGroupHandle_t event_group_;
     std::function<void(const std::string& wake_word)> wake_word_detected_callback_;
-    AudioCodec* codec_ = nullptr;
     std::string last_detected_wake_word_;
 
+    // The AFE output is encoded as it comes, by a low priority task, into a ring of Opus frames
     TaskHandle_t wake_word_encode_task_ = nullptr;
     StaticTask_t wake_word_encode_task_buffer_;
     StackType_t* wake_word_encode_task_stack_ = nullptr;
-    std::list<std::vector<int16_t>> wake_word_pcm_;
-    std::list<std::vector<uint8_t>> wake_word_opus_;
+    std::unique_ptr<OpusEncoderWrapper> preroll_encoder_;   // encode task
+    CaptureRing preroll_pcm_;                               // detection task to encode task
+    CaptureRing::Reader preroll_reader_;                    // encode task
+    std::vector<int16_t> preroll_frame_;                    // encode task
+    std::atomic<bool> preroll_reset_ = false;
     std::mutex wake_word_mutex_;
     std::condition_variable wake_word_cv_;
+    OpusPreroll preroll_;               // wake_word_mutex_
+    bool preroll_sealed_ = false;       // wake_word_mutex_, the encoder has yet to catch up
+    bool preroll_ready_ = false;        // wake_word_mutex_, every frame up to the detection is in
 
     void StoreWakeWordData(uint16_t* data, size_t size);
-    void AudioDetectionTask();
+    void OnFetch(afe_fetch_result_t* res);
+    void PrerollEncodeTask();
 };
 
 #endif
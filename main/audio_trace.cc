@@ -0,0 +1,73 @@
+#include "audio_trace.h"
+
+#include <esp_log.h>
+#include <esp_heap_caps.h>
+#include <cstring>
+
+#define TAG "AudioTrace"
+
+// Records per log line, 8 records are 256 hex characters
+#define AUDIO_TRACE_RECORDS_PER_LINE 8
+
+AudioTrace::AudioTrace() {
+#if CONFIG_USE_AUDIO_TRACE
+    size_t size = AUDIO_TRACE_BUFFER_SIZE * sizeof(AudioTraceRecord);
+    // Prefer PSRAM, the buffer is written once per stage and frame and never read on the hot path
+    records_ = (AudioTraceRecord*)heap_caps_calloc(1, size, MALLOC_CAP_SPIRAM);
+    if (records_ == nullptr) {
+        records_ = (AudioTraceRecord*)heap_caps_calloc(1, size, MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+    }
+    if (records_ == nullptr) {
+        ESP_LOGE(TAG, "Failed to allocate %u bytes, tracing disabled", size);
+    }
+#endif
+}
+
+AudioTrace::~AudioTrace() {
+    if (records_ != nullptr) {
+        heap_caps_free(records_);
+    }
+}
+
+std::vector<AudioTraceRecord> AudioTrace::Snapshot() {
+    std::vector<AudioTraceRecord> records;
+    if (records_ == nullptr) {
+        return records;
+    }
+
+    paused_.store(true, std::memory_order_relaxed);
+    uint32_t head = head_.load(std::memory_order_acquire);
+    uint32_t count = head < AUDIO_TRACE_BUFFER_SIZE ? head : AUDIO_TRACE_BUFFER_SIZE;
+    records.resize(count);
+    for (uint32_t i = 0; i < count; i++) {
+        records[i] = records_[(head - count + i) & (AUDIO_TRACE_BUFFER_SIZE - 1)];
+    }
+    paused_.store(false, std::memory_order_relaxed);
+    return records;
+}
+
+void AudioTrace::Dump() {
+    auto records = Snapshot();
+    ESP_LOGI(TAG, "AUDIO_TRACE_BEGIN %u", records.size());
+
+    static const char hex_chars[] = "0123456789abcdef";
+    char line[AUDIO_TRACE_RECORDS_PER_LINE * sizeof(AudioTraceRecord) * 2 + 1];
+    for (size_t i = 0; i < records.size(); i += AUDIO_TRACE_RECORDS_PER_LINE) {
+        size_t count = std::min<size_t>(AUDIO_TRACE_RECORDS_PER_LINE, records.size() - i);
+        auto bytes = (const uint8_t*)&records[i];
+        size_t length = count * sizeof(AudioTraceRecord);
+        for (size_t j = 0; j < length; j++) {
+            line[j * 2] = hex_chars[bytes[j] >> 4];
+            line[j * 2 + 1] = hex_chars[bytes[j] & 0x0F];
+        }
+        line[length * 2] = '\0';
+        ESP_LOGI(TAG, "AT %s", line);
+    }
+    ESP_LOGI(TAG, "AUDIO_TRACE_END");
+}
+
+void AudioTrace::Clear() {
+    paused_.store(true, std::memory_order_relaxed);
+    head_.store(0, std::memory_order_release);
+    paused_.store(false, std::memory_order_relaxed);
+}
@@ -0,0 +1,89 @@
+#ifndef AUDIO_TRACE_H
+#define AUDIO_TRACE_H
+
+#include <esp_timer.h>
+
+#include <atomic>
+#include <cstdint>
+#include <vector>
+
+/*
+ * Per-frame audio latency trace.
+ *
+ * Every pipeline stage stores a 16-byte record in a fixed ring buffer, the oldest records are overwritten.
+ * Records of the same frame share an id:
+ *   uplink   - capture position in ms at 16kHz since listening started, at the end of the data the stage handled
+ *   downlink - AudioStreamPacket::timestamp of the packet
+ * scripts/audio_trace.py turns a dump into a Chrome trace (chrome://tracing, Perfetto).
+ */
+
+#ifdef CONFIG_AUDIO_TRACE_BUFFER_SIZE
+#define AUDIO_TRACE_BUFFER_SIZE CONFIG_AUDIO_TRACE_BUFFER_SIZE
+#else
+#define AUDIO_TRACE_BUFFER_SIZE 1024
+#endif
+static_assert((AUDIO_TRACE_BUFFER_SIZE & (AUDIO_TRACE_BUFFER_SIZE - 1)) == 0, "Trace buffer size must be a power of 2");
+
+enum AudioTraceEvent : uint8_t {
+    kAudioTraceReadAudio,
+    kAudioTraceAfeFetch,
+    kAudioTraceEncodeStart,
+    kAudioTraceEncodeEnd,
+    kAudioTraceSendAudio,
+    kAudioTraceIncomingAudio,
+    kAudioTraceDecodeStart,
+    kAudioTraceDecodeEnd,
+    kAudioTraceOutputData,
+};
+
+struct AudioTraceRecord {
+    int64_t time_us;
+    uint32_t id;
+    uint8_t event;
+    uint8_t reserved[3];
+};
+
+class AudioTrace {
+public:
+    static AudioTrace& GetInstance() {
+        static AudioTrace instance;
+        return instance;
+    }
+
+    AudioTrace(const AudioTrace&) = delete;
+    AudioTrace& operator=(const AudioTrace&) = delete;
+
+    // Lock-free, safe to call from any task
+    inline void Record(AudioTraceEvent event, uint32_t id) {
+        if (records_ == nullptr || paused_.load(std::memory_order_relaxed)) {
+            return;
+        }
+        uint32_t index = head_.fetch_add(1, std::memory_order_relaxed);
+        auto& record = records_[index & (AUDIO_TRACE_BUFFER_SIZE - 1)];
+        record.time_us = esp_timer_get_time();
+        record.id = id;
+        record.event = event;
+    }
+
+    // Oldest first, recording is paused while copying
+    std::vector<AudioTraceRecord> Snapshot();
+    // Logs the buffer as hex lines between AUDIO_TRACE_BEGIN and AUDIO_TRACE_END
+    void Dump();
+    void Clear();
+
+private:
+    AudioTrace();
+    ~AudioTrace();
+
+    AudioTraceRecord* records_ = nullptr;
+    std::atomic<uint32_t> head_ = 0;
+    std::atomic<bool> paused_ = false;
+};
+
+#if CONFIG_USE_AUDIO_TRACE
+#define AUDIO_TRACE(event, id) AudioTrace::GetInstance().Record(event, id)
+#else
+#define AUDIO_TRACE(event, id) ((void)0)
+#endif
+
+#endif // AUDIO_TRACE_H
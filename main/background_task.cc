@@ -1,63 +1,74 @@
 #include "background_task.h"
 
 #include <esp_log.h>
-#include <esp_task_wdt.h>
+#include <freertos/semphr.h>
 
 #define TAG "BackgroundTask"
 
-BackgroundTask::BackgroundTask(uint32_t stack_size) {
-    xTaskCreate([](void* arg) {
+BackgroundTask::BackgroundTask(const char* name, uint32_t stack_size, UBaseType_t priority, BaseType_t core_id)
+    : name_(name) {
+    room_ = xSemaphoreCreateBinaryStatic(&room_buffer_);
+    xTaskCreatePinnedToCore([](void* arg) {
         BackgroundTask* task = (BackgroundTask*)arg;
         task->BackgroundTaskLoop();
-    }, "background_task", stack_size, this, 2, &background_task_handle_);
+    }, name, stack_size, this, priority, &background_task_handle_, core_id);
 }
 
 BackgroundTask::~BackgroundTask() {
     if (background_task_handle_ != nullptr) {
         vTaskDelete(background_task_handle_);
     }
+    vSemaphoreDelete(room_);
 }
 
-void BackgroundTask::Schedule(std::function<void()> callback) {
-    std::lock_guard<std::mutex> lock(mutex_);
-    if (active_tasks_ >= 30) {
-        int free_sram = heap_caps_get_free_size(MALLOC_CAP_INTERNAL);
-        if (free_sram < 10000) {
-            ESP_LOGW(TAG, "active_tasks_ == %u, free_sram == %u", active_tasks_.load(), free_sram);
-        }
-    }
-    active_tasks_++;
-    main_tasks_.emplace_back([this, cb = std::move(callback)]() {
-        cb();
-        {
-            std::lock_guard<std::mutex> lock(mutex_);
-            active_tasks_--;
-            if (main_tasks_.empty() && active_tasks_ == 0) {
-                condition_variable_.notify_all();
-            }
-        }
+void BackgroundTask::WaitForCompletion() {
+    StaticSemaphore_t done_buffer;
+    SemaphoreHandle_t done = xSemaphoreCreateBinaryStatic(&done_buffer);
+    Fence([done]() {
+        xSemaphoreGive(done);
     });
-    condition_variable_.notify_all();
+    xSemaphoreTake(done, portMAX_DELAY);
+    vSemaphoreDelete(done);
 }
 
-void BackgroundTask::WaitForCompletion() {
-    std::unique_lock<std::mutex> lock(mutex_);
-    condition_variable_.wait(lock, [this]() {
-        return main_tasks_.empty() && active_tasks_ == 0;
-    });
+BackgroundTaskStats BackgroundTask::GetStats() const {
+    return BackgroundTaskStats{
+        .depth = queue_.size(),
+        .high_water = queue_.high_water(),
+        .completed = completed_.load(std::memory_order_relaxed),
+        .dropped = dropped_.load(std::memory_order_relaxed),
+        .avg_latency_us = avg_latency_us_.load(std::memory_order_relaxed),
+        .max_latency_us = max_latency_us_.load(std::memory_order_relaxed),
+        .avg_run_us = avg_run_us_.load(std::memory_order_relaxed),
+    };
 }
 
 void BackgroundTask::BackgroundTaskLoop() {
-    ESP_LOGI(TAG, "background_task started");
+    ESP_LOGI(TAG, "%s started", name_);
+    Entry entry;
     while (true) {
-        std::unique_lock<std::mutex> lock(mutex_);
-        condition_variable_.wait(lock, [this]() { return !main_tasks_.empty(); });
-        
-        std::list<std::function<void()>> tasks = std::move(main_tasks_);
-        lock.unlock();
-
-        for (auto& task : tasks) {
-            task();
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+
+        while (queue_.TryPop(entry)) {
+            if (room_waiters_.load(std::memory_order_acquire) > 0) {
+                xSemaphoreGive(room_);
+            }
+            int64_t start_time = esp_timer_get_time();
+            entry.callback();
+            entry.callback.Reset();
+            int64_t end_time = esp_timer_get_time();
+
+            // Exponential moving average with a 1/16 weight
+            uint32_t latency = start_time - entry.enqueue_time_us;
+            uint32_t run = end_time - start_time;
+            uint32_t avg_latency = avg_latency_us_.load(std::memory_order_relaxed);
+            uint32_t avg_run = avg_run_us_.load(std::memory_order_relaxed);
+            avg_latency_us_.store(avg_latency + ((int32_t)latency - (int32_t)avg_latency) / 16, std::memory_order_relaxed);
+            avg_run_us_.store(avg_run + ((int32_t)run - (int32_t)avg_run) / 16, std::memory_order_relaxed);
+            if (latency > max_latency_us_.load(std::memory_order_relaxed)) {
+                max_latency_us_.store(latency, std::memory_order_relaxed);
+            }
+            completed_.fetch_add(1, std::memory_order_relaxed);
         }
     }
 }
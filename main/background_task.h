@@ -3,25 +3,92 @@
 
 #include <freertos/FreeRTOS.h>
 #include <freertos/task.h>
-#include <mutex>
-#include <list>
-#include <condition_variable>
+#include <freertos/semphr.h>
+#include <esp_timer.h>
 #include <atomic>
+#include <cstdint>
 
+#include "task_queue.h"
+
+#define BACKGROUND_TASK_QUEUE_SIZE 16
+
+using BackgroundCallback = InlineTask<12 * sizeof(void*)>;
+
+struct BackgroundTaskStats {
+    size_t depth;
+    size_t high_water;
+    uint32_t completed;
+    uint32_t dropped;
+    uint32_t avg_latency_us;    // Moving average of the time from Schedule to start of execution
+    uint32_t max_latency_us;
+    uint32_t avg_run_us;        // Moving average of the execution time
+};
+
+// A single worker lane: one FreeRTOS task draining a bounded lock-free queue in FIFO order.
+// Application runs one lane per job class (e.g. opus encode and decode) so they never wait on each other.
 class BackgroundTask {
 public:
-    BackgroundTask(uint32_t stack_size = 4096 * 2);
+    BackgroundTask(const char* name, uint32_t stack_size = 4096 * 2, UBaseType_t priority = 2,
+                   BaseType_t core_id = tskNO_AFFINITY);
     ~BackgroundTask();
 
-    void Schedule(std::function<void()> callback);
+    // Returns false (and counts a drop) if the lane queue is full, the caller decides what the lost task means
+    template <typename F>
+    bool Schedule(F&& callback) {
+        Entry entry{BackgroundCallback(std::forward<F>(callback)), esp_timer_get_time()};
+        if (!queue_.TryPush(entry)) {
+            dropped_.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+        xTaskNotifyGive(background_task_handle_);
+        return true;
+    }
+
+    // Async completion barrier: callback runs on this lane after every task scheduled before it.
+    // A fence is never dropped, if the queue is full the caller sleeps until the lane takes a task out.
+    template <typename F>
+    void Fence(F&& callback) {
+        Entry entry{BackgroundCallback(std::forward<F>(callback)), esp_timer_get_time()};
+        while (!queue_.TryPush(entry)) {
+            // Registered before the retry, so a pop in between gives the semaphore
+            room_waiters_.fetch_add(1, std::memory_order_acq_rel);
+            bool pushed = queue_.TryPush(entry);
+            if (!pushed) {
+                xSemaphoreTake(room_, portMAX_DELAY);
+            }
+            room_waiters_.fetch_sub(1, std::memory_order_acq_rel);
+            if (pushed) {
+                break;
+            }
+        }
+        xTaskNotifyGive(background_task_handle_);
+    }
+
+    // Blocks the caller until the lane is drained. Must not be called from the lane itself.
     void WaitForCompletion();
 
+    BackgroundTaskStats GetStats() const;
+
 private:
-    std::mutex mutex_;
-    std::list<std::function<void()>> main_tasks_;
-    std::condition_variable condition_variable_;
+    struct Entry {
+        BackgroundCallback callback;
+        int64_t enqueue_time_us = 0;
+    };
+
+    const char* name_;
+    TaskQueue<Entry, BACKGROUND_TASK_QUEUE_SIZE> queue_;
     TaskHandle_t background_task_handle_ = nullptr;
-    std::atomic<size_t> active_tasks_{0};
+    // Fences waiting for room, woken by the lane after each task it takes out
+    StaticSemaphore_t room_buffer_;
+    SemaphoreHandle_t room_ = nullptr;
+    std::atomic<int> room_waiters_{0};
+
+    std::atomic<uint32_t> dropped_{0};
+    // Written only by the lane task
+    std::atomic<uint32_t> completed_{0};
+    std::atomic<uint32_t> avg_latency_us_{0};
+    std::atomic<uint32_t> max_latency_us_{0};
+    std::atomic<uint32_t> avg_run_us_{0};
 
     void BackgroundTaskLoop();
 };
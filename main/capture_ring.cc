@@ -0,0 +1,144 @@
+#include "capture_ring.h"
+
+#include <esp_log.h>
+#include <esp_heap_caps.h>
+#include <algorithm>
+#include <cstring>
+
+#define TAG "CaptureRing"
+
+CaptureRing::CaptureRing() {
+}
+
+CaptureRing::~CaptureRing() {
+    if (buffer_ != nullptr) {
+        heap_caps_free(buffer_);
+    }
+}
+
+bool CaptureRing::Configure(int sample_rate, int channels) {
+    if (buffer_ != nullptr) {
+        heap_caps_free(buffer_);
+    }
+    sample_rate_ = sample_rate;
+    channels_ = channels;
+    capacity_ = sample_rate * CAPTURE_RING_MS / 1000;
+    // Read every few milliseconds, keep it in internal RAM
+    buffer_ = (int16_t*)heap_caps_malloc(capacity_ * channels_ * sizeof(int16_t), MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+    if (buffer_ == nullptr) {
+        ESP_LOGE(TAG, "Failed to allocate %u frames", capacity_);
+        capacity_ = 0;
+        return false;
+    }
+    write_position_.store(0, std::memory_order_relaxed);
+    write_limit_.store(0, std::memory_order_relaxed);
+    overruns_.store(0, std::memory_order_relaxed);
+    ESP_LOGI(TAG, "%u frames of %d channels at %dHz", capacity_, channels_, sample_rate_);
+    return true;
+}
+
+void CaptureRing::Write(const int16_t* data, size_t frames, int64_t capture_time_us) {
+    if (capacity_ == 0) {
+        return;
+    }
+    uint32_t position = write_position_.load(std::memory_order_relaxed);
+    // Only the newest capacity_ frames can be read, skip the rest of an oversized write
+    if (frames > capacity_) {
+        data += (frames - capacity_) * channels_;
+        capture_time_us += int64_t(frames - capacity_) * 1000000 / sample_rate_;
+        position += frames - capacity_;
+        frames = capacity_;
+    }
+
+    anchors_.Push(Anchor{position, capture_time_us});
+
+    // Readers copying frames this write overwrites find out from the limit
+    write_limit_.store(position + frames, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    size_t offset = position % capacity_;
+    size_t first = std::min(frames, capacity_ - offset);
+    memcpy(buffer_ + offset * channels_, data, first * channels_ * sizeof(int16_t));
+    if (first < frames) {
+        memcpy(buffer_, data + first * channels_, (frames - first) * channels_ * sizeof(int16_t));
+    }
+    // Publishes the samples and the anchor
+    write_position_.store(position + frames, std::memory_order_release);
+}
+
+size_t CaptureRing::Available(const Reader& reader) const {
+    uint32_t available = write_position_.load(std::memory_order_acquire) - reader.position;
+    return std::min<size_t>(available, capacity_);
+}
+
+void CaptureRing::Seek(Reader& reader) const {
+    reader.position = write_position_.load(std::memory_order_acquire);
+}
+
+int64_t CaptureRing::GetCaptureTime(uint32_t position) const {
+    // The newest write at or before the position, anchors are pushed in position order.
+    // An older position is extrapolated back from the oldest anchor left.
+    uint32_t head = anchors_.head();
+    Anchor anchor;
+    bool found = false;
+    for (uint32_t i = 1; i <= CAPTURE_RING_ANCHORS && i <= head; i++) {
+        Anchor candidate;
+        if (!anchors_.Read(head - i, candidate)) {
+            continue;
+        }
+        anchor = candidate;
+        found = true;
+        if (int32_t(position - candidate.position) >= 0) {
+            break;
+        }
+    }
+    if (!found) {
+        return 0;
+    }
+    return anchor.time_us + int64_t(int32_t(position - anchor.position)) * 1000000 / sample_rate_;
+}
+
+bool CaptureRing::Read(Reader& reader, int16_t* data, size_t frames, int64_t* capture_time_us) {
+    if (capacity_ == 0 || frames > capacity_) {
+        return false;
+    }
+    uint32_t write_position = write_position_.load(std::memory_order_acquire);
+    if (write_position - reader.position > capacity_) {
+        // Overwritten while the reader was away, continue with the oldest frame still there
+        reader.position = write_position - capacity_;
+        reader.overruns++;
+        overruns_.fetch_add(1, std::memory_order_relaxed);
+    }
+    if (write_position - reader.position < frames) {
+        return false;
+    }
+
+    size_t offset = reader.position % capacity_;
+    size_t first = std::min(frames, capacity_ - offset);
+    memcpy(data, buffer_ + offset * channels_, first * channels_ * sizeof(int16_t));
+    if (first < frames) {
+        memcpy(data + first * channels_, buffer_, (frames - first) * channels_ * sizeof(int16_t));
+    }
+    if (capture_time_us != nullptr) {
+        *capture_time_us = GetCaptureTime(reader.position);
+    }
+
+    // The writer does not wait for readers, make sure it did not lap this one during the copy
+    std::atomic_thread_fence(std::memory_order_acquire);
+    uint32_t write_limit = write_limit_.load(std::memory_order_relaxed);
+    if (write_limit - reader.position > capacity_) {
+        reader.position = write_limit - capacity_;
+        reader.overruns++;
+        overruns_.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+    reader.position += frames;
+    return true;
+}
+
+CaptureRingStats CaptureRing::GetStats() const {
+    return CaptureRingStats{
+        .written = write_position_.load(std::memory_order_relaxed),
+        .overruns = overruns_.load(std::memory_order_relaxed),
+    };
+}
@@ -0,0 +1,76 @@
+#ifndef CAPTURE_RING_H
+#define CAPTURE_RING_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+#include "seqlock_ring.h"
+
+// Capture is read from I2S in chunks of this length, independent of what the consumers feed
+#define CAPTURE_CHUNK_MS 10
+// History kept for consumers that fall behind, a consumer further behind loses the oldest audio.
+// The wake word silence gate keeps its pre-roll here as well.
+#ifdef CONFIG_USE_WAKE_WORD_PRE_VAD
+#define CAPTURE_RING_MS 320
+#else
+#define CAPTURE_RING_MS 160
+#endif
+// Capture times of the last writes, enough to cover the whole ring
+#define CAPTURE_RING_ANCHORS (CAPTURE_RING_MS / CAPTURE_CHUNK_MS + 2)
+
+struct CaptureRingStats {
+    uint32_t written;       // Frames since Configure
+    uint32_t overruns;      // Reads that found their data overwritten, summed over the readers
+};
+
+// Interleaved 16kHz capture written by one task and read by any number of readers, each with its own position.
+// Lock free: the writer never waits, a reader that falls more than the ring behind skips to the oldest audio left.
+// Every frame has a capture time, interpolated from the time of the write it came with.
+class CaptureRing {
+public:
+    struct Reader {
+        uint32_t position = 0;  // Next frame to read
+        uint32_t overruns = 0;
+    };
+
+    CaptureRing();
+    ~CaptureRing();
+
+    // Not thread safe, call before the writer and the readers start
+    bool Configure(int sample_rate, int channels);
+
+    // Writer only. capture_time_us is when the first frame was captured.
+    void Write(const int16_t* data, size_t frames, int64_t capture_time_us);
+
+    // Copies exactly frames frames and returns true, or returns false without reading if fewer are available.
+    // capture_time_us, if given, is set to the capture time of the first frame.
+    bool Read(Reader& reader, int16_t* data, size_t frames, int64_t* capture_time_us = nullptr);
+    // Frames the reader can read now
+    size_t Available(const Reader& reader) const;
+    // Starts the reader at the newest frame, dropping what it has not read
+    void Seek(Reader& reader) const;
+
+    CaptureRingStats GetStats() const;
+    inline int channels() const { return channels_; }
+
+private:
+    struct Anchor {
+        uint32_t position;
+        int64_t time_us;
+    };
+
+    int16_t* buffer_ = nullptr;
+    size_t capacity_ = 0;       // Frames
+    int channels_ = 1;
+    int sample_rate_ = 16000;
+    std::atomic<uint32_t> write_position_ = 0;    // Frames before it are readable
+    std::atomic<uint32_t> write_limit_ = 0;       // Frames before it may be in the middle of being written
+    std::atomic<uint32_t> overruns_ = 0;
+    // Readers look up capture times while the writer adds anchors
+    SeqlockRing<Anchor, CAPTURE_RING_ANCHORS> anchors_;
+
+    int64_t GetCaptureTime(uint32_t position) const;
+};
+
+#endif // CAPTURE_RING_H
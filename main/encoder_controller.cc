@@ -0,0 +1,144 @@
+#include "encoder_controller.h"
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <algorithm>
+
+#define TAG "EncoderController"
+
+void EncoderController::Configure(int min_complexity, int max_complexity, int complexity, bool dtx, int frame_duration_ms) {
+    min_complexity_ = min_complexity;
+    max_complexity_ = std::max(min_complexity, max_complexity);
+    default_dtx_ = dtx;
+    frame_duration_ms_ = frame_duration_ms;
+    settings_ = EncoderSettings{std::clamp(complexity, min_complexity_, max_complexity_), dtx};
+    window_start_us_ = esp_timer_get_time();
+    SampleIdle();
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    stats_.complexity = settings_.complexity;
+    stats_.dtx = settings_.dtx;
+    stats_.idle_percent = -1;
+    ESP_LOGI(TAG, "Complexity %d in [%d, %d], DTX %s", settings_.complexity, min_complexity_, max_complexity_,
+        dtx ? "on" : "off");
+}
+
+bool EncoderController::Admit(bool busy) {
+    if (!busy) {
+        busy_chunks_ = 0;
+        return true;
+    }
+    window_busy_++;
+    // A short backlog drains on its own, one that persists means the link can not keep up
+    if (++busy_chunks_ > ENCODER_CONTROL_BUSY_CHUNKS) {
+        window_dropped_++;
+        return false;
+    }
+    return true;
+}
+
+void EncoderController::OnEncode(uint32_t encode_us, int frames) {
+    window_encode_us_ += encode_us;
+    window_frames_ += frames;
+}
+
+// Idle task run time in percent of the time since the last call, over the encode core or all cores
+// when the encode task is not pinned
+int EncoderController::SampleIdle() {
+#if configGENERATE_RUN_TIME_STATS
+#if CONFIG_AUDIO_ENCODE_TASK_CORE >= 0
+    const int first_core = CONFIG_AUDIO_ENCODE_TASK_CORE;
+    const int last_core = CONFIG_AUDIO_ENCODE_TASK_CORE;
+#else
+    const int first_core = 0;
+    const int last_core = portNUM_PROCESSORS - 1;
+#endif
+    uint64_t idle = 0;
+    for (int core = first_core; core <= last_core; core++) {
+        idle += ulTaskGetRunTimeCounter(xTaskGetIdleTaskHandleForCore(core));
+    }
+    uint64_t total = uint64_t(portGET_RUN_TIME_COUNTER_VALUE()) * (last_core - first_core + 1);
+    // The counters are 32 bit and wrap, differences of the truncated values stay right
+    uint32_t idle_delta = uint32_t(idle) - uint32_t(last_idle_);
+    uint32_t total_delta = uint32_t(total) - uint32_t(last_total_);
+    last_idle_ = idle;
+    last_total_ = total;
+    if (total_delta == 0) {
+        return -1;
+    }
+    return std::min<int>(100, uint64_t(idle_delta) * 100 / total_delta);
+#else
+    return -1;
+#endif
+}
+
+bool EncoderController::Update(EncoderSettings& settings) {
+    int64_t now = esp_timer_get_time();
+    if (now - window_start_us_ < ENCODER_CONTROL_WINDOW_MS * 1000) {
+        return false;
+    }
+    int idle = SampleIdle();
+    uint32_t load = 0;
+    if (window_frames_ > 0) {
+        load = window_encode_us_ * 100 / (uint64_t(window_frames_) * frame_duration_ms_ * 1000);
+    }
+    uint32_t busy = window_busy_;
+    uint32_t dropped = window_dropped_;
+    bool encoded = window_frames_ > 0;
+    window_start_us_ = now;
+    window_encode_us_ = 0;
+    window_frames_ = 0;
+    window_busy_ = 0;
+    window_dropped_ = 0;
+
+    EncoderSettings next = settings_;
+    bool overloaded = load > ENCODER_CONTROL_HIGH_LOAD || (idle >= 0 && idle < ENCODER_CONTROL_MIN_IDLE);
+    if (busy > 0 || (encoded && overloaded)) {
+        // Back off fast: two steps, and DTX so that silence costs nothing on the wire
+        next.complexity = std::max(min_complexity_, settings_.complexity - 2);
+        next.dtx = next.dtx || busy > 0;
+        clean_windows_ = 0;
+    } else if (encoded && load < ENCODER_CONTROL_LOW_LOAD && (idle < 0 || idle > ENCODER_CONTROL_RAISE_IDLE)) {
+        // Creep back up one step at a time, the configured DTX first
+        if (++clean_windows_ >= ENCODER_CONTROL_RAISE_HOLDOFF) {
+            clean_windows_ = 0;
+            if (next.dtx != default_dtx_) {
+                next.dtx = default_dtx_;
+            } else if (next.complexity < max_complexity_) {
+                next.complexity++;
+            }
+        }
+    }
+    bool changed = next.complexity != settings_.complexity || next.dtx != settings_.dtx;
+    if (changed) {
+        ESP_LOGI(TAG, "Complexity %d -> %d, DTX %s (load %lu%%, idle %d%%, busy %lu, dropped %lu)",
+            settings_.complexity, next.complexity, next.dtx ? "on" : "off", load, idle, busy, dropped);
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (next.complexity < settings_.complexity) {
+            stats_.lowered++;
+        } else if (next.complexity > settings_.complexity) {
+            stats_.raised++;
+        }
+        stats_.complexity = next.complexity;
+        stats_.dtx = next.dtx;
+        if (encoded) {
+            stats_.load_percent = load;
+        }
+        stats_.idle_percent = idle;
+        stats_.busy += busy;
+        stats_.dropped += dropped;
+    }
+    settings_ = next;
+    settings = next;
+    return changed;
+}
+
+EncoderControllerStats EncoderController::GetStats() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return stats_;
+}
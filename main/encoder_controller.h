@@ -0,0 +1,85 @@
+#ifndef ENCODER_CONTROLLER_H
+#define ENCODER_CONTROLLER_H
+
+#include <cstdint>
+#include <mutex>
+
+#ifdef CONFIG_OPUS_ENCODER_MIN_COMPLEXITY
+#define ENCODER_MIN_COMPLEXITY CONFIG_OPUS_ENCODER_MIN_COMPLEXITY
+#define ENCODER_MAX_COMPLEXITY CONFIG_OPUS_ENCODER_MAX_COMPLEXITY
+#else
+#define ENCODER_MIN_COMPLEXITY 0
+#define ENCODER_MAX_COMPLEXITY 5
+#endif
+
+// Decisions are taken once per window
+#define ENCODER_CONTROL_WINDOW_MS 1000
+// Encode time in percent of the audio it encodes: above HIGH complexity goes down, below LOW it may go up
+#define ENCODER_CONTROL_HIGH_LOAD 40
+#define ENCODER_CONTROL_LOW_LOAD 20
+// Idle time of the encode core in percent: below MIN complexity goes down, above RAISE it may go up
+#define ENCODER_CONTROL_MIN_IDLE 10
+#define ENCODER_CONTROL_RAISE_IDLE 30
+// Clean windows in a row before complexity goes up one step or DTX goes back to its default
+#define ENCODER_CONTROL_RAISE_HOLDOFF 5
+// Chunks in a row that are still encoded while the send queue is backlogged, later ones are dropped
+#define ENCODER_CONTROL_BUSY_CHUNKS 4
+
+struct EncoderSettings {
+    int complexity;
+    bool dtx;
+};
+
+struct EncoderControllerStats {
+    int complexity;
+    bool dtx;
+    uint32_t load_percent;      // Encode time against audio time, last window
+    int idle_percent;           // Encode core, last window, -1 without FreeRTOS run time stats
+    uint32_t busy;              // Chunks that found the send queue backlogged
+    uint32_t dropped;           // Of those, chunks dropped
+    uint32_t lowered;
+    uint32_t raised;
+};
+
+// Closed loop over the uplink Opus encoder settings. Measures the encode time per frame, the idle time
+// of the encode core and how often the send queue is backlogged, and once per window lowers complexity
+// (and turns DTX on) under load or backpressure, or raises it one step after a few clean windows,
+// between the configured bounds. Everything but GetStats() runs on the encode task.
+class EncoderController {
+public:
+    void Configure(int min_complexity, int max_complexity, int complexity, bool dtx, int frame_duration_ms);
+    EncoderSettings settings() const { return settings_; }
+
+    // Returns false if the chunk should be dropped, the send queue has been backlogged for too long
+    bool Admit(bool busy);
+    // After each Encode() call, frames is the number of Opus frames it produced
+    void OnEncode(uint32_t encode_us, int frames);
+    // Returns true with the new settings when they changed
+    bool Update(EncoderSettings& settings);
+
+    EncoderControllerStats GetStats() const;
+
+private:
+    int min_complexity_ = ENCODER_MIN_COMPLEXITY;
+    int max_complexity_ = ENCODER_MAX_COMPLEXITY;
+    bool default_dtx_ = true;
+    int frame_duration_ms_ = 60;
+    EncoderSettings settings_ = {ENCODER_MIN_COMPLEXITY, true};
+
+    int64_t window_start_us_ = 0;
+    uint64_t window_encode_us_ = 0;
+    uint32_t window_frames_ = 0;
+    uint32_t window_busy_ = 0;
+    uint32_t window_dropped_ = 0;
+    int busy_chunks_ = 0;
+    int clean_windows_ = 0;
+    uint64_t last_idle_ = 0;
+    uint64_t last_total_ = 0;
+
+    mutable std::mutex mutex_;
+    EncoderControllerStats stats_ = {};
+
+    int SampleIdle();
+};
+
+#endif // ENCODER_CONTROLLER_H
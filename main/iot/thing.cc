@@ -44,23 +44,24 @@ std::string Thing::GetStateJson() {
     return json_str;
 }
 
-void Thing::Invoke(const cJSON* command) {
-    auto method_name = cJSON_GetObjectItem(command, "method");
-    auto input_params = cJSON_GetObjectItem(command, "parameters");
+void Thing::Invoke(const JsonObject& command) {
+    auto& method_name = command.Get("method");
+    JsonObject input_params;
+    input_params.Parse(command.Get("parameters"));
 
     try {
-        auto& method = methods_[method_name->valuestring];
+        auto& method = methods_[method_name.c_str()];
         for (auto& param : method.parameters()) {
-            auto input_param = cJSON_GetObjectItem(input_params, param.name().c_str());
-            if (param.required() && input_param == nullptr) {
+            auto& input_param = input_params.Get(param.name().c_str());
+            if (param.required() && !input_param) {
                 throw std::runtime_error("Parameter " + param.name() + " is required");
             }
             if (param.type() == kValueTypeNumber) {
-                param.set_number(input_param->valueint);
+                param.set_number(input_param.ToInt());
             } else if (param.type() == kValueTypeString) {
-                param.set_string(input_param->valuestring);
+                param.set_string(input_param.c_str());
             } else if (param.type() == kValueTypeBoolean) {
-                param.set_boolean(input_param->valueint == 1);
+                param.set_boolean(input_param.ToBool() || input_param.ToInt() == 1);
             }
         }
 
@@ -68,7 +69,7 @@ void Thing::Invoke(const cJSON* command) {
             method.Invoke();
         });
     } catch (const std::runtime_error& e) {
-        ESP_LOGE(TAG, "Method not found: %s", method_name->valuestring);
+        ESP_LOGE(TAG, "Method not found: %s", method_name.c_str());
         return;
     }
 }
@@ -6,7 +6,7 @@
 #include <functional>
 #include <vector>
 #include <stdexcept>
-#include <cJSON.h>
+#include "json_reader.h"
 
 namespace iot {
 
@@ -268,7 +268,7 @@ public:
 
     virtual std::string GetDescriptorJson();
     virtual std::string GetStateJson();
-    virtual void Invoke(const cJSON* command);
+    virtual void Invoke(const JsonObject& command);
 
     const std::string& name() const { return name_; }
     const std::string& description() const { return description_; }
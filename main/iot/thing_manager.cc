@@ -50,11 +50,16 @@ bool ThingManager::GetStatesJson(std::string& json, bool delta) {
     return changed;
 }
 
-void ThingManager::Invoke(const cJSON* command) {
-    auto name = cJSON_GetObjectItem(command, "name");
+void ThingManager::Invoke(const JsonValue& command) {
+    JsonObject object;
+    if (!object.Parse(command)) {
+        ESP_LOGE(TAG, "Invalid command");
+        return;
+    }
+    auto& name = object.Get("name");
     for (auto& thing : things_) {
-        if (thing->name() == name->valuestring) {
-            thing->Invoke(command);
+        if (name.Is(thing->name().c_str())) {
+            thing->Invoke(object);
             return;
         }
     }
@@ -4,7 +4,7 @@
 
 #include "thing.h"
 
-#include <cJSON.h>
+#include "json_reader.h"
 
 #include <vector>
 #include <memory>
@@ -26,7 +26,7 @@ public:
 
     std::string GetDescriptorsJson();
     bool GetStatesJson(std::string& json, bool delta = false);
-    void Invoke(const cJSON* command);
+    void Invoke(const JsonValue& command);
 
 private:
     ThingManager() = default;
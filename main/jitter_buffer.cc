@@ -0,0 +1,219 @@
+#include "jitter_buffer.h"
+
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <algorithm>
+
+#define TAG "JitterBuffer"
+
+// Sequence numbers are compared with wraparound
+static inline int32_t SequenceDiff(uint32_t a, uint32_t b) {
+    return (int32_t)(a - b);
+}
+
+JitterBuffer::JitterBuffer() {
+    slots_.resize(max_packets_ * 2);
+}
+
+void JitterBuffer::Configure(int frame_duration_ms, int max_duration_ms, size_t min_depth) {
+    frame_duration_ms_ = frame_duration_ms;
+    max_packets_ = std::max(4, max_duration_ms / frame_duration_ms);
+    slots_.resize(max_packets_ * 2);
+    jitter_ms_ = 0;
+    min_depth_ = std::clamp<size_t>(min_depth, 1, std::max<size_t>(1, max_packets_ / 2));
+    underrun_depth_ = 1;
+    frames_since_underrun_ = 0;
+    target_depth_ = min_depth_;
+    Reset();
+}
+
+void JitterBuffer::Reset() {
+    for (auto& slot : slots_) {
+        if (slot.used) {
+            slot.used = false;
+            slot.packet.payload.reset();
+        }
+    }
+    count_ = 0;
+    started_ = false;
+    playout_started_ = false;
+    playing_ = false;
+    end_of_stream_ = false;
+    consecutive_lost_ = 0;
+    last_timestamp_ = 0;
+}
+
+bool JitterBuffer::Push(AudioStreamPacket&& packet) {
+    int64_t now_us = esp_timer_get_time();
+    received_++;
+
+    uint32_t sequence = packet.sequence;
+    if (sequence == 0) {
+        sequence = started_ ? highest_sequence_ + 1 : 1;
+    }
+
+    if (!started_) {
+        started_ = true;
+        highest_sequence_ = sequence;
+        first_sequence_ = sequence;
+        min_transit_us_ = now_us;
+    } else if ((playout_started_ && SequenceDiff(sequence, next_sequence_) < 0) ||
+               (SlotOf(sequence).used && SlotOf(sequence).packet.sequence == sequence)) {
+        late_++;
+        ESP_LOGD(TAG, "Late packet %lu, next %lu", sequence, next_sequence_);
+        return false;
+    }
+    if (count_ > 0) {
+        uint32_t oldest = SequenceDiff(sequence, oldest_sequence_) < 0 ? sequence : oldest_sequence_;
+        uint32_t newest = SequenceDiff(sequence, newest_sequence_) > 0 ? sequence : newest_sequence_;
+        if (SequenceDiff(newest, oldest) >= (int32_t)slots_.size()) {
+            late_++;
+            ESP_LOGD(TAG, "Packet %lu too far from the buffered %lu..%lu", sequence, oldest_sequence_, newest_sequence_);
+            return false;
+        }
+    }
+
+    UpdateJitter(sequence, now_us);
+    if (count_ == 0 && !playing_) {
+        buffering_since_us_ = now_us;
+    }
+    if (SequenceDiff(sequence, highest_sequence_) > 0) {
+        highest_sequence_ = sequence;
+    }
+    if (count_ == 0 || SequenceDiff(sequence, oldest_sequence_) < 0) {
+        oldest_sequence_ = sequence;
+    }
+    if (count_ == 0 || SequenceDiff(sequence, newest_sequence_) > 0) {
+        newest_sequence_ = sequence;
+    }
+    auto& slot = SlotOf(sequence);
+    packet.sequence = sequence;
+    slot.packet = std::move(packet);
+    slot.used = true;
+    count_++;
+    return true;
+}
+
+void JitterBuffer::UpdateJitter(uint32_t sequence, int64_t now_us) {
+    // A sender running ahead of real time only lowers the transit, so bursts never count as jitter
+    int64_t transit_us = now_us - (int64_t)SequenceDiff(sequence, first_sequence_) * frame_duration_ms_ * 1000;
+    if (transit_us < min_transit_us_) {
+        min_transit_us_ = transit_us;
+    }
+    uint32_t lateness_ms = (transit_us - min_transit_us_) / 1000;
+
+    // Follow spikes at once, forget them slowly
+    if (lateness_ms > jitter_ms_) {
+        jitter_ms_ = lateness_ms;
+    } else {
+        jitter_ms_ -= (jitter_ms_ - lateness_ms) / 16;
+    }
+    UpdateTargetDepth();
+}
+
+void JitterBuffer::UpdateTargetDepth() {
+    size_t target = 1 + (jitter_ms_ + frame_duration_ms_ - 1) / frame_duration_ms_;
+    target = std::max(target, std::max(underrun_depth_, min_depth_));
+    target_depth_ = std::min(target, std::max<size_t>(1, max_packets_ / 2));
+}
+
+JitterBufferResult JitterBuffer::Pop(AudioStreamPacket& packet) {
+    // Pops follow the playback clock, so a gap of more than a frame means the speaker ran dry
+    int64_t now_us = esp_timer_get_time();
+    if (playing_ && !end_of_stream_ && now_us - last_pop_us_ > frame_duration_ms_ * 1500) {
+        underruns_++;
+        playing_ = false;
+        buffering_since_us_ = now_us;
+        // Loss only shows up when the next packet arrives, keep one more packet in hand
+        underrun_depth_++;
+        frames_since_underrun_ = 0;
+        UpdateTargetDepth();
+    }
+    if (count_ == 0) {
+        return kJitterBufferEmpty;
+    }
+
+    if (!playing_) {
+        if (GetPlayoutWaitMs() > 0) {
+            return kJitterBufferEmpty;
+        }
+        playing_ = true;
+        if (!playout_started_) {
+            // The stream starts at the oldest packet, anything older that shows up later is late
+            playout_started_ = true;
+            next_sequence_ = oldest_sequence_;
+        }
+    }
+
+    if (oldest_sequence_ != next_sequence_) {
+        if (consecutive_lost_ < JITTER_BUFFER_MAX_CONCEALED_FRAMES) {
+            consecutive_lost_++;
+            last_pop_us_ = now_us;
+            lost_++;
+            concealed_++;
+            packet.payload.clear();
+            packet.sequence = next_sequence_++;
+            if (last_timestamp_ != 0) {
+                last_timestamp_ += frame_duration_ms_;
+            }
+            packet.timestamp = last_timestamp_;
+            return kJitterBufferConceal;
+        }
+        // Too long to conceal, continue with the next packet that arrived
+        lost_ += SequenceDiff(oldest_sequence_, next_sequence_);
+        next_sequence_ = oldest_sequence_;
+    }
+
+    consecutive_lost_ = 0;
+    last_pop_us_ = now_us;
+    if (++frames_since_underrun_ >= JITTER_BUFFER_DEPTH_DECAY_FRAMES && underrun_depth_ > 1) {
+        underrun_depth_--;
+        frames_since_underrun_ = 0;
+        UpdateTargetDepth();
+    }
+    auto& slot = SlotOf(oldest_sequence_);
+    packet = std::move(slot.packet);
+    slot.used = false;
+    count_--;
+    next_sequence_++;
+    // Buffered packets span less than the ring, so the scan finds the next one within a lap
+    for (uint32_t sequence = next_sequence_; count_ > 0; sequence++) {
+        if (SlotOf(sequence).used) {
+            oldest_sequence_ = sequence;
+            break;
+        }
+    }
+    last_timestamp_ = packet.timestamp;
+    return kJitterBufferPacket;
+}
+
+void JitterBuffer::SetEndOfStream() {
+    end_of_stream_ = true;
+}
+
+int JitterBuffer::GetPlayoutWaitMs() const {
+    if (playing_ || count_ == 0) {
+        return -1;
+    }
+    if (end_of_stream_ || count_ >= target_depth_) {
+        return 0;
+    }
+    // Start anyway once the first packet has waited as long as a full buffer would have
+    int64_t waited_ms = (esp_timer_get_time() - buffering_since_us_) / 1000;
+    int64_t wait_ms = (int64_t)(target_depth_ - 1) * frame_duration_ms_ - waited_ms;
+    return wait_ms > 0 ? wait_ms : 0;
+}
+
+JitterBufferStats JitterBuffer::GetStats() const {
+    return JitterBufferStats{
+        .depth = count_,
+        .target_depth = target_depth_,
+        .jitter_ms = jitter_ms_,
+        .received = received_,
+        .late = late_,
+        .lost = lost_,
+        .concealed = concealed_,
+        .underruns = underruns_,
+        .backpressure = backpressure_,
+    };
+}
@@ -0,0 +1,107 @@
+#ifndef JITTER_BUFFER_H
+#define JITTER_BUFFER_H
+
+#include <vector>
+#include <cstdint>
+
+#include "protocol.h"
+
+// Consecutive lost frames replaced with Opus PLC, longer gaps are skipped
+#define JITTER_BUFFER_MAX_CONCEALED_FRAMES 3
+// Frames played without an underrun before the playout delay is lowered again
+#define JITTER_BUFFER_DEPTH_DECAY_FRAMES 250
+
+struct JitterBufferStats {
+    size_t depth;
+    size_t target_depth;
+    uint32_t jitter_ms;
+    uint32_t received;
+    uint32_t late;          // Arrived after their slot was played or concealed, duplicates, or too far ahead
+    uint32_t lost;          // Never arrived in time
+    uint32_t concealed;     // Lost frames replaced with PLC
+    uint32_t underruns;     // Playout ran dry in the middle of a stream
+    uint32_t backpressure;  // Pushes that had to wait for room
+};
+
+enum JitterBufferResult {
+    kJitterBufferEmpty,     // Nothing to play yet
+    kJitterBufferPacket,    // The next frame
+    kJitterBufferConceal,   // The next frame is lost, the packet has an empty payload for PLC
+};
+
+// Reorders incoming audio by sequence and holds back playout by a delay that follows the measured jitter.
+// Packets without a sequence (reliable transports, local sounds) are numbered in arrival order.
+// Not thread safe, the owner serializes access.
+class JitterBuffer {
+public:
+    JitterBuffer();
+
+    // Drops the buffered packets and the jitter estimate. min_depth is the number of frames that arrive
+    // together in one packet, playout always waits for that many.
+    void Configure(int frame_duration_ms, int max_duration_ms, size_t min_depth = 1);
+    // Drops the buffered packets and starts a new stream, the counters and the jitter estimate are kept
+    void Reset();
+
+    // Returns false for late and duplicate packets
+    bool Push(AudioStreamPacket&& packet);
+    JitterBufferResult Pop(AudioStreamPacket& packet);
+
+    // No more packets are expected, play the rest without waiting for the target depth
+    void SetEndOfStream();
+    // Milliseconds until a buffered stream starts playing, -1 if there is nothing to wait for
+    int GetPlayoutWaitMs() const;
+    void CountBackpressure() { backpressure_++; }
+    JitterBufferStats GetStats() const;
+
+    inline bool empty() const { return count_ == 0; }
+    inline bool full() const { return count_ >= max_packets_; }
+    inline bool drained() const { return end_of_stream_ && count_ == 0; }
+
+private:
+    struct Slot {
+        bool used = false;
+        AudioStreamPacket packet;
+    };
+    // Indexed by sequence modulo the size, allocated in Configure so that buffering a packet never allocates.
+    // Twice max_packets_ slots leave room for gaps, packets further ahead than that are dropped.
+    std::vector<Slot> slots_;
+    size_t count_ = 0;
+    uint32_t oldest_sequence_ = 0;  // Of the buffered packets, valid if count_ > 0
+    uint32_t newest_sequence_ = 0;
+    size_t max_packets_ = 10;
+    int frame_duration_ms_ = 60;
+
+    bool started_ = false;
+    bool playout_started_ = false;
+    bool playing_ = false;
+    bool end_of_stream_ = false;
+    uint32_t next_sequence_ = 0;
+    uint32_t highest_sequence_ = 0;
+    uint32_t first_sequence_ = 0;
+    uint32_t last_timestamp_ = 0;
+    int consecutive_lost_ = 0;
+    int64_t buffering_since_us_ = 0;
+    int64_t last_pop_us_ = 0;
+
+    // Arrival time relative to the frame's place in the stream, the fastest packet defines 0
+    int64_t min_transit_us_ = 0;
+    uint32_t jitter_ms_ = 0;
+    // Raised by underruns, lowered again after JITTER_BUFFER_DEPTH_DECAY_FRAMES clean frames
+    size_t underrun_depth_ = 1;
+    size_t min_depth_ = 1;
+    uint32_t frames_since_underrun_ = 0;
+    size_t target_depth_ = 1;
+
+    uint32_t received_ = 0;
+    uint32_t late_ = 0;
+    uint32_t lost_ = 0;
+    uint32_t concealed_ = 0;
+    uint32_t underruns_ = 0;
+    uint32_t backpressure_ = 0;
+
+    Slot& SlotOf(uint32_t sequence) { return slots_[sequence % slots_.size()]; }
+    void UpdateJitter(uint32_t sequence, int64_t now_us);
+    void UpdateTargetDepth();
+};
+
+#endif // JITTER_BUFFER_H
@@ -0,0 +1,158 @@
+#include "pcm_cache.h"
+
+#include <esp_log.h>
+#include <esp_heap_caps.h>
+#include <cstring>
+
+#define TAG "PcmCache"
+
+#if CONFIG_SPIRAM
+#define PCM_CACHE_CAPS (MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT)
+#else
+#define PCM_CACHE_CAPS (MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT)
+#endif
+
+PcmCache::PcmCache(size_t budget) : budget_(budget) {
+}
+
+PcmCache::~PcmCache() {
+    for (auto& entry : entries_) {
+        Free(&entry);
+    }
+}
+
+PcmCache::Entry* PcmCache::Find(const void* key) {
+    for (auto& entry : entries_) {
+        if (entry.key == key) {
+            return &entry;
+        }
+    }
+    return nullptr;
+}
+
+void PcmCache::Free(Entry* entry) {
+    if (entry->samples != nullptr) {
+        heap_caps_free(entry->samples);
+        bytes_ -= entry->capacity * sizeof(int16_t);
+    }
+    *entry = Entry();
+}
+
+PcmCache::Entry* PcmCache::MakeRoom(size_t bytes) {
+    if (bytes > budget_) {
+        return nullptr;
+    }
+    Entry* slot = nullptr;
+    while (true) {
+        Entry* oldest = nullptr;
+        slot = nullptr;
+        for (auto& entry : entries_) {
+            if (entry.key == nullptr) {
+                slot = &entry;
+            } else if (entry.users == 0 && (oldest == nullptr || entry.last_used < oldest->last_used)) {
+                oldest = &entry;
+            }
+        }
+        if (slot != nullptr && bytes_ + bytes <= budget_) {
+            return slot;
+        }
+        if (oldest == nullptr) {
+            // Everything left is playing
+            return nullptr;
+        }
+        ESP_LOGI(TAG, "Evicting %u bytes", oldest->capacity * sizeof(int16_t));
+        Free(oldest);
+        evictions_++;
+    }
+}
+
+PcmCache::Entry* PcmCache::Acquire(const void* key) {
+    if (budget_ == 0) {
+        return nullptr;
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto entry = Find(key);
+    if (entry == nullptr || !entry->ready) {
+        misses_++;
+        return nullptr;
+    }
+    hits_++;
+    entry->users++;
+    entry->last_used = ++clock_;
+    return entry;
+}
+
+void PcmCache::Release(Entry* entry) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    entry->users--;
+}
+
+PcmCache::Entry* PcmCache::Reserve(const void* key, size_t frames, size_t frame_samples) {
+    if (budget_ == 0 || frames == 0) {
+        return nullptr;
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (Find(key) != nullptr) {
+        // Ready or being filled by someone else
+        return nullptr;
+    }
+    size_t capacity = frames * frame_samples;
+    auto entry = MakeRoom(capacity * sizeof(int16_t));
+    if (entry == nullptr) {
+        return nullptr;
+    }
+    auto samples = (int16_t*)heap_caps_malloc(capacity * sizeof(int16_t), PCM_CACHE_CAPS);
+    if (samples == nullptr) {
+        ESP_LOGW(TAG, "Failed to allocate %u bytes", capacity * sizeof(int16_t));
+        return nullptr;
+    }
+    entry->key = key;
+    entry->samples = samples;
+    entry->capacity = capacity;
+    entry->frame_samples = frame_samples;
+    entry->last_used = ++clock_;
+    entry->users = 1;
+    bytes_ += capacity * sizeof(int16_t);
+    return entry;
+}
+
+bool PcmCache::Append(Entry* entry, const int16_t* samples, size_t count) {
+    // Only the filler touches the samples of an entry that is not ready
+    if (entry->size + count > entry->capacity) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        ESP_LOGW(TAG, "Sound longer than reserved, not cached");
+        Free(entry);
+        return false;
+    }
+    memcpy(entry->samples + entry->size, samples, count * sizeof(int16_t));
+    entry->size += count;
+    return true;
+}
+
+void PcmCache::Finish(Entry* entry) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (entry->size < entry->capacity) {
+        Free(entry);
+        return;
+    }
+    entry->ready = true;
+    entry->users--;
+}
+
+PcmCacheStats PcmCache::GetStats() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    size_t count = 0;
+    for (auto& entry : entries_) {
+        if (entry.ready) {
+            count++;
+        }
+    }
+    return PcmCacheStats{
+        .entries = count,
+        .bytes = bytes_,
+        .budget = budget_,
+        .hits = hits_,
+        .misses = misses_,
+        .evictions = evictions_,
+    };
+}
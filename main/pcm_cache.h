@@ -0,0 +1,75 @@
+#ifndef PCM_CACHE_H
+#define PCM_CACHE_H
+
+#include <array>
+#include <cstdint>
+#include <cstddef>
+#include <mutex>
+
+#define PCM_CACHE_MAX_ENTRIES 24
+
+#ifdef CONFIG_SOUND_PCM_CACHE_SIZE
+#define PCM_CACHE_BUDGET (CONFIG_SOUND_PCM_CACHE_SIZE * 1024)
+#else
+#define PCM_CACHE_BUDGET 0
+#endif
+
+struct PcmCacheStats {
+    size_t entries;
+    size_t bytes;
+    size_t budget;
+    uint32_t hits;
+    uint32_t misses;
+    uint32_t evictions;
+};
+
+// Sounds already decoded and resampled to the output sample rate, keyed by the address of the asset.
+// An entry is pinned while it plays or fills, the least recently used unpinned entries are evicted to stay within the budget.
+// Thread safe, a budget of 0 disables the cache.
+class PcmCache {
+public:
+    struct Entry {
+        const void* key = nullptr;
+        int16_t* samples = nullptr;
+        size_t size = 0;            // Samples written so far
+        size_t capacity = 0;
+        size_t frame_samples = 0;   // Output samples per Opus frame of the asset
+        uint32_t last_used = 0;
+        int users = 0;
+        bool ready = false;         // Every frame is in, visible to Acquire()
+    };
+
+    PcmCache(size_t budget = PCM_CACHE_BUDGET);
+    ~PcmCache();
+
+    // Pins a ready entry, nullptr on a miss
+    Entry* Acquire(const void* key);
+    void Release(Entry* entry);
+
+    // A pinned empty entry for frames * frame_samples samples, nullptr if it is cached already or does not fit.
+    // Fill it with Append() and close it with Finish().
+    Entry* Reserve(const void* key, size_t frames, size_t frame_samples);
+    // Returns false and drops the entry if the samples do not fit
+    bool Append(Entry* entry, const int16_t* samples, size_t count);
+    // Makes a full entry ready, an incomplete one (the sound was cut) is dropped
+    void Finish(Entry* entry);
+
+    PcmCacheStats GetStats();
+
+private:
+    std::mutex mutex_;
+    std::array<Entry, PCM_CACHE_MAX_ENTRIES> entries_;
+    size_t budget_;
+    size_t bytes_ = 0;
+    uint32_t clock_ = 0;
+    uint32_t hits_ = 0;
+    uint32_t misses_ = 0;
+    uint32_t evictions_ = 0;
+
+    Entry* Find(const void* key);
+    void Free(Entry* entry);
+    // Evicts unpinned entries until bytes fit, returns a free slot or nullptr
+    Entry* MakeRoom(size_t bytes);
+};
+
+#endif // PCM_CACHE_H
@@ -0,0 +1,54 @@
+#include "audio_cipher.h"
+
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <cstring>
+
+#define TAG "AudioCipher"
+
+AudioCipher::AudioCipher() {
+    mbedtls_aes_init(&context_);
+}
+
+AudioCipher::~AudioCipher() {
+    mbedtls_aes_free(&context_);
+}
+
+void AudioCipher::SetKey(const uint8_t* key) {
+    mbedtls_aes_free(&context_);
+    mbedtls_aes_init(&context_);
+    mbedtls_aes_setkey_enc(&context_, key, 128);
+}
+
+// The send and receive sides crypt at the same time, each with its own counter, the key schedule is only read
+bool AudioCipher::Crypt(const uint8_t* nonce, const uint8_t* input, uint8_t* output, size_t size) {
+    int64_t start = esp_timer_get_time();
+    uint8_t counter[AUDIO_CIPHER_NONCE_SIZE];
+    uint8_t stream_block[16];
+    size_t offset = 0;
+    memcpy(counter, nonce, sizeof(counter));
+    // One call for the whole datagram, the peripheral is taken once and streams it
+    int ret = mbedtls_aes_crypt_ctr(&context_, size, &offset, counter, stream_block, input, output);
+    if (ret != 0) {
+        ESP_LOGE(TAG, "Failed to crypt audio data, ret: %d", ret);
+        return false;
+    }
+    datagrams_.fetch_add(1, std::memory_order_relaxed);
+    bytes_.fetch_add(size, std::memory_order_relaxed);
+    time_us_.fetch_add(uint32_t(esp_timer_get_time() - start), std::memory_order_relaxed);
+    return true;
+}
+
+AudioCipherStats AudioCipher::GetStats() const {
+    return AudioCipherStats{
+        .datagrams = datagrams_.load(std::memory_order_relaxed),
+        .bytes = bytes_.load(std::memory_order_relaxed),
+        .time_us = time_us_.load(std::memory_order_relaxed),
+    };
+}
+
+void AudioCipher::ResetStats() {
+    datagrams_ = 0;
+    bytes_ = 0;
+    time_us_ = 0;
+}
@@ -0,0 +1,46 @@
+#ifndef AUDIO_CIPHER_H
+#define AUDIO_CIPHER_H
+
+#include <mbedtls/aes.h>
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+// The nonce of a datagram is its header
+#define AUDIO_CIPHER_NONCE_SIZE 16
+
+struct AudioCipherStats {
+    uint32_t datagrams;
+    uint32_t bytes;
+    uint32_t time_us;       // Spent in the cipher
+};
+
+/*
+ * AES-128-CTR of the UDP audio channel. On ESP-IDF mbedtls runs the AES on the peripheral
+ * (CONFIG_MBEDTLS_HARDWARE_AES), with DMA on the targets that have it, and in software everywhere else.
+ * The DMA only reaches internal RAM: a buffer in PSRAM, where the audio buffer pools live, is copied through
+ * a bounce buffer the driver allocates for the call. So the datagrams are crypted in internal buffers that
+ * keep their capacity, in place on the send side, with the header in front of the payload.
+ */
+class AudioCipher {
+public:
+    AudioCipher();
+    ~AudioCipher();
+
+    // 16 bytes
+    void SetKey(const uint8_t* key);
+    // input and output may be the same buffer, nonce is not modified
+    bool Crypt(const uint8_t* nonce, const uint8_t* input, uint8_t* output, size_t size);
+
+    AudioCipherStats GetStats() const;
+    void ResetStats();
+
+private:
+    mbedtls_aes_context context_;
+    std::atomic<uint32_t> datagrams_ = 0;
+    std::atomic<uint32_t> bytes_ = 0;
+    std::atomic<uint32_t> time_us_ = 0;
+};
+
+#endif // AUDIO_CIPHER_H
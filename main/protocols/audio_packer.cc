@@ -0,0 +1,104 @@
+#include "audio_packer.h"
+
+#include <esp_log.h>
+#include <algorithm>
+#include <cstring>
+
+#define TAG "AudioPacker"
+
+// An Opus frame of the uplink encoder fits in a block of the Opus buffer pool
+#define AUDIO_PACKER_FRAME_CAPACITY 512
+
+static inline void PutBe16(uint8_t* p, uint16_t value) {
+    p[0] = value >> 8;
+    p[1] = value;
+}
+
+static inline void PutBe32(uint8_t* p, uint32_t value) {
+    p[0] = value >> 24;
+    p[1] = value >> 16;
+    p[2] = value >> 8;
+    p[3] = value;
+}
+
+static inline uint16_t GetBe16(const uint8_t* p) {
+    return (p[0] << 8) | p[1];
+}
+
+static inline uint32_t GetBe32(const uint8_t* p) {
+    return (uint32_t(p[0]) << 24) | (uint32_t(p[1]) << 16) | (uint32_t(p[2]) << 8) | p[3];
+}
+
+void AudioPacker::Configure(int frames_per_packet) {
+    frames_per_packet_ = std::clamp(frames_per_packet, 1, AUDIO_PACKER_MAX_FRAMES);
+    // Sized once, so packing does not allocate
+    frames_.reserve(frames_per_packet_ * AUDIO_PACKER_FRAME_CAPACITY);
+    packet_.reserve(AUDIO_PACKER_HEADER_SIZE(frames_per_packet_) + frames_per_packet_ * AUDIO_PACKER_FRAME_CAPACITY);
+    Reset();
+}
+
+void AudioPacker::Reset() {
+    count_ = 0;
+    finished_ = false;
+    frames_.clear();
+}
+
+bool AudioPacker::Add(const uint8_t* opus, size_t size, uint32_t timestamp) {
+    if (finished_) {
+        Reset();
+    }
+    sizes_[count_] = size;
+    timestamps_[count_] = timestamp;
+    frames_.insert(frames_.end(), opus, opus + size);
+    count_++;
+    return count_ >= frames_per_packet_;
+}
+
+const std::vector<uint8_t>& AudioPacker::Finish() {
+    packet_.resize(AUDIO_PACKER_HEADER_SIZE(count_) + frames_.size());
+    uint8_t* p = packet_.data();
+    *p++ = count_;
+    for (int i = 0; i < count_; i++, p += 6) {
+        PutBe16(p, sizes_[i]);
+        PutBe32(p + 2, timestamps_[i]);
+    }
+    if (!frames_.empty()) {
+        memcpy(p, frames_.data(), frames_.size());
+    }
+    finished_ = true;
+    return packet_;
+}
+
+bool AudioUnpacker::Parse(const uint8_t* data, size_t size) {
+    count_ = 0;
+    index_ = 0;
+    if (size < 1 || data[0] == 0 || data[0] > AUDIO_PACKER_MAX_FRAMES || size < AUDIO_PACKER_HEADER_SIZE(data[0])) {
+        ESP_LOGE(TAG, "Invalid packed audio of %u bytes", size);
+        return false;
+    }
+    size_t total = AUDIO_PACKER_HEADER_SIZE(data[0]);
+    for (int i = 0; i < data[0]; i++) {
+        total += GetBe16(data + 1 + i * 6);
+    }
+    if (total != size) {
+        ESP_LOGE(TAG, "Packed audio of %u bytes, frames add up to %u", size, total);
+        return false;
+    }
+    data_ = data;
+    count_ = data[0];
+    frame_ = data + AUDIO_PACKER_HEADER_SIZE(count_);
+    return true;
+}
+
+bool AudioUnpacker::Next(const uint8_t*& opus, size_t& size, uint32_t& timestamp) {
+    if (index_ >= count_) {
+        return false;
+    }
+    const uint8_t* entry = data_ + 1 + index_ * 6;
+    opus = frame_;
+    size = GetBe16(entry);
+    timestamp = GetBe32(entry + 2);
+    frame_ += size;
+    index_++;
+    return true;
+}
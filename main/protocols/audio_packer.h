@@ -0,0 +1,64 @@
+#ifndef AUDIO_PACKER_H
+#define AUDIO_PACKER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Most Opus frames in one packed message
+#define AUDIO_PACKER_MAX_FRAMES 8
+// Frame count, then size and timestamp of each frame
+#define AUDIO_PACKER_HEADER_SIZE(frames) (1 + size_t(frames) * 6)
+
+/*
+ * Several Opus frames in one UDP datagram or WebSocket message, to pay the per-packet cost
+ * (AT commands to the modem, IP/UDP headers, encryption nonce) once for all of them:
+ * |count 1u|size 2u|timestamp 4u|...one size and timestamp per frame...|frame data back to back|
+ * Sizes and timestamps are big endian. The envelope marks the payload as packed and carries
+ * the sequence number of the first frame, the frames after it take the following numbers.
+ */
+class AudioPacker {
+public:
+    void Configure(int frames_per_packet);
+    void Reset();
+
+    // Returns true when the packet is full and should be sent
+    bool Add(const uint8_t* opus, size_t size, uint32_t timestamp);
+    // The packed payload of the frames added so far, the packer starts over on the next Add()
+    const std::vector<uint8_t>& Finish();
+
+    inline int frames_per_packet() const { return frames_per_packet_; }
+    inline int count() const { return count_; }
+    // Nothing waits to be sent, a finished packet has been
+    inline bool empty() const { return count_ == 0 || finished_; }
+    // Of the first frame
+    inline uint32_t timestamp() const { return timestamps_[0]; }
+
+private:
+    int frames_per_packet_ = 1;
+    int count_ = 0;
+    bool finished_ = false;
+    uint16_t sizes_[AUDIO_PACKER_MAX_FRAMES];
+    uint32_t timestamps_[AUDIO_PACKER_MAX_FRAMES];
+    std::vector<uint8_t> frames_;
+    std::vector<uint8_t> packet_;
+};
+
+// Walks the frames of a packed payload without copying them
+class AudioUnpacker {
+public:
+    // Returns false if the payload is malformed
+    bool Parse(const uint8_t* data, size_t size);
+    // Points opus into the payload, false after the last frame
+    bool Next(const uint8_t*& opus, size_t& size, uint32_t& timestamp);
+
+    inline int count() const { return count_; }
+
+private:
+    const uint8_t* data_ = nullptr;
+    const uint8_t* frame_ = nullptr;
+    int count_ = 0;
+    int index_ = 0;
+};
+
+#endif // AUDIO_PACKER_H
@@ -0,0 +1,156 @@
+#include "audio_sender.h"
+#include "audio_trace.h"
+
+#include <esp_log.h>
+#include <esp_timer.h>
+
+#define TAG "AudioSender"
+
+AudioSender::AudioSender(std::function<void(const AudioStreamPacket& packet)> send, std::function<void()> flush)
+    : send_(send), flush_(flush) {
+    // Above the encode lane, a frame is sent as soon as it is encoded
+    xTaskCreatePinnedToCore([](void* arg) {
+        AudioSender* sender = (AudioSender*)arg;
+        sender->SenderLoop();
+    }, "audio_send", 4096, this, 3, &task_handle_, AUDIO_SEND_TASK_CORE < 0 ? tskNO_AFFINITY : AUDIO_SEND_TASK_CORE);
+}
+
+AudioSender::~AudioSender() {
+    if (task_handle_ != nullptr) {
+        vTaskDelete(task_handle_);
+    }
+}
+
+void AudioSender::Push(AudioStreamPacket&& packet, bool wait) {
+    Enqueue(Entry{std::move(packet), esp_timer_get_time(), false}, wait);
+}
+
+void AudioSender::Flush() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        flush_after_ = removed_ + count_;
+        flush_pending_ = true;
+    }
+    xTaskNotifyGive(task_handle_);
+}
+
+void AudioSender::Clear() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    while (count_ > 0) {
+        entries_[head_].packet.payload.reset();
+        head_ = (head_ + 1) % AUDIO_SEND_QUEUE_SIZE;
+        count_--;
+        removed_++;
+    }
+    room_cv_.notify_all();
+}
+
+void AudioSender::Enqueue(Entry&& entry, bool wait) {
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        if (wait) {
+            room_cv_.wait_for(lock, std::chrono::milliseconds(AUDIO_SEND_WAIT_MS), [this]() {
+                return count_ < AUDIO_SEND_QUEUE_SIZE;
+            });
+        }
+        if (count_ == AUDIO_SEND_QUEUE_SIZE) {
+            // The block goes back to the pool here, the slot is reused for the newest frame
+            entries_[head_].packet.payload.reset();
+            head_ = (head_ + 1) % AUDIO_SEND_QUEUE_SIZE;
+            count_--;
+            removed_++;
+            dropped_++;
+        }
+        entries_[(head_ + count_) % AUDIO_SEND_QUEUE_SIZE] = std::move(entry);
+        count_++;
+        if (count_ > high_water_) {
+            high_water_ = count_;
+        }
+    }
+    xTaskNotifyGive(task_handle_);
+}
+
+bool AudioSender::Pop(Entry& entry) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (flush_pending_ && (int32_t)(removed_ - flush_after_) >= 0) {
+        flush_pending_ = false;
+        entry.flush = true;
+        return true;
+    }
+    if (count_ == 0) {
+        return false;
+    }
+    entry = std::move(entries_[head_]);
+    entry.flush = false;
+    head_ = (head_ + 1) % AUDIO_SEND_QUEUE_SIZE;
+    count_--;
+    removed_++;
+    room_cv_.notify_one();
+    return true;
+}
+
+bool AudioSender::IsBacklogged() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    bool dropped = dropped_ != backlog_dropped_;
+    backlog_dropped_ = dropped_;
+    return dropped || count_ > AUDIO_SEND_BACKLOG;
+}
+
+AudioSenderStats AudioSender::GetStats() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return AudioSenderStats{
+        .depth = count_,
+        .high_water = high_water_,
+        .capacity = AUDIO_SEND_QUEUE_SIZE,
+        .sent = sent_.load(std::memory_order_relaxed),
+        .dropped = dropped_,
+        .avg_latency_us = avg_latency_us_.load(std::memory_order_relaxed),
+        .max_latency_us = max_latency_us_.load(std::memory_order_relaxed),
+        .avg_send_us = avg_send_us_.load(std::memory_order_relaxed),
+    };
+}
+
+void AudioSender::SenderLoop() {
+    Entry entry;
+    // Frames may wait in the transport for a packed packet to fill up since the last flush
+    bool unflushed = false;
+    while (true) {
+        TickType_t timeout = unflushed ? pdMS_TO_TICKS(AUDIO_SEND_FLUSH_MS) : portMAX_DELAY;
+        if (ulTaskNotifyTake(pdTRUE, timeout) == 0) {
+            flush_();
+            unflushed = false;
+            continue;
+        }
+
+        int burst = 0;
+        while (Pop(entry)) {
+            if (entry.flush) {
+                flush_();
+                unflushed = false;
+                continue;
+            }
+            if (burst++ == AUDIO_SEND_BURST) {
+                vTaskDelay(1);
+                burst = 1;
+            }
+            int64_t start_time = esp_timer_get_time();
+            send_(entry.packet);
+            AUDIO_TRACE(kAudioTraceSendAudio, entry.packet.trace_id);
+            entry.packet.payload.reset();
+            int64_t end_time = esp_timer_get_time();
+            unflushed = true;
+
+            // Exponential moving average with a 1/16 weight
+            uint32_t latency = end_time - entry.enqueue_time_us;
+            uint32_t send = end_time - start_time;
+            uint32_t avg_latency = avg_latency_us_.load(std::memory_order_relaxed);
+            uint32_t avg_send = avg_send_us_.load(std::memory_order_relaxed);
+            avg_latency_us_.store(avg_latency + ((int32_t)latency - (int32_t)avg_latency) / 16, std::memory_order_relaxed);
+            avg_send_us_.store(avg_send + ((int32_t)send - (int32_t)avg_send) / 16, std::memory_order_relaxed);
+            if (latency > max_latency_us_.load(std::memory_order_relaxed)) {
+                max_latency_us_.store(latency, std::memory_order_relaxed);
+            }
+            sent_.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+}
@@ -0,0 +1,113 @@
+#ifndef AUDIO_SENDER_H
+#define AUDIO_SENDER_H
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+
+#include "audio_buffer.h"
+
+#ifdef CONFIG_AUDIO_SEND_QUEUE_SIZE
+#define AUDIO_SEND_QUEUE_SIZE CONFIG_AUDIO_SEND_QUEUE_SIZE
+#else
+#define AUDIO_SEND_QUEUE_SIZE 16
+#endif
+
+#ifdef CONFIG_AUDIO_SEND_TASK_CORE
+#define AUDIO_SEND_TASK_CORE CONFIG_AUDIO_SEND_TASK_CORE
+#else
+#define AUDIO_SEND_TASK_CORE -1
+#endif
+
+// Packets sent back to back when a backlog has built up, before the sender yields for a tick
+// so the network stack drains its buffers instead of failing the sends
+#define AUDIO_SEND_BURST 4
+// Frames held for a packed packet are sent anyway when no frame came for this long
+#define AUDIO_SEND_FLUSH_MS 200
+// How long a burst that must arrive whole waits for room before dropping frames after all
+#define AUDIO_SEND_WAIT_MS 1000
+// Frames waiting above which the queue pushes back on the encoder
+#define AUDIO_SEND_BACKLOG (AUDIO_SEND_QUEUE_SIZE / 2)
+
+struct AudioStreamPacket {
+    uint32_t timestamp = 0;
+    AudioBuffer<uint8_t> payload;   // A block from the Opus pool
+    uint32_t sequence = 0;      // Transport sequence number, 0 if the transport delivers in order
+    uint32_t trace_id = 0;      // Uplink only, the id of the frame in the audio trace
+};
+
+struct AudioSenderStats {
+    size_t depth;
+    size_t high_water;
+    size_t capacity;
+    uint32_t sent;
+    uint32_t dropped;           // Oldest frames dropped to make room for newer ones
+    uint32_t avg_latency_us;    // Moving average of the time from Push to the end of the send
+    uint32_t max_latency_us;
+    uint32_t avg_send_us;       // Moving average of the send alone
+};
+
+/*
+ * Uplink audio on its own task, so that nothing on the main loop (opening a channel, JSON, state changes)
+ * delays a frame, and a slow network never blocks the encoder.
+ * Frames wait in a bounded queue of pool buffers. When it is full the oldest frame is dropped: by the time
+ * the network recovers, current audio is worth more than late audio.
+ */
+class AudioSender {
+public:
+    AudioSender(std::function<void(const AudioStreamPacket& packet)> send, std::function<void()> flush);
+    ~AudioSender();
+
+    // Never blocks unless wait is set, for bursts that must arrive whole such as the wake word pre-roll
+    void Push(AudioStreamPacket&& packet, bool wait = false);
+    // The flush callback runs after the frames pushed before, without waiting for them
+    void Flush();
+    // Drops the frames waiting, when the channel closes
+    void Clear();
+    // More than AUDIO_SEND_BACKLOG frames waiting, or frames dropped since the last call
+    bool IsBacklogged();
+
+    AudioSenderStats GetStats() const;
+
+private:
+    struct Entry {
+        AudioStreamPacket packet;
+        int64_t enqueue_time_us = 0;
+        bool flush = false;     // From Pop only, the flush is due and there is no packet
+    };
+
+    std::function<void(const AudioStreamPacket& packet)> send_;
+    std::function<void()> flush_;
+    TaskHandle_t task_handle_ = nullptr;
+
+    mutable std::mutex mutex_;
+    std::condition_variable room_cv_;
+    Entry entries_[AUDIO_SEND_QUEUE_SIZE];
+    size_t head_ = 0;
+    size_t count_ = 0;
+    size_t high_water_ = 0;
+    // Frames taken out, sent or dropped. A flush is due once the frames pushed before it are out.
+    uint32_t removed_ = 0;
+    uint32_t flush_after_ = 0;
+    bool flush_pending_ = false;
+
+    uint32_t dropped_ = 0;
+    uint32_t backlog_dropped_ = 0;  // dropped_ at the last IsBacklogged()
+    // Written only by the sender task
+    std::atomic<uint32_t> sent_{0};
+    std::atomic<uint32_t> avg_latency_us_{0};
+    std::atomic<uint32_t> max_latency_us_{0};
+    std::atomic<uint32_t> avg_send_us_{0};
+
+    void Enqueue(Entry&& entry, bool wait);
+    // Flush() takes no slot and never drops a frame, flushes requested before it is due are coalesced
+    bool Pop(Entry& entry);
+    void SenderLoop();
+};
+
+#endif // AUDIO_SENDER_H
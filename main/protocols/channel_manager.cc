@@ -0,0 +1,156 @@
+#include "channel_manager.h"
+#include "settings.h"
+
+#include <esp_log.h>
+#include <algorithm>
+
+#define TAG "ChannelManager"
+
+// Connecting runs TLS, the stack is sized for the handshake
+ChannelManager::ChannelManager() : task_("audio_channel", 4096 * 2, 2) {
+    esp_timer_create_args_t standby_timer_args = {
+        .callback = [](void* arg) {
+            ChannelManager* manager = (ChannelManager*)arg;
+            manager->OnStandbyTimeout();
+        },
+        .arg = this,
+        .dispatch_method = ESP_TIMER_TASK,
+        .name = "channel_standby",
+        .skip_unhandled_events = true
+    };
+    esp_timer_create(&standby_timer_args, &standby_timer_);
+}
+
+ChannelManager::~ChannelManager() {
+    if (standby_timer_ != nullptr) {
+        esp_timer_stop(standby_timer_);
+        esp_timer_delete(standby_timer_);
+    }
+}
+
+void ChannelManager::Initialize(Protocol* protocol) {
+    protocol_ = protocol;
+    window_start_us_ = esp_timer_get_time();
+}
+
+void ChannelManager::Open(std::function<void(bool opened)> ready) {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (standby_) {
+            LeaveStandby(esp_timer_get_time());
+        }
+    }
+
+    task_.Fence([this, ready = std::move(ready)]() {
+        if (protocol_->IsAudioChannelOpened()) {
+            reused_.fetch_add(1, std::memory_order_relaxed);
+            ready(true);
+            return;
+        }
+
+        int64_t start_time = esp_timer_get_time();
+        bool opened = protocol_->OpenAudioChannel();
+        if (!opened) {
+            failures_.fetch_add(1, std::memory_order_relaxed);
+            ready(false);
+            return;
+        }
+
+        // Exponential moving average with a 1/16 weight, seeded by the first open
+        uint32_t open_ms = (esp_timer_get_time() - start_time) / 1000;
+        uint32_t avg_open_ms = avg_open_ms_.load(std::memory_order_relaxed);
+        if (opens_.fetch_add(1, std::memory_order_relaxed) == 0) {
+            avg_open_ms = open_ms;
+        }
+        avg_open_ms_.store(avg_open_ms + ((int32_t)open_ms - (int32_t)avg_open_ms) / 16, std::memory_order_relaxed);
+        last_open_ms_.store(open_ms, std::memory_order_relaxed);
+        ESP_LOGI(TAG, "Audio channel opened in %lu ms", open_ms);
+        ready(true);
+    });
+}
+
+bool ChannelManager::Release() {
+    // Settable per device, like the frames per packet
+    Settings settings("audio", false);
+    int64_t standby_us = settings.GetInt("standby_seconds", AUDIO_CHANNEL_STANDBY_SECONDS) * 1000000LL;
+
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        int64_t now = esp_timer_get_time();
+        standby_us = std::min(standby_us, StandbyLeft(now));
+        if (standby_us > 0 && protocol_->IsAudioChannelOpened()) {
+            if (standby_) {
+                LeaveStandby(now);
+            }
+            standby_ = true;
+            standby_start_us_ = now;
+            esp_timer_start_once(standby_timer_, standby_us);
+            ESP_LOGI(TAG, "Audio channel in standby for %d s", (int)(standby_us / 1000000));
+            return true;
+        }
+        if (standby_) {
+            LeaveStandby(now);
+        }
+    }
+
+    CloseChannel(false);
+    return false;
+}
+
+ChannelManagerStats ChannelManager::GetStats() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    int64_t now = esp_timer_get_time();
+    int64_t used_us = AUDIO_CHANNEL_STANDBY_BUDGET * 1000000LL - StandbyLeft(now);
+    return ChannelManagerStats{
+        .opens = opens_.load(std::memory_order_relaxed),
+        .failures = failures_.load(std::memory_order_relaxed),
+        .reused = reused_.load(std::memory_order_relaxed),
+        .last_open_ms = last_open_ms_.load(std::memory_order_relaxed),
+        .avg_open_ms = avg_open_ms_.load(std::memory_order_relaxed),
+        .standby_seconds = (uint32_t)(used_us / 1000000),
+        .standby_budget = AUDIO_CHANNEL_STANDBY_BUDGET,
+    };
+}
+
+// mutex_ is held. What is left of the budget in the current window, counting a standby in progress as spent.
+int64_t ChannelManager::StandbyLeft(int64_t now) {
+    if (now - window_start_us_ >= AUDIO_CHANNEL_BUDGET_WINDOW_SECONDS * 1000000LL) {
+        window_start_us_ = now;
+        standby_used_us_ = 0;
+        if (standby_) {
+            standby_start_us_ = now;
+        }
+    }
+    int64_t used_us = standby_used_us_ + (standby_ ? now - standby_start_us_ : 0);
+    return std::max<int64_t>(AUDIO_CHANNEL_STANDBY_BUDGET * 1000000LL - used_us, 0);
+}
+
+// mutex_ is held
+void ChannelManager::LeaveStandby(int64_t now) {
+    esp_timer_stop(standby_timer_);
+    StandbyLeft(now);
+    standby_used_us_ += now - standby_start_us_;
+    standby_ = false;
+}
+
+// After the opens scheduled before. A standby channel the server closed in the meantime is left alone.
+void ChannelManager::CloseChannel(bool standby) {
+    task_.Fence([this, standby]() {
+        if (!standby || protocol_->IsAudioChannelOpened()) {
+            protocol_->CloseAudioChannel();
+        }
+    });
+}
+
+// On the timer task. An Open() that took the channel first has stopped the standby.
+void ChannelManager::OnStandbyTimeout() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!standby_) {
+            return;
+        }
+        LeaveStandby(esp_timer_get_time());
+    }
+    ESP_LOGI(TAG, "Audio channel standby is over");
+    CloseChannel(true);
+}
@@ -0,0 +1,84 @@
+#ifndef CHANNEL_MANAGER_H
+#define CHANNEL_MANAGER_H
+
+#include <esp_timer.h>
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+
+#include "background_task.h"
+#include "protocol.h"
+
+#ifdef CONFIG_AUDIO_CHANNEL_STANDBY_SECONDS
+#define AUDIO_CHANNEL_STANDBY_SECONDS CONFIG_AUDIO_CHANNEL_STANDBY_SECONDS
+#else
+#define AUDIO_CHANNEL_STANDBY_SECONDS 0
+#endif
+
+#ifdef CONFIG_AUDIO_CHANNEL_STANDBY_BUDGET
+#define AUDIO_CHANNEL_STANDBY_BUDGET CONFIG_AUDIO_CHANNEL_STANDBY_BUDGET
+#else
+#define AUDIO_CHANNEL_STANDBY_BUDGET 600
+#endif
+
+// The standby budget is in seconds per this window
+#define AUDIO_CHANNEL_BUDGET_WINDOW_SECONDS 3600
+
+struct ChannelManagerStats {
+    uint32_t opens;             // Cold opens, with the connect and hello handshake
+    uint32_t failures;
+    uint32_t reused;            // Conversations started on a channel that was still open
+    uint32_t last_open_ms;
+    uint32_t avg_open_ms;       // Moving average of the cold opens
+    uint32_t standby_seconds;   // Spent in standby in the current window
+    uint32_t standby_budget;
+};
+
+/*
+ * Opens and closes the audio channel on its own task, so that the connect and hello handshake runs while the
+ * main loop goes on and the wake word pre-roll is encoded.
+ * After a conversation the channel may stay open in standby, and the next one starts without a handshake.
+ * Standby keeps the connection up and the device out of sleep mode, so it is bounded per conversation and by
+ * a budget of seconds per hour.
+ */
+class ChannelManager {
+public:
+    ChannelManager();
+    ~ChannelManager();
+
+    void Initialize(Protocol* protocol);
+
+    // ready(opened) runs on the channel task once the server hello is in, or right away on an open channel
+    void Open(std::function<void(bool opened)> ready);
+    // The conversation is over. Returns true if the channel stays open in standby, false if it is closing.
+    bool Release();
+
+    ChannelManagerStats GetStats();
+
+private:
+    Protocol* protocol_ = nullptr;
+    BackgroundTask task_;
+    esp_timer_handle_t standby_timer_ = nullptr;
+
+    std::mutex mutex_;
+    bool standby_ = false;
+    int64_t standby_start_us_ = 0;
+    int64_t window_start_us_ = 0;
+    int64_t standby_used_us_ = 0;
+
+    // Written only by the channel task
+    std::atomic<uint32_t> opens_{0};
+    std::atomic<uint32_t> failures_{0};
+    std::atomic<uint32_t> reused_{0};
+    std::atomic<uint32_t> last_open_ms_{0};
+    std::atomic<uint32_t> avg_open_ms_{0};
+
+    int64_t StandbyLeft(int64_t now);
+    void LeaveStandby(int64_t now);
+    void CloseChannel(bool standby);
+    void OnStandbyTimeout();
+};
+
+#endif // CHANNEL_MANAGER_H
@@ -0,0 +1,51 @@
+#include "control_message.h"
+
+#include <string>
+
+// Indexed by MessageType
+static constexpr const char* kMessageTypeNames[] = {
+    "", "hello", "goodbye", "tts", "stt", "llm", "iot", "system", "alert", "pong",
+};
+
+#define MESSAGE_TYPE_SLOTS 32
+
+// Length, first and last character: collision free over the names above, which the table checks when it is built
+static constexpr size_t HashMessageType(const char* name, size_t length) {
+    return (length + (uint8_t(name[0]) << 2) + uint8_t(name[length - 1])) % MESSAGE_TYPE_SLOTS;
+}
+
+struct MessageTypeTable {
+    MessageType slots[MESSAGE_TYPE_SLOTS] = {};
+    bool perfect = true;
+};
+
+static constexpr MessageTypeTable BuildMessageTypeTable() {
+    MessageTypeTable table;
+    for (size_t type = 1; type < sizeof(kMessageTypeNames) / sizeof(kMessageTypeNames[0]); type++) {
+        const char* name = kMessageTypeNames[type];
+        size_t slot = HashMessageType(name, std::char_traits<char>::length(name));
+        if (table.slots[slot] != kMessageTypeUnknown) {
+            table.perfect = false;
+        }
+        table.slots[slot] = MessageType(type);
+    }
+    return table;
+}
+
+static constexpr MessageTypeTable kMessageTypeTable = BuildMessageTypeTable();
+static_assert(kMessageTypeTable.perfect, "Two message types share a slot, change HashMessageType");
+
+MessageType GetMessageType(const JsonValue& type) {
+    if (!type.IsString() || type.length == 0) {
+        return kMessageTypeUnknown;
+    }
+    MessageType candidate = kMessageTypeTable.slots[HashMessageType(type.text, type.length)];
+    if (candidate == kMessageTypeUnknown || strcmp(kMessageTypeNames[candidate], type.text) != 0) {
+        return kMessageTypeUnknown;
+    }
+    return candidate;
+}
+
+const char* GetMessageTypeName(MessageType type) {
+    return kMessageTypeNames[type];
+}
@@ -0,0 +1,24 @@
+#ifndef CONTROL_MESSAGE_H
+#define CONTROL_MESSAGE_H
+
+#include "json_reader.h"
+
+// The "type" of a control channel message from the server
+enum MessageType : uint8_t {
+    kMessageTypeUnknown,
+    kMessageTypeHello,
+    kMessageTypeGoodbye,
+    kMessageTypeTts,
+    kMessageTypeStt,
+    kMessageTypeLlm,
+    kMessageTypeIot,
+    kMessageTypeSystem,
+    kMessageTypeAlert,
+    kMessageTypePong,
+};
+
+// One table lookup and one string compare, kMessageTypeUnknown for a type this firmware does not know
+MessageType GetMessageType(const JsonValue& type);
+const char* GetMessageTypeName(MessageType type);
+
+#endif // CONTROL_MESSAGE_H
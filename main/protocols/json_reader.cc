@@ -0,0 +1,302 @@
+#include "json_reader.h"
+
+static const JsonValue kMissing;
+
+static inline char* SkipSpace(char* p, char* end) {
+    while (p < end && (*p == ' ' || *p == '\n' || *p == '\r' || *p == '\t')) {
+        p++;
+    }
+    return p;
+}
+
+static int HexValue(char c) {
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    }
+    if (c >= 'A' && c <= 'F') {
+        return c - 'A' + 10;
+    }
+    return -1;
+}
+
+static bool ParseHex4(const char* p, const char* end, uint32_t& value) {
+    if (end - p < 4) {
+        return false;
+    }
+    value = 0;
+    for (int i = 0; i < 4; i++) {
+        int digit = HexValue(p[i]);
+        if (digit < 0) {
+            return false;
+        }
+        value = (value << 4) | digit;
+    }
+    return true;
+}
+
+static char* PutUtf8(char* out, uint32_t code) {
+    if (code < 0x80) {
+        *out++ = code;
+    } else if (code < 0x800) {
+        *out++ = 0xc0 | (code >> 6);
+        *out++ = 0x80 | (code & 0x3f);
+    } else if (code < 0x10000) {
+        *out++ = 0xe0 | (code >> 12);
+        *out++ = 0x80 | ((code >> 6) & 0x3f);
+        *out++ = 0x80 | (code & 0x3f);
+    } else {
+        *out++ = 0xf0 | (code >> 18);
+        *out++ = 0x80 | ((code >> 12) & 0x3f);
+        *out++ = 0x80 | ((code >> 6) & 0x3f);
+        *out++ = 0x80 | (code & 0x3f);
+    }
+    return out;
+}
+
+// p is at the opening quote. The string is unescaped over itself, which only ever shortens it,
+// and the NUL goes where the closing quote was at the latest.
+static bool ParseString(char*& p, char* end, char*& text, size_t& length) {
+    char* in = p + 1;
+    text = in;
+    // Most strings have no escapes and stay where they are
+    while (in < end && *in != '"' && *in != '\\') {
+        in++;
+    }
+    char* out = in;
+    while (in < end) {
+        char c = *in++;
+        if (c == '"') {
+            *out = '\0';
+            length = out - text;
+            p = in;
+            return true;
+        }
+        if (c != '\\') {
+            *out++ = c;
+            continue;
+        }
+        if (in == end) {
+            return false;
+        }
+        c = *in++;
+        switch (c) {
+        case '"': case '\\': case '/': *out++ = c; break;
+        case 'b': *out++ = '\b'; break;
+        case 'f': *out++ = '\f'; break;
+        case 'n': *out++ = '\n'; break;
+        case 'r': *out++ = '\r'; break;
+        case 't': *out++ = '\t'; break;
+        case 'u': {
+            uint32_t code;
+            if (!ParseHex4(in, end, code)) {
+                return false;
+            }
+            in += 4;
+            // A character outside the BMP comes as a surrogate pair
+            uint32_t low;
+            if (code >= 0xd800 && code < 0xdc00 && end - in >= 6 && in[0] == '\\' && in[1] == 'u' &&
+                ParseHex4(in + 2, end, low) && low >= 0xdc00 && low < 0xe000) {
+                code = 0x10000 + ((code - 0xd800) << 10) + (low - 0xdc00);
+                in += 6;
+            }
+            out = PutUtf8(out, code);
+            break;
+        }
+        default:
+            return false;
+        }
+    }
+    return false;
+}
+
+// Steps over an object or array without looking inside its strings
+static bool SkipComposite(char*& p, char* end) {
+    int depth = 0;
+    while (p < end) {
+        char c = *p++;
+        if (c == '"') {
+            while (p < end && *p != '"') {
+                p += (*p == '\\') ? 2 : 1;
+            }
+            if (p >= end) {
+                return false;
+            }
+            p++;
+        } else if (c == '{' || c == '[') {
+            depth++;
+        } else if (c == '}' || c == ']') {
+            if (--depth == 0) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+static bool ParseLiteral(char*& p, char* end, const char* literal, size_t length) {
+    if (size_t(end - p) < length || memcmp(p, literal, length) != 0) {
+        return false;
+    }
+    p += length;
+    return true;
+}
+
+static bool ParseValue(char*& p, char* end, JsonValue& value) {
+    value.text = p;
+    switch (*p) {
+    case '"':
+        value.type = kJsonString;
+        return ParseString(p, end, value.text, value.length);
+    case '{':
+    case '[':
+        value.type = *p == '{' ? kJsonObject : kJsonArray;
+        if (!SkipComposite(p, end)) {
+            return false;
+        }
+        break;
+    case 't':
+        value.type = kJsonBool;
+        if (!ParseLiteral(p, end, "true", 4)) {
+            return false;
+        }
+        break;
+    case 'f':
+        value.type = kJsonBool;
+        if (!ParseLiteral(p, end, "false", 5)) {
+            return false;
+        }
+        break;
+    case 'n':
+        value.type = kJsonNull;
+        if (!ParseLiteral(p, end, "null", 4)) {
+            return false;
+        }
+        break;
+    default:
+        if (*p != '-' && (*p < '0' || *p > '9')) {
+            return false;
+        }
+        value.type = kJsonNumber;
+        while (p < end && ((*p >= '0' && *p <= '9') || *p == '-' || *p == '+' || *p == '.' || *p == 'e' || *p == 'E')) {
+            p++;
+        }
+        break;
+    }
+    value.length = p - value.text;
+    return true;
+}
+
+int JsonValue::ToInt(int fallback) const {
+    if (type != kJsonNumber) {
+        return fallback;
+    }
+    const char* p = text;
+    const char* end = text + length;
+    bool negative = *p == '-';
+    if (negative) {
+        p++;
+    }
+    if (p == end || *p < '0' || *p > '9') {
+        return fallback;
+    }
+    int value = 0;
+    while (p < end && *p >= '0' && *p <= '9') {
+        value = value * 10 + (*p++ - '0');
+    }
+    return negative ? -value : value;
+}
+
+bool JsonObject::Parse(char* text, size_t length) {
+    count_ = 0;
+    char* end = text + length;
+    char* p = SkipSpace(text, end);
+    if (p == end || *p != '{') {
+        return false;
+    }
+    p = SkipSpace(p + 1, end);
+    if (p < end && *p == '}') {
+        return true;
+    }
+    while (p < end) {
+        char* key;
+        size_t key_length;
+        if (*p != '"' || !ParseString(p, end, key, key_length)) {
+            return false;
+        }
+        p = SkipSpace(p, end);
+        if (p == end || *p != ':') {
+            return false;
+        }
+        p = SkipSpace(p + 1, end);
+        JsonValue value;
+        if (p == end || !ParseValue(p, end, value)) {
+            return false;
+        }
+        if (count_ < JSON_OBJECT_MAX_MEMBERS) {
+            keys_[count_] = key;
+            values_[count_] = value;
+            count_++;
+        }
+        p = SkipSpace(p, end);
+        if (p < end && *p == '}') {
+            return true;
+        }
+        if (p == end || *p != ',') {
+            return false;
+        }
+        p = SkipSpace(p + 1, end);
+    }
+    return false;
+}
+
+bool JsonObject::Parse(const JsonValue& value) {
+    if (!value.IsObject()) {
+        count_ = 0;
+        return false;
+    }
+    return Parse(value.text, value.length);
+}
+
+const JsonValue& JsonObject::Get(const char* key) const {
+    for (size_t i = 0; i < count_; i++) {
+        if (strcmp(keys_[i], key) == 0) {
+            return values_[i];
+        }
+    }
+    return kMissing;
+}
+
+JsonArrayReader::JsonArrayReader(const JsonValue& array) {
+    if (array.IsArray()) {
+        // Between the brackets
+        position_ = array.text + 1;
+        end_ = array.text + array.length - 1;
+    }
+}
+
+bool JsonArrayReader::Next(JsonValue& element) {
+    char* p = SkipSpace(position_, end_);
+    if (p < end_ && *p == ',') {
+        p = SkipSpace(p + 1, end_);
+    }
+    if (p >= end_ || !ParseValue(p, end_, element)) {
+        position_ = end_;
+        return false;
+    }
+    position_ = p;
+    return true;
+}
+
+bool ParseJson(char* text, size_t length, JsonValue& value) {
+    char* end = text + length;
+    char* p = SkipSpace(text, end);
+    return p < end && ParseValue(p, end, value) && SkipSpace(p, end) == end;
+}
+
+bool JsonReader::Parse(const char* data, size_t length) {
+    buffer_.assign(data, length);
+    return root_.Parse(&buffer_[0], buffer_.size());
+}
@@ -0,0 +1,95 @@
+#ifndef JSON_READER_H
+#define JSON_READER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+// Members kept per object, the ones after are skipped. Control messages have fewer than ten.
+#define JSON_OBJECT_MAX_MEMBERS 16
+
+enum JsonType : uint8_t {
+    kJsonNone,      // Missing member
+    kJsonNull,
+    kJsonBool,
+    kJsonNumber,
+    kJsonString,
+    kJsonObject,
+    kJsonArray,
+};
+
+// A value inside the parsed text. Strings are unescaped and NUL terminated in place;
+// numbers, booleans, objects and arrays point at their JSON text.
+struct JsonValue {
+    JsonType type = kJsonNone;
+    char* text = nullptr;
+    size_t length = 0;
+
+    inline bool IsString() const { return type == kJsonString; }
+    inline bool IsNumber() const { return type == kJsonNumber; }
+    inline bool IsObject() const { return type == kJsonObject; }
+    inline bool IsArray() const { return type == kJsonArray; }
+    inline explicit operator bool() const { return type != kJsonNone; }
+
+    // The string, or "" for any other type
+    inline const char* c_str() const { return type == kJsonString ? text : ""; }
+    inline bool Is(const char* value) const {
+        return type == kJsonString && strcmp(text, value) == 0;
+    }
+    // Integer part of a number, fallback for any other type
+    int ToInt(int fallback = 0) const;
+    inline bool ToBool() const { return type == kJsonBool && text[0] == 't'; }
+};
+
+/*
+ * SAX style reader for the control channel: one pass over the text records where each member of an object
+ * is, without building a tree or allocating. Nested objects and arrays are only delimited, and are parsed
+ * when asked for, in place too, so each one should be parsed once.
+ */
+class JsonObject {
+public:
+    // text is modified by the string unescaping
+    bool Parse(char* text, size_t length);
+    bool Parse(const JsonValue& value);
+
+    // A kJsonNone value if the member is missing
+    const JsonValue& Get(const char* key) const;
+    inline size_t size() const { return count_; }
+    inline const char* key(size_t index) const { return keys_[index]; }
+    inline const JsonValue& value(size_t index) const { return values_[index]; }
+
+private:
+    size_t count_ = 0;
+    const char* keys_[JSON_OBJECT_MAX_MEMBERS];
+    JsonValue values_[JSON_OBJECT_MAX_MEMBERS];
+};
+
+// Walks the elements of an array, parsing each as it is reached
+class JsonArrayReader {
+public:
+    explicit JsonArrayReader(const JsonValue& array);
+    // False after the last element, or on malformed text
+    bool Next(JsonValue& element);
+
+private:
+    char* position_ = nullptr;
+    char* end_ = nullptr;
+};
+
+// Parses a whole value in place, of any type
+bool ParseJson(char* text, size_t length, JsonValue& value);
+
+// Parses received messages in a buffer that keeps its capacity
+class JsonReader {
+public:
+    // Returns false if the message is not a JSON object
+    bool Parse(const char* data, size_t length);
+    inline const JsonObject& root() const { return root_; }
+
+private:
+    std::string buffer_;
+    JsonObject root_;
+};
+
+#endif // JSON_READER_H
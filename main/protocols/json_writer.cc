@@ -0,0 +1,135 @@
+#include "json_writer.h"
+
+#include <esp_log.h>
+#include <cstdio>
+#include <cstring>
+
+#define TAG "JsonWriter"
+
+JsonWriter& JsonWriter::Begin() {
+    buffer_.clear();
+    depth_ = 0;
+    first_ = true;
+    Open(nullptr, '{', '}');
+    return *this;
+}
+
+JsonWriter& JsonWriter::End() {
+    while (depth_ > 0) {
+        Close();
+    }
+    return *this;
+}
+
+JsonWriter& JsonWriter::BeginObject(const char* key) {
+    Open(key, '{', '}');
+    return *this;
+}
+
+JsonWriter& JsonWriter::EndObject() {
+    Close();
+    return *this;
+}
+
+JsonWriter& JsonWriter::BeginArray(const char* key) {
+    Open(key, '[', ']');
+    return *this;
+}
+
+JsonWriter& JsonWriter::EndArray() {
+    Close();
+    return *this;
+}
+
+JsonWriter& JsonWriter::Add(const char* key, const char* value) {
+    AddKey(key);
+    AddString(value, strlen(value));
+    return *this;
+}
+
+JsonWriter& JsonWriter::Add(const char* key, const std::string& value) {
+    AddKey(key);
+    AddString(value.data(), value.size());
+    return *this;
+}
+
+JsonWriter& JsonWriter::Add(const char* key, int value) {
+    AddKey(key);
+    char number[12];
+    int length = snprintf(number, sizeof(number), "%d", value);
+    buffer_.append(number, length);
+    return *this;
+}
+
+JsonWriter& JsonWriter::Add(const char* key, bool value) {
+    AddKey(key);
+    buffer_.append(value ? "true" : "false");
+    return *this;
+}
+
+JsonWriter& JsonWriter::AddRaw(const char* key, const char* json, size_t length) {
+    AddKey(key);
+    buffer_.append(json, length);
+    return *this;
+}
+
+void JsonWriter::AddKey(const char* key) {
+    if (!first_) {
+        buffer_ += ',';
+    }
+    first_ = false;
+    if (key != nullptr) {
+        buffer_ += '"';
+        buffer_.append(key);
+        buffer_.append("\":", 2);
+    }
+}
+
+// Runs that need no escaping, most of any message, are appended in one go
+void JsonWriter::AddString(const char* value, size_t length) {
+    static const char hex[] = "0123456789abcdef";
+    buffer_ += '"';
+    size_t run = 0;
+    for (size_t i = 0; i < length; i++) {
+        uint8_t c = value[i];
+        if (c >= 0x20 && c != '"' && c != '\\') {
+            continue;
+        }
+        buffer_.append(value + run, i - run);
+        run = i + 1;
+        switch (c) {
+        case '"': buffer_.append("\\\"", 2); break;
+        case '\\': buffer_.append("\\\\", 2); break;
+        case '\n': buffer_.append("\\n", 2); break;
+        case '\r': buffer_.append("\\r", 2); break;
+        case '\t': buffer_.append("\\t", 2); break;
+        default:
+            char escaped[6] = {'\\', 'u', '0', '0', hex[c >> 4], hex[c & 0x0f]};
+            buffer_.append(escaped, sizeof(escaped));
+            break;
+        }
+    }
+    buffer_.append(value + run, length - run);
+    buffer_ += '"';
+}
+
+void JsonWriter::Open(const char* key, char opener, char closer) {
+    if (depth_ == JSON_WRITER_MAX_DEPTH) {
+        ESP_LOGE(TAG, "Too deeply nested");
+        return;
+    }
+    if (depth_ > 0) {
+        AddKey(key);
+    }
+    buffer_ += opener;
+    closers_[depth_++] = closer;
+    first_ = true;
+}
+
+void JsonWriter::Close() {
+    if (depth_ == 0) {
+        return;
+    }
+    buffer_ += closers_[--depth_];
+    first_ = false;
+}
@@ -0,0 +1,55 @@
+#ifndef JSON_WRITER_H
+#define JSON_WRITER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// Most nested objects and arrays in a message
+#define JSON_WRITER_MAX_DEPTH 8
+
+/*
+ * Streams compact JSON into a buffer that keeps its capacity, so once it has grown to the largest
+ * control message building one does not allocate. Keys are written as given, string values are escaped.
+ * A key of nullptr adds an array element.
+ *
+ *   writer.Begin().Add("type", "listen").Add("state", "start").End();
+ *   SendText(writer.str());
+ */
+class JsonWriter {
+public:
+    // Starts a message with its root object
+    JsonWriter& Begin();
+    // Closes the objects and arrays still open
+    JsonWriter& End();
+
+    JsonWriter& BeginObject(const char* key);
+    JsonWriter& EndObject();
+    JsonWriter& BeginArray(const char* key);
+    JsonWriter& EndArray();
+
+    JsonWriter& Add(const char* key, const char* value);
+    JsonWriter& Add(const char* key, const std::string& value);
+    JsonWriter& Add(const char* key, int value);
+    JsonWriter& Add(const char* key, bool value);
+    // Value that is JSON already
+    JsonWriter& AddRaw(const char* key, const char* json, size_t length);
+    inline JsonWriter& AddRaw(const char* key, const std::string& json) {
+        return AddRaw(key, json.data(), json.size());
+    }
+
+    inline const std::string& str() const { return buffer_; }
+
+private:
+    std::string buffer_;
+    int depth_ = 0;
+    bool first_ = true;         // Nothing written in the innermost object or array yet
+    char closers_[JSON_WRITER_MAX_DEPTH];
+
+    void AddKey(const char* key);
+    void AddString(const char* value, size_t length);
+    void Open(const char* key, char opener, char closer);
+    void Close();
+};
+
+#endif // JSON_WRITER_H
@@ -31,18 +31,15 @@ bool MqttProtocol::Start() {
     return StartMqttClient(false);
 }
 
+// The client is kept across reconnects, a new one is only made when reconnecting it fails
 bool MqttProtocol::StartMqttClient(bool report_error) {
-    if (mqtt_ != nullptr) {
-        ESP_LOGW(TAG, "Mqtt client already started");
-        delete mqtt_;
-    }
-
     Settings settings("mqtt", false);
     endpoint_ = settings.GetString("endpoint");
     client_id_ = settings.GetString("client_id");
     username_ = settings.GetString("username");
     password_ = settings.GetString("password");
     publish_topic_ = settings.GetString("publish_topic");
+    requested_frames_per_packet_ = settings.GetInt("frames_per_packet", AUDIO_FRAMES_PER_PACKET);
 
     if (endpoint_.empty()) {
         ESP_LOGW(TAG, "MQTT endpoint is not specified");
@@ -52,6 +49,39 @@ bool MqttProtocol::StartMqttClient(bool report_error) {
         return false;
     }
 
+    std::string broker_address;
+    int broker_port = 8883;
+    size_t pos = endpoint_.find(':');
+    if (pos != std::string::npos) {
+        broker_address = endpoint_.substr(0, pos);
+        broker_port = std::stoi(endpoint_.substr(pos + 1));
+    } else {
+        broker_address = endpoint_;
+    }
+
+    bool reconnect = mqtt_ != nullptr;
+    if (!reconnect) {
+        CreateMqttClient();
+    }
+    ESP_LOGI(TAG, "%s endpoint %s", reconnect ? "Reconnecting to" : "Connecting to", endpoint_.c_str());
+    bool connected = mqtt_->Connect(broker_address, broker_port, client_id_, username_, password_);
+    if (!connected && reconnect) {
+        ESP_LOGW(TAG, "Reconnecting failed, starting a new client");
+        delete mqtt_;
+        CreateMqttClient();
+        connected = mqtt_->Connect(broker_address, broker_port, client_id_, username_, password_);
+    }
+    if (!connected) {
+        ESP_LOGE(TAG, "Failed to connect to endpoint");
+        SetError(Lang::Strings::SERVER_NOT_CONNECTED);
+        return false;
+    }
+
+    ESP_LOGI(TAG, "Connected to endpoint");
+    return true;
+}
+
+void MqttProtocol::CreateMqttClient() {
     mqtt_ = Board::GetInstance().CreateMqtt();
     mqtt_->SetKeepAlive(90);
 
@@ -60,53 +90,28 @@ bool MqttProtocol::StartMqttClient(bool report_error) {
     });
 
     mqtt_->OnMessage([this](const std::string& topic, const std::string& payload) {
-        cJSON* root = cJSON_Parse(payload.c_str());
-        if (root == nullptr) {
-            ESP_LOGE(TAG, "Failed to parse json message %s", payload.c_str());
+        MessageType type;
+        if (!ParseMessage(payload.data(), payload.size(), type)) {
             return;
         }
-        cJSON* type = cJSON_GetObjectItem(root, "type");
-        if (type == nullptr) {
-            ESP_LOGE(TAG, "Message type is not specified");
-            cJSON_Delete(root);
-            return;
-        }
-
-        if (strcmp(type->valuestring, "hello") == 0) {
+        auto& root = json_reader_.root();
+        if (type == kMessageTypeHello) {
             ParseServerHello(root);
-        } else if (strcmp(type->valuestring, "goodbye") == 0) {
-            auto session_id = cJSON_GetObjectItem(root, "session_id");
-            ESP_LOGI(TAG, "Received goodbye message, session_id: %s", session_id ? session_id->valuestring : "null");
-            if (session_id == nullptr || session_id_ == session_id->valuestring) {
+        } else if (type == kMessageTypeGoodbye) {
+            auto& session_id = root.Get("session_id");
+            ESP_LOGI(TAG, "Received goodbye message, session_id: %s", session_id ? session_id.c_str() : "null");
+            if (!session_id || session_id_ == session_id.c_str()) {
                 Application::GetInstance().Schedule([this]() {
                     CloseAudioChannel();
                 });
             }
+        } else if (type == kMessageTypePong) {
+            health_.OnPong(root.Get("id").ToInt());
         } else if (on_incoming_json_ != nullptr) {
-            on_incoming_json_(root);
+            on_incoming_json_(type, root);
         }
-        cJSON_Delete(root);
         last_incoming_time_ = std::chrono::steady_clock::now();
     });
-
-    ESP_LOGI(TAG, "Connecting to endpoint %s", endpoint_.c_str());
-    std::string broker_address;
-    int broker_port = 8883;
-    size_t pos = endpoint_.find(':');
-    if (pos != std::string::npos) {
-        broker_address = endpoint_.substr(0, pos);
-        broker_port = std::stoi(endpoint_.substr(pos + 1));
-    } else {
-        broker_address = endpoint_;
-    }
-    if (!mqtt_->Connect(broker_address, broker_port, client_id_, username_, password_)) {
-        ESP_LOGE(TAG, "Failed to connect to endpoint");
-        SetError(Lang::Strings::SERVER_NOT_CONNECTED);
-        return false;
-    }
-
-    ESP_LOGI(TAG, "Connected to endpoint");
-    return true;
 }
 
 bool MqttProtocol::SendText(const std::string& text) {
@@ -121,48 +126,77 @@ bool MqttProtocol::SendText(const std::string& text) {
     return true;
 }
 
-void MqttProtocol::SendAudio(const AudioStreamPacket& packet) {
+void MqttProtocol::SendAudioPacket(const AudioStreamPacket& packet) {
     std::lock_guard<std::mutex> lock(channel_mutex_);
-    if (udp_ == nullptr) {
+    if (udp_ == nullptr || !channel_opened_) {
         return;
     }
+    if (audio_packer_.frames_per_packet() > 1) {
+        if (audio_packer_.Add(packet.payload.data(), packet.payload.size(), packet.timestamp)) {
+            SendPackedAudio();
+        }
+        return;
+    }
+    SendDatagram(packet.payload.data(), packet.payload.size(), packet.timestamp, 0, 1);
+}
 
-    std::string nonce(aes_nonce_);
-    *(uint16_t*)&nonce[2] = htons(packet.payload.size());
-    *(uint32_t*)&nonce[8] = htonl(packet.timestamp);
-    *(uint32_t*)&nonce[12] = htonl(++local_sequence_);
+void MqttProtocol::SendPendingAudio() {
+    std::lock_guard<std::mutex> lock(channel_mutex_);
+    if (udp_ != nullptr && channel_opened_ && !audio_packer_.empty()) {
+        SendPackedAudio();
+    }
+}
 
-    std::string encrypted;
-    encrypted.resize(aes_nonce_.size() + packet.payload.size());
-    memcpy(encrypted.data(), nonce.data(), nonce.size());
+// channel_mutex_ is held
+void MqttProtocol::SendPackedAudio() {
+    int frames = audio_packer_.count();
+    uint32_t timestamp = audio_packer_.timestamp();
+    auto& payload = audio_packer_.Finish();
+    SendDatagram(payload.data(), payload.size(), timestamp, AUDIO_PACKET_FLAG_PACKED, frames);
+}
 
-    size_t nc_off = 0;
-    uint8_t stream_block[16] = {0};
-    if (mbedtls_aes_crypt_ctr(&aes_ctx_, packet.payload.size(), &nc_off, (uint8_t*)nonce.c_str(), stream_block,
-        (uint8_t*)packet.payload.data(), (uint8_t*)&encrypted[nonce.size()]) != 0) {
-        ESP_LOGE(TAG, "Failed to encrypt audio data");
+// channel_mutex_ is held. The sequence number is that of the first frame, the next datagram continues after the last.
+void MqttProtocol::SendDatagram(const uint8_t* payload, size_t size, uint32_t timestamp, uint8_t flags, int frames) {
+    // The payload is copied out of its pool block in PSRAM once, behind the header, and encrypted where it lands
+    send_buffer_.resize(AUDIO_CIPHER_NONCE_SIZE + size);
+    uint8_t* nonce = (uint8_t*)&send_buffer_[0];
+    memcpy(nonce, aes_nonce_.data(), AUDIO_CIPHER_NONCE_SIZE);
+    nonce[1] = flags;
+    *(uint16_t*)&nonce[2] = htons(size);
+    *(uint32_t*)&nonce[8] = htonl(timestamp);
+    *(uint32_t*)&nonce[12] = htonl(local_sequence_ + 1);
+    local_sequence_ += frames;
+
+    uint8_t* encrypted = nonce + AUDIO_CIPHER_NONCE_SIZE;
+    memcpy(encrypted, payload, size);
+    if (!cipher_.Crypt(nonce, encrypted, encrypted, size)) {
         return;
     }
 
-    busy_sending_audio_ = true;
-    udp_->Send(encrypted);
-    busy_sending_audio_ = false;
+    udp_->Send(send_buffer_);
+    health_.OnSent(send_buffer_.size());
 }
 
+// The UDP socket stays open for the next channel, datagrams on it are dropped until then
 void MqttProtocol::CloseAudioChannel() {
+    audio_sender_.Clear();
+    ReportHealth();
     {
         std::lock_guard<std::mutex> lock(channel_mutex_);
-        if (udp_ != nullptr) {
-            delete udp_;
-            udp_ = nullptr;
-        }
+        channel_opened_ = false;
+        audio_packer_.Reset();
+    }
+    auto cipher = cipher_.GetStats();
+    if (cipher.datagrams > 0) {
+        ESP_LOGI(TAG, "Audio cipher: %lu datagrams, %lu bytes, %lu us per datagram",
+            cipher.datagrams, cipher.bytes, cipher.time_us / cipher.datagrams);
     }
 
-    std::string message = "{";
-    message += "\"session_id\":\"" + session_id_ + "\",";
-    message += "\"type\":\"goodbye\"";
-    message += "}";
-    SendText(message);
+    {
+        std::lock_guard<std::mutex> lock(json_mutex_);
+        json_writer_.Begin().Add("session_id", session_id_).Add("type", "goodbye").End();
+        SendText(json_writer_.str());
+    }
 
     if (on_audio_channel_closed_ != nullptr) {
         on_audio_channel_closed_();
@@ -177,24 +211,25 @@ bool MqttProtocol::OpenAudioChannel() {
         }
     }
 
-    busy_sending_audio_ = false;
     error_occurred_ = false;
     session_id_ = "";
+    audio_sender_.Clear();
     xEventGroupClearBits(event_group_handle_, MQTT_PROTOCOL_SERVER_HELLO_EVENT);
+    health_.StartSession();
 
     // 发送 hello 消息申请 UDP 通道
-    std::string message = "{";
-    message += "\"type\":\"hello\",";
-    message += "\"version\": 3,";
-    message += "\"transport\":\"udp\",";
+    {
+        std::lock_guard<std::mutex> lock(json_mutex_);
+        json_writer_.Begin().Add("type", "hello").Add("version", 3).Add("transport", "udp");
 #if CONFIG_USE_SERVER_AEC
-    message += "\"features\":{\"aec\":true},";
+        json_writer_.BeginObject("features").Add("aec", true).EndObject();
 #endif
-    message += "\"audio_params\":{";
-    message += "\"format\":\"opus\", \"sample_rate\":16000, \"channels\":1, \"frame_duration\":" + std::to_string(OPUS_FRAME_DURATION_MS);
-    message += "}}";
-    if (!SendText(message)) {
-        return false;
+        json_writer_.BeginObject("audio_params").Add("format", "opus").Add("sample_rate", 16000).Add("channels", 1)
+            .Add("frame_duration", OPUS_FRAME_DURATION_MS);
+        AddPackingParams(json_writer_);
+        if (!SendText(json_writer_.End().str())) {
+            return false;
+        }
     }
 
     // 等待服务器响应
@@ -206,17 +241,38 @@ bool MqttProtocol::OpenAudioChannel() {
     }
 
     std::lock_guard<std::mutex> lock(channel_mutex_);
+    // A new key is a new session on the server, which gets a new socket
+    if (udp_ != nullptr && udp_->connected() && udp_server_ == connected_server_ && udp_port_ == connected_port_ &&
+        aes_key_ == connected_key_) {
+        ESP_LOGI(TAG, "Reusing the UDP socket");
+    } else {
+        ConnectUdp();
+    }
+    channel_opened_ = true;
+
+    if (on_audio_channel_opened_ != nullptr) {
+        on_audio_channel_opened_();
+    }
+    return true;
+}
+
+// channel_mutex_ is held
+void MqttProtocol::ConnectUdp() {
     if (udp_ != nullptr) {
         delete udp_;
     }
     udp_ = Board::GetInstance().CreateUdp();
     udp_->OnMessage([this](const std::string& data) {
+        if (!channel_opened_) {
+            return;
+        }
         /*
          * UDP Encrypted OPUS Packet Format:
          * |type 1u|flags 1u|payload_len 2u|ssrc 4u|timestamp 4u|sequence 4u|
          * |payload payload_len|
+         * With AUDIO_PACKET_FLAG_PACKED in flags the payload holds several frames (see AudioPacker)
          */
-        if (data.size() < sizeof(aes_nonce_)) {
+        if (data.size() < AUDIO_CIPHER_NONCE_SIZE) {
             ESP_LOGE(TAG, "Invalid audio packet size: %zu", data.size());
             return;
         }
@@ -226,85 +282,120 @@ bool MqttProtocol::OpenAudioChannel() {
         }
         uint32_t timestamp = ntohl(*(uint32_t*)&data[8]);
         uint32_t sequence = ntohl(*(uint32_t*)&data[12]);
-        if (sequence < remote_sequence_) {
-            ESP_LOGW(TAG, "Received audio packet with old sequence: %lu, expected: %lu", sequence, remote_sequence_);
-            return;
-        }
+        // Reordered and lost packets are handled by the jitter buffer
         if (sequence != remote_sequence_ + 1) {
-            ESP_LOGW(TAG, "Received audio packet with wrong sequence: %lu, expected: %lu", sequence, remote_sequence_ + 1);
+            ESP_LOGD(TAG, "Received audio packet with sequence: %lu, expected: %lu", sequence, remote_sequence_ + 1);
         }
 
-        size_t decrypted_size = data.size() - aes_nonce_.size();
-        size_t nc_off = 0;
-        uint8_t stream_block[16] = {0};
-        auto nonce = (uint8_t*)data.data();
-        auto encrypted = (uint8_t*)data.data() + aes_nonce_.size();
-        AudioStreamPacket packet;
-        packet.timestamp = timestamp;
-        packet.payload.resize(decrypted_size);
-        int ret = mbedtls_aes_crypt_ctr(&aes_ctx_, decrypted_size, &nc_off, nonce, stream_block, encrypted, (uint8_t*)packet.payload.data());
-        if (ret != 0) {
-            ESP_LOGE(TAG, "Failed to decrypt audio data, ret: %d", ret);
+        // Decrypted from the datagram into the receive buffer, both in internal RAM,
+        // the frames are copied out into pool blocks after
+        size_t decrypted_size = data.size() - AUDIO_CIPHER_NONCE_SIZE;
+        auto nonce = (const uint8_t*)data.data();
+        receive_buffer_.resize(decrypted_size);
+        if (!cipher_.Crypt(nonce, nonce + AUDIO_CIPHER_NONCE_SIZE, receive_buffer_.data(), decrypted_size)) {
             return;
         }
+        if (data[1] & AUDIO_PACKET_FLAG_PACKED) {
+            int frames = DeliverPackedAudio(receive_buffer_.data(), decrypted_size, sequence);
+            health_.OnReceived(data.size(), timestamp, sequence, frames);
+            last_incoming_time_ = std::chrono::steady_clock::now();
+            return;
+        }
+        health_.OnReceived(data.size(), timestamp, sequence, 1);
         if (on_incoming_audio_ != nullptr) {
-            on_incoming_audio_(std::move(packet));
+            on_incoming_audio_(AudioStreamPacket{
+                .timestamp = timestamp,
+                .payload = AudioBuffer<uint8_t>(AudioBufferPool::GetOpusPool(), receive_buffer_.data(), decrypted_size),
+                .sequence = sequence,
+            });
+        }
+        if (sequence > remote_sequence_) {
+            remote_sequence_ = sequence;
         }
-        remote_sequence_ = sequence;
         last_incoming_time_ = std::chrono::steady_clock::now();
     });
 
     udp_->Connect(udp_server_, udp_port_);
+    connected_server_ = udp_server_;
+    connected_port_ = udp_port_;
+    connected_key_ = aes_key_;
+}
 
-    if (on_audio_channel_opened_ != nullptr) {
-        on_audio_channel_opened_();
+// Frames of a packed datagram take the sequence numbers from the one in the header on. Returns the frame count.
+int MqttProtocol::DeliverPackedAudio(const uint8_t* data, size_t size, uint32_t sequence) {
+    AudioUnpacker unpacker;
+    if (!unpacker.Parse(data, size)) {
+        return 0;
     }
-    return true;
+    int frames = 0;
+    const uint8_t* opus;
+    size_t opus_size;
+    uint32_t timestamp;
+    while (unpacker.Next(opus, opus_size, timestamp)) {
+        if (on_incoming_audio_ != nullptr) {
+            on_incoming_audio_(AudioStreamPacket{
+                .timestamp = timestamp,
+                .payload = AudioBuffer<uint8_t>(AudioBufferPool::GetOpusPool(), opus, opus_size),
+                .sequence = sequence,
+            });
+        }
+        if (sequence > remote_sequence_) {
+            remote_sequence_ = sequence;
+        }
+        sequence++;
+        frames++;
+    }
+    return frames;
 }
 
-void MqttProtocol::ParseServerHello(const cJSON* root) {
-    auto transport = cJSON_GetObjectItem(root, "transport");
-    if (transport == nullptr || strcmp(transport->valuestring, "udp") != 0) {
-        ESP_LOGE(TAG, "Unsupported transport: %s", transport->valuestring);
+void MqttProtocol::ParseServerHello(const JsonObject& root) {
+    auto& transport = root.Get("transport");
+    if (!transport.Is("udp")) {
+        ESP_LOGE(TAG, "Unsupported transport: %s", transport.c_str());
         return;
     }
 
-    auto session_id = cJSON_GetObjectItem(root, "session_id");
-    if (session_id != nullptr) {
-        session_id_ = session_id->valuestring;
+    auto& session_id = root.Get("session_id");
+    if (session_id.IsString()) {
+        session_id_ = session_id.c_str();
         ESP_LOGI(TAG, "Session ID: %s", session_id_.c_str());
     }
 
     // Get sample rate from hello message
-    auto audio_params = cJSON_GetObjectItem(root, "audio_params");
-    if (audio_params != NULL) {
-        auto sample_rate = cJSON_GetObjectItem(audio_params, "sample_rate");
-        if (sample_rate != NULL) {
-            server_sample_rate_ = sample_rate->valueint;
-        }
-        auto frame_duration = cJSON_GetObjectItem(audio_params, "frame_duration");
-        if (frame_duration != NULL) {
-            server_frame_duration_ = frame_duration->valueint;
-        }
+    JsonObject audio_params;
+    if (audio_params.Parse(root.Get("audio_params"))) {
+        server_sample_rate_ = audio_params.Get("sample_rate").ToInt(server_sample_rate_);
+        server_frame_duration_ = audio_params.Get("frame_duration").ToInt(server_frame_duration_);
     }
+    ConfigurePacking(audio_params);
 
-    auto udp = cJSON_GetObjectItem(root, "udp");
-    if (udp == nullptr) {
+    JsonObject udp;
+    if (!udp.Parse(root.Get("udp"))) {
         ESP_LOGE(TAG, "UDP is not specified");
         return;
     }
-    udp_server_ = cJSON_GetObjectItem(udp, "server")->valuestring;
-    udp_port_ = cJSON_GetObjectItem(udp, "port")->valueint;
-    auto key = cJSON_GetObjectItem(udp, "key")->valuestring;
-    auto nonce = cJSON_GetObjectItem(udp, "nonce")->valuestring;
+    udp_server_ = udp.Get("server").c_str();
+    udp_port_ = udp.Get("port").ToInt();
+    auto key = udp.Get("key").c_str();
+    auto nonce = udp.Get("nonce").c_str();
 
-    // auto encryption = cJSON_GetObjectItem(udp, "encryption")->valuestring;
+    // auto encryption = udp.Get("encryption").c_str();
     // ESP_LOGI(TAG, "UDP server: %s, port: %d, encryption: %s", udp_server_.c_str(), udp_port_, encryption);
     aes_nonce_ = DecodeHexString(nonce);
-    mbedtls_aes_init(&aes_ctx_);
-    mbedtls_aes_setkey_enc(&aes_ctx_, (const unsigned char*)DecodeHexString(key).c_str(), 128);
-    local_sequence_ = 0;
-    remote_sequence_ = 0;
+    auto aes_key = DecodeHexString(key);
+    if (aes_nonce_.size() != AUDIO_CIPHER_NONCE_SIZE || aes_key.size() != 16) {
+        ESP_LOGE(TAG, "Invalid UDP key or nonce");
+        return;
+    }
+    // The same key again keeps its cipher, and the sequence numbers go on so that no counter block is used twice
+    if (aes_key != aes_key_) {
+        cipher_.SetKey((const uint8_t*)aes_key.data());
+        aes_key_ = aes_key;
+        local_sequence_ = 0;
+        remote_sequence_ = 0;
+    }
+    cipher_.ResetStats();
+    health_.OnServerHello();
     xEventGroupSetBits(event_group_handle_, MQTT_PROTOCOL_SERVER_HELLO_EVENT);
 }
 
@@ -327,6 +418,8 @@ std::string MqttProtocol::DecodeHexString(const std::string& hex_string) {
     return decoded;
 }
 
+// A channel in standby whose MQTT connection dropped is closed, the next one reconnects
 bool MqttProtocol::IsAudioChannelOpened() const {
-    return udp_ != nullptr && !error_occurred_ && !IsTimeout();
+    return udp_ != nullptr && channel_opened_ && mqtt_ != nullptr && mqtt_->IsConnected() && !error_occurred_ &&
+        !IsTimeout();
 }
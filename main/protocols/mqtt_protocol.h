@@ -5,11 +5,11 @@
 #include "protocol.h"
 #include <mqtt.h>
 #include <udp.h>
-#include <cJSON.h>
-#include <mbedtls/aes.h>
+#include "audio_cipher.h"
 #include <freertos/FreeRTOS.h>
 #include <freertos/event_groups.h>
 
+#include <atomic>
 #include <functional>
 #include <string>
 #include <map>
@@ -26,7 +26,6 @@ public:
     ~MqttProtocol();
 
     bool Start() override;
-    void SendAudio(const AudioStreamPacket& packet) override;
     bool OpenAudioChannel() override;
     void CloseAudioChannel() override;
     bool IsAudioChannelOpened() const override;
@@ -43,17 +42,33 @@ private:
     std::mutex channel_mutex_;
     Mqtt* mqtt_ = nullptr;
     Udp* udp_ = nullptr;
-    mbedtls_aes_context aes_ctx_;
+    // The socket and the cipher are kept between channels, while the server hands out the same ones
+    std::atomic<bool> channel_opened_ = false;
+    AudioCipher cipher_;
+    std::string aes_key_;
     std::string aes_nonce_;
     std::string udp_server_;
     int udp_port_;
-    uint32_t local_sequence_;
-    uint32_t remote_sequence_;
+    std::string connected_server_;
+    int connected_port_ = 0;
+    std::string connected_key_;
+    uint32_t local_sequence_ = 0;
+    uint32_t remote_sequence_ = 0;
+    // Datagrams are crypted here, in internal RAM, the capacity is reused between frames
+    std::string send_buffer_;
+    std::vector<uint8_t> receive_buffer_;
 
     bool StartMqttClient(bool report_error=false);
-    void ParseServerHello(const cJSON* root);
+    void CreateMqttClient();
+    void ConnectUdp();
+    void SendDatagram(const uint8_t* payload, size_t size, uint32_t timestamp, uint8_t flags, int frames);
+    void SendPackedAudio();
+    int DeliverPackedAudio(const uint8_t* data, size_t size, uint32_t sequence);
+    void ParseServerHello(const JsonObject& root);
     std::string DecodeHexString(const std::string& hex_string);
 
+    void SendAudioPacket(const AudioStreamPacket& packet) override;
+    void SendPendingAudio() override;
     bool SendText(const std::string& text) override;
 };
 
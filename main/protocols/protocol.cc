@@ -1,10 +1,16 @@
 #include "protocol.h"
 
 #include <esp_log.h>
+#include <algorithm>
 
 #define TAG "Protocol"
 
-void Protocol::OnIncomingJson(std::function<void(const cJSON* root)> callback) {
+Protocol::Protocol()
+    : audio_sender_([this](const AudioStreamPacket& packet) { SendAudioPacket(packet); },
+                    [this]() { SendPendingAudio(); }) {
+}
+
+void Protocol::OnIncomingJson(std::function<void(MessageType type, const JsonObject& root)> callback) {
     on_incoming_json_ = callback;
 }
 
@@ -32,87 +38,125 @@ void Protocol::SetError(const std::string& message) {
 }
 
 void Protocol::SendAbortSpeaking(AbortReason reason) {
-    std::string message = "{\"session_id\":\"" + session_id_ + "\",\"type\":\"abort\"";
+    std::lock_guard<std::mutex> lock(json_mutex_);
+    json_writer_.Begin().Add("session_id", session_id_).Add("type", "abort");
     if (reason == kAbortReasonWakeWordDetected) {
-        message += ",\"reason\":\"wake_word_detected\"";
+        json_writer_.Add("reason", "wake_word_detected");
     }
-    message += "}";
-    SendText(message);
+    SendText(json_writer_.End().str());
 }
 
 void Protocol::SendWakeWordDetected(const std::string& wake_word) {
-    std::string json = "{\"session_id\":\"" + session_id_ + 
-                      "\",\"type\":\"listen\",\"state\":\"detect\",\"text\":\"" + wake_word + "\"}";
-    SendText(json);
+    std::lock_guard<std::mutex> lock(json_mutex_);
+    json_writer_.Begin().Add("session_id", session_id_).Add("type", "listen").Add("state", "detect")
+        .Add("text", wake_word).End();
+    SendText(json_writer_.str());
 }
 
 void Protocol::SendStartListening(ListeningMode mode) {
-    std::string message = "{\"session_id\":\"" + session_id_ + "\"";
-    message += ",\"type\":\"listen\",\"state\":\"start\"";
+    std::lock_guard<std::mutex> lock(json_mutex_);
+    json_writer_.Begin().Add("session_id", session_id_).Add("type", "listen").Add("state", "start");
     if (mode == kListeningModeRealtime) {
-        message += ",\"mode\":\"realtime\"";
+        json_writer_.Add("mode", "realtime");
     } else if (mode == kListeningModeAutoStop) {
-        message += ",\"mode\":\"auto\"";
+        json_writer_.Add("mode", "auto");
     } else {
-        message += ",\"mode\":\"manual\"";
+        json_writer_.Add("mode", "manual");
     }
-    message += "}";
-    SendText(message);
+    SendText(json_writer_.End().str());
 }
 
 void Protocol::SendStopListening() {
-    std::string message = "{\"session_id\":\"" + session_id_ + "\",\"type\":\"listen\",\"state\":\"stop\"}";
-    SendText(message);
+    // The server takes the stop as the end of the audio
+    FlushAudio();
+    std::lock_guard<std::mutex> lock(json_mutex_);
+    json_writer_.Begin().Add("session_id", session_id_).Add("type", "listen").Add("state", "stop").End();
+    SendText(json_writer_.str());
 }
 
+// One message per thing. The descriptors are only split at the top level and copied through as they are.
 void Protocol::SendIotDescriptors(const std::string& descriptors) {
-    cJSON* root = cJSON_Parse(descriptors.c_str());
-    if (root == nullptr) {
-        ESP_LOGE(TAG, "Failed to parse IoT descriptors: %s", descriptors.c_str());
-        return;
-    }
-
-    if (!cJSON_IsArray(root)) {
+    // Parsed in place, in a copy
+    std::string array = descriptors;
+    JsonValue root;
+    if (!ParseJson(&array[0], array.size(), root) || !root.IsArray()) {
         ESP_LOGE(TAG, "IoT descriptors should be an array");
-        cJSON_Delete(root);
         return;
     }
 
-    int arraySize = cJSON_GetArraySize(root);
-    for (int i = 0; i < arraySize; ++i) {
-        cJSON* descriptor = cJSON_GetArrayItem(root, i);
-        if (descriptor == nullptr) {
-            ESP_LOGE(TAG, "Failed to get IoT descriptor at index %d", i);
+    std::lock_guard<std::mutex> lock(json_mutex_);
+    JsonArrayReader reader(root);
+    JsonValue descriptor;
+    while (reader.Next(descriptor)) {
+        if (!descriptor.IsObject()) {
+            ESP_LOGE(TAG, "Invalid IoT descriptor");
             continue;
         }
+        json_writer_.Begin().Add("session_id", session_id_).Add("type", "iot").Add("update", true)
+            .BeginArray("descriptors").AddRaw(nullptr, descriptor.text, descriptor.length).End();
+        SendText(json_writer_.str());
+    }
+}
 
-        cJSON* messageRoot = cJSON_CreateObject();
-        cJSON_AddStringToObject(messageRoot, "session_id", session_id_.c_str());
-        cJSON_AddStringToObject(messageRoot, "type", "iot");
-        cJSON_AddBoolToObject(messageRoot, "update", true);
+void Protocol::SendIotStates(const std::string& states) {
+    std::lock_guard<std::mutex> lock(json_mutex_);
+    json_writer_.Begin().Add("session_id", session_id_).Add("type", "iot").Add("update", true)
+        .AddRaw("states", states).End();
+    SendText(json_writer_.str());
+}
 
-        cJSON* descriptorArray = cJSON_CreateArray();
-        cJSON_AddItemToArray(descriptorArray, cJSON_Duplicate(descriptor, 1));
-        cJSON_AddItemToObject(messageRoot, "descriptors", descriptorArray);
+void Protocol::SendPing() {
+    std::lock_guard<std::mutex> lock(json_mutex_);
+    json_writer_.Begin().Add("session_id", session_id_).Add("type", "ping").Add("id", (int)health_.StartPing()).End();
+    SendText(json_writer_.str());
+}
 
-        char* message = cJSON_PrintUnformatted(messageRoot);
-        if (message == nullptr) {
-            ESP_LOGE(TAG, "Failed to print JSON message for IoT descriptor at index %d", i);
-            cJSON_Delete(messageRoot);
-            continue;
-        }
+ProtocolHealthStats Protocol::GetHealthStats() {
+    return health_.GetStats();
+}
 
-        SendText(std::string(message));
-        cJSON_free(message);
-        cJSON_Delete(messageRoot);
+static void AddHistogram(JsonWriter& writer, const char* key, const uint16_t* histogram) {
+    writer.BeginArray(key);
+    for (int i = 0; i < PROTOCOL_HEALTH_BUCKETS; i++) {
+        writer.Add(nullptr, (int)histogram[i]);
     }
-
-    cJSON_Delete(root);
+    writer.EndArray();
 }
 
-void Protocol::SendIotStates(const std::string& states) {
-    std::string message = "{\"session_id\":\"" + session_id_ + "\",\"type\":\"iot\",\"update\":true,\"states\":" + states + "}";
-    SendText(message);
+void Protocol::ReportHealth() {
+    if (!health_.EndSession()) {
+        return;
+    }
+    auto health = health_.GetStats();
+    ESP_LOGI(TAG, "Session health: %lu ms, sent %lu packets %lu bytes, received %lu packets %lu bytes, "
+        "lost %lu/%lu reordered %lu jitter %lu ms, hello %lu ms first audio %lu ms, rtt %lu/%lu/%lu ms (%lu/%lu pongs)",
+        health.duration_ms, health.packets_sent, health.bytes_sent, health.packets_received, health.bytes_received,
+        health.frames_lost, health.frames_expected, health.frames_reordered, health.jitter_ms, health.hello_ms,
+        health.first_audio_ms, health.min_rtt_ms, health.avg_rtt_ms, health.max_rtt_ms, health.pongs, health.pings);
+
+#if CONFIG_REPORT_SESSION_HEALTH
+    // Nothing is sent on a channel that failed or is gone
+    if (!IsAudioChannelOpened()) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(json_mutex_);
+    json_writer_.Begin().Add("session_id", session_id_).Add("type", "health")
+        .Add("duration_ms", (int)health.duration_ms).Add("hello_ms", (int)health.hello_ms)
+        .Add("first_audio_ms", (int)health.first_audio_ms).Add("bucket_ms", PROTOCOL_HEALTH_BUCKET_MS);
+    json_writer_.BeginObject("sent").Add("packets", (int)health.packets_sent).Add("bytes", (int)health.bytes_sent)
+        .EndObject();
+    json_writer_.BeginObject("received").Add("packets", (int)health.packets_received)
+        .Add("bytes", (int)health.bytes_received).Add("expected", (int)health.frames_expected)
+        .Add("lost", (int)health.frames_lost).Add("reordered", (int)health.frames_reordered)
+        .Add("jitter_ms", (int)health.jitter_ms);
+    AddHistogram(json_writer_, "arrival_histogram", health.arrival_histogram);
+    json_writer_.EndObject();
+    json_writer_.BeginObject("rtt").Add("pings", (int)health.pings).Add("pongs", (int)health.pongs)
+        .Add("min_ms", (int)health.min_rtt_ms).Add("avg_ms", (int)health.avg_rtt_ms)
+        .Add("max_ms", (int)health.max_rtt_ms);
+    AddHistogram(json_writer_, "histogram", health.rtt_histogram);
+    SendText(json_writer_.End().str());
+#endif
 }
 
 bool Protocol::IsTimeout() const {
@@ -126,7 +170,59 @@ bool Protocol::IsTimeout() const {
     return timeout;
 }
 
-bool Protocol::IsAudioChannelBusy() const {
-    return busy_sending_audio_;
+// Parses a control message into json_reader_ and looks up its type
+bool Protocol::ParseMessage(const char* data, size_t length, MessageType& type) {
+    if (!json_reader_.Parse(data, length)) {
+        ESP_LOGE(TAG, "Failed to parse json message %.*s", (int)length, data);
+        return false;
+    }
+    auto& type_value = json_reader_.root().Get("type");
+    if (!type_value.IsString()) {
+        ESP_LOGE(TAG, "Message type is not specified");
+        return false;
+    }
+    type = GetMessageType(type_value);
+    if (type == kMessageTypeUnknown) {
+        ESP_LOGW(TAG, "Unknown message type: %s", type_value.text);
+        return false;
+    }
+    return true;
+}
+
+// The audio_params entry asking the server to accept packed uplink audio, nothing when packing is off
+void Protocol::AddPackingParams(JsonWriter& writer) const {
+    if (requested_frames_per_packet_ > 1) {
+        writer.Add("frames_per_packet", requested_frames_per_packet_);
+    }
+}
+
+// A server that does not know about packing leaves frames_per_packet out of its hello, and gets one frame per packet
+void Protocol::ConfigurePacking(const JsonObject& audio_params) {
+    int frames_per_packet = 1;
+    auto& accepted = audio_params.Get("frames_per_packet");
+    if (accepted.IsNumber() && requested_frames_per_packet_ > 1) {
+        frames_per_packet = std::min(accepted.ToInt(), requested_frames_per_packet_);
+    }
+    audio_packer_.Configure(frames_per_packet);
+    if (frames_per_packet > 1) {
+        ESP_LOGI(TAG, "Packing %d audio frames per packet", audio_packer_.frames_per_packet());
+    }
+}
+
+void Protocol::SendAudio(AudioStreamPacket&& packet, bool wait) {
+    audio_sender_.Push(std::move(packet), wait);
+}
+
+void Protocol::FlushAudio() {
+    audio_sender_.Flush();
+}
+
+AudioSenderStats Protocol::GetAudioSenderStats() const {
+    return audio_sender_.GetStats();
+}
+
+// The sender queue absorbs a slow send, the encoder only backs off once it fills up
+bool Protocol::IsAudioChannelBusy() {
+    return audio_sender_.IsBacklogged();
 }
 
@@ -1,20 +1,41 @@
 #ifndef PROTOCOL_H
 #define PROTOCOL_H
 
-#include <cJSON.h>
 #include <string>
 #include <functional>
 #include <chrono>
+#include <mutex>
 #include <vector>
+#include <atomic>
 
-struct AudioStreamPacket {
-    uint32_t timestamp = 0;
-    std::vector<uint8_t> payload;
-};
+#include "audio_buffer.h"
+#include "audio_packer.h"
+#include "audio_sender.h"
+#include "control_message.h"
+#include "protocol_health.h"
+#include "json_reader.h"
+#include "json_writer.h"
+
+#ifdef CONFIG_AUDIO_FRAMES_PER_PACKET
+#define AUDIO_FRAMES_PER_PACKET CONFIG_AUDIO_FRAMES_PER_PACKET
+#else
+#define AUDIO_FRAMES_PER_PACKET 1
+#endif
+
+#ifdef CONFIG_PROTOCOL_PING_INTERVAL_SECONDS
+#define PROTOCOL_PING_INTERVAL_SECONDS CONFIG_PROTOCOL_PING_INTERVAL_SECONDS
+#else
+#define PROTOCOL_PING_INTERVAL_SECONDS 0
+#endif
+
+// Marks a payload packed by AudioPacker: a bit in the flags byte of the UDP header,
+// the message type of BinaryProtocol2/3
+#define AUDIO_PACKET_FLAG_PACKED 0x01
+#define AUDIO_PACKET_TYPE_PACKED 2
 
 struct BinaryProtocol2 {
     uint16_t version;
-    uint16_t type;          // Message type (0: OPUS, 1: JSON)
+    uint16_t type;          // Message type (0: OPUS, 1: JSON, 2: packed OPUS frames)
     uint32_t reserved;      // Reserved for future use
     uint32_t timestamp;     // Timestamp in milliseconds (used for server-side AEC)
     uint32_t payload_size;  // Payload size in bytes
@@ -41,6 +62,7 @@ enum ListeningMode {
 
 class Protocol {
 public:
+    Protocol();
     virtual ~Protocol() = default;
 
     inline int server_sample_rate() const {
@@ -52,9 +74,13 @@ public:
     inline const std::string& session_id() const {
         return session_id_;
     }
+    // Frames per packet agreed with the server in the hello, what the uplink sends and the most the downlink carries
+    inline int frames_per_packet() const {
+        return audio_packer_.frames_per_packet();
+    }
 
     void OnIncomingAudio(std::function<void(AudioStreamPacket&& packet)> callback);
-    void OnIncomingJson(std::function<void(const cJSON* root)> callback);
+    void OnIncomingJson(std::function<void(MessageType type, const JsonObject& root)> callback);
     void OnAudioChannelOpened(std::function<void()> callback);
     void OnAudioChannelClosed(std::function<void()> callback);
     void OnNetworkError(std::function<void(const std::string& message)> callback);
@@ -63,17 +89,24 @@ public:
     virtual bool OpenAudioChannel() = 0;
     virtual void CloseAudioChannel() = 0;
     virtual bool IsAudioChannelOpened() const = 0;
-    virtual bool IsAudioChannelBusy() const;
-    virtual void SendAudio(const AudioStreamPacket& packet) = 0;
+    virtual bool IsAudioChannelBusy();
+    // Queues the frame for the sender task, from any task, see AudioSender
+    void SendAudio(AudioStreamPacket&& packet, bool wait = false);
+    // Sends the frames waiting for a packed packet to fill up, after the frames queued before
+    void FlushAudio();
+    AudioSenderStats GetAudioSenderStats() const;
     virtual void SendWakeWordDetected(const std::string& wake_word);
     virtual void SendStartListening(ListeningMode mode);
     virtual void SendStopListening();
     virtual void SendAbortSpeaking(AbortReason reason);
     virtual void SendIotDescriptors(const std::string& descriptors);
     virtual void SendIotStates(const std::string& states);
+    // The server answers with a pong carrying the same id, which gives the control channel round trip
+    void SendPing();
+    ProtocolHealthStats GetHealthStats();
 
 protected:
-    std::function<void(const cJSON* root)> on_incoming_json_;
+    std::function<void(MessageType type, const JsonObject& root)> on_incoming_json_;
     std::function<void(AudioStreamPacket&& packet)> on_incoming_audio_;
     std::function<void()> on_audio_channel_opened_;
     std::function<void()> on_audio_channel_closed_;
@@ -82,13 +115,28 @@ protected:
     int server_sample_rate_ = 24000;
     int server_frame_duration_ = 60;
     bool error_occurred_ = false;
-    bool busy_sending_audio_ = false;
     std::string session_id_;
+    int requested_frames_per_packet_ = AUDIO_FRAMES_PER_PACKET;
+    AudioPacker audio_packer_;
     std::chrono::time_point<std::chrono::steady_clock> last_incoming_time_;
+    // Messages are built in json_writer_ under json_mutex_ and parsed in json_reader_ on the network task
+    JsonWriter json_writer_;
+    std::mutex json_mutex_;
+    JsonReader json_reader_;
+    AudioSender audio_sender_;
+    ProtocolHealth health_;
 
+    // Run on the sender task
+    virtual void SendAudioPacket(const AudioStreamPacket& packet) = 0;
+    virtual void SendPendingAudio() {}
     virtual bool SendText(const std::string& text) = 0;
     virtual void SetError(const std::string& message);
     virtual bool IsTimeout() const;
+    bool ParseMessage(const char* data, size_t length, MessageType& type);
+    void AddPackingParams(JsonWriter& writer) const;
+    void ConfigurePacking(const JsonObject& audio_params);
+    // Ends the session of health_, logs it and reports it to the server, while the control channel is still up
+    void ReportHealth();
 };
 
 #endif // PROTOCOL_H
@@ -0,0 +1,139 @@
+#include "protocol_health.h"
+
+#include <esp_timer.h>
+#include <algorithm>
+#include <cstdlib>
+
+void ProtocolHealth::StartSession() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    uint32_t sessions = stats_.sessions + 1;
+    stats_ = {};
+    stats_.sessions = sessions;
+    stats_.active = true;
+    start_time_us_ = esp_timer_get_time();
+    last_arrival_us_ = 0;
+    last_timestamp_ = 0;
+    jitter_us_ = 0;
+    sequenced_frames_ = 0;
+    ping_time_us_ = 0;
+}
+
+void ProtocolHealth::OnServerHello() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (stats_.active) {
+        stats_.hello_ms = (esp_timer_get_time() - start_time_us_) / 1000;
+    }
+}
+
+bool ProtocolHealth::EndSession() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!stats_.active) {
+        return false;
+    }
+    stats_.active = false;
+    stats_.duration_ms = (esp_timer_get_time() - start_time_us_) / 1000;
+    return true;
+}
+
+void ProtocolHealth::OnSent(size_t bytes) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stats_.packets_sent++;
+    stats_.bytes_sent += bytes;
+}
+
+void ProtocolHealth::OnReceived(size_t bytes, uint32_t timestamp, uint32_t sequence, int frames) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    int64_t now = esp_timer_get_time();
+    stats_.packets_received++;
+    stats_.bytes_received += bytes;
+    if (stats_.first_audio_ms == 0 && stats_.active) {
+        stats_.first_audio_ms = std::max<int64_t>((now - start_time_us_) / 1000, 1);
+    }
+
+    if (last_arrival_us_ != 0) {
+        int64_t gap_us = now - last_arrival_us_;
+        auto& count = stats_.arrival_histogram[Bucket(gap_us / 1000)];
+        if (count < UINT16_MAX) {
+            count++;
+        }
+        // How much later or earlier than its timestamp says the packet came, smoothed with a 1/16 weight
+        if (timestamp != 0 && last_timestamp_ != 0 && gap_us < PROTOCOL_HEALTH_SPURT_GAP_MS * 1000) {
+            int64_t transit_us = gap_us - (int32_t)(timestamp - last_timestamp_) * 1000LL;
+            jitter_us_ += (std::llabs(transit_us) - jitter_us_) / 16;
+            stats_.jitter_ms = jitter_us_ / 1000;
+        }
+    }
+    last_arrival_us_ = now;
+    last_timestamp_ = timestamp;
+
+    if (sequence == 0) {
+        return;
+    }
+    // Frames below the highest number seen came late, the numbers never seen are lost
+    uint32_t last = sequence + frames - 1;
+    if (sequenced_frames_ == 0) {
+        first_sequence_ = sequence;
+        highest_sequence_ = last;
+    } else {
+        if ((int32_t)(sequence - highest_sequence_) <= 0) {
+            stats_.frames_reordered += frames;
+        }
+        if ((int32_t)(sequence - first_sequence_) < 0) {
+            first_sequence_ = sequence;
+        }
+        if ((int32_t)(last - highest_sequence_) > 0) {
+            highest_sequence_ = last;
+        }
+    }
+    sequenced_frames_ += frames;
+    stats_.frames_expected = highest_sequence_ - first_sequence_ + 1;
+    stats_.frames_lost = stats_.frames_expected > sequenced_frames_ ? stats_.frames_expected - sequenced_frames_ : 0;
+}
+
+uint32_t ProtocolHealth::StartPing() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stats_.pings++;
+    ping_time_us_ = esp_timer_get_time();
+    return ++ping_id_;
+}
+
+// A pong for an older ping, or from an older session, is not counted
+void ProtocolHealth::OnPong(uint32_t id) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (id != ping_id_ || ping_time_us_ == 0) {
+        return;
+    }
+    uint32_t rtt_ms = (esp_timer_get_time() - ping_time_us_) / 1000;
+    ping_time_us_ = 0;
+
+    // Exponential moving average with a 1/16 weight, seeded by the first round trip
+    if (stats_.pongs++ == 0) {
+        stats_.min_rtt_ms = rtt_ms;
+        stats_.avg_rtt_ms = rtt_ms;
+    }
+    stats_.rtt_ms = rtt_ms;
+    stats_.min_rtt_ms = std::min(stats_.min_rtt_ms, rtt_ms);
+    stats_.max_rtt_ms = std::max(stats_.max_rtt_ms, rtt_ms);
+    stats_.avg_rtt_ms += ((int32_t)rtt_ms - (int32_t)stats_.avg_rtt_ms) / 16;
+    auto& count = stats_.rtt_histogram[Bucket(rtt_ms)];
+    if (count < UINT16_MAX) {
+        count++;
+    }
+}
+
+ProtocolHealthStats ProtocolHealth::GetStats() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    ProtocolHealthStats stats = stats_;
+    if (stats.active) {
+        stats.duration_ms = (esp_timer_get_time() - start_time_us_) / 1000;
+    }
+    return stats;
+}
+
+int ProtocolHealth::Bucket(uint32_t ms) {
+    int bucket = 0;
+    while (bucket < PROTOCOL_HEALTH_BUCKETS - 1 && ms >= ((uint32_t)PROTOCOL_HEALTH_BUCKET_MS << bucket)) {
+        bucket++;
+    }
+    return bucket;
+}
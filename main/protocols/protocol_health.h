@@ -0,0 +1,78 @@
+#ifndef PROTOCOL_HEALTH_H
+#define PROTOCOL_HEALTH_H
+
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+
+// Bucket i of a histogram counts times under PROTOCOL_HEALTH_BUCKET_MS << i, the last one the rest
+#define PROTOCOL_HEALTH_BUCKETS 8
+#define PROTOCOL_HEALTH_BUCKET_MS 20
+// A downlink pause this long starts a new talk spurt, whose timestamps may start over, the jitter skips it
+#define PROTOCOL_HEALTH_SPURT_GAP_MS 1000
+
+// Network quality of one audio channel session, from the hello to the close
+struct ProtocolHealthStats {
+    uint32_t sessions;          // Since boot, the last one is the one below
+    bool active;
+    uint32_t duration_ms;
+    uint32_t packets_sent;
+    uint32_t bytes_sent;
+    uint32_t packets_received;
+    uint32_t bytes_received;
+    // Downlink frames, from the sequence numbers of the transports that have them (UDP)
+    uint32_t frames_expected;
+    uint32_t frames_lost;
+    uint32_t frames_reordered;
+    uint32_t jitter_ms;         // Interarrival jitter of the downlink (RFC 3550), from the packet timestamps
+    uint32_t hello_ms;          // Client hello to server hello
+    uint32_t first_audio_ms;    // Client hello to the first downlink audio, 0 if none came
+    // Control channel round trips, from ping and pong messages
+    uint32_t pings;
+    uint32_t pongs;
+    uint32_t rtt_ms;
+    uint32_t min_rtt_ms;
+    uint32_t avg_rtt_ms;        // Moving average
+    uint32_t max_rtt_ms;
+    uint16_t rtt_histogram[PROTOCOL_HEALTH_BUCKETS];
+    uint16_t arrival_histogram[PROTOCOL_HEALTH_BUCKETS];   // Time between downlink packets
+};
+
+/*
+ * Counts what a protocol sends and receives in a session. The transports report packets from their
+ * network and sender tasks, the numbers are read from any task.
+ */
+class ProtocolHealth {
+public:
+    // Before the client hello. The numbers of the previous session are dropped.
+    void StartSession();
+    void OnServerHello();
+    // Returns false if no session was active. The numbers stay until the next session starts.
+    bool EndSession();
+
+    void OnSent(size_t bytes);
+    // A downlink packet with frames numbered from sequence on, sequence 0 on transports without numbers
+    void OnReceived(size_t bytes, uint32_t timestamp, uint32_t sequence, int frames);
+    // Returns the id for the ping message. A ping still unanswered is given up.
+    uint32_t StartPing();
+    void OnPong(uint32_t id);
+
+    ProtocolHealthStats GetStats();
+
+private:
+    std::mutex mutex_;
+    ProtocolHealthStats stats_ = {};
+    int64_t start_time_us_ = 0;
+    int64_t last_arrival_us_ = 0;
+    uint32_t last_timestamp_ = 0;
+    int64_t jitter_us_ = 0;
+    uint32_t first_sequence_ = 0;
+    uint32_t highest_sequence_ = 0;
+    uint32_t sequenced_frames_ = 0;
+    uint32_t ping_id_ = 0;
+    int64_t ping_time_us_ = 0;  // 0 when no ping is waiting for its pong
+
+    static int Bucket(uint32_t ms);
+};
+
+#endif // PROTOCOL_HEALTH_H
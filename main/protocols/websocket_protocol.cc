@@ -5,7 +5,6 @@
 #include "settings.h"
 
 #include <cstring>
-#include <cJSON.h>
 #include <esp_log.h>
 #include <arpa/inet.h>
 #include "assets/lang_config.h"
@@ -14,9 +13,23 @@
 
 WebsocketProtocol::WebsocketProtocol() {
     event_group_handle_ = xEventGroupCreate();
+
+    esp_timer_create_args_t linger_timer_args = {
+        .callback = [](void* arg) {
+            WebsocketProtocol* protocol = (WebsocketProtocol*)arg;
+            protocol->OnLingerTimeout();
+        },
+        .arg = this,
+        .dispatch_method = ESP_TIMER_TASK,
+        .name = "ws_linger",
+        .skip_unhandled_events = true
+    };
+    esp_timer_create(&linger_timer_args, &linger_timer_);
 }
 
 WebsocketProtocol::~WebsocketProtocol() {
+    esp_timer_stop(linger_timer_);
+    esp_timer_delete(linger_timer_);
     if (websocket_ != nullptr) {
         delete websocket_;
     }
@@ -28,50 +41,96 @@ bool WebsocketProtocol::Start() {
     return true;
 }
 
-void WebsocketProtocol::SendAudio(const AudioStreamPacket& packet) {
-    if (websocket_ == nullptr) {
+void WebsocketProtocol::SendAudioPacket(const AudioStreamPacket& packet) {
+    std::lock_guard<std::mutex> lock(channel_mutex_);
+    if (websocket_ == nullptr || !websocket_->IsConnected() || !channel_opened_) {
+        return;
+    }
+    if (audio_packer_.frames_per_packet() > 1) {
+        if (audio_packer_.Add(packet.payload.data(), packet.payload.size(), packet.timestamp)) {
+            SendPackedAudio();
+        }
         return;
     }
+    SendAudioMessage(packet.payload.data(), packet.payload.size(), packet.timestamp, 0);
+}
+
+void WebsocketProtocol::SendPendingAudio() {
+    std::lock_guard<std::mutex> lock(channel_mutex_);
+    if (websocket_ != nullptr && !audio_packer_.empty()) {
+        SendPackedAudio();
+    }
+}
+
+// channel_mutex_ is held
+void WebsocketProtocol::SendPackedAudio() {
+    uint32_t timestamp = audio_packer_.timestamp();
+    auto& payload = audio_packer_.Finish();
+    SendAudioMessage(payload.data(), payload.size(), timestamp, AUDIO_PACKET_TYPE_PACKED);
+}
 
+// channel_mutex_ is held. Packing is only negotiated from version 2 on, version 1 messages are bare Opus frames
+void WebsocketProtocol::SendAudioMessage(const uint8_t* payload, size_t size, uint32_t timestamp, uint16_t type) {
+    const void* message = payload;
+    size_t message_size = size;
     if (version_ == 2) {
-        std::string serialized;
-        serialized.resize(sizeof(BinaryProtocol2) + packet.payload.size());
-        auto bp2 = (BinaryProtocol2*)serialized.data();
+        send_buffer_.resize(sizeof(BinaryProtocol2) + size);
+        auto bp2 = (BinaryProtocol2*)send_buffer_.data();
         bp2->version = htons(version_);
-        bp2->type = 0;
+        bp2->type = htons(type);
         bp2->reserved = 0;
-        bp2->timestamp = htonl(packet.timestamp);
-        bp2->payload_size = htonl(packet.payload.size());
-        memcpy(bp2->payload, packet.payload.data(), packet.payload.size());
-
-        busy_sending_audio_ = true;
-        websocket_->Send(serialized.data(), serialized.size(), true);
-        busy_sending_audio_ = false;
+        bp2->timestamp = htonl(timestamp);
+        bp2->payload_size = htonl(size);
+        memcpy(bp2->payload, payload, size);
+        message = send_buffer_.data();
+        message_size = send_buffer_.size();
     } else if (version_ == 3) {
-        std::string serialized;
-        serialized.resize(sizeof(BinaryProtocol3) + packet.payload.size());
-        auto bp3 = (BinaryProtocol3*)serialized.data();
-        bp3->type = 0;
+        send_buffer_.resize(sizeof(BinaryProtocol3) + size);
+        auto bp3 = (BinaryProtocol3*)send_buffer_.data();
+        bp3->type = type;
         bp3->reserved = 0;
-        bp3->payload_size = htons(packet.payload.size());
-        memcpy(bp3->payload, packet.payload.data(), packet.payload.size());
+        bp3->payload_size = htons(size);
+        memcpy(bp3->payload, payload, size);
+        message = send_buffer_.data();
+        message_size = send_buffer_.size();
+    }
+
+    websocket_->Send(message, message_size, true);
+    health_.OnSent(message_size);
+}
 
-        busy_sending_audio_ = true;
-        websocket_->Send(serialized.data(), serialized.size(), true);
-        busy_sending_audio_ = false;
-    } else {
-        busy_sending_audio_ = true;
-        websocket_->Send(packet.payload.data(), packet.payload.size(), true);
-        busy_sending_audio_ = false;
+// Timestamps come with each frame, there are no sequence numbers on a stream. Returns the first timestamp.
+uint32_t WebsocketProtocol::DeliverPackedAudio(const uint8_t* data, size_t size) {
+    AudioUnpacker unpacker;
+    if (!unpacker.Parse(data, size)) {
+        return 0;
+    }
+    const uint8_t* opus;
+    size_t opus_size;
+    uint32_t timestamp;
+    uint32_t first_timestamp = 0;
+    bool first = true;
+    while (unpacker.Next(opus, opus_size, timestamp)) {
+        if (first) {
+            first_timestamp = timestamp;
+            first = false;
+        }
+        on_incoming_audio_(AudioStreamPacket{
+            .timestamp = timestamp,
+            .payload = AudioBuffer<uint8_t>(AudioBufferPool::GetOpusPool(), opus, opus_size)
+        });
     }
+    return first_timestamp;
 }
 
 bool WebsocketProtocol::SendText(const std::string& text) {
+    std::unique_lock<std::mutex> lock(channel_mutex_);
     if (websocket_ == nullptr) {
         return false;
     }
 
     if (!websocket_->Send(text)) {
+        lock.unlock();
         ESP_LOGE(TAG, "Failed to send text: %s", text.c_str());
         SetError(Lang::Strings::SERVER_ERROR);
         return false;
@@ -81,21 +140,46 @@ bool WebsocketProtocol::SendText(const std::string& text) {
 }
 
 bool WebsocketProtocol::IsAudioChannelOpened() const {
-    return websocket_ != nullptr && websocket_->IsConnected() && !error_occurred_ && !IsTimeout();
+    return websocket_ != nullptr && websocket_->IsConnected() && channel_opened_ && !error_occurred_ && !IsTimeout();
 }
 
+// The connection lingers after the channel closes: the next OpenAudioChannel sends its hello on it instead of
+// connecting again. The app sees the channel closed right away.
 void WebsocketProtocol::CloseAudioChannel() {
-    if (websocket_ != nullptr) {
+    audio_sender_.Clear();
+    ReportHealth();
+    std::unique_lock<std::mutex> lock(channel_mutex_);
+    if (websocket_ == nullptr) {
+        return;
+    }
+    if (WEBSOCKET_LINGER_SECONDS == 0 || !reuse_supported_ || error_occurred_ || !websocket_->IsConnected()) {
+        // Reports the disconnection
         delete websocket_;
         websocket_ = nullptr;
+        return;
+    }
+    bool opened = channel_opened_.exchange(false);
+    audio_packer_.Reset();
+    esp_timer_stop(linger_timer_);
+    esp_timer_start_once(linger_timer_, WEBSOCKET_LINGER_SECONDS * 1000000LL);
+    lock.unlock();
+
+    if (opened && on_audio_channel_closed_ != nullptr) {
+        on_audio_channel_closed_();
     }
 }
 
-bool WebsocketProtocol::OpenAudioChannel() {
-    if (websocket_ != nullptr) {
+// On the timer task, unless a new channel took the connection first
+void WebsocketProtocol::OnLingerTimeout() {
+    std::lock_guard<std::mutex> lock(channel_mutex_);
+    if (websocket_ != nullptr && !channel_opened_) {
+        ESP_LOGI(TAG, "Closing the idle websocket connection");
         delete websocket_;
+        websocket_ = nullptr;
     }
+}
 
+bool WebsocketProtocol::OpenAudioChannel() {
     Settings settings("websocket", false);
     std::string url = settings.GetString("url");
     std::string token = settings.GetString("token");
@@ -103,12 +187,50 @@ bool WebsocketProtocol::OpenAudioChannel() {
     if (version != 0) {
         version_ = version;
     }
+    requested_frames_per_packet_ = version_ >= 2 ? settings.GetInt("frames_per_packet", AUDIO_FRAMES_PER_PACKET) : 1;
 
-    busy_sending_audio_ = false;
     error_occurred_ = false;
+    audio_sender_.Clear();
 
+    // A lingering connection to the same server only needs a new hello
+    esp_timer_stop(linger_timer_);
+    std::unique_lock<std::mutex> lock(channel_mutex_);
+    bool reuse = websocket_ != nullptr && websocket_->IsConnected() && url == connected_url_ &&
+        version_ == connected_version_;
+    audio_packer_.Reset();
+    lock.unlock();
+    if (reuse) {
+        ESP_LOGI(TAG, "Reusing the websocket connection");
+        if (SendHello(WEBSOCKET_REUSE_HELLO_TIMEOUT_MS)) {
+            return true;
+        }
+        ESP_LOGW(TAG, "No hello on the reused connection, connecting again");
+        // A server that ignored a second hello gets a new connection for every channel from now on
+        if (websocket_ != nullptr && websocket_->IsConnected()) {
+            reuse_supported_ = false;
+        }
+        error_occurred_ = false;
+    }
+
+    if (!Connect(url, token)) {
+        return false;
+    }
+    if (!SendHello(10000)) {
+        ESP_LOGE(TAG, "Failed to receive server hello");
+        SetError(Lang::Strings::SERVER_TIMEOUT);
+        return false;
+    }
+    return true;
+}
+
+// A new connection, replacing the lingering one if any
+bool WebsocketProtocol::Connect(const std::string& url, std::string token) {
+    std::unique_lock<std::mutex> lock(channel_mutex_);
+    if (websocket_ != nullptr) {
+        delete websocket_;
+    }
     websocket_ = Board::GetInstance().CreateWebSocket();
-    
+
     if (!token.empty()) {
         // If token not has a space, add "Bearer " prefix
         if (token.find(" ") == std::string::npos) {
@@ -122,7 +244,10 @@ bool WebsocketProtocol::OpenAudioChannel() {
 
     websocket_->OnData([this](const char* data, size_t len, bool binary) {
         if (binary) {
-            if (on_incoming_audio_ != nullptr) {
+            // Audio of an older conversation on a lingering connection is dropped
+            if (on_incoming_audio_ != nullptr && channel_opened_) {
+                // For the jitter, from the frame timestamps where the version has them
+                uint32_t timestamp = 0;
                 if (version_ == 2) {
                     BinaryProtocol2* bp2 = (BinaryProtocol2*)data;
                     bp2->version = ntohs(bp2->version);
@@ -130,52 +255,60 @@ bool WebsocketProtocol::OpenAudioChannel() {
                     bp2->timestamp = ntohl(bp2->timestamp);
                     bp2->payload_size = ntohl(bp2->payload_size);
                     auto payload = (uint8_t*)bp2->payload;
-                    on_incoming_audio_(AudioStreamPacket{
-                        .timestamp = bp2->timestamp,
-                        .payload = std::vector<uint8_t>(payload, payload + bp2->payload_size)
-                    });
+                    timestamp = bp2->timestamp;
+                    if (bp2->type == AUDIO_PACKET_TYPE_PACKED) {
+                        timestamp = DeliverPackedAudio(payload, bp2->payload_size);
+                    } else {
+                        on_incoming_audio_(AudioStreamPacket{
+                            .timestamp = bp2->timestamp,
+                            .payload = AudioBuffer<uint8_t>(AudioBufferPool::GetOpusPool(), payload, bp2->payload_size)
+                        });
+                    }
                 } else if (version_ == 3) {
                     BinaryProtocol3* bp3 = (BinaryProtocol3*)data;
                     bp3->type = bp3->type;
                     bp3->payload_size = ntohs(bp3->payload_size);
                     auto payload = (uint8_t*)bp3->payload;
-                    on_incoming_audio_(AudioStreamPacket{
-                        .timestamp = 0,
-                        .payload = std::vector<uint8_t>(payload, payload + bp3->payload_size)
-                    });
+                    if (bp3->type == AUDIO_PACKET_TYPE_PACKED) {
+                        timestamp = DeliverPackedAudio(payload, bp3->payload_size);
+                    } else {
+                        on_incoming_audio_(AudioStreamPacket{
+                            .timestamp = 0,
+                            .payload = AudioBuffer<uint8_t>(AudioBufferPool::GetOpusPool(), payload, bp3->payload_size)
+                        });
+                    }
                 } else {
                     on_incoming_audio_(AudioStreamPacket{
                         .timestamp = 0,
-                        .payload = std::vector<uint8_t>((uint8_t*)data, (uint8_t*)data + len)
+                        .payload = AudioBuffer<uint8_t>(AudioBufferPool::GetOpusPool(), (const uint8_t*)data, len)
                     });
                 }
+                health_.OnReceived(len, timestamp, 0, 1);
             }
         } else {
-            // Parse JSON data
-            auto root = cJSON_Parse(data);
-            auto type = cJSON_GetObjectItem(root, "type");
-            if (type != NULL) {
-                if (strcmp(type->valuestring, "hello") == 0) {
-                    ParseServerHello(root);
-                } else {
-                    if (on_incoming_json_ != nullptr) {
-                        on_incoming_json_(root);
-                    }
+            MessageType type;
+            if (ParseMessage(data, len, type)) {
+                if (type == kMessageTypeHello) {
+                    ParseServerHello(json_reader_.root());
+                } else if (type == kMessageTypePong) {
+                    health_.OnPong(json_reader_.root().Get("id").ToInt());
+                } else if (on_incoming_json_ != nullptr && channel_opened_) {
+                    on_incoming_json_(type, json_reader_.root());
                 }
-            } else {
-                ESP_LOGE(TAG, "Missing message type, data: %s", data);
             }
-            cJSON_Delete(root);
         }
         last_incoming_time_ = std::chrono::steady_clock::now();
     });
 
+    // A lingering connection has reported its channel closed already
     websocket_->OnDisconnected([this]() {
         ESP_LOGI(TAG, "Websocket disconnected");
-        if (on_audio_channel_closed_ != nullptr) {
+        if (channel_opened_.exchange(false) && on_audio_channel_closed_ != nullptr) {
             on_audio_channel_closed_();
         }
     });
+    connected_url_.clear();
+    lock.unlock();
 
     ESP_LOGI(TAG, "Connecting to websocket server: %s with version: %d", url.c_str(), version_);
     if (!websocket_->Connect(url.c_str())) {
@@ -183,31 +316,41 @@ bool WebsocketProtocol::OpenAudioChannel() {
         SetError(Lang::Strings::SERVER_NOT_FOUND);
         return false;
     }
+    lock.lock();
+    connected_url_ = url;
+    connected_version_ = version_;
+    return true;
+}
 
+// The channel is open once the server answers the hello
+bool WebsocketProtocol::SendHello(int timeout_ms) {
+    xEventGroupClearBits(event_group_handle_, WEBSOCKET_PROTOCOL_SERVER_HELLO_EVENT);
+    health_.StartSession();
     // Send hello message to describe the client
     // keys: message type, version, audio_params (format, sample_rate, channels)
-    std::string message = "{";
-    message += "\"type\":\"hello\",";
-    message += "\"version\": " + std::to_string(version_) + ",";
+    {
+        std::lock_guard<std::mutex> lock(json_mutex_);
+        json_writer_.Begin().Add("type", "hello").Add("version", version_);
 #if CONFIG_USE_SERVER_AEC
-    message += "\"features\":{\"aec\":true},";
+        json_writer_.BeginObject("features").Add("aec", true).EndObject();
 #endif
-    message += "\"transport\":\"websocket\",";
-    message += "\"audio_params\":{";
-    message += "\"format\":\"opus\", \"sample_rate\":16000, \"channels\":1, \"frame_duration\":" + std::to_string(OPUS_FRAME_DURATION_MS);
-    message += "}}";
-    if (!SendText(message)) {
-        return false;
+        json_writer_.Add("transport", "websocket");
+        json_writer_.BeginObject("audio_params").Add("format", "opus").Add("sample_rate", 16000).Add("channels", 1)
+            .Add("frame_duration", OPUS_FRAME_DURATION_MS);
+        AddPackingParams(json_writer_);
+        if (!SendText(json_writer_.End().str())) {
+            return false;
+        }
     }
 
     // Wait for server hello
-    EventBits_t bits = xEventGroupWaitBits(event_group_handle_, WEBSOCKET_PROTOCOL_SERVER_HELLO_EVENT, pdTRUE, pdFALSE, pdMS_TO_TICKS(10000));
+    EventBits_t bits = xEventGroupWaitBits(event_group_handle_, WEBSOCKET_PROTOCOL_SERVER_HELLO_EVENT, pdTRUE, pdFALSE, pdMS_TO_TICKS(timeout_ms));
     if (!(bits & WEBSOCKET_PROTOCOL_SERVER_HELLO_EVENT)) {
-        ESP_LOGE(TAG, "Failed to receive server hello");
-        SetError(Lang::Strings::SERVER_TIMEOUT);
         return false;
     }
 
+    last_incoming_time_ = std::chrono::steady_clock::now();
+    channel_opened_ = true;
     if (on_audio_channel_opened_ != nullptr) {
         on_audio_channel_opened_();
     }
@@ -215,30 +358,26 @@ bool WebsocketProtocol::OpenAudioChannel() {
     return true;
 }
 
-void WebsocketProtocol::ParseServerHello(const cJSON* root) {
-    auto transport = cJSON_GetObjectItem(root, "transport");
-    if (transport == nullptr || strcmp(transport->valuestring, "websocket") != 0) {
-        ESP_LOGE(TAG, "Unsupported transport: %s", transport->valuestring);
+void WebsocketProtocol::ParseServerHello(const JsonObject& root) {
+    auto& transport = root.Get("transport");
+    if (!transport.Is("websocket")) {
+        ESP_LOGE(TAG, "Unsupported transport: %s", transport.c_str());
         return;
     }
 
-    auto session_id = cJSON_GetObjectItem(root, "session_id");
-    if (session_id != nullptr) {
-        session_id_ = session_id->valuestring;
+    auto& session_id = root.Get("session_id");
+    if (session_id.IsString()) {
+        session_id_ = session_id.c_str();
         ESP_LOGI(TAG, "Session ID: %s", session_id_.c_str());
     }
 
-    auto audio_params = cJSON_GetObjectItem(root, "audio_params");
-    if (audio_params != NULL) {
-        auto sample_rate = cJSON_GetObjectItem(audio_params, "sample_rate");
-        if (sample_rate != NULL) {
-            server_sample_rate_ = sample_rate->valueint;
-        }
-        auto frame_duration = cJSON_GetObjectItem(audio_params, "frame_duration");
-        if (frame_duration != NULL) {
-            server_frame_duration_ = frame_duration->valueint;
-        }
+    JsonObject audio_params;
+    if (audio_params.Parse(root.Get("audio_params"))) {
+        server_sample_rate_ = audio_params.Get("sample_rate").ToInt(server_sample_rate_);
+        server_frame_duration_ = audio_params.Get("frame_duration").ToInt(server_frame_duration_);
     }
+    ConfigurePacking(audio_params);
 
+    health_.OnServerHello();
     xEventGroupSetBits(event_group_handle_, WEBSOCKET_PROTOCOL_SERVER_HELLO_EVENT);
 }
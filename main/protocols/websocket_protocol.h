@@ -5,28 +5,57 @@
 #include "protocol.h"
 
 #include <web_socket.h>
+#include <esp_timer.h>
 #include <freertos/FreeRTOS.h>
 #include <freertos/event_groups.h>
 
+#include <atomic>
+
 #define WEBSOCKET_PROTOCOL_SERVER_HELLO_EVENT (1 << 0)
 
+#ifdef CONFIG_WEBSOCKET_LINGER_SECONDS
+#define WEBSOCKET_LINGER_SECONDS CONFIG_WEBSOCKET_LINGER_SECONDS
+#else
+#define WEBSOCKET_LINGER_SECONDS 30
+#endif
+
+// A server that does not answer a hello on a reused connection is given this long before reconnecting
+#define WEBSOCKET_REUSE_HELLO_TIMEOUT_MS 3000
+
 class WebsocketProtocol : public Protocol {
 public:
     WebsocketProtocol();
     ~WebsocketProtocol();
 
     bool Start() override;
-    void SendAudio(const AudioStreamPacket& packet) override;
     bool OpenAudioChannel() override;
     void CloseAudioChannel() override;
     bool IsAudioChannelOpened() const override;
 
 private:
     EventGroupHandle_t event_group_handle_;
+    // Audio goes out on the sender task, text on the others, one message at a time
+    std::mutex channel_mutex_;
     WebSocket* websocket_ = nullptr;
     int version_ = 1;
-
-    void ParseServerHello(const cJSON* root);
+    // The connection outlives the channel for a while, so the next conversation only needs a hello
+    std::atomic<bool> channel_opened_ = false;
+    esp_timer_handle_t linger_timer_ = nullptr;
+    std::string connected_url_;
+    int connected_version_ = 0;
+    bool reuse_supported_ = true;   // Cleared when the server did not answer a hello on a reused connection
+    // Binary protocol frames are built here, the capacity is reused between frames
+    std::string send_buffer_;
+
+    bool Connect(const std::string& url, std::string token);
+    bool SendHello(int timeout_ms);
+    void OnLingerTimeout();
+    void ParseServerHello(const JsonObject& root);
+    void SendAudioMessage(const uint8_t* payload, size_t size, uint32_t timestamp, uint16_t type);
+    void SendPackedAudio();
+    uint32_t DeliverPackedAudio(const uint8_t* data, size_t size);
+    void SendAudioPacket(const AudioStreamPacket& packet) override;
+    void SendPendingAudio() override;
     bool SendText(const std::string& text) override;
 };
 
@@ -0,0 +1,48 @@
+#ifndef SEQLOCK_RING_H
+#define SEQLOCK_RING_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+// Single writer ring whose slots readers copy out without locking. A slot carries its own sequence number,
+// odd while the writer is in it, so a reader detects a copy the writer overwrote and skips the slot.
+template <typename T, size_t N>
+class SeqlockRing {
+public:
+    // Writer only
+    void Push(const T& value) {
+        uint32_t sequence = head_.load(std::memory_order_relaxed);
+        auto& slot = slots_[sequence % N];
+        slot.sequence.store(sequence * 2 + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        slot.value = value;
+        slot.sequence.store(sequence * 2 + 2, std::memory_order_release);
+        head_.store(sequence + 1, std::memory_order_release);
+    }
+
+    // Pushes so far, the newest value has sequence head() - 1
+    uint32_t head() const { return head_.load(std::memory_order_acquire); }
+
+    // False if the value is not there any more, or not yet
+    bool Read(uint32_t sequence, T& value) const {
+        const auto& slot = slots_[sequence % N];
+        uint32_t before = slot.sequence.load(std::memory_order_acquire);
+        if (before != sequence * 2 + 2) {
+            return false;
+        }
+        value = slot.value;
+        std::atomic_thread_fence(std::memory_order_acquire);
+        return slot.sequence.load(std::memory_order_relaxed) == before;
+    }
+
+private:
+    struct Slot {
+        std::atomic<uint32_t> sequence = 0;
+        T value = {};
+    };
+    Slot slots_[N];
+    std::atomic<uint32_t> head_ = 0;
+};
+
+#endif // SEQLOCK_RING_H
@@ -0,0 +1,96 @@
+#include "sound_queue.h"
+
+#include <esp_log.h>
+#include <arpa/inet.h>
+
+#define TAG "SoundQueue"
+
+bool SoundQueue::Push(const std::string_view& sound, SoundPriority priority) {
+    if (sound.size() < sizeof(BinaryProtocol3)) {
+        return false;
+    }
+
+    if (count_ == entries_.size()) {
+        // Make room by dropping the newest sound of the lowest priority, if it is below this one
+        auto& last = entries_[count_ - 1];
+        if (last.priority >= priority) {
+            ESP_LOGW(TAG, "Queue full, sound dropped");
+            stats_.dropped++;
+            return false;
+        }
+        count_--;
+        stats_.dropped++;
+    }
+
+    // Behind every sound of the same or a higher priority
+    size_t index = count_;
+    while (index > 0 && entries_[index - 1].priority < priority) {
+        entries_[index] = entries_[index - 1];
+        index--;
+    }
+    entries_[index] = Entry{sound, priority};
+    count_++;
+    stats_.queued++;
+
+    if (!current_.empty() && priority > current_priority_) {
+        current_ = {};
+        stats_.preempted++;
+    }
+    return true;
+}
+
+SoundFrameResult SoundQueue::PopFrame(AudioStreamPacket& packet) {
+    auto result = kSoundFrameNext;
+    if (current_.empty()) {
+        if (count_ == 0) {
+            return kSoundFrameNone;
+        }
+        current_ = entries_[0].sound;
+        current_sound_ = current_;
+        current_priority_ = entries_[0].priority;
+        for (size_t i = 1; i < count_; i++) {
+            entries_[i - 1] = entries_[i];
+        }
+        count_--;
+        stats_.played++;
+        result = kSoundFrameStart;
+    }
+
+    auto p3 = (const BinaryProtocol3*)current_.data();
+    size_t payload_size = ntohs(p3->payload_size);
+    size_t frame_size = sizeof(BinaryProtocol3) + payload_size;
+    if (frame_size > current_.size()) {
+        ESP_LOGE(TAG, "Truncated frame of %u bytes, %u left", frame_size, current_.size());
+        current_ = {};
+        return PopFrame(packet);
+    }
+
+    packet.timestamp = 0;
+    packet.sequence = 0;
+    packet.payload = AudioBuffer<uint8_t>::Wrap(p3->payload, payload_size);
+    current_.remove_prefix(frame_size);
+    // Too short for another frame header, the sound is over
+    if (current_.size() < sizeof(BinaryProtocol3)) {
+        current_ = {};
+    }
+    return result;
+}
+
+size_t SoundQueue::GetFrameCount(const std::string_view& sound) {
+    size_t frames = 0;
+    size_t offset = 0;
+    while (offset + sizeof(BinaryProtocol3) <= sound.size()) {
+        auto p3 = (const BinaryProtocol3*)(sound.data() + offset);
+        offset += sizeof(BinaryProtocol3) + ntohs(p3->payload_size);
+        if (offset > sound.size()) {
+            break;
+        }
+        frames++;
+    }
+    return frames;
+}
+
+void SoundQueue::Clear() {
+    count_ = 0;
+    current_ = {};
+}
@@ -0,0 +1,65 @@
+#ifndef SOUND_QUEUE_H
+#define SOUND_QUEUE_H
+
+#include <array>
+#include <cstdint>
+#include <string_view>
+
+#include "protocol.h"
+
+#define SOUND_QUEUE_SIZE 16
+
+enum SoundPriority {
+    kSoundPriorityLow,      // Notifications that may be skipped, e.g. the startup chime
+    kSoundPriorityNormal,   // Prompts, e.g. activation code digits
+    kSoundPriorityHigh,     // Alerts, cut a lower priority sound that is playing
+};
+
+enum SoundFrameResult {
+    kSoundFrameNone,        // Nothing to play
+    kSoundFrameNext,        // The next frame of the current sound
+    kSoundFrameStart,       // The first frame of a new sound
+};
+
+struct SoundQueueStats {
+    uint32_t queued;
+    uint32_t played;
+    uint32_t preempted;     // Cut by a higher priority sound
+    uint32_t dropped;       // Did not fit in the queue
+};
+
+// Pending P3 sounds in priority order, first in first out within a priority.
+// Frames are handed out as packets that point into the asset, so a sound is never copied to RAM.
+// Not thread safe, the owner serializes access.
+class SoundQueue {
+public:
+    // The sound must stay valid until it has played, embedded assets always do.
+    // Returns false if the queue is full of sounds of the same or a higher priority.
+    bool Push(const std::string_view& sound, SoundPriority priority);
+    SoundFrameResult PopFrame(AudioStreamPacket& packet);
+    // Stops the current sound and drops the queued ones
+    void Clear();
+    SoundQueueStats GetStats() const { return stats_; }
+
+    inline bool empty() const { return count_ == 0 && current_.empty(); }
+    // The whole asset of the sound PopFrame() last started
+    inline const std::string_view& current_sound() const { return current_sound_; }
+
+    static size_t GetFrameCount(const std::string_view& sound);
+
+private:
+    struct Entry {
+        std::string_view sound;
+        SoundPriority priority;
+    };
+    // Sorted by priority, the next sound to play is at the front
+    std::array<Entry, SOUND_QUEUE_SIZE> entries_;
+    size_t count_ = 0;
+    // What is left of the sound that is playing
+    std::string_view current_;
+    std::string_view current_sound_;
+    SoundPriority current_priority_ = kSoundPriorityLow;
+    SoundQueueStats stats_ = {};
+};
+
+#endif // SOUND_QUEUE_H
@@ -0,0 +1,175 @@
+#ifndef TASK_QUEUE_H
+#define TASK_QUEUE_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+// A move-only void() callable stored inline, never on the heap.
+// Callables that do not fit in kInlineSize bytes are rejected at compile time.
+template <size_t kInlineSize>
+class InlineTask {
+public:
+    InlineTask() = default;
+
+    template <typename F, typename Fn = std::decay_t<F>,
+              typename = std::enable_if_t<!std::is_same_v<Fn, InlineTask>>>
+    InlineTask(F&& callback) {
+        static_assert(sizeof(Fn) <= kInlineSize, "Callable capture is too large for InlineTask storage");
+        static_assert(alignof(Fn) <= alignof(std::max_align_t), "Callable alignment is not supported");
+        new (storage_) Fn(std::forward<F>(callback));
+        invoke_ = [](void* storage) {
+            (*static_cast<Fn*>(storage))();
+        };
+        manage_ = [](void* dst, void* src) {
+            if (dst != nullptr) {
+                new (dst) Fn(std::move(*static_cast<Fn*>(src)));
+            }
+            static_cast<Fn*>(src)->~Fn();
+        };
+    }
+
+    InlineTask(InlineTask&& other) noexcept {
+        MoveFrom(other);
+    }
+
+    InlineTask& operator=(InlineTask&& other) noexcept {
+        if (this != &other) {
+            Reset();
+            MoveFrom(other);
+        }
+        return *this;
+    }
+
+    InlineTask(const InlineTask&) = delete;
+    InlineTask& operator=(const InlineTask&) = delete;
+
+    ~InlineTask() {
+        Reset();
+    }
+
+    void operator()() {
+        invoke_(storage_);
+    }
+
+    explicit operator bool() const {
+        return invoke_ != nullptr;
+    }
+
+    void Reset() {
+        if (manage_ != nullptr) {
+            manage_(nullptr, storage_);
+            invoke_ = nullptr;
+            manage_ = nullptr;
+        }
+    }
+
+private:
+    alignas(std::max_align_t) uint8_t storage_[kInlineSize];
+    void (*invoke_)(void* storage) = nullptr;
+    // Moves the callable from src into dst (if not null) and destroys src
+    void (*manage_)(void* dst, void* src) = nullptr;
+
+    void MoveFrom(InlineTask& other) {
+        if (other.manage_ != nullptr) {
+            other.manage_(storage_, other.storage_);
+            invoke_ = other.invoke_;
+            manage_ = other.manage_;
+            other.invoke_ = nullptr;
+            other.manage_ = nullptr;
+        }
+    }
+};
+
+// Fixed-capacity lock-free multi-producer single-consumer ring (Vyukov bounded queue).
+// Producers may call TryPush from any task; only one task may call TryPop.
+template <typename T, size_t kCapacity>
+class TaskQueue {
+    static_assert(kCapacity >= 2 && (kCapacity & (kCapacity - 1)) == 0, "Capacity must be a power of 2");
+
+public:
+    TaskQueue() {
+        for (size_t i = 0; i < kCapacity; i++) {
+            cells_[i].sequence.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    TaskQueue(const TaskQueue&) = delete;
+    TaskQueue& operator=(const TaskQueue&) = delete;
+
+    // Returns false and leaves item untouched if the queue is full
+    bool TryPush(T& item) {
+        Cell* cell;
+        size_t pos = enqueue_pos_.load(std::memory_order_relaxed);
+        while (true) {
+            cell = &cells_[pos & (kCapacity - 1)];
+            size_t sequence = cell->sequence.load(std::memory_order_acquire);
+            intptr_t diff = (intptr_t)sequence - (intptr_t)pos;
+            if (diff == 0) {
+                if (enqueue_pos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    break;
+                }
+            } else if (diff < 0) {
+                overflow_count_.fetch_add(1, std::memory_order_relaxed);
+                return false;
+            } else {
+                pos = enqueue_pos_.load(std::memory_order_relaxed);
+            }
+        }
+        cell->data = std::move(item);
+        cell->sequence.store(pos + 1, std::memory_order_release);
+        UpdateHighWater(pos + 1 - dequeue_pos_.load(std::memory_order_relaxed));
+        return true;
+    }
+
+    bool TryPop(T& item) {
+        size_t pos = dequeue_pos_.load(std::memory_order_relaxed);
+        Cell* cell = &cells_[pos & (kCapacity - 1)];
+        size_t sequence = cell->sequence.load(std::memory_order_acquire);
+        if ((intptr_t)sequence - (intptr_t)(pos + 1) < 0) {
+            return false;
+        }
+        item = std::move(cell->data);
+        cell->sequence.store(pos + kCapacity, std::memory_order_release);
+        dequeue_pos_.store(pos + 1, std::memory_order_relaxed);
+        return true;
+    }
+
+    // Approximate when producers are active
+    size_t size() const {
+        size_t enqueued = enqueue_pos_.load(std::memory_order_relaxed);
+        size_t dequeued = dequeue_pos_.load(std::memory_order_relaxed);
+        return enqueued > dequeued ? enqueued - dequeued : 0;
+    }
+
+    bool empty() const { return size() == 0; }
+    constexpr size_t capacity() const { return kCapacity; }
+    size_t high_water() const { return high_water_.load(std::memory_order_relaxed); }
+    uint32_t overflow_count() const { return overflow_count_.load(std::memory_order_relaxed); }
+
+private:
+    struct Cell {
+        std::atomic<size_t> sequence;
+        T data;
+    };
+
+    Cell cells_[kCapacity];
+    std::atomic<size_t> enqueue_pos_{0};
+    std::atomic<size_t> dequeue_pos_{0};
+    std::atomic<size_t> high_water_{0};
+    std::atomic<uint32_t> overflow_count_{0};
+
+    void UpdateHighWater(size_t depth) {
+        if (depth > kCapacity) {
+            return;
+        }
+        size_t current = high_water_.load(std::memory_order_relaxed);
+        while (depth > current && !high_water_.compare_exchange_weak(current, depth, std::memory_order_relaxed)) {
+        }
+    }
+};
+
+#endif // TASK_QUEUE_H
@@ -0,0 +1,208 @@
+#!/usr/bin/env python3
+"""
+把音频延迟追踪（main/audio_trace.h）转换为 Chrome trace JSON，可在 chrome://tracing 或 ui.perfetto.dev 打开。
+
+输入可以是：
+  - 设备日志：服务器下发 system 命令 trace_dump 后，AUDIO_TRACE_BEGIN 与 AUDIO_TRACE_END 之间的 "AT <hex>" 行
+  - 二进制文件：主机构建脚本命令 trace <file> 写出的记录
+
+用法：
+  python scripts/audio_trace.py monitor.log -o trace.json
+"""
+import argparse
+import json
+import re
+import struct
+import sys
+from collections import defaultdict, deque
+
+RECORD = struct.Struct("<qIB3x")
+
+EVENTS = [
+    "read_audio",
+    "afe_fetch",
+    "encode_start",
+    "encode_end",
+    "send_audio",
+    "incoming_audio",
+    "decode_start",
+    "decode_end",
+    "output_data",
+]
+UPLINK = EVENTS[0:5]
+DOWNLINK = EVENTS[5:9]
+
+# Spans between consecutive stages of a frame
+UPLINK_SPANS = [
+    ("capture", "read_audio", "afe_fetch"),
+    ("processor_to_encode", "afe_fetch", "encode_start"),
+    ("encode", "encode_start", "encode_end"),
+    ("encode_to_send", "encode_end", "send_audio"),
+]
+DOWNLINK_SPANS = [
+    ("decode_queue", "incoming_audio", "decode_start"),
+    ("decode", "decode_start", "decode_end"),
+    ("output", "decode_end", "output_data"),
+]
+
+LINE_PATTERN = re.compile(r"\bAT ([0-9a-f]+)")
+
+
+def parse_records(data):
+    records = []
+    for offset in range(0, len(data) - RECORD.size + 1, RECORD.size):
+        time_us, record_id, event = RECORD.unpack_from(data, offset)
+        if event < len(EVENTS):
+            records.append((time_us, record_id, EVENTS[event]))
+    return records
+
+
+def load(path):
+    with open(path, "rb") as f:
+        data = f.read()
+    if b"AUDIO_TRACE_BEGIN" not in data:
+        return parse_records(data)
+
+    # 只取最后一次 dump
+    text = data.decode("utf-8", errors="replace")
+    text = text[text.rfind("AUDIO_TRACE_BEGIN"):]
+    payload = bytearray()
+    for line in text.splitlines():
+        if "AUDIO_TRACE_END" in line:
+            break
+        match = LINE_PATTERN.search(line)
+        if match:
+            payload += bytes.fromhex(match.group(1))
+    return parse_records(bytes(payload))
+
+
+def match_uplink(records):
+    """
+    上行记录的 id 是本次聆听开始后的采集毫秒数，指向该阶段处理的数据末尾。
+    每个 encode_end 定义一帧，其余阶段取同一次聆听中第一个 id >= 帧末尾的记录。
+    id 回退表示新一次聆听。
+    """
+    sessions = defaultdict(lambda: defaultdict(list))
+    session_of = {}
+    last_id = {}
+    for time_us, record_id, event in records:
+        if event not in UPLINK:
+            continue
+        if record_id < last_id.get(event, 0):
+            session_of[event] = session_of.get(event, 0) + 1
+        last_id[event] = record_id
+        sessions[session_of.get(event, 0)][event].append((record_id, time_us))
+
+    frames = []
+    for session in sorted(sessions):
+        stages = sessions[session]
+        for frame_end, end_time in stages["encode_end"]:
+            frame = {"id": frame_end, "session": session, "encode_end": end_time}
+            for event in UPLINK:
+                if event == "encode_end":
+                    continue
+                for record_id, time_us in stages[event]:
+                    if record_id >= frame_end:
+                        frame[event] = time_us
+                        break
+            frames.append(frame)
+    return frames
+
+
+def match_downlink(records):
+    """
+    下行记录的 id 是服务器下发的时间戳，同一 id 按先后顺序配对。
+    服务器不带时间戳（id 为 0）时，只能按 FIFO 顺序配对，队列满或打断丢包后会错位。
+    """
+    pending = defaultdict(deque)
+    frames = []
+    for time_us, record_id, event in records:
+        if event not in DOWNLINK:
+            continue
+        if event == "incoming_audio":
+            frame = {"id": record_id, "incoming_audio": time_us}
+            frames.append(frame)
+            pending[(record_id, "decode_start")].append(frame)
+            continue
+        queue = pending[(record_id, event)]
+        if not queue:
+            continue
+        frame = queue.popleft()
+        frame[event] = time_us
+        next_index = DOWNLINK.index(event) + 1
+        if next_index < len(DOWNLINK):
+            pending[(record_id, DOWNLINK[next_index])].append(frame)
+    return frames
+
+
+def to_chrome_trace(uplink, downlink, base_us):
+    events = []
+    for tid, name in enumerate(EVENTS):
+        events.append({"ph": "M", "pid": 1, "tid": tid, "name": "thread_name", "args": {"name": name}})
+
+    def add_frames(frames, spans, category, prefix):
+        for index, frame in enumerate(frames):
+            async_id = "%s%d" % (prefix, index)
+            label = "%s %d" % (category, frame["id"])
+            for name, start, end in spans:
+                if start not in frame or end not in frame:
+                    continue
+                args = {"id": frame["id"], "latency_ms": (frame[end] - frame[start]) / 1000}
+                events.append({"ph": "b", "cat": category, "name": name, "id": async_id, "pid": 2,
+                               "ts": frame[start] - base_us, "args": dict(args, frame=label)})
+                events.append({"ph": "e", "cat": category, "name": name, "id": async_id, "pid": 2,
+                               "ts": frame[end] - base_us})
+
+    add_frames(uplink, UPLINK_SPANS, "uplink", "u")
+    add_frames(downlink, DOWNLINK_SPANS, "downlink", "d")
+    return events
+
+
+def percentile(values, p):
+    values = sorted(values)
+    return values[min(len(values) - 1, int(len(values) * p))]
+
+
+def print_summary(frames, spans, first, last, title, out):
+    rows = list(spans) + [("total", first, last)]
+    print("%s: %d frames" % (title, len(frames)), file=out)
+    for name, start, end in rows:
+        values = [(f[end] - f[start]) / 1000 for f in frames if start in f and end in f]
+        if not values:
+            continue
+        print("  %-20s n=%-5d p50=%7.2f ms  p95=%7.2f ms  max=%7.2f ms" % (
+            name, len(values), percentile(values, 0.5), percentile(values, 0.95), max(values)), file=out)
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Convert an audio latency trace to Chrome trace JSON")
+    parser.add_argument("input", help="device log with a trace_dump, or a binary file from the host runner")
+    parser.add_argument("-o", "--output", default="audio_trace.json", help="Chrome trace JSON output")
+    args = parser.parse_args()
+
+    records = load(args.input)
+    if not records:
+        print("No trace records found in %s" % args.input, file=sys.stderr)
+        return 1
+    records.sort(key=lambda record: record[0])
+
+    uplink = match_uplink(records)
+    downlink = match_downlink(records)
+    base_us = records[0][0]
+    events = []
+    for time_us, record_id, event in records:
+        events.append({"ph": "i", "s": "t", "pid": 1, "tid": EVENTS.index(event), "name": event,
+                       "ts": time_us - base_us, "args": {"id": record_id}})
+    events += to_chrome_trace(uplink, downlink, base_us)
+
+    with open(args.output, "w") as f:
+        json.dump({"traceEvents": events, "displayTimeUnit": "ms"}, f)
+
+    print("%d records, written to %s" % (len(records), args.output))
+    print_summary(uplink, UPLINK_SPANS, "read_audio", "send_audio", "Uplink", sys.stdout)
+    print_summary(downlink, DOWNLINK_SPANS, "incoming_audio", "output_data", "Downlink", sys.stdout)
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())